@@ -7,6 +7,8 @@
 
 #include <librecast/types.h>
 
+struct mmsghdr;
+
 extern int (*lc_msg_logger)(lc_channel_t *, lc_message_t *, void *logdb);
 
 /* create new librecast context and set up environment
@@ -16,12 +18,54 @@ lc_ctx_t *lc_ctx_new();
 /* destroy librecast context and clean up */
 void lc_ctx_free(lc_ctx_t *ctx);
 
+/* select the I/O engine for ctx, LC_ENGINE_SYSCALL or LC_ENGINE_URING. With
+ * io_uring, lc_socket_listen() receives with a multishot recvmsg into a ring
+ * of provided buffers, and batch sends are submitted as one set of linked
+ * sendmsg operations. Falls back to LC_ENGINE_SYSCALL if the kernel doesn't
+ * support it. Set before creating sockets. Returns the engine in use, or
+ * LC_ERROR_INVALID_PARAMS */
+int lc_ctx_engine(lc_ctx_t *ctx, int engine);
+
 /* create librecast socket */
 lc_socket_t *lc_socket_new(lc_ctx_t *ctx);
 
 /* bind socket to interface with index idx. 0 = ALL (default) */
 int lc_socket_bind(lc_socket_t *sock, unsigned int ifx);
 
+/* receive through an AF_PACKET TPACKET_V3 ring of size bytes (rounded up to
+ * whole 1 MiB blocks) instead of the UDP socket, which is kept only for group
+ * membership. Messages for channels bound to sock are parsed in place and
+ * handed to lc_socket_listen() callbacks with data pointing into the ring, so
+ * it is only valid until the callback returns and lc_msg_ref() fails. UDP
+ * checksums are not verified. lc_msg_recv(), lc_msg_recv_batch() and
+ * lc_socket_listen_batch() return LC_ERROR_INVALID_PARAMS on a ring socket.
+ * size 0 returns to normal receive. Needs
+ * CAP_NET_RAW. Linux only. 0 on success, -1 on error with errno set */
+int lc_socket_ring(lc_socket_t *sock, size_t size);
+
+/* send and receive through an AF_XDP socket on the interface sock is bound to
+ * (required), with a UMEM shared with the kernel, instead of the UDP stack.
+ * An XDP program in generic (SKB) mode, so any interface will do, takes
+ * multicast UDP to our port for the groups of channels bound to sock arriving
+ * on queue 0 - the kernel stack and other sockets no longer see those. Other
+ * queues still go through the stack, and are received from it too. Received
+ * messages for channels bound to sock point into the UMEM until freed, and
+ * lc_msg_ref() fails. Datagrams that don't fit in a frame are sent through
+ * the kernel, and our own sends are not looped back. Works with
+ * lc_socket_listen(), lc_msg_recv() but not lc_socket_watch(). Needs
+ * CAP_NET_ADMIN and CAP_BPF. Linux only. val 0 turns it off. 0 on success,
+ * -1 on error with errno set */
+int lc_socket_xdp(lc_socket_t *sock, int val);
+
+/* trade a CPU for latency: lc_socket_listen() polls sock without blocking,
+ * yielding between polls, until it has been idle for usec, and only then
+ * blocks until the next message. Also sets SO_BUSY_POLL to usec and
+ * SO_PREFER_BUSY_POLL, so the kernel busy polls the device queue (NAPI
+ * drivers only). Raising SO_BUSY_POLL needs CAP_NET_ADMIN - without it, only
+ * the listener spins. Not used with lc_socket_ring(). usec 0 turns it off.
+ * Linux only. 0 on success, -1 on error with errno set */
+int lc_socket_busypoll(lc_socket_t *sock, unsigned int usec);
+
 /* close socket */
 void lc_socket_close(lc_socket_t *sock);
 
@@ -43,12 +87,50 @@ lc_channel_t * lc_channel_sidehash(lc_channel_t *base, unsigned char *key, size_
 /* create random channel */
 lc_channel_t *lc_channel_random(lc_ctx_t *ctx);
 
-/* bind channel to socket */
+/* bind channel to socket. On Linux, the socket's kernel filter is rebuilt so
+ * it drops multicast for groups with no channel bound to the socket. Beyond
+ * 256 channels, or more than net.core.optmem_max makes room for, it only tests
+ * a hash of the group, which lets some others by - see lc_socket_filter_mode() */
 int lc_channel_bind(lc_socket_t *sock, lc_channel_t *chan);
 
 /* unbind channel from socket */
 int lc_channel_unbind(lc_channel_t *chan);
 
+/* limit sends to chan to rate bytes/s, with bursts of up to burst bytes
+ * going out back to back (token bucket). Counts datagram payload, message
+ * header included, of lc_msg_send() and friends, lc_channel_send() and
+ * lc_channel_sendmsg(), but not lc_socket_send() fan-out. A send that would
+ * overdraw the bucket sleeps until it can go, or, with lc_socket_txtime(), is
+ * handed to the kernel with a departure time. lc_msg_send_batch() ends the
+ * sendmmsg() at a message that has to wait. Each channel keeps its own
+ * bucket, a few words, so a socket can pace any number of channels. Make
+ * burst at least the largest send, or those sends wait for more tokens than
+ * the bucket can hold. rate 0 removes the limit (default) */
+void lc_channel_rate(lc_channel_t *chan, uint64_t rate, size_t burst);
+
+/* forward error correction for sends to chan. After every k datagrams of
+ * lc_msg_send() and lc_msg_sendv() (fragments each count as one), m repair
+ * datagrams go out, from which a receiver missing any m of the block's k + m
+ * rebuilds what it lost, with no feedback to the sender (systematic
+ * Reed-Solomon over GF(256)). Repairs are as long as the longest datagram in
+ * their block. They go to repair, a sideband from lc_channel_sideband() bound
+ * to a socket, or to chan itself if repair is NULL. Sources are sent as
+ * usual with a FEC header behind the message header, and LC_OP_FEC set in
+ * their op. Receivers decode them without being asked, handing each message
+ * on as it arrives, and any that were lost once the block's repairs are in,
+ * out of order. To take repairs from a sideband, a receiver calls
+ * lc_channel_fec() with the sideband on its own channel, and joins it too.
+ * lc_channel_send() and zero-copy sends skip FEC, and
+ * GSO is not used for a FEC channel. k + m is at most 255. k = 0 disables
+ * (default). Returns 0 on success, -1 on error (errno set) */
+int lc_channel_fec(lc_channel_t *chan, int k, int m, lc_channel_t *repair);
+
+/* send the repairs for chan's part filled FEC block now, so the last few
+ * datagrams before a pause can be recovered without waiting for the block
+ * to fill. Returns bytes sent, 0 if there was nothing to repair, -1 on error
+ * (errno set) */
+ssize_t lc_channel_fec_flush(lc_channel_t *chan);
+
 /* join librecast channel */
 int lc_channel_join(lc_channel_t *chan);
 
@@ -62,30 +144,216 @@ ssize_t lc_socket_recv(lc_socket_t *sock, void *buf, size_t len, int flags);
 int lc_socket_listen(lc_socket_t *sock, void (*callback_msg)(lc_message_t*),
 			                void (*callback_err)(int));
 
+/* as lc_socket_listen(), but receive with recvmmsg() and pass every message
+ * received per wakeup to callback_batch in one call. Fragments and FEC
+ * datagrams are reassembled and decoded first, so the callback only sees
+ * whole messages. Messages are freed when the callback returns */
+int lc_socket_listen_batch(lc_socket_t *sock, void (*callback_batch)(lc_message_t*, size_t),
+					void (*callback_err)(int));
+
 /* stop listening on socket */
 int lc_socket_listen_cancel(lc_socket_t *sock);
 
-/* send to all channels bound to a socket */
+/* run lc_socket_listen() callbacks (and opcode handlers) on a pool of worker
+ * threads instead of the listening thread, so a slow callback doesn't hold up
+ * receive. Each worker has a lock-free queue of qlen messages. Messages for
+ * the same channel always go to the same worker, in the order received. When
+ * a worker's queue is full, the message is dropped rather than block the
+ * listener. Messages still queued when listening stops are dropped too. Set
+ * before listening. workers 0 turns it off. 0 on success, -1 on error */
+int lc_socket_dispatch(lc_socket_t *sock, int workers, size_t qlen);
+
+/* messages waiting for a dispatch worker */
+size_t lc_socket_dispatch_depth(lc_socket_t *sock);
+
+/* messages dropped by the dispatch stage */
+uint64_t lc_socket_dispatch_drops(lc_socket_t *sock);
+
+/* create a group of nworkers sockets sharing the librecast port with
+ * SO_REUSEPORT, so traffic for one set of channels can be spread across
+ * threads. Each channel joined with lc_socket_group_join() is received by
+ * exactly one worker, chosen by hashing either the group address (default)
+ * or the source address, see lc_socket_group_steer(). Free the group with
+ * lc_socket_group_free() before freeing ctx. NULL on error */
+lc_socket_group_t *lc_socket_group_new(lc_ctx_t *ctx, int nworkers);
+
+/* close all sockets in group and free it */
+void lc_socket_group_free(lc_socket_group_t *grp);
+
+/* steer traffic by LC_STEER_GROUP (each multicast group goes to one worker)
+ * or LC_STEER_SOURCE (each source goes to one worker). Set before joining
+ * channels. Source steering filters in the kernel (Linux only) */
+int lc_socket_group_steer(lc_socket_group_t *grp, int mode);
+
+/* pin worker thread to cpu, or unpin it if cpu is -1. Takes effect now if
+ * the group is listening, or when it starts */
+int lc_socket_group_cpu(lc_socket_group_t *grp, int worker, int cpu);
+
+/* return socket for worker, NULL if there is no such worker */
+lc_socket_t *lc_socket_group_socket(lc_socket_group_t *grp, int worker);
+
+/* bind channel to the group and join it on the worker(s) that need it */
+int lc_socket_group_join(lc_socket_group_t *grp, lc_channel_t *chan);
+
+/* leave channel on all workers that joined it */
+int lc_socket_group_part(lc_socket_group_t *grp, lc_channel_t *chan);
+
+/* start one listening thread per worker, with the same callbacks as
+ * lc_socket_listen(). Callbacks run concurrently on different workers, but
+ * messages for one group (or source) always arrive on the same one */
+int lc_socket_group_listen(lc_socket_group_t *grp, void (*callback_msg)(lc_message_t*),
+					void (*callback_err)(int));
+
+/* stop all worker threads */
+int lc_socket_group_listen_cancel(lc_socket_group_t *grp);
+
+/* as lc_socket_listen(), but without a thread. The socket is added to the
+ * ctx event loop, and callbacks are called from lc_ctx_poll() / lc_ctx_run()
+ * in the calling thread. Not for sockets receiving with lc_socket_ring() or
+ * lc_socket_xdp() (LC_ERROR_INVALID_PARAMS). Linux only (epoll) */
+int lc_socket_watch(lc_socket_t *sock, void (*callback_msg)(lc_message_t*),
+					void (*callback_err)(int));
+
+/* remove socket from ctx event loop */
+int lc_socket_unwatch(lc_socket_t *sock);
+
+/* wait up to timeout ms (-1 = forever) for messages on watched sockets and
+ * due timers, and run their callbacks. Returns number of messages and timers
+ * handled, or -1 on error. Watched sockets and timers are not thread safe -
+ * manage them from the thread running the event loop */
+int lc_ctx_poll(lc_ctx_t *ctx, int timeout);
+
+/* run ctx event loop until lc_ctx_stop() is called. 0 on success, -1 on error */
+int lc_ctx_run(lc_ctx_t *ctx);
+
+/* make lc_ctx_run() return. Safe to call from any thread or callback */
+void lc_ctx_stop(lc_ctx_t *ctx);
+
+/* call f(arg) from the ctx event loop after delay ms, then every interval ms
+ * if interval is nonzero. Timers have 1 ms resolution. Returns timer, or NULL
+ * on error. One-shot timers are freed once they have run */
+lc_timer_t *lc_timer_add(lc_ctx_t *ctx, unsigned int delay, unsigned int interval,
+		void (*f)(void *), void *arg);
+
+/* cancel and free timer. May be called from the timer's own callback */
+void lc_timer_del(lc_ctx_t *ctx, lc_timer_t *timer);
+
+/* send to all channels bound to a socket, with as few syscalls as possible.
+ * An error sending to one channel does not stop the others - check
+ * lc_channel_errno() for the result of each. Returns total bytes sent, or -1
+ * if nothing could be sent */
 ssize_t lc_socket_send(lc_socket_t *sock, const void *buf, size_t len, int flags);
 ssize_t lc_socket_sendmsg(lc_socket_t *sock, struct msghdr *msg, int flags);
 
+/* return errno from last lc_socket_send() / lc_socket_sendmsg() to chan, or
+ * 0 if it succeeded */
+int lc_channel_errno(lc_channel_t *chan);
+
 /* send to channel. Channel must be bound to Librecast socket with
  * lc_channel_bind() first. */
 ssize_t lc_channel_send(lc_channel_t *chan, const void *buf, size_t len, int flags);
 ssize_t lc_channel_sendmsg(lc_channel_t *chan, struct msghdr *msg, int flags);
 
+/* send vlen datagrams to channel with a single sendmmsg(). The destination
+ * (msg_name) of each message is set to the channel address.
+ * Returns number of messages sent, or -1 on error. */
+int lc_channel_sendmmsg(lc_channel_t *chan, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+
 /* blocking message receive */
 ssize_t lc_msg_recv(lc_socket_t *sock, lc_message_t *msg);
+
+/* receive up to max messages with a single recvmmsg(). flags are passed to
+ * recvmmsg() - use MSG_WAITFORONE to return as soon as one message is
+ * available. Returns number of messages received, or -1 on error.
+ * Free each message with lc_msg_free() */
+ssize_t lc_msg_recv_batch(lc_socket_t *sock, lc_message_t *msgs, size_t max, int flags);
 ssize_t lc_socket_recvmsg(lc_socket_t *sock, struct msghdr *msg, int flags);
 
-/* send a message to a channel */
+/* send a message to a channel. On a socket with lc_socket_zerocopy() set, a
+ * message at or above the threshold with a free function (msg->free) may be
+ * sent without copying: the library then owns msg->data, sets msg->free to
+ * NULL, and calls the free function once the kernel is done with the data */
 ssize_t lc_msg_send(lc_channel_t *chan, lc_message_t *msg);
+
+/* send n messages, msgs[i] to chans[i], batching into as few sendmmsg()
+ * calls as possible. Returns the number of messages sent, which may be fewer
+ * than n. Sequence numbers are only consumed for messages actually sent.
+ * msgs[i].bytes is set to the bytes sent for each message sent. Messages
+ * for a FEC channel, or big enough for GSO or fragmenting, are sent one at a
+ * time with lc_msg_sendv() in their place in the batch. */
+ssize_t lc_msg_send_batch(lc_channel_t **chans, lc_message_t *msgs, size_t n);
+
+/* send a message to a channel, gathering the payload from iovcnt buffers in
+ * iov. Header fields (opcode, timestamp) are taken from msg; msg->data and
+ * msg->len are ignored. */
+ssize_t lc_msg_sendv(lc_channel_t *chan, lc_message_t *msg, const struct iovec *iov, int iovcnt);
 ssize_t lc_msg_sendto(int sock, const void *buf, size_t len, struct sockaddr_in6 *addr, int flags);
 
 /* get/set socket options */
 int lc_socket_getopt(lc_socket_t *sock, int optname, void *optval, socklen_t *optlen);
 int lc_socket_setopt(lc_socket_t *sock, int optname, const void *optval, socklen_t optlen);
 
+/* UDP GSO (generic segmentation offload) mode - Linux 4.18+
+ * When size > 0, payloads larger than size are handed to the kernel in one
+ * syscall and split into datagrams carrying size bytes of payload each.
+ * lc_msg_send() / lc_msg_sendv() give every segment its own message header;
+ * lc_channel_send() segments the raw buffer. size = 0 disables (default).
+ * Returns 0 on success, -1 on error (errno set) */
+int lc_socket_gso(lc_socket_t *sock, size_t size);
+
+/* send lc_msg_send() / lc_msg_sendv() messages that don't fit in a datagram
+ * of size bytes (message header included) as fragments of at most size
+ * bytes, instead of leaving it to IPv6 fragmentation, where losing any one
+ * fragment loses the message. Set size to the path MTU less IPv6 and UDP
+ * headers, 1232 for the IPv6 minimum MTU. Fragments have LC_OP_FRAG set in
+ * their op and a fragment header ahead of the payload. Receivers reassemble
+ * them for lc_msg_recv() and lc_socket_listen() callbacks, which see each
+ * message once, whole, as does lc_socket_listen_batch(). lc_msg_recv_batch()
+ * doesn't reassemble. Messages of more than 65535 fragments fail with
+ * EMSGSIZE. size = 0 disables (default).
+ * Returns 0 on success, -1 on error (errno set) */
+int lc_socket_fragment(lc_socket_t *sock, size_t size);
+
+/* cap the memory sock holds for messages being reassembled from fragments
+ * at maxmem bytes (default 16MiB). Messages bigger than that are dropped,
+ * and the least recently active partial messages make way for new ones.
+ * A message is dropped after a second without a new fragment */
+void lc_socket_reassembly(lc_socket_t *sock, size_t maxmem);
+
+/* UDP GRO (generic receive offload) mode - Linux 5.0+
+ * val = 1: the kernel may coalesce datagrams into a single buffer which
+ * lc_msg_recv() (and so lc_socket_listen()) splits back into messages, one
+ * per call. lc_socket_recv() / lc_socket_recvmsg() return the raw coalesced
+ * buffer. val = 0 disables (default).
+ * Returns 0 on success, -1 on error (errno set) */
+int lc_socket_gro(lc_socket_t *sock, int val);
+
+/* MSG_ZEROCOPY sends - Linux 4.14+ (UDP 5.0+)
+ * lc_msg_send() payloads of size bytes or more, that have a free function, are
+ * sent from the caller's pages instead of being copied into the kernel. The
+ * kernel reports when it's done with them on the socket error queue, which is
+ * read on later sends, by lc_socket_zerocopy_pending() and on close, and
+ * msg->free is called then. Pinning pages costs more than copying small
+ * payloads - somewhere around 10KiB is where it starts to pay. Smaller
+ * messages, lc_channel_send() and sockets using GSO or XDP are copied as
+ * usual. size = 0 disables (default).
+ * Returns 0 on success, -1 on error (errno set) */
+int lc_socket_zerocopy(lc_socket_t *sock, size_t size);
+
+/* reap zero-copy completions, returning the number of sends the kernel may
+ * still be reading from */
+int lc_socket_zerocopy_pending(lc_socket_t *sock);
+
+/* pace rate limited channels (lc_channel_rate()) bound to sock in the qdisc
+ * rather than by sleeping: sends are stamped with a SO_TXTIME departure time
+ * on clock, and held until then by the fq (CLOCK_MONOTONIC) or etf
+ * (CLOCK_TAI) qdisc, which must be set up on the egress interface - other
+ * qdiscs send them at once. Sends more than 100ms ahead of their time still
+ * sleep the difference. Clocks other than CLOCK_MONOTONIC need
+ * CAP_NET_ADMIN. clock -1 goes back to sleeping (default). Linux 4.19+.
+ * Returns 0 on success, -1 on error (errno set) */
+int lc_socket_txtime(lc_socket_t *sock, int clock);
+
 /* turn socket loopback on (val = 1) or off (val = 0)*/
 int lc_socket_loop(lc_socket_t *sock, int val);
 
@@ -104,13 +372,33 @@ int lc_msg_init_size(lc_message_t *msg, size_t len);
  * if not NULL, function f will be called to free the structure with hint as an argument */
 int lc_msg_init_data(lc_message_t *msg, void *data, size_t len, lc_free_fn_t *f, void *hint);
 
-/* free message */
+/* free message. For received messages this drops one reference to the
+ * message data, see lc_msg_ref() */
 void lc_msg_free(void *msg);
 
-/* hash message data and source address
+/* take another reference to the data of a received message, which is held
+ * in a refcounted buffer from the ctx pools. Copy the lc_message_t (the
+ * struct, not the data) once per reference taken and hand a copy to each
+ * consumer; the buffer goes back to its pool when the last copy is unrefed.
+ * Returns 0 on success, -1 (errno EINVAL) if msg data is not refcounted */
+int lc_msg_ref(lc_message_t *msg);
+
+/* drop a reference to message data taken with lc_msg_ref(). Same as
+ * lc_msg_free() */
+void lc_msg_unref(lc_message_t *msg);
+
+/* hash message data and (binary) source address
  * call with pre-allocated buffer id of size len */
 int lc_msg_id(lc_message_t *msg, unsigned char *id, size_t len);
 
+/* return message source address as a string. Formatted on first call and
+ * cached in msg->srcaddr */
+const char *lc_msg_srcaddr(lc_message_t *msg);
+
+/* return message destination address as a string. Formatted on first call
+ * and cached in msg->dstaddr */
+const char *lc_msg_dstaddr(lc_message_t *msg);
+
 /* return pointer to message data */
 void *lc_msg_data(lc_message_t *msg);
 
@@ -129,6 +417,12 @@ uint32_t lc_channel_get_id(lc_channel_t *chan);
 
 /* return raw network socket */
 int lc_socket_raw(lc_socket_t *sock);
+
+/* how sock's kernel filter tests the group of multicast it receives:
+ * LC_FILTER_EXACT, LC_FILTER_HASH with too many channels bound to test each
+ * (see lc_channel_bind()), or LC_FILTER_NONE with none, on a ring socket or
+ * off Linux */
+int lc_socket_filter_mode(lc_socket_t *sock);
 int lc_channel_socket_raw(lc_channel_t *chan);
 
 /* return context for channel chan */
@@ -143,6 +437,10 @@ struct sockaddr_in6 *lc_channel_sockaddr(lc_channel_t *chan);
 /* return struct in6_addr for this channel */
 struct in6_addr *lc_channel_in6addr(lc_channel_t *chan);
 
+/* find channel in ctx by group address. Where more than one channel has the
+ * same address, the most recently created is returned. NULL if not found */
+lc_channel_t *lc_channel_by_address(lc_ctx_t *lctx, struct in6_addr *addr);
+
 /* return channel uri */
 char *lc_channel_uri(lc_channel_t *chan);
 
@@ -152,7 +450,9 @@ lc_channel_t * lc_channel_init(lc_ctx_t *ctx, struct sockaddr_in6 *sa);
 /* free channel */
 void lc_channel_free(lc_channel_t *chan);
 
-/* get some random bytes */
+/* fill buf with buflen cryptographically secure random bytes, from a
+ * per-thread ChaCha20 generator seeded by the OS (no syscall once seeded,
+ * reseeded after fork). Returns buflen, or -1 on error */
 int lc_getrandom(void *buf, size_t buflen);
 
 #endif /* _LIBRECAST_NET_H */
@@ -17,6 +17,19 @@
 #define DEFAULT_MULTICAST_LOOP 0
 #define DEFAULT_MULTICAST_HOPS 255
 
+/* how a socket group shares traffic between workers */
+#define LC_STEER_GROUP 0 /* by multicast group (default) */
+#define LC_STEER_SOURCE 1 /* by source address */
+
+/* how a ctx does its socket I/O */
+#define LC_ENGINE_SYSCALL 0 /* recvmsg() / sendmmsg() (default) */
+#define LC_ENGINE_URING 1 /* io_uring */
+
+/* how a socket's kernel filter tests the group of multicast it receives */
+#define LC_FILTER_NONE 0 /* it doesn't */
+#define LC_FILTER_EXACT 1 /* against each bound channel */
+#define LC_FILTER_HASH 2 /* against a hash of them, which lets some others by */
+
 typedef uint64_t lc_seq_t;
 typedef uint64_t lc_rnd_t;
 typedef uint64_t lc_len_t;
@@ -26,6 +39,8 @@ typedef struct lc_channel_t lc_channel_t;
 typedef struct lc_msg_head_t lc_msg_head_t;
 typedef struct lc_query_t lc_query_t;
 typedef struct lc_query_param_t lc_query_param_t;
+typedef struct lc_timer_s lc_timer_t;
+typedef struct lc_socket_group_t lc_socket_group_t;
 typedef void *lc_free_fn_t(void *msg, void *hint);
 
 #define LC_OPCODES(X) \
@@ -47,6 +62,12 @@ typedef enum {
 	LC_OPCODES(LC_OPCODE_ENUM)
 } lc_opcode_t;
 
+/* op flag: message is one fragment of a bigger one, see lc_socket_fragment() */
+#define LC_OP_FRAG 0x80
+
+/* op flag: datagram carries a FEC header, see lc_channel_fec() */
+#define LC_OP_FEC 0x40
+
 typedef enum {
 	LC_DB_MODE_DUP = 1,
 	LC_DB_MODE_LEFT = 2,
@@ -79,6 +100,7 @@ typedef enum {
 
 typedef struct lc_message_t {
 	uint64_t timestamp;
+	uint64_t rxtime; /* kernel receive time, ns since the epoch, 0 = unknown */
 	struct in6_addr dst;
 	struct in6_addr src;
 	lc_seq_t seq;
@@ -89,8 +111,8 @@ typedef struct lc_message_t {
 	lc_opcode_t op;
 	lc_free_fn_t *free;
 	lc_channel_t *chan;
-	char srcaddr[INET6_ADDRSTRLEN];
-	char dstaddr[INET6_ADDRSTRLEN];
+	char srcaddr[INET6_ADDRSTRLEN]; /* empty until lc_msg_srcaddr() is called */
+	char dstaddr[INET6_ADDRSTRLEN]; /* empty until lc_msg_dstaddr() is called */
 	void *hint;
 	void *data;
 } lc_message_t;
@@ -112,6 +134,7 @@ typedef struct lc_socket_call_s {
 	lc_socket_t *sock;
 	void (*callback_msg)(lc_message_t*);
 	void (*callback_err)(int);
+	void (*callback_batch)(lc_message_t*, size_t);
 } lc_socket_call_t;
 
 extern void (*lc_op_handler[LC_OP_MAX])(lc_socket_call_t *, lc_message_t *);
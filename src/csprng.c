@@ -0,0 +1,160 @@
+/* SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only */
+/* Copyright (c) 2021 Brett Sheffield <bacs@librecast.net> */
+
+#include "csprng.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__linux__) || defined(__FreeBSD__)
+#include <sys/random.h>
+#define LC_GETRANDOM 1
+#endif
+
+#define LC_CSPRNG_BUFSZ (LC_CSPRNG_BLOCKS * 64)
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define QR(a, b, c, d) \
+	a += b; d ^= a; d = ROTL(d, 16); \
+	c += d; b ^= c; b = ROTL(b, 12); \
+	a += b; d ^= a; d = ROTL(d, 8); \
+	c += d; b ^= c; b = ROTL(b, 7)
+
+/* per thread generator */
+typedef struct lc_csprng_s {
+	uint32_t state[16];
+	unsigned char buf[LC_CSPRNG_BUFSZ]; /* keystream, zeroed as it's used */
+	size_t avail; /* unused bytes at the end of buf */
+	unsigned int gen; /* fork generation we were seeded in, 0 = not seeded */
+} lc_csprng_t;
+
+static _Thread_local lc_csprng_t rng;
+static atomic_uint forks = 1; /* bumped in the child on fork() */
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+void lc_chacha20_block(uint32_t out[16], const uint32_t in[16])
+{
+	uint32_t x[16];
+
+	memcpy(x, in, sizeof x);
+	for (int i = 0; i < 10; i++) {
+		QR(x[0], x[4], x[8], x[12]);
+		QR(x[1], x[5], x[9], x[13]);
+		QR(x[2], x[6], x[10], x[14]);
+		QR(x[3], x[7], x[11], x[15]);
+		QR(x[0], x[5], x[10], x[15]);
+		QR(x[1], x[6], x[11], x[12]);
+		QR(x[2], x[7], x[8], x[13]);
+		QR(x[3], x[4], x[9], x[14]);
+	}
+	for (int i = 0; i < 16; i++) out[i] = x[i] + in[i];
+}
+
+static void lc_csprng_forked(void)
+{
+	/* only the forking thread survives, and it will see this */
+	atomic_fetch_add(&forks, 1);
+}
+
+static void lc_csprng_atfork(void)
+{
+	pthread_atfork(NULL, NULL, &lc_csprng_forked);
+}
+
+static int lc_csprng_seed(unsigned char *key)
+{
+	size_t off = 0;
+	ssize_t n;
+#ifdef LC_GETRANDOM
+	while (off < LC_CSPRNG_KEYSZ) {
+		if ((n = getrandom(key + off, LC_CSPRNG_KEYSZ - off, 0)) == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		off += n;
+	}
+#else
+	int fd;
+
+	if ((fd = open("/dev/urandom", O_RDONLY)) == -1) return -1;
+	while (off < LC_CSPRNG_KEYSZ) {
+		if ((n = read(fd, key + off, LC_CSPRNG_KEYSZ - off)) <= 0) {
+			if (n == -1 && errno == EINTR) continue;
+			close(fd);
+			return -1;
+		}
+		off += n;
+	}
+	close(fd);
+#endif
+	return 0;
+}
+
+static void lc_csprng_key(lc_csprng_t *r, const unsigned char *key)
+{
+	/* "expand 32-byte k" */
+	r->state[0] = 0x61707865;
+	r->state[1] = 0x3320646e;
+	r->state[2] = 0x79622d32;
+	r->state[3] = 0x6b206574;
+	for (int i = 0; i < 8; i++) {
+		r->state[4 + i] = (uint32_t)key[4 * i] | (uint32_t)key[4 * i + 1] << 8
+			| (uint32_t)key[4 * i + 2] << 16 | (uint32_t)key[4 * i + 3] << 24;
+	}
+	/* the key is never used for more than one batch, so counter and
+	 * nonce can start from zero each time */
+	memset(&r->state[12], 0, 4 * sizeof(uint32_t));
+}
+
+static void lc_csprng_refill(lc_csprng_t *r)
+{
+	uint32_t out[16];
+	unsigned char *p = r->buf;
+
+	for (int b = 0; b < LC_CSPRNG_BLOCKS; b++) {
+		lc_chacha20_block(out, r->state);
+		r->state[12]++;
+		for (int i = 0; i < 16; i++, p += 4) {
+			p[0] = out[i];
+			p[1] = out[i] >> 8;
+			p[2] = out[i] >> 16;
+			p[3] = out[i] >> 24;
+		}
+	}
+	/* fast key erasure: the start of the batch is the next key, and is
+	 * never handed out */
+	lc_csprng_key(r, r->buf);
+	memset(r->buf, 0, LC_CSPRNG_KEYSZ);
+	r->avail = LC_CSPRNG_BUFSZ - LC_CSPRNG_KEYSZ;
+}
+
+int lc_csprng(void *buf, size_t len)
+{
+	unsigned char key[LC_CSPRNG_KEYSZ];
+	unsigned char *p = buf, *src;
+	unsigned int gen;
+	size_t n;
+
+	pthread_once(&atfork_once, &lc_csprng_atfork);
+	gen = atomic_load_explicit(&forks, memory_order_relaxed);
+	if (rng.gen != gen) {
+		/* first use in this thread, or we're a new process that would
+		 * otherwise repeat our parent's output */
+		if (lc_csprng_seed(key) == -1) return -1;
+		lc_csprng_key(&rng, key);
+		memset(key, 0, sizeof key);
+		rng.avail = 0;
+		rng.gen = gen;
+	}
+	for (size_t off = 0; off < len; off += n) {
+		if (!rng.avail) lc_csprng_refill(&rng);
+		n = (len - off < rng.avail) ? len - off : rng.avail;
+		src = rng.buf + LC_CSPRNG_BUFSZ - rng.avail;
+		memcpy(p + off, src, n);
+		memset(src, 0, n);
+		rng.avail -= n;
+	}
+	return (int)len;
+}
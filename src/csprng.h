@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only */
+/* Copyright (c) 2021 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _CSPRNG_H
+#define _CSPRNG_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LC_CSPRNG_BLOCKS 8 /* ChaCha20 blocks generated at a time */
+#define LC_CSPRNG_KEYSZ 32
+
+/* ChaCha20 block function (RFC 8439): 16 words of keystream from 16 words
+ * of state - constants, key, block counter and nonce */
+void lc_chacha20_block(uint32_t out[16], const uint32_t in[16]);
+
+/* fill buf with len random bytes from the calling thread's generator.
+ * ChaCha20, seeded from the OS on first use and again after fork(), with
+ * the key replaced from its own output after each batch of blocks (fast key
+ * erasure), so earlier output can't be recovered from the state. Returns
+ * len, or -1 if the generator can't be seeded */
+int lc_csprng(void *buf, size_t len);
+
+#endif /* _CSPRNG_H */
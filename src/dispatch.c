@@ -0,0 +1,145 @@
+/* SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only */
+/* Copyright (c) 2021 Brett Sheffield <bacs@librecast.net> */
+
+#include "dispatch.h"
+#include <errno.h>
+#include <stdlib.h>
+
+static void lc_dispatch_msg_free(lc_message_t *msg)
+{
+	if (msg->free) msg->free(msg->data, msg->hint);
+}
+
+/* worker. Cancellation only takes effect while waiting, never part way
+ * through a message */
+static void *lc_dispatch_thread(void *arg)
+{
+	lc_dispatch_q_t *q = arg;
+	lc_dispatch_t *d = q->d;
+	lc_message_t msg;
+	size_t tail;
+	int state;
+
+	for (;;) {
+		if (sem_wait(&q->sem) == -1) continue;
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+		/* take it out, so its slot is free while we work */
+		tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+		msg = q->slot[tail & q->mask];
+		atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+		d->f(d->arg, &msg);
+		lc_dispatch_msg_free(&msg);
+		pthread_setcancelstate(state, NULL);
+	}
+	/* not reached */
+	return NULL;
+}
+
+lc_dispatch_t *lc_dispatch_new(int workers, size_t qlen)
+{
+	lc_dispatch_t *d;
+	size_t slots = 1;
+
+	if (workers < 1 || !qlen) {
+		errno = EINVAL;
+		return NULL;
+	}
+	while (slots < qlen) slots <<= 1;
+	if (!(d = calloc(1, sizeof(lc_dispatch_t)))) return NULL;
+	if (!(d->q = calloc(workers, sizeof(lc_dispatch_q_t)))) goto err_0;
+	for (d->workers = 0; d->workers < workers; d->workers++) {
+		lc_dispatch_q_t *q = &d->q[d->workers];
+		if (!(q->slot = calloc(slots, sizeof(lc_message_t)))) goto err_0;
+		if (sem_init(&q->sem, 0, 0) == -1) {
+			free(q->slot);
+			goto err_0;
+		}
+		q->mask = slots - 1;
+		q->d = d;
+	}
+	return d;
+err_0:
+	lc_dispatch_free(d);
+	return NULL;
+}
+
+void lc_dispatch_free(lc_dispatch_t *d)
+{
+	if (!d) return;
+	lc_dispatch_stop(d);
+	for (int i = 0; i < d->workers; i++) {
+		sem_destroy(&d->q[i].sem);
+		free(d->q[i].slot);
+	}
+	free(d->q);
+	free(d);
+}
+
+int lc_dispatch_start(lc_dispatch_t *d, void (*f)(void *, lc_message_t *), void *arg)
+{
+	int i, err;
+
+	d->f = f;
+	d->arg = arg;
+	for (i = 0; i < d->workers; i++) {
+		if ((err = pthread_create(&d->q[i].thread, NULL, &lc_dispatch_thread, &d->q[i])))
+			break;
+	}
+	d->running = i;
+	if (i < d->workers) {
+		lc_dispatch_stop(d);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+void lc_dispatch_stop(lc_dispatch_t *d)
+{
+	lc_dispatch_q_t *q;
+	size_t head, tail;
+
+	for (int i = 0; i < d->running; i++) {
+		pthread_cancel(d->q[i].thread);
+		pthread_join(d->q[i].thread, NULL);
+	}
+	d->running = 0;
+	/* nobody is pushing or taking now */
+	for (int i = 0; i < d->workers; i++) {
+		q = &d->q[i];
+		head = atomic_load(&q->head);
+		for (tail = atomic_load(&q->tail); tail != head; tail++) {
+			lc_dispatch_msg_free(&q->slot[tail & q->mask]);
+			d->drops++;
+		}
+		atomic_store(&q->tail, tail);
+		while (!sem_trywait(&q->sem));
+	}
+}
+
+int lc_dispatch_push(lc_dispatch_t *d, uint32_t key, lc_message_t *msg)
+{
+	lc_dispatch_q_t *q = &d->q[key % d->workers];
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+	if (head - atomic_load_explicit(&q->tail, memory_order_acquire) > q->mask) {
+		d->drops++;
+		errno = ENOBUFS;
+		return -1;
+	}
+	q->slot[head & q->mask] = *msg;
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	sem_post(&q->sem);
+	return 0;
+}
+
+size_t lc_dispatch_depth(lc_dispatch_t *d)
+{
+	size_t depth = 0;
+
+	for (int i = 0; i < d->workers; i++) {
+		depth += atomic_load_explicit(&d->q[i].head, memory_order_acquire)
+			- atomic_load_explicit(&d->q[i].tail, memory_order_acquire);
+	}
+	return depth;
+}
@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only */
+/* Copyright (c) 2021 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _DISPATCH_H
+#define _DISPATCH_H 1
+
+#include "../include/librecast/types.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* bounded single producer / single consumer ring of messages. head and tail
+ * only ever grow, and are masked to find their slot */
+typedef struct lc_dispatch_q_s {
+	lc_message_t *slot;
+	size_t mask; /* slots - 1, slots is a power of 2 */
+	atomic_size_t head; /* next slot to fill, written by producer */
+	atomic_size_t tail; /* next slot to take, written by consumer */
+	sem_t sem; /* messages waiting */
+	pthread_t thread;
+	struct lc_dispatch_s *d;
+} lc_dispatch_q_t;
+
+/* pool of worker threads, each with its own queue. Messages pushed with the
+ * same key go to the same worker, so they are handled in order */
+typedef struct lc_dispatch_s {
+	lc_dispatch_q_t *q;
+	int workers;
+	int running;
+	void (*f)(void *, lc_message_t *); /* what workers do with each message */
+	void *arg;
+	atomic_uint_fast64_t drops; /* messages refused by a full queue, or never handled */
+} lc_dispatch_t;
+
+/* create workers queues of qlen messages (rounded up to a power of 2). NULL on
+ * error with errno set */
+lc_dispatch_t *lc_dispatch_new(int workers, size_t qlen);
+
+/* stop workers and free everything, including messages still queued */
+void lc_dispatch_free(lc_dispatch_t *d);
+
+/* start workers, which call f(arg, msg) for each message, then free it */
+int lc_dispatch_start(lc_dispatch_t *d, void (*f)(void *, lc_message_t *), void *arg);
+
+/* stop workers, and free messages they hadn't got to. These count as drops */
+void lc_dispatch_stop(lc_dispatch_t *d);
+
+/* queue msg for the worker chosen by key. The queue takes msg over, so it
+ * must not be freed by the caller. Never blocks - if the queue is full, -1
+ * with errno ENOBUFS, the message is counted as a drop and the caller still
+ * owns it. Single producer */
+int lc_dispatch_push(lc_dispatch_t *d, uint32_t key, lc_message_t *msg);
+
+/* messages queued and not yet taken by a worker */
+size_t lc_dispatch_depth(lc_dispatch_t *d);
+
+#endif /* _DISPATCH_H */
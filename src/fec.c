@@ -0,0 +1,560 @@
+/* SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only */
+/* Copyright (c) 2021 Brett Sheffield <bacs@librecast.net> */
+
+#include "fec.h"
+#include "csprng.h"
+#include "librecast_pvt.h"
+#include "pool.h"
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LC_GF_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define LC_GF_NEON 1
+#endif
+
+typedef void lc_gf_muladd_fn(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t gf_mul[256][256];
+static lc_gf_muladd_fn *gf_muladd = &lc_gf_muladd_scalar;
+static const char *gf_kernel = "scalar";
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+
+void lc_gf_muladd_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+	const uint8_t *row = gf_mul[c];
+	for (size_t i = 0; i < len; i++) dst[i] ^= row[src[i]];
+}
+
+/* The vector kernels split each byte into nibbles and look both up in 16
+ * entry tables of their products with c, whose xor is the product of the
+ * byte */
+static void lc_gf_nibbles(uint8_t c, uint8_t lo[16], uint8_t hi[16])
+{
+	for (int i = 0; i < 16; i++) {
+		lo[i] = gf_mul[c][i];
+		hi[i] = gf_mul[c][i << 4];
+	}
+}
+
+#ifdef LC_GF_X86
+__attribute__((target("ssse3")))
+static void lc_gf_muladd_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+	uint8_t lo[16], hi[16];
+	size_t i = 0;
+
+	lc_gf_nibbles(c, lo, hi);
+	const __m128i tlo = _mm_loadu_si128((const __m128i *)lo);
+	const __m128i thi = _mm_loadu_si128((const __m128i *)hi);
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	for (; i + 16 <= len; i += 16) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+		__m128i l = _mm_shuffle_epi8(tlo, _mm_and_si128(s, mask));
+		__m128i h = _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+	}
+	lc_gf_muladd_scalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("avx2")))
+static void lc_gf_muladd_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+	uint8_t lo[16], hi[16];
+	size_t i = 0;
+
+	lc_gf_nibbles(c, lo, hi);
+	const __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+	const __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	for (; i + 32 <= len; i += 32) {
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		__m256i l = _mm256_shuffle_epi8(tlo, _mm256_and_si256(s, mask));
+		__m256i h = _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+	}
+	lc_gf_muladd_scalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+#ifdef LC_GF_NEON
+static void lc_gf_muladd_neon(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+	uint8_t lo[16], hi[16];
+	size_t i = 0;
+
+	lc_gf_nibbles(c, lo, hi);
+	const uint8x16_t tlo = vld1q_u8(lo);
+	const uint8x16_t thi = vld1q_u8(hi);
+	const uint8x16_t mask = vdupq_n_u8(0x0f);
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t s = vld1q_u8(src + i);
+		uint8x16_t l = vqtbl1q_u8(tlo, vandq_u8(s, mask));
+		uint8x16_t h = vqtbl1q_u8(thi, vshrq_n_u8(s, 4));
+		vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), veorq_u8(l, h)));
+	}
+	lc_gf_muladd_scalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+static void lc_gf_init(void)
+{
+	unsigned int x = 1;
+
+	for (int i = 0; i < 255; i++) {
+		gf_exp[i] = gf_exp[i + 255] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if (x & 0x100) x ^= 0x11d;
+	}
+	for (int a = 1; a < 256; a++) {
+		for (int b = 1; b < 256; b++) gf_mul[a][b] = gf_exp[gf_log[a] + gf_log[b]];
+	}
+#ifdef LC_GF_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		gf_muladd = &lc_gf_muladd_avx2;
+		gf_kernel = "avx2";
+	}
+	else if (__builtin_cpu_supports("ssse3")) {
+		gf_muladd = &lc_gf_muladd_ssse3;
+		gf_kernel = "ssse3";
+	}
+#endif
+#ifdef LC_GF_NEON
+	gf_muladd = &lc_gf_muladd_neon;
+	gf_kernel = "neon";
+#endif
+}
+
+/* region multiply-add, once the tables are set up */
+static inline void gf_addmul(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+	if (!c || !len) return;
+	gf_muladd(dst, src, c, len);
+}
+
+void lc_gf_muladd(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+	pthread_once(&gf_once, &lc_gf_init);
+	gf_addmul(dst, src, c, len);
+}
+
+const char *lc_gf_kernel(void)
+{
+	pthread_once(&gf_once, &lc_gf_init);
+	return gf_kernel;
+}
+
+uint8_t lc_gf_mul(uint8_t a, uint8_t b)
+{
+	pthread_once(&gf_once, &lc_gf_init);
+	return gf_mul[a][b];
+}
+
+static inline uint8_t gf_inv(uint8_t a)
+{
+	return gf_exp[255 - gf_log[a]];
+}
+
+/* Cauchy matrix coefficient of source j in repair r */
+static inline uint8_t lc_fec_coef(int r, int j)
+{
+	return gf_inv((255 - r) ^ j);
+}
+
+lc_fec_enc_t *lc_fec_enc_new(int k, int m)
+{
+	lc_fec_enc_t *enc;
+
+	if (k < 1 || m < 1 || k + m > LC_FEC_MAXN) {
+		errno = EINVAL;
+		return NULL;
+	}
+	pthread_once(&gf_once, &lc_gf_init);
+	if (!(enc = calloc(1, sizeof(lc_fec_enc_t)))) return NULL;
+	if (lc_csprng(&enc->id, sizeof enc->id) == -1) {
+		free(enc);
+		return NULL;
+	}
+	enc->k = k;
+	enc->m = m;
+	return enc;
+}
+
+void lc_fec_enc_free(lc_fec_enc_t *enc)
+{
+	if (!enc) return;
+	for (int r = 0; r < enc->m; r++) free(enc->rep[r]);
+	free(enc);
+}
+
+int lc_fec_enc_add(lc_fec_enc_t *enc, const struct iovec *iov, int iovcnt)
+{
+	uint8_t hdr[2], c;
+	size_t len = 0, symlen, cap, off;
+
+	for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+	symlen = sizeof hdr + len;
+	if (len > UINT16_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (symlen > enc->cap) {
+		/* symbols beyond the end of a shorter one are zero */
+		cap = (symlen + 1023) & ~(size_t)1023;
+		for (int r = 0; r < enc->m; r++) {
+			uint8_t *p = realloc(enc->rep[r], cap);
+			if (!p) return -1;
+			memset(p + enc->cap, 0, cap - enc->cap);
+			enc->rep[r] = p;
+		}
+		enc->cap = cap;
+	}
+	hdr[0] = len >> 8;
+	hdr[1] = len & 0xff;
+	for (int r = 0; r < enc->m; r++) {
+		c = lc_fec_coef(r, enc->n);
+		gf_addmul(enc->rep[r], hdr, c, sizeof hdr);
+		off = sizeof hdr;
+		for (int i = 0; i < iovcnt; i++) {
+			gf_addmul(enc->rep[r] + off, iov[i].iov_base, c, iov[i].iov_len);
+			off += iov[i].iov_len;
+		}
+	}
+	if (symlen > enc->symsz) enc->symsz = symlen;
+	enc->n++;
+	return 0;
+}
+
+void lc_fec_enc_next(lc_fec_enc_t *enc)
+{
+	for (int r = 0; r < enc->m; r++) memset(enc->rep[r], 0, enc->symsz);
+	enc->symsz = 0;
+	enc->n = 0;
+	enc->block++;
+}
+
+static size_t lc_fec_hash(const struct in6_addr *src, const struct in6_addr *dst, uint32_t id,
+		uint32_t block)
+{
+	uint64_t h = (uint64_t)id << 32 | block, w;
+
+	for (int i = 0; i < 16; i += 8) {
+		memcpy(&w, &src->s6_addr[i], sizeof w);
+		h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+		memcpy(&w, &dst->s6_addr[i], sizeof w);
+		h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+	}
+	return (h >> 32) & (LC_FEC_BUCKETS - 1);
+}
+
+static lc_fec_block_t **lc_fec_find(lc_fec_dec_t *dec, const struct in6_addr *src,
+		const struct in6_addr *dst, uint32_t id, uint32_t block)
+{
+	lc_fec_block_t **p = &dec->tab[lc_fec_hash(src, dst, id, block)];
+
+	for (; *p; p = &(*p)->hnext) {
+		if ((*p)->block == block && (*p)->id == id
+		&& !memcmp(&(*p)->src, src, sizeof(struct in6_addr))
+		&& !memcmp(&(*p)->dst, dst, sizeof(struct in6_addr)))
+			break;
+	}
+	return p;
+}
+
+/* block that was dealt with less than timeout ago, NULL if none */
+static lc_fec_done_t *lc_fec_is_done(lc_fec_dec_t *dec, const struct in6_addr *src,
+		const struct in6_addr *dst, uint32_t id, uint32_t block, uint64_t now)
+{
+	for (unsigned int i = 0; i < dec->ndone; i++) {
+		if (dec->done[i].block == block && dec->done[i].id == id
+		&& dec->done[i].expires > now
+		&& !memcmp(&dec->done[i].src, src, sizeof(struct in6_addr))
+		&& !memcmp(&dec->done[i].dst, dst, sizeof(struct in6_addr)))
+			return &dec->done[i];
+	}
+	return NULL;
+}
+
+static void lc_fec_unlink(lc_fec_dec_t *dec, lc_fec_block_t *b)
+{
+	if (b->prev) b->prev->next = b->next;
+	else dec->oldest = b->next;
+	if (b->next) b->next->prev = b->prev;
+	else dec->newest = b->prev;
+	b->prev = b->next = NULL;
+}
+
+static void lc_fec_append(lc_fec_dec_t *dec, lc_fec_block_t *b)
+{
+	b->prev = dec->newest;
+	if (dec->newest) dec->newest->next = b;
+	else dec->oldest = b;
+	dec->newest = b;
+}
+
+/* take block out of the decoder, counting any sources it never got */
+static void lc_fec_drop(lc_fec_dec_t *dec, lc_fec_block_t *b)
+{
+	lc_fec_block_t **p = lc_fec_find(dec, &b->src, &b->dst, b->id, b->block);
+
+	*p = b->hnext;
+	lc_fec_unlink(dec, b);
+	if (b->k) dec->lost += b->k - b->nsrc;
+	for (int i = 0; i < LC_FEC_MAXN; i++) {
+		if (b->sym[i]) lc_buf_unref(b->sym[i], NULL);
+		if (b->rep[i]) lc_buf_unref(b->rep[i], NULL);
+	}
+	dec->mem -= b->mem;
+	free(b);
+}
+
+static void lc_fec_finish(lc_fec_dec_t *dec, lc_fec_block_t *b, uint64_t now)
+{
+	lc_fec_done_t *done = &dec->done[dec->donei];
+
+	done->src = b->src;
+	done->dst = b->dst;
+	done->id = b->id;
+	done->block = b->block;
+	done->expires = now + dec->timeout;
+	memcpy(done->seen, b->seen, sizeof done->seen);
+	dec->donei = (dec->donei + 1) % LC_FEC_DONE;
+	if (dec->ndone < LC_FEC_DONE) dec->ndone++;
+	lc_fec_drop(dec, b);
+}
+
+lc_fec_dec_t *lc_fec_dec_new(size_t maxmem, uint64_t timeout, lc_fec_alloc_fn *alloc, void *arg)
+{
+	lc_fec_dec_t *dec;
+
+	pthread_once(&gf_once, &lc_gf_init);
+	if (!(dec = calloc(1, sizeof(lc_fec_dec_t)))) return NULL;
+	dec->maxmem = maxmem;
+	dec->timeout = timeout;
+	dec->alloc = alloc;
+	dec->arg = arg;
+	return dec;
+}
+
+static void lc_fec_out_clear(lc_fec_dec_t *dec)
+{
+	while (dec->iout < dec->nout) lc_buf_unref(dec->out[dec->iout++], NULL);
+	dec->nout = dec->iout = 0;
+}
+
+void lc_fec_dec_free(lc_fec_dec_t *dec)
+{
+	if (!dec) return;
+	lc_fec_out_clear(dec);
+	while (dec->oldest) lc_fec_drop(dec, dec->oldest);
+	free(dec);
+}
+
+/* invert e x e matrix a into inv by Gauss-Jordan elimination. Any square
+ * part of a Cauchy matrix is invertible */
+static int lc_fec_invert(uint8_t *a, uint8_t *inv, int e)
+{
+	uint8_t tmp[LC_FEC_MAXN], f;
+	int p;
+
+	memset(inv, 0, (size_t)e * e);
+	for (int i = 0; i < e; i++) inv[i * e + i] = 1;
+	for (int c = 0; c < e; c++) {
+		for (p = c; p < e && !a[p * e + c]; p++);
+		if (p == e) return -1;
+		if (p != c) {
+			memcpy(tmp, a + p * e, e);
+			memcpy(a + p * e, a + c * e, e);
+			memcpy(a + c * e, tmp, e);
+			memcpy(tmp, inv + p * e, e);
+			memcpy(inv + p * e, inv + c * e, e);
+			memcpy(inv + c * e, tmp, e);
+		}
+		f = gf_inv(a[c * e + c]);
+		for (int i = 0; i < e; i++) {
+			a[c * e + i] = gf_mul[f][a[c * e + i]];
+			inv[c * e + i] = gf_mul[f][inv[c * e + i]];
+		}
+		for (int r = 0; r < e; r++) {
+			if (r == c || !(f = a[r * e + c])) continue;
+			gf_addmul(a + r * e, a + c * e, f, e);
+			gf_addmul(inv + r * e, inv + c * e, f, e);
+		}
+	}
+	return 0;
+}
+
+/* recover the missing sources of b from its repairs, into dec->out */
+static void lc_fec_decode(lc_fec_dec_t *dec, lc_fec_block_t *b)
+{
+	int miss[LC_FEC_MAXN], rows[LC_FEC_MAXN];
+	uint8_t *a, *inv, *sym;
+	size_t len;
+	int e = 0, n = 0;
+
+	for (int j = 0; j < b->k; j++) if (!b->sym[j]) miss[e++] = j;
+	for (int r = 0; r < b->m && n < e; r++) if (b->rep[r]) rows[n++] = r;
+	if (!(a = malloc(2 * (size_t)e * e))) return;
+	inv = a + (size_t)e * e;
+
+	/* take the sources we have out of the repairs, leaving each a sum of
+	 * the missing ones only */
+	for (int i = 0; i < e; i++) {
+		for (int j = 0; j < b->k; j++) {
+			if (!b->sym[j]) continue;
+			len = (b->symlen[j] < b->symsz) ? b->symlen[j] : b->symsz;
+			gf_addmul(b->rep[rows[i]], b->sym[j], lc_fec_coef(rows[i], j), len);
+		}
+		for (int c = 0; c < e; c++) a[i * e + c] = lc_fec_coef(rows[i], miss[c]);
+	}
+	if (lc_fec_invert(a, inv, e)) goto done;
+	for (int c = 0; c < e; c++) {
+		if (!(sym = dec->alloc(dec->arg, b->symsz))) continue;
+		memset(sym, 0, b->symsz);
+		for (int i = 0; i < e; i++) {
+			gf_addmul(sym, b->rep[rows[i]], inv[c * e + i], b->symsz);
+		}
+		len = (size_t)sym[0] << 8 | sym[1];
+		if (len < sizeof(lc_message_head_t) || len + 2 > b->symsz) {
+			lc_buf_unref(sym, NULL);
+			continue;
+		}
+		dec->out[dec->nout++] = sym;
+		dec->recovered++;
+		b->seen[miss[c] / 8] |= 1 << (miss[c] % 8);
+		b->nsrc++; /* not lost */
+	}
+done:
+	free(a);
+}
+
+/* symbol for source datagram msg with len bytes of payload after its FEC
+ * header: the datagram as it was before the FEC header went in */
+static uint8_t *lc_fec_source(lc_fec_dec_t *dec, const lc_message_t *msg, size_t len)
+{
+	lc_message_head_t head = {0};
+	uint8_t *sym;
+
+	len += sizeof head;
+	if (!(sym = dec->alloc(dec->arg, 2 + len))) return NULL;
+	sym[0] = len >> 8;
+	sym[1] = len & 0xff;
+	head.timestamp = htobe64(msg->timestamp);
+	head.seq = htobe64(msg->seq);
+	head.rnd = htobe64(msg->rnd);
+	head.op = msg->op & ~LC_OP_FEC;
+	head.len = htobe64(len - sizeof head);
+	memcpy(sym + 2, &head, sizeof head);
+	memcpy(sym + 2 + sizeof head, (char *)msg->data + sizeof(lc_fec_head_t), len - sizeof head);
+	return sym;
+}
+
+int lc_fec_dec_add(lc_fec_dec_t *dec, const lc_message_t *msg, const struct in6_addr *dst,
+		uint64_t now)
+{
+	lc_fec_head_t fh;
+	lc_fec_block_t **p, *b;
+	lc_fec_done_t *done;
+	uint8_t *sym;
+	size_t len, symlen;
+	uint32_t id, block;
+	int idx, k, m, repair;
+
+	lc_fec_out_clear(dec);
+	while (dec->oldest && dec->oldest->expires <= now) lc_fec_drop(dec, dec->oldest);
+	dec->src = msg->src;
+	dec->dst = *dst;
+	dec->rxtime = msg->rxtime;
+
+	if (!msg->data || msg->len < sizeof fh) goto bad;
+	memcpy(&fh, msg->data, sizeof fh);
+	id = be32toh(fh.id);
+	block = be32toh(fh.block);
+	idx = fh.idx;
+	k = fh.k;
+	m = fh.m;
+	len = msg->len - sizeof fh;
+	if (!k || !m || k + m > LC_FEC_MAXN || idx >= k + m) goto bad;
+	repair = (idx >= k); /* in a repair, k is that of its own block */
+	symlen = (repair) ? len : 2 + sizeof(lc_message_head_t) + len;
+	if (symlen > 2 + UINT16_MAX || symlen > dec->maxmem) goto bad;
+
+	p = lc_fec_find(dec, &msg->src, dst, id, block);
+	if (!(b = *p)) {
+		if ((done = lc_fec_is_done(dec, &msg->src, dst, id, block, now))) {
+			/* late source the block managed without, unless it was
+			 * recovered. Nothing to hold it for */
+			if (repair || done->seen[idx / 8] & (1 << (idx % 8))) return 0;
+			if (!(sym = lc_fec_source(dec, msg, len))) goto bad;
+			done->seen[idx / 8] |= 1 << (idx % 8);
+			dec->out[dec->nout++] = sym;
+			return dec->nout;
+		}
+		if (!(b = calloc(1, sizeof(lc_fec_block_t)))) goto bad;
+		b->src = msg->src;
+		b->dst = *dst;
+		b->id = id;
+		b->block = block;
+		*p = b;
+		lc_fec_append(dec, b);
+	}
+	if (repair) {
+		idx -= k;
+		if ((b->k && (b->k != k || b->m != m)) || (b->symsz && b->symsz != len)) goto bad;
+		for (int j = k; j < LC_FEC_MAXN; j++) if (b->sym[j]) goto bad;
+		b->k = k;
+		b->m = m;
+		b->symsz = len;
+		if (b->rep[idx]) return 0; /* duplicate */
+	}
+	else {
+		if (b->k && idx >= b->k) goto bad;
+		if (b->sym[idx]) return 0; /* duplicate */
+	}
+
+	/* make room, oldest first, never the block we're adding to */
+	while (dec->oldest != b && dec->mem + symlen > dec->maxmem) lc_fec_drop(dec, dec->oldest);
+	if (repair) {
+		if (!(sym = dec->alloc(dec->arg, symlen))) goto bad;
+		memcpy(sym, (char *)msg->data + sizeof fh, len);
+		b->rep[idx] = sym;
+		b->nrep++;
+	}
+	else {
+		if (!(sym = lc_fec_source(dec, msg, len))) goto bad;
+		b->sym[idx] = sym;
+		b->symlen[idx] = symlen;
+		b->seen[idx / 8] |= 1 << (idx % 8);
+		b->nsrc++;
+		lc_buf_ref(sym);
+		dec->out[dec->nout++] = sym;
+	}
+	b->mem += symlen;
+	dec->mem += symlen;
+
+	if (b->k && b->nsrc + b->nrep >= b->k) {
+		if (b->nsrc < b->k) lc_fec_decode(dec, b);
+		lc_fec_finish(dec, b, now);
+	}
+	else {
+		/* still active, to the back of the queue */
+		b->expires = now + dec->timeout;
+		lc_fec_unlink(dec, b);
+		lc_fec_append(dec, b);
+	}
+	return dec->nout;
+bad:
+	dec->dropped++;
+	return dec->nout;
+}
@@ -0,0 +1,140 @@
+/* SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only */
+/* Copyright (c) 2021 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _FEC_H
+#define _FEC_H 1
+
+#include "../include/librecast/types.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define LC_FEC_MAXN 255 /* max source + repair datagrams per block */
+#define LC_FEC_BUCKETS 1024 /* decoder hash table size (power of 2) */
+#define LC_FEC_DONE 256 /* recently finished blocks remembered, to ignore stragglers */
+
+/* GF(256) (polynomial 0x11d) multiply-add of a region: dst[i] ^= c * src[i].
+ * Uses AVX2, SSSE3 or NEON where the CPU has them */
+void lc_gf_muladd(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+/* the same, one byte at a time from a multiplication table */
+void lc_gf_muladd_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+/* name of the kernel lc_gf_muladd() uses */
+const char *lc_gf_kernel(void);
+
+uint8_t lc_gf_mul(uint8_t a, uint8_t b);
+
+/* header following the message header of each source and repair datagram.
+ * Sources have LC_OP_FEC set in their op, and are otherwise sent as they
+ * would be without FEC. Repairs have only LC_OP_FEC as op, and a repair
+ * symbol for payload */
+typedef struct lc_fec_head_t {
+	uint32_t id; /* random, per encoder, so restarted senders start afresh */
+	uint32_t block; /* block number */
+	uint8_t idx; /* source index, or k + repair index */
+	uint8_t k; /* sources in block. Nominal in sources, actual in repairs */
+	uint8_t m; /* repairs per block */
+	uint8_t pad;
+} __attribute__((__packed__)) lc_fec_head_t;
+
+/* Symbols are datagrams as they would be sent without FEC, message header
+ * and all, with a 2 byte length in front, zero padded to the longest in
+ * the block. Repair r is sum(C[r][j] * source j) for the Cauchy matrix
+ * C[r][j] = 1 / ((255 - r) + j), so any k of the k + m symbols of a block
+ * give back its sources (systematic Cauchy Reed-Solomon) */
+
+/* encoder for one channel's sends */
+typedef struct lc_fec_enc_s {
+	uint8_t *rep[LC_FEC_MAXN]; /* repair symbols being built */
+	size_t cap; /* bytes allocated for each repair symbol */
+	size_t symsz; /* longest symbol in block so far */
+	uint32_t id;
+	uint32_t block;
+	int k, m;
+	int n; /* sources in block so far */
+} lc_fec_enc_t;
+
+/* encoder of blocks of k sources and m repairs, with a random id. NULL on
+ * error (errno set) */
+lc_fec_enc_t *lc_fec_enc_new(int k, int m);
+void lc_fec_enc_free(lc_fec_enc_t *enc);
+
+/* add the next source datagram of the block, gathered from iov, to the
+ * repair symbols. Returns 0, -1 on error (errno set) */
+int lc_fec_enc_add(lc_fec_enc_t *enc, const struct iovec *iov, int iovcnt);
+
+/* after the last source of a block (n == k, or fewer to cut it short), the
+ * m repairs are enc->rep[0..m-1], each symsz bytes. Start the next block */
+void lc_fec_enc_next(lc_fec_enc_t *enc);
+
+/* refcounted buffer (see pool.h) of len bytes for a symbol */
+typedef void *lc_fec_alloc_fn(void *arg, size_t len);
+
+/* block being received */
+typedef struct lc_fec_block_s {
+	struct lc_fec_block_s *hnext; /* next in hash bucket */
+	struct lc_fec_block_s *prev, *next; /* by last activity, oldest first */
+	struct in6_addr src;
+	struct in6_addr dst;
+	uint32_t id;
+	uint32_t block;
+	uint64_t expires; /* ns */
+	size_t mem; /* bytes of symbols held */
+	size_t symsz; /* repair symbol size, 0 = no repair yet */
+	int k; /* sources in block, 0 = not known until a repair arrives */
+	int m;
+	int nsrc, nrep; /* symbols held */
+	uint8_t *sym[LC_FEC_MAXN]; /* source symbols by index */
+	size_t symlen[LC_FEC_MAXN];
+	uint8_t *rep[LC_FEC_MAXN]; /* repair symbols by index, symsz bytes each */
+	uint8_t seen[(LC_FEC_MAXN + 7) / 8]; /* bitmap of sources handed out */
+} lc_fec_block_t;
+
+/* block that has been dealt with. Its repairs are dropped from then on, and
+ * any sources not yet handed out are handed out as they come */
+typedef struct lc_fec_done_s {
+	struct in6_addr src;
+	struct in6_addr dst;
+	uint32_t id;
+	uint32_t block;
+	uint64_t expires; /* ns, forgotten after */
+	uint8_t seen[(LC_FEC_MAXN + 7) / 8];
+} lc_fec_done_t;
+
+/* FEC decoder for a socket. Blocks are keyed by source, group, encoder id
+ * and block number, and each is dropped when it has had nothing for timeout
+ * ns, or to keep within maxmem bytes, least recently active first */
+typedef struct lc_fec_dec_s {
+	lc_fec_block_t *tab[LC_FEC_BUCKETS];
+	lc_fec_block_t *oldest, *newest;
+	lc_fec_done_t done[LC_FEC_DONE]; /* ring of recently finished blocks */
+	unsigned int donei; /* next slot in done */
+	unsigned int ndone; /* slots of done filled */
+	lc_fec_alloc_fn *alloc;
+	void *arg;
+	size_t mem; /* bytes held */
+	size_t maxmem;
+	uint64_t timeout;
+	uint8_t *out[LC_FEC_MAXN]; /* symbols to deliver, from the last lc_fec_dec_add() */
+	int nout; /* symbols in out */
+	int iout; /* next in out to deliver */
+	struct in6_addr src, dst; /* of the block out came from */
+	uint64_t rxtime; /* when the datagram that gave out arrived */
+	uint64_t recovered; /* sources decoded from repairs */
+	uint64_t lost; /* sources that could not be recovered */
+	uint64_t dropped; /* datagrams that were bad or too big */
+} lc_fec_dec_t;
+
+lc_fec_dec_t *lc_fec_dec_new(size_t maxmem, uint64_t timeout, lc_fec_alloc_fn *alloc, void *arg);
+void lc_fec_dec_free(lc_fec_dec_t *dec);
+
+/* add datagram msg with FEC header, received at now (ns), keyed by group
+ * dst. Source symbols go to dec->out at once. Any sources the block was
+ * missing follow as soon as enough repairs are in to decode them. Each
+ * symbol in out holds a reference to its buffer for the caller. Returns the
+ * number of symbols in dec->out (dec->nout) */
+int lc_fec_dec_add(lc_fec_dec_t *dec, const lc_message_t *msg, const struct in6_addr *dst,
+		uint64_t now);
+
+#endif /* _FEC_H */
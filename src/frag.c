@@ -0,0 +1,190 @@
+/* SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only */
+/* Copyright (c) 2021 Brett Sheffield <bacs@librecast.net> */
+
+#include "frag.h"
+#include "pool.h"
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t lc_frag_hash(const struct in6_addr *src, const struct in6_addr *dst, lc_seq_t seq,
+		lc_rnd_t rnd)
+{
+	uint64_t h = (seq ^ rnd) * 0x9e3779b97f4a7c15ULL, w;
+
+	for (int i = 0; i < 16; i += 8) {
+		memcpy(&w, &src->s6_addr[i], sizeof w);
+		h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+		memcpy(&w, &dst->s6_addr[i], sizeof w);
+		h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+	}
+	return (h >> 32) & (LC_FRAG_BUCKETS - 1);
+}
+
+static lc_frag_msg_t **lc_frag_find(lc_frag_t *fr, const lc_message_t *msg)
+{
+	lc_frag_msg_t **p = &fr->tab[lc_frag_hash(&msg->src, &msg->dst, msg->seq, msg->rnd)];
+
+	for (; *p; p = &(*p)->hnext) {
+		if ((*p)->msg.seq == msg->seq && (*p)->msg.rnd == msg->rnd
+		&& !memcmp(&(*p)->msg.src, &msg->src, sizeof(struct in6_addr))
+		&& !memcmp(&(*p)->msg.dst, &msg->dst, sizeof(struct in6_addr)))
+			break;
+	}
+	return p;
+}
+
+/* msg is a late or duplicate fragment of a message already reassembled */
+static int lc_frag_is_done(lc_frag_t *fr, const lc_message_t *msg, uint64_t now)
+{
+	for (int i = 0; i < LC_FRAG_DONE; i++) {
+		if (fr->done[i].expires > now
+		&& fr->done[i].seq == msg->seq && fr->done[i].rnd == msg->rnd
+		&& !memcmp(&fr->done[i].src, &msg->src, sizeof(struct in6_addr))
+		&& !memcmp(&fr->done[i].dst, &msg->dst, sizeof(struct in6_addr)))
+			return 1;
+	}
+	return 0;
+}
+
+static void lc_frag_unlink(lc_frag_t *fr, lc_frag_msg_t *fm)
+{
+	if (fm->prev) fm->prev->next = fm->next;
+	else fr->oldest = fm->next;
+	if (fm->next) fm->next->prev = fm->prev;
+	else fr->newest = fm->prev;
+	fm->prev = fm->next = NULL;
+}
+
+static void lc_frag_append(lc_frag_t *fr, lc_frag_msg_t *fm)
+{
+	fm->prev = fr->newest;
+	if (fr->newest) fr->newest->next = fm;
+	else fr->oldest = fm;
+	fr->newest = fm;
+}
+
+/* take fm out of the engine. Its buffer goes too, unless keep is set */
+static void lc_frag_drop(lc_frag_t *fr, lc_frag_msg_t *fm, int keep)
+{
+	lc_frag_msg_t **p = lc_frag_find(fr, &fm->msg);
+
+	*p = fm->hnext;
+	lc_frag_unlink(fr, fm);
+	fr->mem -= fm->len;
+	if (!keep) lc_buf_unref(fm->msg.data, NULL);
+	free(fm);
+}
+
+lc_frag_t *lc_frag_new(size_t maxmem, uint64_t timeout, lc_frag_alloc_fn *alloc, void *arg)
+{
+	lc_frag_t *fr;
+
+	if (!(fr = calloc(1, sizeof(lc_frag_t)))) return NULL;
+	fr->maxmem = maxmem;
+	fr->timeout = timeout;
+	fr->alloc = alloc;
+	fr->arg = arg;
+	return fr;
+}
+
+void lc_frag_free(lc_frag_t *fr)
+{
+	if (!fr) return;
+	while (fr->oldest) lc_frag_drop(fr, fr->oldest, 0);
+	free(fr);
+}
+
+int lc_frag_add(lc_frag_t *fr, const lc_message_t *msg, lc_message_t *whole, uint64_t now)
+{
+	lc_frag_head_t fh;
+	lc_frag_msg_t **p, *fm;
+	size_t len, off, flen, fragsz;
+	uint16_t idx, cnt;
+
+	while (fr->oldest && fr->oldest->expires <= now) {
+		lc_frag_drop(fr, fr->oldest, 0);
+		fr->expired++;
+	}
+
+	if (!msg->data || msg->len < sizeof fh) goto bad;
+	memcpy(&fh, msg->data, sizeof fh);
+	len = be32toh(fh.len);
+	off = be32toh(fh.off);
+	idx = be16toh(fh.idx);
+	cnt = be16toh(fh.cnt);
+	flen = msg->len - sizeof fh;
+	if (idx >= cnt || off > len || flen > len - off || len > fr->maxmem) goto bad;
+	/* every fragment gives the fragment size, from its own length, or the
+	 * last from its offset. Fragments that don't fit it would leave holes */
+	if (idx < cnt - 1) {
+		fragsz = flen;
+		if (!flen || off != (size_t)idx * flen) goto bad;
+	}
+	else if (idx) {
+		fragsz = off / idx;
+		if (!flen || off % idx || flen > fragsz || off + flen != len) goto bad;
+	}
+	else {
+		fragsz = len;
+		if (off || flen != len) goto bad;
+	}
+
+	p = lc_frag_find(fr, msg);
+	if (!(fm = *p)) {
+		if (lc_frag_is_done(fr, msg, now)) return 0;
+		/* make room, oldest first */
+		while (fr->oldest && fr->mem + len > fr->maxmem) {
+			lc_frag_drop(fr, fr->oldest, 0);
+			fr->evicted++;
+		}
+		if (!(fm = calloc(1, sizeof(lc_frag_msg_t) + (cnt + 7) / 8))) goto bad;
+		if (!(fm->msg.data = fr->alloc(fr->arg, len))) {
+			free(fm);
+			goto bad;
+		}
+		fm->msg.seq = msg->seq;
+		fm->msg.rnd = msg->rnd;
+		fm->msg.timestamp = msg->timestamp;
+		fm->msg.op = msg->op & ~LC_OP_FRAG;
+		fm->msg.src = msg->src;
+		fm->msg.dst = msg->dst;
+		fm->msg.sockid = msg->sockid;
+		fm->msg.len = len;
+		fm->msg.free = &lc_buf_unref;
+		fm->len = len;
+		fm->fragsz = fragsz;
+		fm->cnt = cnt;
+		fr->mem += len;
+		/* find it again, the table may have changed under eviction */
+		p = lc_frag_find(fr, msg);
+		*p = fm;
+		lc_frag_append(fr, fm);
+	}
+	else if (fm->len != len || fm->cnt != cnt || fm->fragsz != fragsz) goto bad;
+	if (fm->seen[idx / 8] & (1 << (idx % 8))) return 0; /* duplicate */
+	fm->seen[idx / 8] |= 1 << (idx % 8);
+	memcpy((char *)fm->msg.data + off, (char *)msg->data + sizeof fh, flen);
+	fm->msg.bytes += msg->bytes;
+	fm->msg.rxtime = msg->rxtime;
+	fm->expires = now + fr->timeout;
+	if (++fm->got < fm->cnt) {
+		/* still active, to the back of the queue */
+		lc_frag_unlink(fr, fm);
+		lc_frag_append(fr, fm);
+		return 0;
+	}
+	*whole = fm->msg;
+	fr->done[fr->donei].src = fm->msg.src;
+	fr->done[fr->donei].dst = fm->msg.dst;
+	fr->done[fr->donei].seq = fm->msg.seq;
+	fr->done[fr->donei].rnd = fm->msg.rnd;
+	fr->done[fr->donei].expires = now + fr->timeout;
+	fr->donei = (fr->donei + 1) % LC_FRAG_DONE;
+	lc_frag_drop(fr, fm, 1);
+	fr->complete++;
+	return 1;
+bad:
+	fr->dropped++;
+	return 0;
+}
@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only */
+/* Copyright (c) 2021 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _FRAG_H
+#define _FRAG_H 1
+
+#include "../include/librecast/types.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define LC_FRAG_BUCKETS 1024 /* reassembly hash table size (power of 2) */
+#define LC_FRAG_DONE 256 /* recently completed messages remembered, to ignore stragglers */
+
+/* header extension following the message header of each fragment. The
+ * message header is the same in every fragment of a message, except for its
+ * op, which has LC_OP_FRAG set, and len, which is the fragment's own */
+typedef struct lc_frag_head_t {
+	uint32_t len; /* length of the whole message */
+	uint32_t off; /* offset of this fragment in the message */
+	uint16_t idx; /* fragment index */
+	uint16_t cnt; /* fragments in message */
+} __attribute__((__packed__)) lc_frag_head_t;
+
+/* refcounted buffer (see pool.h) of len bytes to reassemble into */
+typedef void *lc_frag_alloc_fn(void *arg, size_t len);
+
+/* message being reassembled */
+typedef struct lc_frag_msg_s {
+	struct lc_frag_msg_s *hnext; /* next in hash bucket */
+	struct lc_frag_msg_s *prev, *next; /* by last activity, oldest first */
+	uint64_t expires; /* ns */
+	lc_message_t msg; /* header from first fragment to arrive, data is the buffer */
+	size_t len; /* message length */
+	size_t fragsz; /* length of every fragment but the last */
+	uint16_t cnt; /* fragments in message */
+	uint16_t got; /* fragments received */
+	unsigned char seen[]; /* bitmap of fragments received */
+} lc_frag_msg_t;
+
+/* message that has been reassembled */
+typedef struct lc_frag_done_s {
+	struct in6_addr src;
+	struct in6_addr dst;
+	lc_seq_t seq;
+	lc_rnd_t rnd;
+	uint64_t expires; /* ns, forgotten after */
+} lc_frag_done_t;
+
+/* reassembly of messages from fragments. Messages are keyed by source,
+ * group, sequence number and the sender's random rnd, and each times out on
+ * its own when no fragment has arrived for it for timeout ns. The least
+ * recently active messages are dropped to keep within maxmem bytes.
+ * Fragments are all fragsz bytes long, but the last, which may be shorter,
+ * and fragment idx is at offset idx * fragsz */
+typedef struct lc_frag_s {
+	lc_frag_msg_t *tab[LC_FRAG_BUCKETS];
+	lc_frag_msg_t *oldest, *newest;
+	lc_frag_done_t done[LC_FRAG_DONE]; /* ring of recently completed messages */
+	unsigned int donei; /* next slot in done */
+	lc_frag_alloc_fn *alloc;
+	void *arg;
+	size_t mem; /* bytes held */
+	size_t maxmem;
+	uint64_t timeout;
+	uint64_t complete; /* messages reassembled */
+	uint64_t expired; /* messages dropped on timeout */
+	uint64_t evicted; /* messages dropped to make room */
+	uint64_t dropped; /* fragments that were bad or too big */
+} lc_frag_t;
+
+/* create reassembly engine holding up to maxmem bytes of partial messages,
+ * with buffers from alloc(arg, len). NULL on error */
+lc_frag_t *lc_frag_new(size_t maxmem, uint64_t timeout, lc_frag_alloc_fn *alloc, void *arg);
+
+/* free reassembly engine and any partial messages */
+void lc_frag_free(lc_frag_t *fr);
+
+/* add fragment msg, received at now (ns). Its data is copied, and msg is
+ * left to the caller. Returns 1 if that completes a message, which is
+ * handed over in whole (free with lc_msg_free()), 0 otherwise */
+int lc_frag_add(lc_frag_t *fr, const lc_message_t *msg, lc_message_t *whole, uint64_t now);
+
+#endif /* _FRAG_H */
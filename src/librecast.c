@@ -4,20 +4,49 @@
 #define _GNU_SOURCE
 #include "librecast_pvt.h"
 #include <librecast/net.h>
+#include "csprng.h"
+#include "dispatch.h"
+#include "fec.h"
+#include "frag.h"
 #include "hash.h"
+#include "pool.h"
+#include "timer.h"
+#include "uring.h"
+#include "xdp.h"
 #include <arpa/inet.h>
 #include <assert.h>
 #include <fcntl.h>
 #include <ifaddrs.h>
+#include <limits.h>
 #include <net/if.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/net_tstamp.h>
+#include <netinet/ip6.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#endif
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define LC_ZEROCOPY 1
+#endif
 
 uint32_t ctx_id = 0;
 uint32_t sock_id = 0;
@@ -39,13 +68,7 @@ void (*lc_op_handler[LC_OP_MAX])(lc_socket_call_t *, lc_message_t *) = {
 
 int lc_getrandom(void *buf, size_t buflen)
 {
-	int err, fd;
-
-	if ((fd = open("/dev/urandom", O_RDONLY)) == -1) return -1;
-	err = read(fd, buf, buflen);
-	close(fd);
-
-	return err;
+	return lc_csprng(buf, buflen);
 }
 
 uint32_t lc_ctx_get_id(lc_ctx_t *ctx)
@@ -88,6 +111,11 @@ struct sockaddr_in6 *lc_channel_sockaddr(lc_channel_t *chan)
 	return &chan->sa;
 }
 
+int lc_channel_errno(lc_channel_t *chan)
+{
+	return chan->err;
+}
+
 int lc_channel_socket_raw(lc_channel_t *chan)
 {
 	return chan->sock->sock;
@@ -98,6 +126,11 @@ int lc_socket_raw(lc_socket_t *sock)
 	return sock->sock;
 }
 
+int lc_socket_filter_mode(lc_socket_t *sock)
+{
+	return sock->filter;
+}
+
 void *lc_msg_data(lc_message_t *msg)
 {
 	return (msg) ? msg->data: NULL;
@@ -147,12 +180,24 @@ int lc_msg_id(lc_message_t *msg, unsigned char *id, size_t len)
 
 	hash_init(&state, NULL, 0, len);
 	hash_update(&state, (unsigned char *)msg->data, msg->len);
-	hash_update(&state, (unsigned char *)msg->srcaddr, sizeof(struct in6_addr));
+	hash_update(&state, (unsigned char *)&msg->src, sizeof(struct in6_addr));
 	hash_final(&state, id, len);
 
 	return 0;
 }
 
+const char *lc_msg_srcaddr(lc_message_t *msg)
+{
+	if (!msg->srcaddr[0]) inet_ntop(AF_INET6, &msg->src, msg->srcaddr, INET6_ADDRSTRLEN);
+	return msg->srcaddr;
+}
+
+const char *lc_msg_dstaddr(lc_message_t *msg)
+{
+	if (!msg->dstaddr[0]) inet_ntop(AF_INET6, &msg->dst, msg->dstaddr, INET6_ADDRSTRLEN);
+	return msg->dstaddr;
+}
+
 int lc_socket_getopt(lc_socket_t *sock, int optname, void *optval, socklen_t *optlen)
 {
 	return getsockopt(sock->sock, IPPROTO_IPV6, optname, optval, optlen);
@@ -163,6 +208,481 @@ int lc_socket_setopt(lc_socket_t *sock, int optname, const void *optval, socklen
 	return setsockopt(sock->sock, IPPROTO_IPV6, optname, optval, optlen);
 }
 
+int lc_socket_gso(lc_socket_t *sock, size_t size)
+{
+#ifdef UDP_SEGMENT
+	int opt;
+	socklen_t optlen = sizeof opt;
+
+	if (size > UINT16_MAX - sizeof(lc_message_head_t)) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* probe for kernel support (Linux 4.18+) */
+	if (size && getsockopt(sock->sock, SOL_UDP, UDP_SEGMENT, &opt, &optlen) == -1)
+		return -1;
+	sock->gso = size;
+	return 0;
+#else
+	(void)sock; (void)size;
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+int lc_socket_gro(lc_socket_t *sock, int val)
+{
+#ifdef UDP_GRO
+	val = !!val;
+	if (setsockopt(sock->sock, SOL_UDP, UDP_GRO, &val, sizeof val) == -1)
+		return -1;
+	if (val && !sock->gro) {
+		sock->gro = calloc(1, sizeof(lc_gro_t));
+		if (!sock->gro) return -1;
+	}
+	else if (!val) {
+		free(sock->gro);
+		sock->gro = NULL;
+	}
+	return 0;
+#else
+	(void)sock; (void)val;
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+#ifdef __linux__
+/* the kernel wants an int sized optval even though it doesn't read it */
+static int lc_filter_detach(int s)
+{
+	int dummy = 0;
+	return setsockopt(s, SOL_SOCKET, SO_DETACH_FILTER, &dummy, sizeof dummy);
+}
+
+static void lc_ring_free(lc_ring_t *ring)
+{
+	if (!ring) return;
+	if (ring->map) munmap(ring->map, ring->blocksz * ring->blocks);
+	if (ring->fd >= 0) close(ring->fd);
+	free(ring);
+}
+
+static int lc_ring_bind(lc_ring_t *ring, unsigned int ifx)
+{
+	struct sockaddr_ll sll = {
+		.sll_family = AF_PACKET,
+		.sll_protocol = htons(ETH_P_IPV6),
+		.sll_ifindex = ifx,
+	};
+	return bind(ring->fd, (struct sockaddr *)&sll, sizeof sll);
+}
+
+/* only multicast UDP to our port reaches the ring */
+static int lc_ring_filter(lc_ring_t *ring)
+{
+	struct sock_filter f[] = {
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, SKF_NET_OFF + (int)offsetof(struct ip6_hdr, ip6_nxt)),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, IPPROTO_UDP, 0, 5),
+		BPF_STMT(BPF_LD|BPF_B|BPF_ABS, SKF_NET_OFF + LC_IP6_DST),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0xff, 0, 3),
+		BPF_STMT(BPF_LD|BPF_H|BPF_ABS, SKF_NET_OFF + (int)(sizeof(struct ip6_hdr)
+				+ offsetof(struct udphdr, uh_dport))),
+		BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, LC_DEFAULT_PORT, 0, 1),
+		BPF_STMT(BPF_RET|BPF_K, UINT32_MAX),
+		BPF_STMT(BPF_RET|BPF_K, 0),
+	};
+	struct sock_fprog prog = { .len = sizeof f / sizeof f[0], .filter = f };
+	return setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof prog);
+}
+
+static lc_ring_t *lc_ring_new(size_t size, unsigned int ifx)
+{
+	struct tpacket_req3 req = {0};
+	lc_ring_t *ring;
+	int opt, err;
+
+	if (!(ring = calloc(1, sizeof(lc_ring_t)))) return NULL;
+	ring->blocksz = LC_RING_BLOCKSZ;
+	ring->blocks = (size + LC_RING_BLOCKSZ - 1) / LC_RING_BLOCKSZ;
+	/* no protocol until bound, so nothing arrives before the filter */
+	if ((ring->fd = socket(AF_PACKET, SOCK_DGRAM, 0)) == -1) goto err_0;
+	if (lc_ring_filter(ring) == -1) goto err_0;
+	opt = TPACKET_V3;
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &opt, sizeof opt) == -1) goto err_0;
+#ifdef PACKET_IGNORE_OUTGOING
+	/* Linux 4.20+. Older kernels give us our own sends, which we skip */
+	opt = 1;
+	setsockopt(ring->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &opt, sizeof opt);
+#endif
+	req.tp_block_size = ring->blocksz;
+	req.tp_block_nr = ring->blocks;
+	req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+	req.tp_frame_nr = ring->blocksz / req.tp_frame_size * ring->blocks;
+	req.tp_retire_blk_tov = LC_RING_TOV;
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof req) == -1) goto err_0;
+	ring->map = mmap(NULL, ring->blocksz * ring->blocks, PROT_READ | PROT_WRITE,
+			MAP_SHARED, ring->fd, 0);
+	if (ring->map == MAP_FAILED) {
+		ring->map = NULL;
+		goto err_0;
+	}
+	if (lc_ring_bind(ring, ifx) == -1) goto err_0;
+	return ring;
+err_0:
+	err = errno;
+	lc_ring_free(ring);
+	errno = err;
+	return NULL;
+}
+
+/* append classic BPF leaving A = lc_steer_hash(addr) % n, where addr is the
+ * IPv6 address off bytes into the network header. Returns instructions used */
+static int lc_bpf_steer(struct sock_filter *f, uint32_t off, uint32_t n)
+{
+	int i = 0;
+
+	f[i++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_NET_OFF + off);
+	for (uint32_t w = 4; w < 16; w += 4) {
+		f[i++] = (struct sock_filter)BPF_STMT(BPF_MISC|BPF_TAX, 0);
+		f[i++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_NET_OFF + off + w);
+		f[i++] = (struct sock_filter)BPF_STMT(BPF_ALU|BPF_XOR|BPF_X, 0);
+	}
+	f[i++] = (struct sock_filter)BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, n);
+	return i;
+}
+
+#define LC_BPF_STEER_LEN 11
+#define LC_BPF_SOCK_LEN (LC_BPF_STEER_LEN + 10) /* filter, less the channels */
+#define LC_BPF_CHAN_LEN 9 /* instructions per bound channel */
+#define LC_BPF_CHANS_MAX 256 /* more bound channels than this are hashed */
+#define LC_BPF_BUCKETS 2048 /* buckets groups are hashed into, a multiple of 32 */
+#define LC_BPF_HASH_LEN (11 + 5 * LC_BPF_BUCKETS / 32) /* most instructions to test them */
+
+/* append classic BPF to return 0 (drop) unless A == k */
+static int lc_bpf_require(struct sock_filter *f, uint32_t k)
+{
+	f[0] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, k, 1, 0);
+	f[1] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0);
+	return 2;
+}
+
+/* append classic BPF to accept datagrams to addr, else fall through to the
+ * next instruction. Low word first - that's where channels differ */
+static int lc_bpf_group(struct sock_filter *f, const struct in6_addr *addr)
+{
+	uint32_t w;
+	int i = 0;
+
+	for (int off = 12; off >= 0; off -= 4) {
+		memcpy(&w, &addr->s6_addr[off], sizeof w);
+		f[i++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_NET_OFF + LC_IP6_DST + off);
+		/* no match - on to the next channel */
+		f[i] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ntohl(w), 0,
+				LC_BPF_CHAN_LEN - 1 - i);
+		i++;
+	}
+	f[i++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, UINT32_MAX);
+	return i;
+}
+
+/* append classic BPF to accept datagrams to groups in the same bucket as a
+ * channel in chan_list, else drop. A group's bucket is the low word of its
+ * address mod LC_BPF_BUCKETS, and the buckets in use are a bitmap, tested a
+ * word at a time, so a datagram costs at most two instructions per bitmap
+ * word in use, however many channels there are. Unbound groups that share
+ * a bucket with a bound one get through. Returns instructions used */
+static int lc_bpf_hash(struct sock_filter *f, lc_channel_t *chan_list)
+{
+	uint32_t map[LC_BPF_BUCKETS / 32] = {0};
+	uint32_t w;
+	int i = 0;
+
+	for (lc_channel_t *chan = chan_list; chan; chan = chan->snext) {
+		memcpy(&w, &chan->sa.sin6_addr.s6_addr[12], sizeof w);
+		w = ntohl(w) % LC_BPF_BUCKETS;
+		map[w / 32] |= 1U << (w % 32);
+	}
+	/* M[0] = the bucket's bit in its bitmap word, A = which word */
+	f[i++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_NET_OFF + LC_IP6_DST + 12);
+	f[i++] = (struct sock_filter)BPF_STMT(BPF_ALU|BPF_AND|BPF_K, LC_BPF_BUCKETS - 1);
+	f[i++] = (struct sock_filter)BPF_STMT(BPF_ST, 1);
+	f[i++] = (struct sock_filter)BPF_STMT(BPF_ALU|BPF_AND|BPF_K, 31);
+	f[i++] = (struct sock_filter)BPF_STMT(BPF_MISC|BPF_TAX, 0);
+	f[i++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_IMM, 1);
+	f[i++] = (struct sock_filter)BPF_STMT(BPF_ALU|BPF_LSH|BPF_X, 0);
+	f[i++] = (struct sock_filter)BPF_STMT(BPF_ST, 0);
+	f[i++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_MEM, 1);
+	f[i++] = (struct sock_filter)BPF_STMT(BPF_ALU|BPF_RSH|BPF_K, 5);
+	for (uint32_t k = 0; k < LC_BPF_BUCKETS / 32; k++) {
+		if (!map[k]) continue;
+		/* not this word - on to the next */
+		f[i++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, k, 0, 4);
+		f[i++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_MEM, 0);
+		f[i++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, map[k], 0, 1);
+		f[i++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, UINT32_MAX);
+		f[i++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0);
+	}
+	f[i++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0);
+	return i;
+}
+
+/* (re)build the classic BPF filter on sock's UDP socket from its state, so
+ * the kernel drops what we don't want before it is queued: everything while a
+ * ring receives for us, else datagrams that arrived on an interface other
+ * than the one we're bound to, that belong to another worker, or that are
+ * for a multicast group none of our channels are bound to. Each test drops
+ * on the spot, so no jump has to reach past the channel list. Unless exact,
+ * groups are tested by lc_bpf_hash() instead. sock->filter says which */
+static int lc_socket_filter_build(lc_socket_t *sock, int exact)
+{
+	struct sock_filter *f;
+	struct sock_fprog prog;
+	int mode = LC_FILTER_NONE;
+	int i = 0, rc;
+
+	f = malloc((LC_BPF_SOCK_LEN + ((exact) ? LC_BPF_CHAN_LEN * sock->bound : LC_BPF_HASH_LEN))
+			* sizeof(struct sock_filter));
+	if (!f) return -1;
+	if (sock->ring) {
+		f[i++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0);
+		goto attach;
+	}
+	if (sock->ifx) {
+		f[i++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_IFINDEX);
+		i += lc_bpf_require(&f[i], sock->ifx);
+	}
+	if (sock->steer) {
+		i += lc_bpf_steer(&f[i], LC_IP6_SRC, sock->steer);
+		i += lc_bpf_require(&f[i], sock->worker);
+	}
+	if (sock->bound) {
+		/* unicast isn't for a channel - leave it be */
+		f[i++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_B|BPF_ABS, SKF_NET_OFF + LC_IP6_DST);
+		f[i++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0xff, 1, 0);
+		f[i++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, UINT32_MAX);
+		if (exact) {
+			for (lc_channel_t *chan = sock->chan_list; chan; chan = chan->snext) {
+				i += lc_bpf_group(&f[i], &chan->sa.sin6_addr);
+			}
+			f[i++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0);
+			mode = LC_FILTER_EXACT;
+		}
+		else {
+			i += lc_bpf_hash(&f[i], sock->chan_list);
+			mode = LC_FILTER_HASH;
+		}
+	}
+	else if (!i) {
+		free(f);
+		if (lc_filter_detach(sock->sock) == -1 && errno != ENOENT) return -1;
+		sock->filter = LC_FILTER_NONE;
+		return 0;
+	}
+	else f[i++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, UINT32_MAX);
+attach:
+	prog.len = i;
+	prog.filter = f;
+	rc = setsockopt(sock->sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof prog);
+	if (!rc) sock->filter = mode;
+	free(f);
+	/* the kernel charges filters to socket option memory, which a long
+	 * channel list can run out of (net.core.optmem_max) */
+	if (rc == -1 && errno == ENOMEM && mode == LC_FILTER_EXACT)
+		return lc_socket_filter_build(sock, 0);
+	return rc;
+}
+
+static int lc_socket_filter(lc_socket_t *sock)
+{
+	return lc_socket_filter_build(sock, sock->bound <= LC_BPF_CHANS_MAX);
+}
+#else
+static int lc_socket_filter(lc_socket_t *sock)
+{
+	/* no socket filters. Userspace drops what isn't ours */
+	(void)sock;
+	return 0;
+}
+#endif
+
+int lc_socket_ring(lc_socket_t *sock, size_t size)
+{
+#ifdef __linux__
+	lc_ring_t *ring = NULL, *old = sock->ring;
+
+	if (sock->thread || sock->watch) return LC_ERROR_SOCKET_LISTENING;
+	if (size && sock->xdp) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (size && !(ring = lc_ring_new(size, sock->ifx))) return -1;
+	/* the UDP socket stays, to hold group memberships, but its filter
+	 * drops everything it would receive - that comes through the ring */
+	sock->ring = ring;
+	if (lc_socket_filter(sock) == -1) {
+		int err = errno;
+		sock->ring = old;
+		lc_ring_free(ring);
+		errno = err;
+		return -1;
+	}
+	lc_ring_free(old);
+	return 0;
+#else
+	(void)sock; (void)size;
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+#ifdef LC_XDP
+/* have xdp's program redirect the groups of channels bound to sock */
+static int lc_socket_xdp_groups(lc_socket_t *sock, lc_xdp_t *xdp)
+{
+	for (lc_channel_t *chan = sock->chan_list; chan; chan = chan->snext) {
+		if (lc_xdp_group(xdp, &chan->sa.sin6_addr, 1) == -1) return -1;
+	}
+	return 0;
+}
+#endif
+
+int lc_socket_xdp(lc_socket_t *sock, int val)
+{
+#ifdef LC_XDP
+	lc_xdp_t *xdp = NULL;
+	socklen_t optlen = sizeof(int);
+
+	if (sock->thread || sock->watch) return LC_ERROR_SOCKET_LISTENING;
+	if (val && sock->xdp) return 0;
+	if (val) {
+		if (!sock->ifx) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (sock->ring) {
+			errno = EBUSY;
+			return -1;
+		}
+		if (!(xdp = lc_xdp_new(sock->ifx, LC_DEFAULT_PORT))) return -1;
+		if (lc_socket_xdp_groups(sock, xdp) == -1) {
+			int err = errno;
+			lc_xdp_release(xdp);
+			errno = err;
+			return -1;
+		}
+		xdp->hops = DEFAULT_MULTICAST_HOPS;
+		getsockopt(sock->sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &xdp->hops, &optlen);
+	}
+	if (sock->xdp) lc_xdp_release(sock->xdp);
+	sock->xdp = xdp;
+	return 0;
+#else
+	(void)sock; (void)val;
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+int lc_socket_busypoll(lc_socket_t *sock, unsigned int usec)
+{
+#ifdef SO_BUSY_POLL
+	int val = (usec > INT_MAX) ? INT_MAX : (int)usec;
+
+	if (sock->thread || sock->watch) return LC_ERROR_SOCKET_LISTENING;
+	/* raising it needs CAP_NET_ADMIN, and only helps on a NAPI device.
+	 * Without it, the listener still spins in userspace */
+	if (setsockopt(sock->sock, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof val) == -1
+	&& errno != EPERM)
+		return -1;
+#ifdef SO_PREFER_BUSY_POLL
+	val = !!usec;
+	if (setsockopt(sock->sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &val, sizeof val) == -1
+	&& errno != EPERM && errno != ENOPROTOOPT)
+		return -1;
+#endif
+	sock->busypoll = usec;
+	return 0;
+#else
+	(void)sock; (void)usec;
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+int lc_socket_dispatch(lc_socket_t *sock, int workers, size_t qlen)
+{
+	lc_dispatch_t *d = NULL;
+
+	if (sock->thread || sock->watch) return LC_ERROR_SOCKET_LISTENING;
+	if (workers < 0) return LC_ERROR_INVALID_PARAMS;
+	if (workers && !(d = lc_dispatch_new(workers, qlen))) return -1;
+	lc_dispatch_free(sock->dispatch);
+	sock->dispatch = d;
+	return 0;
+}
+
+size_t lc_socket_dispatch_depth(lc_socket_t *sock)
+{
+	return (sock->dispatch) ? lc_dispatch_depth(sock->dispatch) : 0;
+}
+
+uint64_t lc_socket_dispatch_drops(lc_socket_t *sock)
+{
+	return (sock->dispatch) ? sock->dispatch->drops : 0;
+}
+
+int lc_socket_fragment(lc_socket_t *sock, size_t size)
+{
+	/* room for a byte of payload, whatever the headers */
+	if (size && size <= sizeof(lc_message_head_t) + sizeof(lc_frag_head_t) + sizeof(lc_fec_head_t)) {
+		errno = EINVAL;
+		return -1;
+	}
+	sock->frag = size;
+	return 0;
+}
+
+void lc_socket_reassembly(lc_socket_t *sock, size_t maxmem)
+{
+	sock->fragmem = maxmem;
+	if (sock->reasm) sock->reasm->maxmem = maxmem;
+}
+
+int lc_socket_txtime(lc_socket_t *sock, int clock)
+{
+#ifdef SO_TXTIME
+	struct sock_txtime txt = { .clockid = clock };
+
+	if (clock == -1) {
+		/* sends without a departure time go straight out */
+		sock->txtime = 0;
+		return 0;
+	}
+	if (setsockopt(sock->sock, SOL_SOCKET, SO_TXTIME, &txt, sizeof txt) == -1) return -1;
+	sock->txclock = clock;
+	sock->txtime = 1;
+	return 0;
+#else
+	(void)sock; (void)clock;
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+void lc_channel_rate(lc_channel_t *chan, uint64_t rate, size_t burst)
+{
+	uint64_t s = (rate) ? burst / rate : 0;
+
+	/* whole seconds first, so a big burst can't overflow, and a burst of
+	 * centuries is as good as forever */
+	chan->rate = rate;
+	if (!rate) chan->tau = 0;
+	else if (s >= UINT64_MAX / 1000000000 - 1) chan->tau = UINT64_MAX;
+	else chan->tau = s * 1000000000 + (uint64_t)((double)(burst % rate) * 1e9 / rate);
+	chan->tat = 0;
+}
+
 int lc_socket_loop(lc_socket_t *sock, int val)
 {
 	return setsockopt(sock->sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &val, sizeof val);
@@ -170,7 +690,16 @@ int lc_socket_loop(lc_socket_t *sock, int val)
 
 int lc_socket_ttl(lc_socket_t *sock, int val)
 {
-	return setsockopt(sock->sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &val, sizeof val);
+	if (setsockopt(sock->sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &val, sizeof val) == -1)
+		return -1;
+#ifdef LC_XDP
+	/* kernel has checked it, and turned -1 into the default */
+	if (sock->xdp) {
+		socklen_t optlen = sizeof val;
+		getsockopt(sock->sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &sock->xdp->hops, &optlen);
+	}
+#endif
+	return 0;
 }
 
 static void *_free(void *msg, void *hint)
@@ -179,6 +708,39 @@ static void *_free(void *msg, void *hint)
 	return hint;
 }
 
+/* payload size of each class of pooled message buffer, and how many free
+ * buffers of each to keep per ctx */
+static const size_t lc_pool_bufsz[LC_POOL_CLASSES] = {
+	LC_POOL_SMALL, LC_POOL_MEDIUM, LC_RECV_BUFSZ + LC_RECV_HEADROOM
+};
+static const size_t lc_pool_keep[LC_POOL_CLASSES] = { 256, 64, LC_RECVMMSG_MAX };
+
+/* refcounted buffer from the smallest class that holds len bytes, or from
+ * the heap if none do */
+static void *lc_ctx_buf(lc_ctx_t *ctx, size_t len)
+{
+	int i;
+	for (i = 0; i < LC_POOL_CLASSES && len > lc_pool_bufsz[i]; i++);
+	if (i == LC_POOL_CLASSES) return lc_buf_new(len);
+	return lc_buf_get(ctx->pool[i]);
+}
+
+int lc_msg_ref(lc_message_t *msg)
+{
+	if (!msg->data || msg->free != &lc_buf_unref) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* hint is the start of the buffer when data points inside it */
+	lc_buf_ref(msg->hint ? msg->hint : msg->data);
+	return 0;
+}
+
+void lc_msg_unref(lc_message_t *msg)
+{
+	lc_msg_free(msg);
+}
+
 void lc_msg_free(void *arg)
 {
 	lc_message_t *msg = (lc_message_t *)arg;
@@ -213,58 +775,346 @@ int lc_msg_init_size(lc_message_t *msg, size_t len)
 	return 0;
 }
 
+static size_t lc_chantab_hash(const struct in6_addr *addr)
+{
+	uint64_t a, b;
+
+	memcpy(&a, addr->s6_addr, sizeof a);
+	memcpy(&b, addr->s6_addr + sizeof a, sizeof b);
+	a ^= b * 0x9e3779b97f4a7c15ULL;
+	a ^= a >> 32;
+	a *= 0xd6e8feb86659fd93ULL;
+	a ^= a >> 32;
+	return (size_t)a;
+}
+
+/* channels are indexed by address in ctx->chantab, an open addressing hash
+ * table with linear probing. Each slot holds the most recently added channel
+ * for an address, with any older channels for that address chained through
+ * hnext. Return the slot for addr - the one holding it, or the empty slot
+ * where it would go */
+static lc_chanslot_t *lc_chantab_slot(lc_ctx_t *ctx, const struct in6_addr *addr)
+{
+	const size_t mask = ctx->chantabsz - 1;
+	lc_chanslot_t *slot;
+
+	for (size_t i = lc_chantab_hash(addr) & mask;; i = (i + 1) & mask) {
+		slot = &ctx->chantab[i];
+		if (!slot->chan || !memcmp(addr, &slot->addr, sizeof(struct in6_addr)))
+			return slot;
+	}
+}
+
+static void lc_chantab_del(lc_ctx_t *ctx, lc_channel_t *chan)
+{
+	const size_t mask = ctx->chantabsz - 1;
+	lc_chanslot_t *slot;
+	lc_channel_t **p;
+	size_t i, j, k;
+
+	if (!ctx->chantab) return;
+	slot = lc_chantab_slot(ctx, &chan->sa.sin6_addr);
+	for (p = &slot->chan; *p && *p != chan; p = &(*p)->hnext);
+	if (!*p) return;
+	*p = chan->hnext;
+	if (slot->chan) return;
+
+	/* slot emptied - shift back any entries in the probe sequence that
+	 * would no longer be found, so we need no tombstones */
+	ctx->chantabn--;
+	i = slot - ctx->chantab;
+	for (j = (i + 1) & mask; ctx->chantab[j].chan; j = (j + 1) & mask) {
+		k = lc_chantab_hash(&ctx->chantab[j].addr) & mask;
+		/* leave entries whose home slot k lies cyclically in (i, j] */
+		if ((i < j) ? (k > i && k <= j) : (k > i || k <= j)) continue;
+		ctx->chantab[i] = ctx->chantab[j];
+		ctx->chantab[j].chan = NULL;
+		i = j;
+	}
+}
+
 void lc_channel_free(lc_channel_t * chan)
 {
 	if (!chan) return;
+	if (chan->sock) lc_channel_unbind(chan);
+	lc_chantab_del(chan->ctx, chan);
+	if (chan->fecrepair && chan->fecrepair->fecsrc == chan) chan->fecrepair->fecsrc = NULL;
+	if (chan->fecsrc && chan->fecsrc->fecrepair == chan) chan->fecsrc->fecrepair = NULL;
+	lc_fec_enc_free(chan->fec);
 	for (lc_channel_t *p = chan->ctx->chan_list, *prev = NULL; p; p = p->next) {
 		if (p->id == chan->id) {
 			if (prev) prev->next = p->next;
 			else chan->ctx->chan_list = p->next;
+			break;
 		}
 		prev = p;
 	}
 	free(chan);
 }
 
-ssize_t lc_channel_sendmsg(lc_channel_t *chan, struct msghdr *msg, int flags)
+#ifdef UDP_SEGMENT
+static void lc_cmsg_segment(struct msghdr *msgh, char *ctl, size_t ctllen, uint16_t segsz)
+{
+	struct cmsghdr *cmsg;
+
+	msgh->msg_control = ctl;
+	msgh->msg_controllen = ctllen;
+	cmsg = CMSG_FIRSTHDR(msgh);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	memcpy(CMSG_DATA(cmsg), &segsz, sizeof(uint16_t));
+}
+#endif
+
+static uint64_t lc_clock_ns(clockid_t clk)
+{
+	struct timespec ts;
+	clock_gettime(clk, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Pace a send of len bytes on chan, a token bucket kept as the time it next
+ * empties (GCRA), so each channel costs three words and no timers. A send
+ * may go once it leaves the bucket no more than the burst (tau) ahead of
+ * now. We sleep until then or, with SO_TXTIME, leave up to LC_PACE_AHEAD of
+ * the waiting to the qdisc and return the departure time to send with (in
+ * sock->txclock), 0 for now. If block is 0, returns LC_PACE_LATER rather
+ * than sleeping, without taking the tokens */
+#define LC_PACE_LATER UINT64_MAX
+static uint64_t lc_channel_pace(lc_channel_t *chan, size_t len, int block)
+{
+	lc_socket_t *sock = chan->sock;
+	uint64_t now = lc_clock_ns(CLOCK_MONOTONIC);
+	uint64_t ahead = (sock->txtime && !sock->xdp) ? LC_PACE_AHEAD : 0;
+	uint64_t tat = ((chan->tat > now) ? chan->tat : now) + len * 1000000000 / chan->rate;
+	uint64_t wait = (tat - now > chan->tau) ? tat - now - chan->tau : 0;
+	struct timespec ts;
+
+	if (wait > ahead) {
+		if (!block) return LC_PACE_LATER;
+		/* sleep for whatever the qdisc won't hold */
+		now += wait - ahead;
+		ts.tv_sec = now / 1000000000;
+		ts.tv_nsec = now % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+		wait = ahead;
+	}
+	chan->tat = tat;
+	return (wait) ? lc_clock_ns(sock->txclock) + wait : 0;
+}
+
+#ifdef SO_TXTIME
+/* add a SCM_TXTIME departure time to msgh's control data, copying it into
+ * ctl, which needs room for msg_controllen + CMSG_SPACE(sizeof(uint64_t)) */
+static void lc_cmsg_txtime(struct msghdr *msgh, char *ctl, uint64_t t)
+{
+	struct cmsghdr *cmsg;
+
+	if (msgh->msg_controllen) memcpy(ctl, msgh->msg_control, msgh->msg_controllen);
+	cmsg = (struct cmsghdr *)(ctl + msgh->msg_controllen);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_TXTIME;
+	cmsg->cmsg_len = CMSG_LEN(sizeof t);
+	memcpy(CMSG_DATA(cmsg), &t, sizeof t);
+	msgh->msg_control = ctl;
+	msgh->msg_controllen += CMSG_SPACE(sizeof t);
+}
+#endif
+
+/* send msg on chan, paced. If copied is not NULL and a MSG_ZEROCOPY send
+ * fails for want of option memory for its notification, send it again by
+ * copying, with the same departure time, and set *copied */
+static ssize_t lc_channel_sendmsg_zc(lc_channel_t *chan, struct msghdr *msg, int flags,
+		int *copied)
 {
+	ssize_t rc;
+#ifdef SO_TXTIME
+	char ctl[LC_CMSGSZ];
+	struct msghdr m;
+#endif
 	msg->msg_name = (struct sockaddr *)&chan->sa;
 	msg->msg_namelen = sizeof(struct sockaddr_in6);
-	return sendmsg(chan->sock->sock, msg, flags);
+	if (chan->rate) {
+		size_t len = 0;
+		uint64_t t;
+
+		for (size_t i = 0; i < (size_t)msg->msg_iovlen; i++) len += msg->msg_iov[i].iov_len;
+		t = lc_channel_pace(chan, len, 1);
+#ifdef SO_TXTIME
+		if (t && msg->msg_controllen + CMSG_SPACE(sizeof t) <= sizeof ctl) {
+			m = *msg;
+			lc_cmsg_txtime(&m, ctl, t);
+			msg = &m;
+		}
+		else if (t) {
+			/* no room for the departure time, so wait for it here */
+			struct timespec ts = { .tv_sec = t / 1000000000, .tv_nsec = t % 1000000000 };
+			while (clock_nanosleep(chan->sock->txclock, TIMER_ABSTIME, &ts, NULL) == EINTR);
+		}
+#else
+		(void)t;
+#endif
+	}
+#ifdef LC_XDP
+	if (chan->sock->xdp) {
+		/* anything too big for a frame goes through the kernel */
+		rc = lc_xdp_send(chan->sock->xdp, &chan->sa, msg->msg_iov, msg->msg_iovlen, 1);
+		if (rc != -1 || errno != EMSGSIZE) return rc;
+	}
+#endif
+	rc = sendmsg(chan->sock->sock, msg, flags);
+#ifdef LC_ZEROCOPY
+	if (rc == -1 && errno == ENOBUFS && copied && (flags & MSG_ZEROCOPY)) {
+		rc = sendmsg(chan->sock->sock, msg, flags & ~MSG_ZEROCOPY);
+		*copied = 1;
+	}
+#else
+	(void)copied;
+#endif
+	return rc;
+}
+
+ssize_t lc_channel_sendmsg(lc_channel_t *chan, struct msghdr *msg, int flags)
+{
+	return lc_channel_sendmsg_zc(chan, msg, flags, NULL);
+}
+
+/* sendmmsg() on sock, through the ctx io_uring if it has one */
+static int lc_socket_sendmmsg(lc_socket_t *sock, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+#ifdef LC_XDP
+	if (sock->xdp) {
+		struct msghdr *h;
+		ssize_t rc = 0;
+		unsigned int i;
+
+		/* queue the lot, then one wakeup to send them */
+		for (i = 0; i < vlen; i++) {
+			h = &msgvec[i].msg_hdr;
+			rc = lc_xdp_send(sock->xdp, h->msg_name, h->msg_iov, h->msg_iovlen, 0);
+			if (rc == -1 && errno == EMSGSIZE) rc = sendmsg(sock->sock, h, flags);
+			if (rc == -1) break;
+			msgvec[i].msg_len = rc;
+		}
+		if (i) lc_xdp_kick(sock->xdp);
+		return (i || rc != -1) ? (int)i : -1;
+	}
+#endif
+#ifdef LC_URING
+	lc_ctx_t *ctx = sock->ctx;
+	int rc, err;
+
+	if (ctx->uring) {
+		pthread_mutex_lock(&ctx->uring_mtx);
+		rc = lc_uring_sendmmsg(ctx->uring, sock->sock, msgvec, vlen, flags);
+		err = errno;
+		pthread_mutex_unlock(&ctx->uring_mtx);
+		errno = err;
+		return rc;
+	}
+#endif
+	return sendmmsg(sock->sock, msgvec, vlen, flags);
+}
+
+int lc_channel_sendmmsg(lc_channel_t *chan, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	if (chan->rate) {
+		/* one at a time, each paced */
+		ssize_t rc;
+		for (unsigned int i = 0; i < vlen; i++) {
+			if ((rc = lc_channel_sendmsg(chan, &msgvec[i].msg_hdr, flags)) == -1)
+				return (i) ? (int)i : -1;
+			msgvec[i].msg_len = rc;
+		}
+		return vlen;
+	}
+	for (unsigned int i = 0; i < vlen; i++) {
+		msgvec[i].msg_hdr.msg_name = (struct sockaddr *)&chan->sa;
+		msgvec[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+	}
+	return lc_socket_sendmmsg(chan->sock, msgvec, vlen, flags);
 }
 
 ssize_t lc_channel_send(lc_channel_t *chan, const void *buf, size_t len, int flags)
 {
+#ifdef LC_XDP
+	if (chan->sock->xdp) {
+		struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+		struct msghdr msgh = { .msg_iov = &iov, .msg_iovlen = 1 };
+		return lc_channel_sendmsg(chan, &msgh, flags);
+	}
+#endif
+#ifdef UDP_SEGMENT
+	if (chan->sock->gso && len > chan->sock->gso) {
+		char ctl[CMSG_SPACE(sizeof(uint16_t))] = {0};
+		struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+		struct msghdr msgh = { .msg_iov = &iov, .msg_iovlen = 1 };
+		lc_cmsg_segment(&msgh, ctl, sizeof ctl, chan->sock->gso);
+		return lc_channel_sendmsg(chan, &msgh, flags);
+	}
+#endif
+	if (chan->rate) {
+		struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+		struct msghdr msgh = { .msg_iov = &iov, .msg_iovlen = 1 };
+		return lc_channel_sendmsg(chan, &msgh, flags);
+	}
 	return sendto(chan->sock->sock, buf, len, flags,
 		(struct sockaddr *)&chan->sa, sizeof(struct sockaddr_in6));
 }
 
-ssize_t lc_socket_sendmsg(lc_socket_t *sock, struct msghdr *msg, int flags)
+static ssize_t lc_socket_fanout(lc_socket_t *sock, struct msghdr *msg, int flags)
 {
-	ssize_t bytes = 0, rc;
-	for (lc_channel_t *chan = sock->ctx->chan_list; chan; chan = chan->next) {
-		if (chan->sock == sock) {
-			if ((rc = lc_channel_sendmsg(chan, msg, flags)) > 0) {
-				bytes += rc;
+	lc_channel_t *chan[LC_SENDMMSG_MAX];
+	struct mmsghdr mmsg[LC_SENDMMSG_MAX];
+	lc_channel_t *p = sock->chan_list;
+	ssize_t bytes = 0;
+	int vlen, sent, rc, err = 0, ok = 0;
+
+	/* send to every channel bound to the socket, LC_SENDMMSG_MAX channels
+	 * per syscall. A failure is recorded against that channel and we carry
+	 * on with the rest */
+	while (p) {
+		for (vlen = 0; p && vlen < LC_SENDMMSG_MAX; p = p->snext, vlen++) {
+			chan[vlen] = p;
+			mmsg[vlen].msg_hdr = *msg;
+			mmsg[vlen].msg_hdr.msg_name = (struct sockaddr *)&p->sa;
+			mmsg[vlen].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+			mmsg[vlen].msg_len = 0;
+		}
+		for (sent = 0; sent < vlen; sent += rc) {
+			rc = lc_socket_sendmmsg(sock, &mmsg[sent], vlen - sent, flags);
+			if (rc > 0) {
+				for (int i = sent; i < sent + rc; i++) {
+					chan[i]->err = 0;
+					bytes += mmsg[i].msg_len;
+				}
+				ok++;
+			}
+			else {
+				/* sendmmsg() reports the error of the first message */
+				err = chan[sent]->err = errno;
+				rc = 1;
 			}
-			else return -1;
 		}
 	}
+	if (!ok && err) {
+		errno = err;
+		return -1;
+	}
 	return bytes;
 }
 
+ssize_t lc_socket_sendmsg(lc_socket_t *sock, struct msghdr *msg, int flags)
+{
+	return lc_socket_fanout(sock, msg, flags);
+}
+
 ssize_t lc_socket_send(lc_socket_t *sock, const void *buf, size_t len, int flags)
 {
-	ssize_t bytes = 0, rc;
-	for (lc_channel_t *chan = sock->ctx->chan_list; chan; chan = chan->next) {
-		if (chan->sock == sock) {
-			if ((rc = lc_channel_send(chan, buf, len, flags)) > 0) {
-				bytes += rc;
-			}
-			else return -1;
-		}
-	}
-	return bytes;
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	return lc_socket_fanout(sock, &msg, flags);
 }
 
 ssize_t lc_msg_sendto(int sock, const void *buf, size_t len, struct sockaddr_in6 *sa, int flags)
@@ -272,24 +1122,10 @@ ssize_t lc_msg_sendto(int sock, const void *buf, size_t len, struct sockaddr_in6
 	return sendto(sock, buf, len, flags, (struct sockaddr *)sa, sizeof(struct sockaddr_in6));
 }
 
-ssize_t lc_msg_send(lc_channel_t *chan, lc_message_t *msg)
+static void lc_msg_head(lc_channel_t *chan, lc_message_t *msg, lc_message_head_t *head,
+		lc_len_t len)
 {
-	struct sockaddr_in6 *sa = &chan->sa;
-	lc_message_head_t *head = NULL;
-	char *buf = NULL;
-	size_t len = 0;
-	ssize_t bytes = 0;
 	struct timespec t = {0};
-	int state = 0;
-	int err = 0;
-
-	if (!chan->sock) return LC_ERROR_SOCKET_REQUIRED;
-	if (msg->len > 0 && !msg->data) return LC_ERROR_MESSAGE_EMPTY;
-
-	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
-
-	head = calloc(1, sizeof(lc_message_head_t));
-	if (!head) return LC_ERROR_MALLOC;
 
 	if (msg->timestamp)
 		head->timestamp = htobe64(msg->timestamp);
@@ -298,249 +1134,2106 @@ ssize_t lc_msg_send(lc_channel_t *chan, lc_message_t *msg)
 
 	head->seq = htobe64(++chan->seq);
 	lc_getrandom(&head->rnd, sizeof(lc_rnd_t));
-	head->len = htobe64(msg->len);
+	head->len = htobe64(len);
 	head->op = msg->op;
-	len = msg->len;
-	buf = calloc(1, sizeof(lc_message_head_t) + len);
-	if (!buf) {
-		free(head);
-		return LC_ERROR_MALLOC;
+}
+
+#ifdef LC_ZEROCOPY
+/* take zero-copy completions off sock's error queue, waiting up to timeout
+ * ms for the first, and give each buffer the kernel has let go of back to
+ * its owner. Caller holds zc->mtx */
+static void lc_zc_reap(lc_socket_t *sock, int timeout)
+{
+	lc_zc_t *zc = sock->zc;
+	struct pollfd pfd = { .fd = sock->sock };
+	char ctl[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+	struct msghdr msgh;
+	struct cmsghdr *cmsg;
+	struct sock_extended_err ee;
+	lc_zcsend_t *zs;
+
+	/* the error queue always polls as POLLERR */
+	if (timeout && poll(&pfd, 1, timeout) < 1) return;
+	for (;;) {
+		memset(&msgh, 0, sizeof msgh);
+		msgh.msg_control = ctl;
+		msgh.msg_controllen = sizeof ctl;
+		if (recvmsg(sock->sock, &msgh, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) break;
+		for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+			if (!(cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)
+			&& !(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR))
+				continue;
+			memcpy(&ee, CMSG_DATA(cmsg), sizeof ee);
+			if (ee.ee_errno || ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+			/* ids ee_info to ee_data inclusive are done */
+			if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				zc->copied += ee.ee_data - ee.ee_info + 1;
+			for (uint32_t id = ee.ee_info; id != ee.ee_data + 1; id++) {
+				zs = &zc->send[id % LC_ZC_PENDING];
+				if (zs->free) zs->free(zs->data, zs->hint);
+				zs->free = NULL;
+			}
+		}
 	}
-	memcpy(buf, head, sizeof(lc_message_head_t));
-	memcpy(buf + sizeof(lc_message_head_t), msg->data, len);
-	len += sizeof(lc_message_head_t);
+	while (zc->done != zc->next && !zc->send[zc->done % LC_ZC_PENDING].free) zc->done++;
+}
 
-	bytes = lc_msg_sendto(chan->sock->sock, buf, len, sa, 0);
-	if (bytes == -1) err = errno;
+/* send msg with MSG_ZEROCOPY. The kernel reads the payload straight from
+ * msg->data, so it's ours until the kernel says it is done with it, and
+ * msg->free is called then. If the kernel has no room for the notification,
+ * the same datagram is sent by copying, and msg is left to the caller.
+ * Returns 0 without sending if we can't track another send, leaving msg to
+ * the caller to send by copying */
+static ssize_t lc_msg_send_zc(lc_channel_t *chan, lc_message_t *msg)
+{
+	lc_zc_t *zc = chan->sock->zc;
+	lc_zcsend_t *zs;
+	struct iovec iov[2];
+	struct msghdr msgh = { .msg_iov = iov, .msg_iovlen = 2 };
+	ssize_t bytes = 0;
+	int state = 0;
+	int err = 0;
+	int copied = 0;
 
-	free(head);
-	free(buf);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+	pthread_mutex_lock(&zc->mtx);
+	lc_zc_reap(chan->sock, 0);
+	if (zc->next - zc->done >= LC_ZC_PENDING) lc_zc_reap(chan->sock, LC_ZC_WAIT);
+	if (zc->next - zc->done < LC_ZC_PENDING) {
+		zs = &zc->send[zc->next % LC_ZC_PENDING];
+		memset(&zs->head, 0, sizeof(lc_message_head_t));
+		lc_msg_head(chan, msg, &zs->head, msg->len);
+		iov[0].iov_base = &zs->head;
+		iov[0].iov_len = sizeof(lc_message_head_t);
+		iov[1].iov_base = msg->data;
+		iov[1].iov_len = msg->len;
+		bytes = lc_channel_sendmsg_zc(chan, &msgh, MSG_ZEROCOPY, &copied);
+		if (bytes == -1) err = errno;
+		else if (!copied) {
+			zs->free = msg->free;
+			zs->data = msg->data;
+			zs->hint = msg->hint;
+			msg->free = NULL;
+			zc->next++;
+			zc->sends++;
+		}
+	}
+	pthread_mutex_unlock(&zc->mtx);
 	pthread_setcancelstate(state, NULL);
 
 	if (err) errno = err;
 	return bytes;
 }
 
-ssize_t lc_msg_recv(lc_socket_t *sock, lc_message_t *msg)
+/* hand back every zero-copy buffer before sock goes, waiting a while for
+ * the kernel to finish with them */
+static void lc_zc_free(lc_socket_t *sock)
 {
-	ssize_t zi = 0, err = 0;
-	struct iovec iov[2];
-	struct msghdr msgh = {0};
-	char buf[sizeof(lc_message_head_t)];
-	char cmsgbuf[BUFSIZE];
-	struct sockaddr_in6 from;
-	socklen_t fromlen = sizeof(from);
-	struct cmsghdr *cmsg;
-	lc_message_head_t head;
+	lc_zc_t *zc = sock->zc;
+	lc_zcsend_t *zs;
+
+	if (!zc) return;
+	for (int i = 0; i < LC_ZC_WAIT / 10 && zc->done != zc->next; i++) lc_zc_reap(sock, 10);
+	for (; zc->done != zc->next; zc->done++) {
+		zs = &zc->send[zc->done % LC_ZC_PENDING];
+		if (zs->free) zs->free(zs->data, zs->hint);
+	}
+	pthread_mutex_destroy(&zc->mtx);
+	free(zc);
+	sock->zc = NULL;
+}
+#endif
 
-	zi = recv(sock->sock, NULL, 0, MSG_PEEK | MSG_TRUNC);
-	if (zi == -1) return -1;
+int lc_socket_zerocopy(lc_socket_t *sock, size_t size)
+{
+#ifdef LC_ZEROCOPY
+	int opt = 1;
 
-	if ((size_t)zi > sizeof(lc_message_head_t)) {
-		err = lc_msg_init_size(msg, (size_t)zi - sizeof(lc_message_head_t));
-		if (err) return LC_ERROR_MALLOC;
+	if (size && !sock->zc) {
+		if (setsockopt(sock->sock, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof opt) == -1)
+			return -1;
+		if (!(sock->zc = calloc(1, sizeof(lc_zc_t)))) return -1;
+		pthread_mutex_init(&sock->zc->mtx, NULL);
 	}
+	sock->zerocopy = size;
+	return 0;
+#else
+	(void)sock; (void)size;
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
 
-	iov[0].iov_base = buf;
-	iov[0].iov_len = sizeof(lc_message_head_t);
-	iov[1].iov_base = msg->data;
-	iov[1].iov_len = msg->len;
-	msgh.msg_control = cmsgbuf;
-	msgh.msg_controllen = BUFSIZE;
-	msgh.msg_name = &from;
-	msgh.msg_namelen = fromlen;
-	msgh.msg_iov = iov;
-	msgh.msg_iovlen = 2;
-	msgh.msg_flags = 0;
+int lc_socket_zerocopy_pending(lc_socket_t *sock)
+{
+#ifdef LC_ZEROCOPY
+	int n;
 
-	pthread_testcancel();
-	if ((zi = recvmsg(sock->sock, &msgh, 0)) <= 0) return zi;
-	memcpy(&head, buf, sizeof(lc_message_head_t));
-	msg->seq = be64toh(head.seq);
-	msg->rnd = be64toh(head.rnd);
-	msg->len = be64toh(head.len);
-	msg->timestamp = be64toh(head.timestamp);
-	msg->op = head.op;
-	for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
-		if (cmsg->cmsg_type == IPV6_PKTINFO) {
-			/* may not be aligned, copy */
-			memcpy(&msg->dst, CMSG_DATA(cmsg), sizeof(struct in6_addr));
-			msg->src = (&from)->sin6_addr;
+	if (!sock->zc) return 0;
+	pthread_mutex_lock(&sock->zc->mtx);
+	lc_zc_reap(sock, 0);
+	n = sock->zc->next - sock->zc->done;
+	pthread_mutex_unlock(&sock->zc->mtx);
+	return n;
+#else
+	(void)sock;
+	return 0;
+#endif
+}
+
+#ifdef UDP_SEGMENT
+/* Send payload as a train of datagrams of sock->gso bytes, each with its own
+ * header, handing segmentation to the kernel. If the egress device can't
+ * checksum GSO packets (EIO) the segments we built are sent one by one. */
+static ssize_t lc_msg_sendv_gso(lc_channel_t *chan, lc_message_t *msg,
+		const struct iovec *iov, int iovcnt, lc_len_t len)
+{
+	lc_message_head_t head[LC_GSO_SEGS];
+	struct iovec v[LC_GSO_IOV];
+	int segv[LC_GSO_SEGS + 1]; /* index into v of each segment */
+	char ctl[CMSG_SPACE(sizeof(uint16_t))] = {0};
+	struct msghdr msgh = {0};
+	const size_t segsz = chan->sock->gso;
+	const size_t hdrsz = sizeof(lc_message_head_t);
+	size_t maxsegs, seglen, off = 0, n;
+	ssize_t bytes = 0, rc = 0;
+	int idx = 0, nv, nseg, state = 0, err = 0;
+
+	maxsegs = LC_GSO_BYTES / (hdrsz + segsz);
+	if (maxsegs > LC_GSO_SEGS) maxsegs = LC_GSO_SEGS;
+	if (!maxsegs) return LC_ERROR_INVALID_PARAMS;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+	while (len) {
+		for (nv = 0, nseg = 0; len && (size_t)nseg < maxsegs; nseg++) {
+			seglen = (len < segsz) ? len : segsz;
+			/* worst case, one iovec per remaining caller buffer */
+			n = (size_t)(iovcnt - idx) < seglen ? (size_t)(iovcnt - idx) : seglen;
+			if (nv + 1 + n > LC_GSO_IOV) break;
+			segv[nseg] = nv;
+			memset(&head[nseg], 0, hdrsz);
+			lc_msg_head(chan, msg, &head[nseg], seglen);
+			v[nv].iov_base = &head[nseg];
+			v[nv++].iov_len = hdrsz;
+			len -= seglen;
+			while (seglen) {
+				n = iov[idx].iov_len - off;
+				if (n > seglen) n = seglen;
+				if (n) {
+					v[nv].iov_base = (char *)iov[idx].iov_base + off;
+					v[nv++].iov_len = n;
+				}
+				seglen -= n;
+				off += n;
+				if (off == iov[idx].iov_len) {
+					idx++;
+					off = 0;
+				}
+			}
+		}
+		if (!nseg) {
+			errno = EMSGSIZE;
+			rc = -1;
+			break;
+		}
+		segv[nseg] = nv;
+		msgh.msg_iov = v;
+		msgh.msg_iovlen = nv;
+		lc_cmsg_segment(&msgh, ctl, sizeof ctl, hdrsz + segsz);
+		rc = lc_channel_sendmsg(chan, &msgh, 0);
+		if (rc == -1 && errno == EIO) {
+			msgh.msg_control = NULL;
+			msgh.msg_controllen = 0;
+			for (int i = 0; i < nseg; i++) {
+				msgh.msg_iov = &v[segv[i]];
+				msgh.msg_iovlen = segv[i + 1] - segv[i];
+				if ((rc = lc_channel_sendmsg(chan, &msgh, 0)) == -1) {
+					chan->seq -= nseg - i;
+					break;
+				}
+				bytes += rc;
+			}
+			if (rc == -1) break;
+			continue;
+		}
+		if (rc == -1) {
+			chan->seq -= nseg;
 			break;
 		}
+		bytes += rc;
 	}
-	return zi;
+	if (rc == -1) err = errno;
+	pthread_setcancelstate(state, NULL);
+
+	if (err && !bytes) {
+		errno = err;
+		return -1;
+	}
+	return bytes;
 }
+#endif
 
-int lc_socket_listen_cancel(lc_socket_t *sock)
+/* send the repairs for chan's FEC block so far, and start the next block */
+static ssize_t lc_fec_repair(lc_channel_t *chan)
 {
-	if (sock->thread) {
-		if (pthread_cancel(sock->thread))
-			return LC_ERROR_THREAD_CANCEL;
-		if (pthread_join(sock->thread, NULL))
-			return LC_ERROR_THREAD_JOIN;
-		sock->thread = 0;
+	lc_fec_enc_t *enc = chan->fec;
+	lc_channel_t *side = (chan->fecrepair) ? chan->fecrepair : chan;
+	lc_message_head_t head = {0};
+	lc_fec_head_t fh = {0};
+	struct iovec iov[3];
+	struct msghdr msgh = { .msg_iov = iov, .msg_iovlen = 3 };
+	ssize_t bytes = 0, rc;
+	int err = 0;
+
+	if (!enc->n) return 0;
+	if (!side->sock) {
+		lc_fec_enc_next(enc);
+		errno = ENOTCONN;
+		return -1;
 	}
-	return 0;
+	head.op = LC_OP_FEC;
+	head.len = htobe64(sizeof fh + enc->symsz);
+	fh.id = htobe32(enc->id);
+	fh.block = htobe32(enc->block);
+	fh.k = enc->n;
+	fh.m = enc->m;
+	iov[0].iov_base = &head;
+	iov[0].iov_len = sizeof head;
+	iov[1].iov_base = &fh;
+	iov[1].iov_len = sizeof fh;
+	iov[2].iov_len = enc->symsz;
+	for (int r = 0; r < enc->m; r++) {
+		fh.idx = enc->n + r;
+		iov[2].iov_base = enc->rep[r];
+		if ((rc = lc_channel_sendmsg(side, &msgh, 0)) == -1) err = errno;
+		else bytes += rc;
+	}
+	lc_fec_enc_next(enc);
+	if (!bytes && err) {
+		errno = err;
+		return -1;
+	}
+	return bytes;
 }
 
-static void lc_op_pong_handler(lc_socket_call_t *sc, lc_message_t *msg)
+/* send msgh, whose first iovec is the message header, as the next source of
+ * chan's FEC block: with a FEC header after the message header, and the
+ * repairs behind it if that completes the block. Returns bytes of the source
+ * datagram sent */
+static ssize_t lc_fec_sendmsg(lc_channel_t *chan, struct msghdr *msgh)
 {
-	if (sc->callback_msg) sc->callback_msg(msg);
+	lc_fec_enc_t *enc = chan->fec;
+	const size_t iovlen = msgh->msg_iovlen;
+	lc_message_head_t head, wire;
+	lc_fec_head_t fh = {0};
+	struct iovec v[iovlen + 1];
+	struct msghdr m = *msgh;
+	size_t len = 0;
+	ssize_t bytes;
+	int err = 0;
+
+	for (size_t i = 1; i < iovlen; i++) len += msgh->msg_iov[i].iov_len;
+	memcpy(&head, msgh->msg_iov[0].iov_base, sizeof head);
+	head.len = htobe64(len);
+
+	/* the source symbol is the datagram as it would go without FEC, so
+	 * lost ones come back exactly as they were sent */
+	v[0].iov_base = &head;
+	v[0].iov_len = sizeof head;
+	memcpy(&v[1], &msgh->msg_iov[1], sizeof(struct iovec) * (iovlen - 1));
+	if (lc_fec_enc_add(enc, v, iovlen) == -1) return -1;
+
+	wire = head;
+	wire.op |= LC_OP_FEC;
+	wire.len = htobe64(sizeof fh + len);
+	fh.id = htobe32(enc->id);
+	fh.block = htobe32(enc->block);
+	fh.idx = enc->n - 1;
+	fh.k = enc->k;
+	fh.m = enc->m;
+	v[0].iov_base = &wire;
+	v[1].iov_base = &fh;
+	v[1].iov_len = sizeof fh;
+	memcpy(&v[2], &msgh->msg_iov[1], sizeof(struct iovec) * (iovlen - 1));
+	m.msg_iov = v;
+	m.msg_iovlen = iovlen + 1;
+	bytes = lc_channel_sendmsg(chan, &m, 0);
+	if (bytes == -1) err = errno;
+
+	/* a source lost on send can still be recovered from the repairs */
+	if (enc->n == enc->k) lc_fec_repair(chan);
+	if (err) errno = err;
+	return bytes;
 }
 
-static void lc_op_ping_handler(lc_socket_call_t *sc, lc_message_t *msg)
+/* lc_channel_sendmmsg() for a FEC channel, one source at a time */
+static int lc_fec_sendmmsg(lc_channel_t *chan, struct mmsghdr *msgvec, unsigned int vlen)
 {
-	(void) sc; /* unused */
-	int opt = LC_OP_PONG;
+	ssize_t rc;
+	unsigned int i;
 
-	/* received PING, echo PONG back to same channel */
-	lc_msg_set(msg, LC_ATTR_OPCODE, &opt);
-	lc_msg_send(msg->chan, msg);
+	for (i = 0; i < vlen; i++) {
+		if ((rc = lc_fec_sendmsg(chan, &msgvec[i].msg_hdr)) == -1) break;
+		msgvec[i].msg_len = rc;
+	}
+	return (i || !vlen) ? (int)i : -1;
 }
 
-static void lc_op_data_handler(lc_socket_call_t *sc, lc_message_t *msg)
+int lc_channel_fec(lc_channel_t *chan, int k, int m, lc_channel_t *repair)
 {
-	/* callback to message handler */
-	if (sc->callback_msg) sc->callback_msg(msg);
+	lc_fec_enc_t *enc = NULL;
+
+	if (k < 0 || (k && (m < 1 || k + m > LC_FEC_MAXN)) || repair == chan) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (k && !(enc = lc_fec_enc_new(k, m))) return -1;
+	if (chan->fecrepair && chan->fecrepair->fecsrc == chan) chan->fecrepair->fecsrc = NULL;
+	lc_fec_enc_free(chan->fec);
+	chan->fec = enc;
+	chan->fecrepair = (k) ? repair : NULL;
+	if (chan->fecrepair) chan->fecrepair->fecsrc = chan;
+	return 0;
 }
 
-lc_channel_t *lc_channel_by_address(lc_ctx_t *lctx, struct in6_addr *addr)
+ssize_t lc_channel_fec_flush(lc_channel_t *chan)
+{
+	ssize_t rc;
+	int state = 0;
+
+	if (!chan->fec) return 0;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+	rc = lc_fec_repair(chan);
+	pthread_setcancelstate(state, NULL);
+	return rc;
+}
+
+/* Send a message too big for one sock->frag byte datagram as fragments, each
+ * carrying the message header and a fragment header ahead of its slice of
+ * the payload, LC_SENDMMSG_MAX fragments per sendmmsg() */
+static ssize_t lc_msg_sendv_frag(lc_channel_t *chan, lc_message_t *msg,
+		const struct iovec *iov, int iovcnt, lc_len_t len)
+{
+	const size_t fecsz = (chan->fec) ? sizeof(lc_fec_head_t) : 0;
+	const size_t fragsz = chan->sock->frag - sizeof(lc_message_head_t) - sizeof(lc_frag_head_t) - fecsz;
+	const size_t cnt = (len + fragsz - 1) / fragsz;
+	lc_message_head_t hd = {0}, head[LC_SENDMMSG_MAX];
+	lc_frag_head_t fh[LC_SENDMMSG_MAX];
+	struct mmsghdr mmsg[LC_SENDMMSG_MAX];
+	struct iovec v[3 * LC_SENDMMSG_MAX + iovcnt];
+	size_t idx, off = 0, vo = 0, flen, take, nv;
+	ssize_t bytes = 0;
+	int vi = 0, n, sent, rc, state = 0, err = 0;
+
+	if (cnt > UINT16_MAX || len > UINT32_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+	/* one seq and rnd for the whole message, each fragment with its own
+	 * length */
+	lc_msg_head(chan, msg, &hd, 0);
+	hd.op |= LC_OP_FRAG;
+	for (idx = 0; idx < cnt;) {
+		for (n = 0, nv = 0; n < LC_SENDMMSG_MAX && idx < cnt; n++, idx++) {
+			flen = (len - off < fragsz) ? len - off : fragsz;
+			head[n] = hd;
+			head[n].len = htobe64(flen + sizeof fh[n]);
+			fh[n].len = htobe32(len);
+			fh[n].off = htobe32(off);
+			fh[n].idx = htobe16(idx);
+			fh[n].cnt = htobe16(cnt);
+			memset(&mmsg[n], 0, sizeof(struct mmsghdr));
+			mmsg[n].msg_hdr.msg_iov = &v[nv];
+			v[nv].iov_base = &head[n];
+			v[nv++].iov_len = sizeof head[n];
+			v[nv].iov_base = &fh[n];
+			v[nv++].iov_len = sizeof fh[n];
+			/* this fragment's slice of the caller's buffers */
+			for (off += flen; flen; flen -= take) {
+				take = iov[vi].iov_len - vo;
+				if (take > flen) take = flen;
+				if (take) {
+					v[nv].iov_base = (char *)iov[vi].iov_base + vo;
+					v[nv++].iov_len = take;
+				}
+				if ((vo += take) == iov[vi].iov_len) {
+					vi++;
+					vo = 0;
+				}
+			}
+			mmsg[n].msg_hdr.msg_iovlen = &v[nv] - mmsg[n].msg_hdr.msg_iov;
+		}
+		for (sent = 0; sent < n; sent += rc) {
+			rc = (chan->fec) ? lc_fec_sendmmsg(chan, &mmsg[sent], n - sent)
+				: lc_channel_sendmmsg(chan, &mmsg[sent], n - sent, 0);
+			if (rc == -1) {
+				err = errno;
+				break;
+			}
+			for (int i = sent; i < sent + rc; i++) bytes += mmsg[i].msg_len;
+		}
+		if (err) break;
+	}
+	pthread_setcancelstate(state, NULL);
+
+	/* a message missing a fragment is lost */
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return bytes;
+}
+
+ssize_t lc_msg_sendv(lc_channel_t *chan, lc_message_t *msg, const struct iovec *iov, int iovcnt)
 {
-	for (lc_channel_t *p = lctx->chan_list; p; p = p->next) {
-		if (!memcmp(addr,& p->sa.sin6_addr, sizeof(struct in6_addr)))
-			return p;
+	lc_message_head_t head = {0};
+	struct msghdr msgh = {0};
+	lc_len_t len = 0;
+	ssize_t bytes = 0;
+	int state = 0;
+	int err = 0;
+
+	if (!chan->sock) return LC_ERROR_SOCKET_REQUIRED;
+	if (iovcnt < 0 || iovcnt >= IOV_MAX) return LC_ERROR_INVALID_PARAMS;
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > 0 && !iov[i].iov_base) return LC_ERROR_MESSAGE_EMPTY;
+		len += iov[i].iov_len;
 	}
-	return NULL;
+
+#ifdef UDP_SEGMENT
+	if (chan->sock->gso && len > chan->sock->gso && !chan->fec)
+		return lc_msg_sendv_gso(chan, msg, iov, iovcnt, len);
+#endif
+	if (chan->sock->frag && sizeof(lc_message_head_t) + len
+			+ ((chan->fec) ? sizeof(lc_fec_head_t) : 0) > chan->sock->frag)
+		return lc_msg_sendv_frag(chan, msg, iov, iovcnt, len);
+
+	/* header is built on the stack and sent ahead of the caller's
+	 * buffers - no allocations, no copying of payload */
+	struct iovec v[iovcnt + 1];
+	v[0].iov_base = &head;
+	v[0].iov_len = sizeof(lc_message_head_t);
+	if (iovcnt) memcpy(&v[1], iov, sizeof(struct iovec) * iovcnt);
+	msgh.msg_iov = v;
+	msgh.msg_iovlen = iovcnt + 1;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+
+	lc_msg_head(chan, msg, &head, len);
+	bytes = (chan->fec) ? lc_fec_sendmsg(chan, &msgh) : lc_channel_sendmsg(chan, &msgh, 0);
+	if (bytes == -1) err = errno;
+
+	pthread_setcancelstate(state, NULL);
+
+	if (err) errno = err;
+	return bytes;
 }
 
-static ssize_t lc_socket_recvmsg_if(lc_socket_t *sock, struct msghdr *msg, int flags)
+ssize_t lc_msg_send(lc_channel_t *chan, lc_message_t *msg)
 {
-	struct in6_pktinfo pi = {0};
-	char ctl[CMSG_SPACE(sizeof pi)];
-	struct cmsghdr *cmsg;
-	ssize_t bytes;
-	int opt = 1;
+	struct iovec iov = { .iov_base = msg->data, .iov_len = msg->len };
 
-	/* We're only interested in packets arriving on the socket->ifx
-	 * interface. If we bind to an interface-specific address, we will get no
-	 * multicast packets. If bound to either INADDR_ANY or the multicast
-	 * group address, we receive packets on all interfaces. So, we need to
-	 * filter by extracting the receiving interface from ancillary data */
+	if (msg->len > 0 && !msg->data) return LC_ERROR_MESSAGE_EMPTY;
+#ifdef LC_ZEROCOPY
+	lc_socket_t *sock = chan->sock;
+	if (sock && sock->zerocopy && msg->len >= sock->zerocopy && msg->free
+	&& !sock->gso && !sock->xdp && !chan->fec
+	&& (!sock->frag || sizeof(lc_message_head_t) + msg->len <= sock->frag)) {
+		ssize_t rc = lc_msg_send_zc(chan, msg);
+		if (rc) return rc;
+	}
+#endif
+
+	return lc_msg_sendv(chan, msg, &iov, 1);
+}
 
-	setsockopt(sock->sock, IPPROTO_IPV6, IPV6_RECVPKTINFO, &opt, sizeof opt);
+/* msg to chan is more than the one plain datagram lc_msg_send_batch()
+ * builds: it has FEC, or is big enough for GSO or fragmenting */
+static int lc_msg_send_alone(lc_channel_t *chan, lc_message_t *msg)
+{
+	lc_socket_t *sock = chan->sock;
 
-	/* provide control buffer if caller hasn't */
-	if (!msg->msg_control) {
-		msg->msg_control = ctl;
-		msg->msg_controllen = sizeof ctl;
+	return chan->fec || (sock->gso && msg->len > sock->gso)
+		|| (sock->frag && sizeof(lc_message_head_t) + msg->len > sock->frag);
+}
+
+ssize_t lc_msg_send_batch(lc_channel_t **chans, lc_message_t *msgs, size_t n)
+{
+	lc_message_head_t head[LC_SENDMMSG_MAX];
+	struct iovec iov[LC_SENDMMSG_MAX][2];
+	struct mmsghdr mmsg[LC_SENDMMSG_MAX];
+#ifdef SO_TXTIME
+	char ctl[LC_SENDMMSG_MAX][CMSG_SPACE(sizeof(uint64_t))];
+#endif
+	lc_socket_t *sock;
+	ssize_t sent = 0;
+	size_t i, j, vlen;
+	uint64_t t = 0;
+	int state = 0;
+	int rc = 0;
+	int err = 0;
+
+	for (i = 0; i < n; i++) {
+		if (!chans[i]->sock) return LC_ERROR_SOCKET_REQUIRED;
+		if (msgs[i].len > 0 && !msgs[i].data) return LC_ERROR_MESSAGE_EMPTY;
 	}
 
-	for (;;) {
-		bytes = recvmsg(sock->sock, msg, flags);
-		for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
-			if (cmsg->cmsg_type == IPV6_PKTINFO) {
-				memcpy(&pi, CMSG_DATA(cmsg), sizeof pi);
-				if (sock->ifx == pi.ipi6_ifindex) return bytes;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+
+	/* one sendmmsg() per run of messages with the same socket, up to
+	 * LC_SENDMMSG_MAX messages at a time. A paced message that has to wait
+	 * starts a new run, unless the qdisc is doing the waiting */
+	for (i = 0; i < n; i += vlen) {
+		sock = chans[i]->sock;
+		if (lc_msg_send_alone(chans[i], &msgs[i])) {
+			struct iovec v = { .iov_base = msgs[i].data, .iov_len = msgs[i].len };
+			lc_seq_t seq = chans[i]->seq;
+			ssize_t bytes = lc_msg_sendv(chans[i], &msgs[i], &v, 1);
+			if (bytes == -1) {
+				err = errno;
+				chans[i]->seq = seq;
+				break;
+			}
+			msgs[i].bytes = bytes;
+			sent++;
+			vlen = 1;
+			continue;
+		}
+		for (vlen = 0; vlen < LC_SENDMMSG_MAX && i + vlen < n; vlen++) {
+			j = i + vlen;
+			if (chans[j]->sock != sock || lc_msg_send_alone(chans[j], &msgs[j])) break;
+			if (chans[j]->rate) {
+				t = lc_channel_pace(chans[j], sizeof(lc_message_head_t) + msgs[j].len, !vlen);
+				if (t == LC_PACE_LATER) break;
 			}
+			memset(&head[vlen], 0, sizeof(lc_message_head_t));
+			lc_msg_head(chans[j], &msgs[j], &head[vlen], msgs[j].len);
+			iov[vlen][0].iov_base = &head[vlen];
+			iov[vlen][0].iov_len = sizeof(lc_message_head_t);
+			iov[vlen][1].iov_base = msgs[j].data;
+			iov[vlen][1].iov_len = msgs[j].len;
+			memset(&mmsg[vlen], 0, sizeof(struct mmsghdr));
+			mmsg[vlen].msg_hdr.msg_name = &chans[j]->sa;
+			mmsg[vlen].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+			mmsg[vlen].msg_hdr.msg_iov = iov[vlen];
+			mmsg[vlen].msg_hdr.msg_iovlen = 2;
+#ifdef SO_TXTIME
+			if (chans[j]->rate && t) lc_cmsg_txtime(&mmsg[vlen].msg_hdr, ctl[vlen], t);
+#endif
+		}
+		rc = lc_socket_sendmmsg(sock, mmsg, vlen, 0);
+		if (rc == -1) {
+			err = errno;
+			rc = 0;
+		}
+		for (j = 0; j < (size_t)rc; j++) msgs[i + j].bytes = mmsg[j].msg_len;
+		sent += rc;
+		if ((size_t)rc < vlen) {
+			/* partial send - hand back the sequence numbers of every
+			 * message we didn't send, so the next send reuses them */
+			for (j = i + vlen; j-- > i + rc;) chans[j]->seq--;
+			break;
 		}
 	}
-	/* not reached */
+
+	pthread_setcancelstate(state, NULL);
+
+	if (!sent && err) {
+		errno = err;
+		return -1;
+	}
+	return sent;
+}
+
+static void lc_msg_head_decode(lc_message_t *msg, void *buf)
+{
+	lc_message_head_t head;
+
+	memcpy(&head, buf, sizeof(lc_message_head_t));
+	msg->seq = be64toh(head.seq);
+	msg->rnd = be64toh(head.rnd);
+	msg->len = be64toh(head.len);
+	msg->timestamp = be64toh(head.timestamp);
+	msg->op = head.op;
+}
+
+/* kernel receive timestamp in ns from control message cmsg, 0 if it isn't
+ * one */
+static uint64_t lc_cmsg_rxtime(struct cmsghdr *cmsg)
+{
+	if (cmsg->cmsg_level != SOL_SOCKET) return 0;
+#if defined(SO_TIMESTAMPNS)
+	if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+		struct timespec ts;
+		memcpy(&ts, CMSG_DATA(cmsg), sizeof ts);
+		return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+#elif defined(SO_TIMESTAMP)
+	if (cmsg->cmsg_type == SCM_TIMESTAMP) {
+		struct timeval tv;
+		memcpy(&tv, CMSG_DATA(cmsg), sizeof tv);
+		return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+	}
+#endif
+	return 0;
+}
+
+#ifdef UDP_GRO
+/* hand out the next segment of a coalesced GRO buffer as a message */
+static ssize_t lc_msg_recv_gro_next(lc_socket_t *sock, lc_message_t *msg)
+{
+	lc_gro_t *gro = sock->gro;
+	void *data;
+	const size_t hdrsz = sizeof(lc_message_head_t);
+	size_t seg = (gro->len < gro->segsz) ? gro->len : gro->segsz;
+	char *p = gro->buf + gro->off;
+	size_t len;
+
+	gro->off += seg;
+	gro->len -= seg;
+	if (seg < hdrsz) return seg;
+	len = seg - hdrsz;
+	if (!(data = lc_ctx_buf(sock->ctx, len))) return LC_ERROR_MALLOC;
+	memcpy(data, p + hdrsz, len);
+	lc_msg_init_data(msg, data, 0, &lc_buf_unref, NULL);
+	lc_msg_head_decode(msg, p);
+	if (msg->len > len) msg->len = len;
+	msg->dst = gro->dst;
+	msg->src = gro->src;
+	msg->rxtime = gro->rxtime;
+	return seg;
+}
+
+static ssize_t lc_msg_recv_gro(lc_socket_t *sock, lc_message_t *msg, int flags)
+{
+	lc_gro_t *gro = sock->gro;
+	struct iovec iov = { .iov_base = gro->buf, .iov_len = sizeof gro->buf };
+	struct msghdr msgh = {0};
+	char cmsgbuf[BUFSIZE];
+	struct sockaddr_in6 from;
+	struct cmsghdr *cmsg;
+	ssize_t zi;
+	int segsz = 0;
+
+	pthread_testcancel();
+	if (gro->len) return lc_msg_recv_gro_next(sock, msg);
+
+	msgh.msg_control = cmsgbuf;
+	msgh.msg_controllen = BUFSIZE;
+	msgh.msg_name = &from;
+	msgh.msg_namelen = sizeof from;
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+	if ((zi = recvmsg(sock->sock, &msgh, flags)) <= 0) return zi;
+	gro->rxtime = 0;
+	for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+			memcpy(&segsz, CMSG_DATA(cmsg), sizeof segsz);
+		}
+		else if (cmsg->cmsg_type == IPV6_PKTINFO) {
+			memcpy(&gro->dst, CMSG_DATA(cmsg), sizeof(struct in6_addr));
+			gro->src = from.sin6_addr;
+		}
+		else if (!gro->rxtime) gro->rxtime = lc_cmsg_rxtime(cmsg);
+	}
+	/* no UDP_GRO cmsg => a single datagram */
+	gro->segsz = (segsz > 0) ? (size_t)segsz : (size_t)zi;
+	gro->len = zi;
+	gro->off = 0;
+	return lc_msg_recv_gro_next(sock, msg);
+}
+#endif
+
+/* fill in msg from a received datagram of zi bytes, header in head, payload
+ * at data. data is in refcounted buffer buf (NULL = data is the start of the
+ * buffer), which is handed to msg or returned to its pool */
+static void lc_msg_recv_fill(lc_message_t *msg, void *head, void *data, void *buf, size_t zi,
+		struct msghdr *msgh)
+{
+	const size_t hdrsz = sizeof(lc_message_head_t);
+	struct sockaddr_in6 *from = msgh->msg_name;
+	struct cmsghdr *cmsg;
+	size_t len = 0;
+
+	if (zi > hdrsz) {
+		lc_msg_init_data(msg, data, 0, &lc_buf_unref, buf);
+		len = zi - hdrsz;
+	}
+	else lc_msg_init(msg);
+	lc_msg_head_decode(msg, head);
+	/* head may be in the buffer too, so let go only once it's decoded */
+	if (!len) lc_buf_unref(data, buf);
+	/* never trust the header to describe more than we received */
+	if (msg->len > len) msg->len = len;
+	for (cmsg = CMSG_FIRSTHDR(msgh); cmsg; cmsg = CMSG_NXTHDR(msgh, cmsg)) {
+		if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+			/* may not be aligned, copy */
+			memcpy(&msg->dst, CMSG_DATA(cmsg), sizeof(struct in6_addr));
+			msg->src = from->sin6_addr;
+		}
+		else if (!msg->rxtime) msg->rxtime = lc_cmsg_rxtime(cmsg);
+	}
+}
+
+/* receive slot size: small, unless sock fragments messages into datagrams
+ * bigger than that */
+static size_t lc_rx_bufsz(lc_socket_t *sock)
+{
+	const size_t hdrsz = sizeof(lc_message_head_t);
+	return (sock->frag > hdrsz + LC_POOL_SMALL) ? LC_POOL_MEDIUM : LC_POOL_SMALL;
+}
+
+static lc_rx_t *lc_rx_new(void)
+{
+	lc_rx_t *rx;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+	if (!(rx = calloc(1, sizeof(lc_rx_t)))) return NULL;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+	rx->spill = mmap(NULL, LC_RECVMMSG_MAX * LC_RX_SPILL, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (rx->spill == MAP_FAILED) {
+		free(rx);
+		return NULL;
+	}
+	return rx;
+}
+
+static void lc_rx_free(lc_rx_t *rx)
+{
+	if (!rx) return;
+	for (int i = 0; i < LC_RECVMMSG_MAX; i++) lc_buf_unref(rx->buf[i], NULL);
+	munmap(rx->spill, LC_RECVMMSG_MAX * LC_RX_SPILL);
+	free(rx);
+}
+
+/* sock's receive slots, with buffers in the first *n, or fewer if the pool
+ * runs dry, which *n is set to. If another receive has them, a one-off
+ * single slot in tmp, spilling into a largest pooled buffer. NULL if not
+ * even one slot could be had. Give them back with lc_rx_put() */
+static lc_rx_t *lc_rx_get(lc_socket_t *sock, lc_rx_t *tmp, unsigned int *n)
+{
+	lc_rx_t *rx = sock->rx, *none = NULL;
+	size_t bufsz = lc_rx_bufsz(sock);
+	unsigned int i;
+
+	if (!rx && (rx = lc_rx_new())) {
+		/* first receive on sock, and maybe not the only one */
+		if (!__atomic_compare_exchange_n(&sock->rx, &none, rx, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			lc_rx_free(rx);
+			rx = none;
+		}
+	}
+	if (!rx || atomic_exchange_explicit(&rx->busy, 1, memory_order_acquire)) {
+		memset(tmp, 0, sizeof(lc_rx_t));
+		tmp->bufsz = LC_POOL_SMALL;
+		tmp->buf[0] = lc_ctx_buf(sock->ctx, LC_POOL_SMALL);
+		tmp->spillbuf = lc_ctx_buf(sock->ctx, LC_RX_SPILL);
+		if (!tmp->buf[0] || !tmp->spillbuf) {
+			lc_buf_unref(tmp->buf[0], NULL);
+			lc_buf_unref(tmp->spillbuf, NULL);
+			return NULL;
+		}
+		tmp->spill = tmp->spillbuf;
+		*n = 1;
+		return tmp;
+	}
+	if (rx->bufsz != bufsz) {
+		for (i = 0; i < LC_RECVMMSG_MAX; i++) {
+			lc_buf_unref(rx->buf[i], NULL);
+			rx->buf[i] = NULL;
+		}
+		rx->bufsz = bufsz;
+	}
+	for (i = 0; i < *n; i++) {
+		if (!rx->buf[i] && !(rx->buf[i] = lc_ctx_buf(sock->ctx, bufsz))) break;
+	}
+	if (!(*n = i)) {
+		atomic_store_explicit(&rx->busy, 0, memory_order_release);
+		return NULL;
+	}
+	return rx;
+}
+
+/* give back slots from lc_rx_get(). A cancellation cleanup handler */
+static void lc_rx_put(void *arg)
+{
+	lc_rx_t *rx = arg;
+
+	if (rx->spillbuf) {
+		lc_buf_unref(rx->buf[0], NULL);
+		lc_buf_unref(rx->spillbuf, NULL);
+	}
+	else atomic_store_explicit(&rx->busy, 0, memory_order_release);
+}
+
+/* recvmmsg() into rx's slots, giving them back if cancelled while waiting */
+static int lc_rx_recv(lc_rx_t *rx, int fd, struct mmsghdr *mmsg, unsigned int vlen, int flags)
+{
+	int n;
+
+	pthread_cleanup_push(lc_rx_put, rx);
+	pthread_testcancel();
+	n = recvmmsg(fd, mmsg, vlen, flags, NULL);
+	pthread_cleanup_pop(0);
+	return n;
+}
+
+/* head, slot buffer and spill region of slot i, to receive into */
+static void lc_rx_iov(lc_rx_t *rx, int i, struct iovec *iov, void *head)
+{
+	iov[0].iov_base = head;
+	iov[0].iov_len = sizeof(lc_message_head_t);
+	iov[1].iov_base = rx->buf[i];
+	iov[1].iov_len = rx->bufsz;
+	iov[2].iov_base = rx->spill + (size_t)i * LC_RX_SPILL;
+	iov[2].iov_len = LC_RECV_BUFSZ - rx->bufsz;
+}
+
+/* the len bytes of payload received into slot i: its buffer, which the
+ * slot lets go of, if it all fits. Otherwise a buffer of its own size, with
+ * the overflow copied from the spill region, and the slot keeps its buffer.
+ * NULL if there's no buffer to be had */
+static void *lc_rx_take(lc_ctx_t *ctx, lc_rx_t *rx, int i, size_t len)
+{
+	void *buf = rx->buf[i];
+
+	if (len <= rx->bufsz) {
+		rx->buf[i] = NULL;
+		return buf;
+	}
+	if (!(buf = lc_ctx_buf(ctx, len))) return NULL;
+	memcpy(buf, rx->buf[i], rx->bufsz);
+	memcpy((char *)buf + rx->bufsz, rx->spill + (size_t)i * LC_RX_SPILL, len - rx->bufsz);
+	return buf;
+}
+
+/* lc_msg_recv() from sock's UDP socket, with recvmsg() flags */
+static ssize_t lc_msg_recv_udp(lc_socket_t *sock, lc_message_t *msg, int flags)
+{
+	ssize_t zi = 0;
+	struct iovec iov[3];
+	struct mmsghdr mmsg = {0};
+	char buf[sizeof(lc_message_head_t)];
+	char cmsgbuf[BUFSIZE];
+	struct sockaddr_in6 from;
+	lc_rx_t tmp, *rx;
+	unsigned int n = 1;
+	void *data = NULL;
+
+#ifdef UDP_GRO
+	if (sock->gro) return lc_msg_recv_gro(sock, msg, flags);
+#endif
+
+	/* receive straight into a slot's pooled buffer, which goes with the
+	 * message. Anything that doesn't fit spills, see lc_rx_take() */
+	if (!(rx = lc_rx_get(sock, &tmp, &n))) return LC_ERROR_MALLOC;
+	lc_rx_iov(rx, 0, iov, buf);
+	mmsg.msg_hdr.msg_control = cmsgbuf;
+	mmsg.msg_hdr.msg_controllen = BUFSIZE;
+	mmsg.msg_hdr.msg_name = &from;
+	mmsg.msg_hdr.msg_namelen = sizeof(from);
+	mmsg.msg_hdr.msg_iov = iov;
+	mmsg.msg_hdr.msg_iovlen = 3;
+
+	if ((zi = lc_rx_recv(rx, sock->sock, &mmsg, 1, flags)) == 1) {
+		zi = mmsg.msg_len;
+		if (zi > (ssize_t)sizeof(lc_message_head_t)
+		&& !(data = lc_rx_take(sock->ctx, rx, 0, zi - sizeof(lc_message_head_t))))
+			zi = LC_ERROR_MALLOC;
+	}
+	lc_rx_put(rx);
+	if (zi <= 0) return zi;
+	lc_msg_recv_fill(msg, buf, data, NULL, zi, &mmsg.msg_hdr);
+	return zi;
+}
+
+#ifdef LC_XDP
+/* next message for a channel bound to sock from its AF_XDP socket. Data
+ * stays in the UMEM frame, which goes back to the kernel when msg is freed.
+ * The AF_XDP socket only has queue 0, and the XDP program passes traffic on
+ * other queues to the stack, so the UDP socket is read too: whenever the
+ * ring is empty, and every LC_XDP_UDP messages so a busy ring can't starve
+ * it. 0 if block is not set and there is nothing waiting */
+static ssize_t lc_msg_recv_xdp(lc_socket_t *sock, lc_message_t *msg, int block)
+{
+	const size_t hdrsz = sizeof(lc_message_head_t);
+	struct pollfd pfd[2] = {
+		{ .fd = sock->xdp->fd, .events = POLLIN },
+		{ .fd = sock->sock, .events = POLLIN },
+	};
+	lc_xdp_pkt_t pkt;
+	lc_channel_t *chan;
+	ssize_t zi;
+	int rc;
+
+	for (;;) {
+		pthread_testcancel();
+		if (++sock->xdpudp > LC_XDP_UDP) {
+			sock->xdpudp = 0;
+			zi = lc_msg_recv_udp(sock, msg, MSG_DONTWAIT);
+			if (zi > 0 || (zi < 0 && errno != EAGAIN)) return zi;
+		}
+		if ((rc = lc_xdp_recv(sock->xdp, &pkt, 0)) == -1) return -1;
+		if (rc) {
+			chan = lc_channel_by_address(sock->ctx, &pkt.dst);
+			if (chan && chan->sock == sock && pkt.dport == chan->sa.sin6_port
+			&& pkt.len >= hdrsz)
+				break;
+			lc_xdp_free(pkt.data, sock->xdp);
+			continue;
+		}
+		sock->xdpudp = 0;
+		zi = lc_msg_recv_udp(sock, msg, MSG_DONTWAIT);
+		if (zi > 0 || (zi < 0 && errno != EAGAIN)) return zi;
+		if (!block) return 0;
+		if (poll(pfd, 2, -1) == -1 && errno != EINTR) return -1;
+	}
+	lc_msg_init_data(msg, pkt.data + hdrsz, 0, &lc_xdp_free, sock->xdp);
+	lc_msg_head_decode(msg, pkt.data);
+	if (msg->len > pkt.len - hdrsz) msg->len = pkt.len - hdrsz;
+	msg->dst = pkt.dst;
+	msg->src = pkt.src;
+	return pkt.len;
+}
+#endif
+
+/* lc_msg_recv() with recvmsg() flags. MSG_DONTWAIT returns -1 with errno
+ * EAGAIN if there is nothing waiting, whichever path receives for sock */
+static ssize_t lc_msg_recv_flags(lc_socket_t *sock, lc_message_t *msg, int flags)
+{
+	/* the ring socket's filter drops all it would receive, so this would
+	 * wait forever */
+	if (sock->ring) return LC_ERROR_INVALID_PARAMS;
+#ifdef LC_XDP
+	if (sock->xdp) {
+		ssize_t zi;
+		if ((zi = lc_msg_recv_xdp(sock, msg, !(flags & MSG_DONTWAIT))) == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+		return zi;
+	}
+#endif
+	return lc_msg_recv_udp(sock, msg, flags);
+}
+
+static void *lc_frag_buf(void *ctx, size_t len)
+{
+	return lc_ctx_buf(ctx, len);
+}
+
+/* add fragment msg to sock's reassembly. Returns 1 with the message it
+ * completes in whole, 0 if it doesn't complete one */
+static int lc_socket_reassemble(lc_socket_t *sock, lc_message_t *msg, lc_message_t *whole)
+{
+	if (!sock->reasm) {
+		sock->reasm = lc_frag_new(sock->fragmem, LC_FRAG_TIMEOUT, &lc_frag_buf, sock->ctx);
+		if (!sock->reasm) return 0;
+	}
+	return lc_frag_add(sock->reasm, msg, whole, lc_clock_ns(CLOCK_MONOTONIC));
+}
+
+/* group the FEC datagram msg belongs to: that of the channel it carries
+ * repairs for if it came in on a sideband */
+static const struct in6_addr *lc_fec_group(lc_socket_t *sock, lc_message_t *msg)
+{
+	lc_channel_t *chan = lc_channel_by_address(sock->ctx, &msg->dst);
+
+	if (chan && chan->fecsrc) return &chan->fecsrc->sa.sin6_addr;
+	return &msg->dst;
+}
+
+/* add FEC datagram msg to sock's decoding. Returns the number of datagrams
+ * it gives back, to be taken with lc_socket_fec_next() */
+static int lc_socket_fec(lc_socket_t *sock, lc_message_t *msg)
+{
+	if (!sock->fecdec) {
+		sock->fecdec = lc_fec_dec_new(LC_FEC_MEM, LC_FEC_TIMEOUT, &lc_frag_buf, sock->ctx);
+		if (!sock->fecdec) return 0;
+	}
+	return lc_fec_dec_add(sock->fecdec, msg, lc_fec_group(sock, msg),
+			lc_clock_ns(CLOCK_MONOTONIC));
+}
+
+/* next datagram given back by sock's FEC decoding, as a message. Returns its
+ * size, 0 if there are none left */
+static ssize_t lc_socket_fec_next(lc_socket_t *sock, lc_message_t *msg)
+{
+	const size_t hdrsz = sizeof(lc_message_head_t);
+	lc_fec_dec_t *dec = sock->fecdec;
+	uint8_t *sym;
+	size_t len;
+
+	if (!dec || dec->iout == dec->nout) return 0;
+	sym = dec->out[dec->iout++];
+	len = (size_t)sym[0] << 8 | sym[1];
+	lc_msg_init_data(msg, sym + 2 + hdrsz, 0, &lc_buf_unref, sym);
+	lc_msg_head_decode(msg, sym + 2);
+	if (msg->len > len - hdrsz) msg->len = len - hdrsz;
+	msg->src = dec->src;
+	msg->dst = dec->dst;
+	msg->rxtime = dec->rxtime;
+	msg->sockid = sock->id;
+	msg->bytes = len;
+	return len;
+}
+
+ssize_t lc_msg_recv(lc_socket_t *sock, lc_message_t *msg)
+{
+	lc_message_t whole;
+	ssize_t zi;
+
+	for (;;) {
+		/* datagrams from FEC decoding first, then the socket */
+		if (!(zi = lc_socket_fec_next(sock, msg))
+		&& (zi = lc_msg_recv_flags(sock, msg, 0)) <= 0)
+			break;
+		if (msg->op & LC_OP_FEC) {
+			lc_socket_fec(sock, msg);
+			lc_msg_free(msg);
+			continue;
+		}
+		/* fragments are held until their message is complete */
+		if (!(msg->op & LC_OP_FRAG)) break;
+		msg->bytes = zi;
+		if (lc_socket_reassemble(sock, msg, &whole)) {
+			lc_msg_free(msg);
+			*msg = whole;
+			return whole.bytes;
+		}
+		lc_msg_free(msg);
+	}
+	return zi;
+}
+
+ssize_t lc_msg_recv_batch(lc_socket_t *sock, lc_message_t *msgs, size_t max, int flags)
+{
+	char head[LC_RECVMMSG_MAX][sizeof(lc_message_head_t)];
+	char cmsgbuf[LC_RECVMMSG_MAX][LC_CMSGSZ];
+	struct sockaddr_in6 from[LC_RECVMMSG_MAX];
+	struct mmsghdr mmsg[LC_RECVMMSG_MAX];
+	struct iovec iov[LC_RECVMMSG_MAX][3];
+	lc_rx_t tmp, *rx;
+	unsigned int vlen;
+	void *data;
+	int i, n, got;
+
+	if (!max) return 0;
+	if (sock->ring) return LC_ERROR_INVALID_PARAMS;
+#ifdef LC_XDP
+	if (sock->xdp) {
+		/* first call may block, then take whatever else is waiting */
+		const int block = !(flags & MSG_DONTWAIT);
+		ssize_t zi;
+		for (vlen = 0; vlen < max; vlen++) {
+			if ((zi = lc_msg_recv_xdp(sock, &msgs[vlen], block && !vlen)) <= 0) {
+				if (vlen) break;
+				if (!zi && !block) {
+					errno = EAGAIN;
+					return -1;
+				}
+				return zi;
+			}
+			msgs[vlen].bytes = zi;
+		}
+		return vlen;
+	}
+#endif
+#ifdef UDP_GRO
+	if (sock->gro) {
+		/* first call may block, then hand out what's already buffered */
+		ssize_t zi;
+		for (vlen = 0; vlen < max; vlen++) {
+			if (vlen && !sock->gro->len) break;
+			if ((zi = lc_msg_recv_gro(sock, &msgs[vlen], flags)) <= 0) {
+				if (!vlen) return zi;
+				break;
+			}
+			msgs[vlen].bytes = zi;
+		}
+		return vlen;
+	}
+#endif
+	/* slots as lc_msg_recv_flags() has them, each spilling into a region
+	 * of its own, as recvmmsg() fills them one after another */
+	vlen = (max < LC_RECVMMSG_MAX) ? max : LC_RECVMMSG_MAX;
+	if (!(rx = lc_rx_get(sock, &tmp, &vlen))) return LC_ERROR_MALLOC;
+	for (i = 0; i < (int)vlen; i++) {
+		lc_rx_iov(rx, i, iov[i], head[i]);
+		memset(&mmsg[i], 0, sizeof(struct mmsghdr));
+		mmsg[i].msg_hdr.msg_control = cmsgbuf[i];
+		mmsg[i].msg_hdr.msg_controllen = LC_CMSGSZ;
+		mmsg[i].msg_hdr.msg_name = &from[i];
+		mmsg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+		mmsg[i].msg_hdr.msg_iov = iov[i];
+		mmsg[i].msg_hdr.msg_iovlen = 3;
+	}
+
+	n = lc_rx_recv(rx, sock->sock, mmsg, vlen, flags);
+	for (i = 0, got = 0; i < n; i++) {
+		data = NULL;
+		if (mmsg[i].msg_len > sizeof(lc_message_head_t)
+		&& !(data = lc_rx_take(sock->ctx, rx, i, mmsg[i].msg_len - sizeof(lc_message_head_t))))
+			continue; /* nowhere to keep it */
+		lc_msg_recv_fill(&msgs[got], head[i], data, NULL, mmsg[i].msg_len, &mmsg[i].msg_hdr);
+		msgs[got++].bytes = mmsg[i].msg_len;
+	}
+	lc_rx_put(rx);
+	if (n > 0 && !got) return LC_ERROR_MALLOC;
+
+	return (n > 0) ? got : n;
+}
+
+int lc_socket_listen_cancel(lc_socket_t *sock)
+{
+	if (sock->thread) {
+		if (pthread_cancel(sock->thread))
+			return LC_ERROR_THREAD_CANCEL;
+		if (pthread_join(sock->thread, NULL))
+			return LC_ERROR_THREAD_JOIN;
+		sock->thread = 0;
+	}
+	/* nothing more is coming, so the workers can go */
+	if (sock->dispatch && sock->dispatch->running) {
+		lc_dispatch_stop(sock->dispatch);
+		free(sock->dispatch->arg);
+		sock->dispatch->arg = NULL;
+	}
+	return 0;
+}
+
+static void lc_op_pong_handler(lc_socket_call_t *sc, lc_message_t *msg)
+{
+	if (sc->callback_msg) sc->callback_msg(msg);
+}
+
+static void lc_op_ping_handler(lc_socket_call_t *sc, lc_message_t *msg)
+{
+	(void) sc; /* unused */
+	int opt = LC_OP_PONG;
+	lc_message_t pong;
+
+	/* received PING, echo PONG back to same channel. The data is still the
+	 * listener's, so it's sent by copying, never handed to zero-copy */
+	lc_msg_set(msg, LC_ATTR_OPCODE, &opt);
+	pong = *msg;
+	pong.free = NULL;
+	lc_msg_send(msg->chan, &pong);
+}
+
+static void lc_op_data_handler(lc_socket_call_t *sc, lc_message_t *msg)
+{
+	/* callback to message handler */
+	if (sc->callback_msg) sc->callback_msg(msg);
+}
+
+lc_channel_t *lc_channel_by_address(lc_ctx_t *lctx, struct in6_addr *addr)
+{
+	if (!lctx->chantab) return NULL;
+	return lc_chantab_slot(lctx, addr)->chan;
+}
+
+#ifndef __linux__
+static ssize_t lc_socket_recvmsg_if(lc_socket_t *sock, struct msghdr *msg, int flags)
+{
+	struct in6_pktinfo pi = {0};
+	char ctl[CMSG_SPACE(sizeof pi)];
+	struct cmsghdr *cmsg;
+	ssize_t bytes;
+
+	/* We're only interested in packets arriving on the socket->ifx
+	 * interface. If we bind to an interface-specific address, we will get no
+	 * multicast packets. If bound to either INADDR_ANY or the multicast
+	 * group address, we receive packets on all interfaces. Linux drops the
+	 * others with a socket filter, elsewhere we extract the receiving
+	 * interface from ancillary data (IPV6_RECVPKTINFO is set on creation) */
+
+	/* provide control buffer if caller hasn't */
+	if (!msg->msg_control) {
+		msg->msg_control = ctl;
+		msg->msg_controllen = sizeof ctl;
+	}
+	for (;;) {
+		if ((bytes = recvmsg(sock->sock, msg, flags)) == -1) return -1;
+		for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+			if (cmsg->cmsg_type == IPV6_PKTINFO) {
+				memcpy(&pi, CMSG_DATA(cmsg), sizeof pi);
+				if (sock->ifx == pi.ipi6_ifindex) return bytes;
+			}
+		}
+	}
+	/* not reached */
+}
+#endif
+
+ssize_t lc_socket_recvmsg(lc_socket_t *sock, struct msghdr *msg, int flags)
+{
+#ifndef __linux__
+	if (sock->ifx) return lc_socket_recvmsg_if(sock, msg, flags);
+#endif
+	return recvmsg(sock->sock, msg, flags);
+}
+
+ssize_t lc_socket_recv(lc_socket_t *sock, void *buf, size_t len, int flags)
+{
+#ifndef __linux__
+	if (sock->ifx) {
+		struct iovec iov = { .iov_base = buf, .iov_len = len };
+		struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+		return lc_socket_recvmsg_if(sock, &msg, flags);
+	}
+#endif
+	return recv(sock->sock, buf, len, flags);
+}
+
+/* opcode handler, then the message callback */
+static void lc_msg_callback(lc_socket_call_t *sc, lc_message_t *msg)
+{
+	if (msg->op < LC_OP_MAX && lc_op_handler[msg->op])
+		lc_op_handler[msg->op](sc, msg);
+
+	if (sc->callback_msg) sc->callback_msg(msg);
+}
+
+/* the opcode handler has already run on the listener */
+static void lc_socket_dispatch_msg(void *arg, lc_message_t *msg)
+{
+	lc_socket_call_t *sc = arg;
+
+	if (sc->callback_msg) sc->callback_msg(msg);
+}
+
+/* queue a copy of msg for sock's dispatch workers. The queued message takes
+ * its own reference to msg's data, or a copy where it can't (ring, UMEM), so
+ * the listener frees msg as usual. Messages for the same channel always go
+ * to the same worker, which keeps them in order */
+static void lc_socket_dispatch_push(lc_socket_t *sock, lc_message_t *msg)
+{
+	lc_message_t q = *msg;
+	uint32_t key;
+
+	if (!msg->data || !msg->len) {
+		q.data = NULL;
+		q.free = NULL;
+	}
+	else if (lc_msg_ref(&q) == -1) {
+		if (!(q.data = lc_ctx_buf(sock->ctx, msg->len))) {
+			sock->dispatch->drops++;
+			return;
+		}
+		memcpy(q.data, msg->data, msg->len);
+		q.free = &lc_buf_unref;
+		q.hint = NULL;
+	}
+	/* channel addresses are hashes, so any word of the group will do */
+	memcpy(&key, &msg->dst.s6_addr[12], sizeof key);
+	if (lc_dispatch_push(sock->dispatch, key, &q) == -1) lc_msg_free(&q);
+}
+
+static void process_msg(lc_socket_call_t *sc, lc_message_t *msg)
+{
+	lc_message_t whole;
+	lc_channel_t *chan;
+
+	msg->sockid = sc->sock->id;
+
+	/* FEC datagrams give back the ones they carry, sources at once,
+	 * anything lost as soon as the repairs make up for it */
+	if (msg->op & LC_OP_FEC) {
+		lc_message_t out;
+		lc_socket_fec(sc->sock, msg);
+		while (lc_socket_fec_next(sc->sock, &out) > 0) {
+			process_msg(sc, &out);
+			lc_msg_free(&out);
+		}
+		return;
+	}
+
+	/* fragments go no further than reassembly, until the last one */
+	if (msg->op & LC_OP_FRAG) {
+		if (!lc_socket_reassemble(sc->sock, msg, &whole)) return;
+		process_msg(sc, &whole);
+		lc_msg_free(&whole);
+		return;
+	}
+
+	/* update channel stats */
+	chan = lc_channel_by_address(sc->sock->ctx, &msg->dst);
+	if (chan) {
+		msg->chan = chan;
+		chan->seq = (msg->seq > chan->seq) ? msg->seq + 1 : chan->seq + 1;
+		chan->rnd = msg->rnd;
+		if (lc_msg_logger) lc_msg_logger(chan, msg, NULL);
+	}
+
+	/* a dispatch worker takes it from here, so a slow callback doesn't
+	 * hold up receive. Opcode handlers stay on the listener, as a PING
+	 * sends on the channel whose seq and pacing the listener updates;
+	 * they get no callbacks, which are the worker's to call */
+	if (sc->sock->dispatch && sc->sock->dispatch->running) {
+		lc_socket_call_t op = { .sock = sc->sock };
+
+		if (msg->op < LC_OP_MAX && lc_op_handler[msg->op])
+			lc_op_handler[msg->op](&op, msg);
+		lc_socket_dispatch_push(sc->sock, msg);
+		return;
+	}
+	lc_msg_callback(sc, msg);
+}
+
+void *lc_socket_listen_thread(void *arg)
+{
+	ssize_t len;
+	lc_message_t msg = {0};
+	lc_socket_call_t *sc = arg;
+
+	pthread_cleanup_push(free, arg);
+	pthread_cleanup_push(lc_msg_free, &msg);
+	while(1) {
+		len = lc_msg_recv(sc->sock, &msg);
+		if (len > 0) {
+			msg.bytes = len;
+			process_msg(sc, &msg);
+		}
+		if (len < 0) {
+			lc_msg_free(&msg);
+			if (sc->callback_err) sc->callback_err(len);
+		}
+		lc_msg_free(&msg);
+	}
+	/* not reached */
+	pthread_cleanup_pop(0);
+	pthread_cleanup_pop(0);
+
+	return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+# define lc_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+# define lc_cpu_relax() __asm__ __volatile__("yield")
+#else
+# define lc_cpu_relax() do {} while (0)
+#endif
+#define LC_SPIN 16 /* pauses between polls */
+
+static uint64_t lc_clock_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* lc_socket_listen_thread() for a busy polling socket. Polls without
+ * blocking, LC_SPIN pauses apart, and only blocks once it has been idle for
+ * sock->busypoll usec. The first message after that puts it back to
+ * spinning. No backoff: a poll that comes late is the tail latency we spin
+ * to avoid. Each empty poll yields, so whoever shares our core - likely the
+ * thread we're waiting to hear from - isn't kept off it for a timeslice */
+static void lc_socket_spin_loop(lc_socket_call_t *sc, lc_message_t *msg)
+{
+	uint64_t last = lc_clock_us();
+	int flags = MSG_DONTWAIT;
+	ssize_t len;
+
+	for (;;) {
+		len = lc_msg_recv_flags(sc->sock, msg, flags);
+		if (len > 0) {
+			msg->bytes = len;
+			process_msg(sc, msg);
+			last = lc_clock_us();
+			flags = MSG_DONTWAIT;
+		}
+		else if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			pthread_testcancel();
+			if (lc_clock_us() - last >= sc->sock->busypoll) flags = 0;
+			else {
+				for (int i = 0; i < LC_SPIN; i++) lc_cpu_relax();
+				sched_yield();
+			}
+			continue;
+		}
+		else if (len < 0) {
+			lc_msg_free(msg);
+			if (sc->callback_err) sc->callback_err(len);
+		}
+		lc_msg_free(msg);
+	}
+}
+
+static void *lc_socket_listen_spin_thread(void *arg)
+{
+	lc_message_t msg = {0};
+
+	pthread_cleanup_push(free, arg);
+	pthread_cleanup_push(lc_msg_free, &msg);
+	lc_socket_spin_loop(arg, &msg);
+	/* not reached */
+	pthread_cleanup_pop(0);
+	pthread_cleanup_pop(0);
+
+	return NULL;
+}
+
+static void lc_msg_free_batch(void *arg)
+{
+	lc_message_t *msgs = arg;
+	for (int i = 0; i < LC_RECVMMSG_MAX; i++) lc_msg_free(&msgs[i]);
+}
+
+/* hand the n messages in out to the batch callback, and free them */
+static void lc_socket_batch_flush(lc_socket_call_t *sc, lc_message_t *out, size_t *n)
+{
+	sc->callback_batch(out, *n);
+	for (size_t i = 0; i < *n; i++) {
+		lc_msg_free(&out[i]);
+		lc_msg_init(&out[i]);
+	}
+	*n = 0;
+}
+
+/* per-message housekeeping and opcode handlers for msg, then move it to the
+ * batch in out, which goes to the callback as soon as it is full. FEC
+ * datagrams and fragments go no further than decoding and reassembly, and
+ * what those give back is added in their place, so the callback only ever
+ * sees whole messages. msg is left empty */
+static void lc_socket_batch_add(lc_socket_call_t *sc, lc_message_t *out, size_t *n,
+		lc_message_t *msg)
+{
+	lc_message_t m;
+
+	msg->sockid = sc->sock->id;
+	if (msg->op & LC_OP_FEC) {
+		lc_socket_fec(sc->sock, msg);
+		lc_msg_free(msg);
+		lc_msg_init(msg);
+		while (lc_socket_fec_next(sc->sock, &m) > 0) lc_socket_batch_add(sc, out, n, &m);
+		return;
+	}
+	if (msg->op & LC_OP_FRAG) {
+		int whole = lc_socket_reassemble(sc->sock, msg, &m);
+		lc_msg_free(msg);
+		lc_msg_init(msg);
+		if (whole) lc_socket_batch_add(sc, out, n, &m);
+		return;
+	}
+	process_msg(sc, msg);
+	out[(*n)++] = *msg;
+	lc_msg_init(msg);
+	if (*n == LC_RECVMMSG_MAX) lc_socket_batch_flush(sc, out, n);
+}
+
+static void *lc_socket_listen_batch_thread(void *arg)
+{
+	ssize_t n;
+	lc_message_t msgs[LC_RECVMMSG_MAX] = {0};
+	lc_message_t out[LC_RECVMMSG_MAX] = {0};
+	size_t nout = 0;
+	lc_socket_call_t *sc = arg;
+
+	pthread_cleanup_push(free, arg);
+	pthread_cleanup_push(lc_msg_free_batch, msgs);
+	pthread_cleanup_push(lc_msg_free_batch, out);
+	while(1) {
+		n = lc_msg_recv_batch(sc->sock, msgs, LC_RECVMMSG_MAX, MSG_WAITFORONE);
+		if (n > 0) {
+			for (ssize_t i = 0; i < n; i++) lc_socket_batch_add(sc, out, &nout, &msgs[i]);
+			if (nout) lc_socket_batch_flush(sc, out, &nout);
+		}
+		else if (n < 0 && sc->callback_err) sc->callback_err(n);
+	}
+	/* not reached */
+	pthread_cleanup_pop(0);
+	pthread_cleanup_pop(0);
+	pthread_cleanup_pop(0);
+
+	return NULL;
+}
+
+#ifdef __linux__
+/* parse the IPv6/UDP/librecast headers of a packet of caplen bytes at ip,
+ * captured by sock's ring. msg data points into the ring. -1 if it isn't for
+ * a channel bound to sock */
+static int lc_ring_msg(lc_socket_t *sock, char *ip, size_t caplen, lc_message_t *msg)
+{
+	const size_t hdrsz = sizeof(lc_message_head_t);
+	const size_t off = sizeof(struct ip6_hdr) + sizeof(struct udphdr);
+	struct ip6_hdr ip6;
+	struct udphdr udp;
+	lc_channel_t *chan;
+	size_t zi;
+
+	if (caplen < off + hdrsz) return -1;
+	memcpy(&ip6, ip, sizeof ip6);
+	memcpy(&udp, ip + sizeof ip6, sizeof udp);
+	if (ip6.ip6_nxt != IPPROTO_UDP) return -1;
+	chan = lc_channel_by_address(sock->ctx, &ip6.ip6_dst);
+	if (!chan || chan->sock != sock || udp.uh_dport != chan->sa.sin6_port) return -1;
+	zi = ntohs(udp.uh_ulen);
+	if (zi < sizeof udp + hdrsz) return -1;
+	zi -= sizeof udp;
+	if (zi > caplen - off) zi = caplen - off;
+	lc_msg_init_data(msg, ip + off + hdrsz, 0, NULL, NULL);
+	lc_msg_head_decode(msg, ip + off);
+	if (msg->len > zi - hdrsz) msg->len = zi - hdrsz;
+	msg->dst = ip6.ip6_dst;
+	msg->src = ip6.ip6_src;
+	msg->bytes = zi;
+	return 0;
+}
+
+/* hand every message in a retired ring block to the callbacks */
+static void lc_ring_block(lc_socket_call_t *sc, struct tpacket_block_desc *bd)
+{
+	const size_t slloff = TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+	struct tpacket3_hdr *pkt;
+	struct sockaddr_ll *sll;
+	lc_message_t msg;
+	uint32_t n = bd->hdr.bh1.num_pkts;
+
+	pkt = (struct tpacket3_hdr *)((char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+	for (uint32_t i = 0; i < n; i++) {
+		sll = (struct sockaddr_ll *)((char *)pkt + slloff);
+		if (sll->sll_pkttype != PACKET_OUTGOING
+		&& !lc_ring_msg(sc->sock, (char *)pkt + pkt->tp_net,
+				pkt->tp_snaplen - (pkt->tp_net - pkt->tp_mac), &msg)) {
+			/* stamped by the kernel as it went into the ring */
+			msg.rxtime = (uint64_t)pkt->tp_sec * 1000000000 + pkt->tp_nsec;
+			process_msg(sc, &msg);
+		}
+		pkt = (struct tpacket3_hdr *)((char *)pkt + pkt->tp_next_offset);
+	}
+}
+
+static void lc_ring_release(void *arg)
+{
+	struct tpacket_block_desc *bd = arg;
+	__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+}
+
+/* messages point straight into the ring, and each block goes back to the
+ * kernel once its callbacks have returned. The only syscall is poll() when
+ * we've caught up */
+static void *lc_socket_listen_ring_thread(void *arg)
+{
+	lc_socket_call_t *sc = arg;
+	lc_ring_t *ring = sc->sock->ring;
+	struct pollfd pfd = { .fd = ring->fd, .events = POLLIN | POLLERR };
+	struct tpacket_block_desc *bd;
+
+	pthread_cleanup_push(free, arg);
+	for (;;) {
+		bd = (struct tpacket_block_desc *)(ring->map + ring->cur * ring->blocksz);
+		if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		pthread_cleanup_push(lc_ring_release, bd);
+		lc_ring_block(sc, bd);
+		pthread_cleanup_pop(1);
+		ring->cur = (ring->cur + 1) % ring->blocks;
+	}
+	/* not reached */
+	pthread_cleanup_pop(0);
+
+	return NULL;
+}
+#endif
+
+#ifdef LC_URING
+#define LC_URING_BGID 0 /* provided buffer group */
+#define LC_URING_RECV 1 /* user_data of multishot recvmsg */
+#define LC_URING_CANCEL 2 /* user_data of its cancellation */
+#define LC_URING_ERRMAX 10 /* errors in a row before falling back to recvmsg() */
+
+/* io_uring listener. Each provided buffer is a largest-class refcounted
+ * buffer, which the kernel fills with a struct io_uring_recvmsg_out, name,
+ * control data and then the datagram. The message payload points straight
+ * into it, so nothing is copied */
+typedef struct lc_uring_listen_s {
+	lc_uring_t ring;
+	lc_socket_call_t *sc;
+	struct msghdr msgh; /* space for name and control data in each buffer */
+	size_t off; /* offset of datagram in buffer */
+	void *buf[LC_URING_BUFS]; /* buffers by bid, NULL = not in ring */
+	int missing; /* buffers we failed to replace */
+	int armed; /* multishot recvmsg is active */
+} lc_uring_listen_t;
+
+static void lc_uring_listen_free(void *arg)
+{
+	lc_uring_listen_t *ul = arg;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+
+	/* the kernel must be done with our buffers before they go back */
+	if (ul->armed && (sqe = lc_uring_sqe(&ul->ring))) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = LC_URING_RECV;
+		sqe->user_data = LC_URING_CANCEL;
+		while (ul->armed && lc_uring_enter(&ul->ring, 1) != -1) {
+			for (; (cqe = lc_uring_cqe(&ul->ring)); lc_uring_cqe_seen(&ul->ring)) {
+				if ((cqe->user_data == LC_URING_RECV && !(cqe->flags & IORING_CQE_F_MORE))
+				|| (cqe->user_data == LC_URING_CANCEL && cqe->res < 0))
+					ul->armed = 0;
+			}
+		}
+	}
+	lc_uring_free(&ul->ring);
+	for (int i = 0; i < LC_URING_BUFS; i++) lc_buf_unref(ul->buf[i], NULL);
+	free(ul);
+}
+
+static int lc_uring_listen_add(lc_uring_listen_t *ul, uint16_t bid)
+{
+	const int big = LC_POOL_CLASSES - 1;
+	lc_ctx_t *ctx = ul->sc->sock->ctx;
+
+	if (!(ul->buf[bid] = lc_buf_get(ctx->pool[big]))) return -1;
+	lc_uring_buf_add(&ul->ring, ul->buf[bid], lc_pool_bufsz[big], bid);
+	return 0;
+}
+
+static lc_uring_listen_t *lc_uring_listen_new(lc_socket_call_t *sc)
+{
+	lc_uring_listen_t *ul;
+
+	if (!(ul = calloc(1, sizeof(lc_uring_listen_t)))) return NULL;
+	ul->sc = sc;
+	ul->msgh.msg_namelen = CMSG_ALIGN(sizeof(struct sockaddr_in6));
+	ul->msgh.msg_controllen = LC_URING_CMSGSZ;
+	ul->off = sizeof(struct io_uring_recvmsg_out) + ul->msgh.msg_namelen + ul->msgh.msg_controllen;
+	assert(ul->off + sizeof(lc_message_head_t) <= LC_RECV_HEADROOM);
+	if (lc_uring_init(&ul->ring, LC_URING_BUFS) == -1) goto err_0;
+	if (lc_uring_buf_ring(&ul->ring, LC_URING_BUFS, LC_URING_BGID) == -1) goto err_0;
+	for (uint16_t bid = 0; bid < LC_URING_BUFS; bid++) {
+		if (lc_uring_listen_add(ul, bid) == -1) goto err_0;
+	}
+	lc_uring_buf_commit(&ul->ring);
+	return ul;
+err_0:
+	lc_uring_listen_free(ul);
+	return NULL;
+}
+
+static int lc_uring_listen_arm(lc_uring_listen_t *ul)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = lc_uring_sqe(&ul->ring))) return -1;
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = ul->sc->sock->sock;
+	sqe->addr = (uintptr_t)&ul->msgh;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = LC_URING_BGID;
+	sqe->user_data = LC_URING_RECV;
+	ul->armed = 1;
+	return 0;
+}
+
+/* hand the datagram of res bytes in buffer bid to the callbacks, then put a
+ * buffer back in the ring in its place */
+static void lc_uring_listen_msg(lc_uring_listen_t *ul, uint16_t bid, int res)
+{
+	struct io_uring_recvmsg_out *out;
+	struct msghdr msgh = {0};
+	lc_message_t msg;
+	char *buf, *head;
+	size_t zi;
+
+	if (bid >= LC_URING_BUFS || !(buf = ul->buf[bid])) return;
+	out = (struct io_uring_recvmsg_out *)buf;
+	head = buf + ul->off;
+	zi = ((size_t)res > ul->off) ? (size_t)res - ul->off : 0;
+	if (out->payloadlen < zi) zi = out->payloadlen;
+	if (zi >= sizeof(lc_message_head_t)) {
+		msgh.msg_name = out + 1;
+		msgh.msg_namelen = out->namelen;
+		msgh.msg_control = (char *)(out + 1) + ul->msgh.msg_namelen;
+		msgh.msg_controllen = out->controllen;
+		lc_msg_recv_fill(&msg, head, head + sizeof(lc_message_head_t), buf, zi, &msgh);
+		msg.bytes = zi;
+		ul->sc->sock->uring_msgs++;
+		process_msg(ul->sc, &msg);
+		/* nobody else kept hold of it - straight back into the ring */
+		if (msg.data && msg.hint == buf && lc_buf_refs(buf) == 1) {
+			lc_uring_buf_add(&ul->ring, buf, lc_pool_bufsz[LC_POOL_CLASSES - 1], bid);
+			return;
+		}
+		lc_msg_free(&msg);
+		ul->buf[bid] = NULL;
+	}
+	else {
+		/* too short to be ours */
+		lc_uring_buf_add(&ul->ring, buf, lc_pool_bufsz[LC_POOL_CLASSES - 1], bid);
+		return;
+	}
+	if (lc_uring_listen_add(ul, bid) == -1) {
+		ul->missing++;
+		if (ul->sc->callback_err) ul->sc->callback_err(LC_ERROR_MALLOC);
+	}
+}
+
+/* listener error: report it, and back off for longer each time it happens
+ * again without a message in between. Returns nonzero once it has happened
+ * too often in a row to carry on */
+static int lc_uring_listen_err(lc_uring_listen_t *ul, int *errs)
+{
+	if (ul->sc->callback_err) ul->sc->callback_err(-1);
+	if (++*errs >= LC_URING_ERRMAX) return -1;
+	nanosleep(&(struct timespec){ .tv_nsec = *errs * 1000000L }, NULL);
+	return 0;
+}
+
+/* returns when multishot recvmsg isn't supported, or the ring keeps
+ * failing, so the caller can fall back to recvmsg(). Otherwise runs until
+ * cancelled. io_uring_enter() through syscall() isn't a cancellation point,
+ * so it only submits here, and we wait in poll() on the ring, which is */
+static void lc_uring_listen_loop(lc_uring_listen_t *ul)
+{
+	struct pollfd pfd = { .fd = ul->ring.fd, .events = POLLIN };
+	struct io_uring_cqe *cqe;
+	int rc, msgs = 0, errs = 0;
+
+	for (;;) {
+		if (!ul->armed) lc_uring_listen_arm(ul);
+		for (int bid = 0; ul->missing && bid < LC_URING_BUFS; bid++) {
+			if (!ul->buf[bid] && !lc_uring_listen_add(ul, bid)) ul->missing--;
+		}
+		lc_uring_buf_commit(&ul->ring);
+
+		if ((rc = lc_uring_enter(&ul->ring, 0)) == -1 && errno != EBUSY) {
+			if (lc_uring_listen_err(ul, &errs)) return;
+			continue;
+		}
+		if (lc_uring_cqe(&ul->ring)) rc = 0;
+		else {
+			ul->ring.enters++; /* it's the wait's syscall */
+			rc = poll(&pfd, 1, -1);
+		}
+		ul->sc->sock->uring_enters = ul->ring.enters;
+		if (rc == -1 && errno != EINTR) {
+			if (lc_uring_listen_err(ul, &errs)) return;
+			continue;
+		}
+
+		for (; (cqe = lc_uring_cqe(&ul->ring)); lc_uring_cqe_seen(&ul->ring)) {
+			if (cqe->user_data != LC_URING_RECV) continue;
+			if (!(cqe->flags & IORING_CQE_F_MORE)) ul->armed = 0;
+			if (cqe->res < 0) {
+				/* EINVAL before anything arrives => the kernel
+				 * doesn't do multishot recvmsg */
+				if (cqe->res == -EINVAL && !msgs) return;
+				/* ENOBUFS => ring ran dry, rearm and carry on */
+				if (cqe->res != -ENOBUFS) {
+					errno = -cqe->res;
+					if (lc_uring_listen_err(ul, &errs)) return;
+				}
+				continue;
+			}
+			msgs++;
+			errs = 0;
+			if (cqe->flags & IORING_CQE_F_BUFFER)
+				lc_uring_listen_msg(ul, cqe->flags >> IORING_CQE_BUFFER_SHIFT, cqe->res);
+		}
+	}
+}
+
+static void *lc_socket_listen_uring_thread(void *arg)
+{
+	lc_socket_call_t *sc = arg;
+	lc_uring_listen_t *ul;
+
+	/* fall back to recvmsg() if the kernel can't do what we need */
+	if (!(ul = lc_uring_listen_new(sc))) return lc_socket_listen_thread(arg);
+	pthread_cleanup_push(free, arg);
+	pthread_cleanup_push(lc_uring_listen_free, ul);
+	lc_uring_listen_loop(ul);
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(0);
+
+	return lc_socket_listen_thread(arg);
+}
+#endif
+
+static int lc_socket_listen_start(lc_socket_t *sock, lc_socket_call_t *call,
+		void *(*thread)(void *))
+{
+	pthread_attr_t attr = {0};
+	lc_socket_call_t *sc;
+
+	if (!sock) return LC_ERROR_SOCKET_REQUIRED;
+	if (sock->thread || sock->watch) return LC_ERROR_SOCKET_LISTENING;
+
+	sc = malloc(sizeof(lc_socket_call_t));
+	if (!sc) return LC_ERROR_MALLOC;
+	memcpy(sc, call, sizeof(lc_socket_call_t));
+	sc->sock = sock;
+
+	pthread_attr_init(&attr);
+	pthread_create(&sock->thread, &attr, thread, sc);
+	pthread_attr_destroy(&attr);
+
+	return 0;
+}
+
+/* workers get their own copy of the callbacks, as the listener frees its
+ * copy when cancelled, which is before the workers are stopped */
+static int lc_socket_dispatch_start(lc_socket_t *sock, lc_socket_call_t *call)
+{
+	lc_socket_call_t *sc;
+
+	if (sock->dispatch->running) return 0;
+	if (!(sc = malloc(sizeof(lc_socket_call_t)))) return LC_ERROR_MALLOC;
+	memcpy(sc, call, sizeof(lc_socket_call_t));
+	sc->sock = sock;
+	if (lc_dispatch_start(sock->dispatch, &lc_socket_dispatch_msg, sc) == -1) {
+		free(sc);
+		return -1;
+	}
+	return 0;
+}
+
+int lc_socket_listen(lc_socket_t *sock, void (*callback_msg)(lc_message_t*),
+					void (*callback_err)(int))
+{
+	lc_socket_call_t sc = {
+		.callback_msg = callback_msg,
+		.callback_err = callback_err,
+	};
+	int rc;
+
+	if (sock && sock->dispatch && !sock->thread && !sock->watch) {
+		if ((rc = lc_socket_dispatch_start(sock, &sc))) return rc;
+	}
+#ifdef __linux__
+	if (sock && sock->ring)
+		return lc_socket_listen_start(sock, &sc, &lc_socket_listen_ring_thread);
+#endif
+	if (sock && sock->busypoll)
+		return lc_socket_listen_start(sock, &sc, &lc_socket_listen_spin_thread);
+#ifdef LC_URING
+	if (sock && sock->ctx->engine == LC_ENGINE_URING && !sock->gro && !sock->xdp)
+		return lc_socket_listen_start(sock, &sc, &lc_socket_listen_uring_thread);
+#endif
+	return lc_socket_listen_start(sock, &sc, &lc_socket_listen_thread);
+}
+
+int lc_socket_listen_batch(lc_socket_t *sock, void (*callback_batch)(lc_message_t*, size_t),
+					void (*callback_err)(int))
+{
+	lc_socket_call_t sc = {
+		.callback_batch = callback_batch,
+		.callback_err = callback_err,
+	};
+	if (!callback_batch) return LC_ERROR_INVALID_PARAMS;
+	if (sock && sock->ring) return LC_ERROR_INVALID_PARAMS;
+	return lc_socket_listen_start(sock, &sc, &lc_socket_listen_batch_thread);
 }
 
-static ssize_t lc_socket_recv_if(lc_socket_t *sock, void *buf, size_t len, int flags)
+static uint64_t lc_clock_ms(void)
 {
-	struct iovec iov = { .iov_base = buf, .iov_len = len };
-	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
-	return lc_socket_recvmsg_if(sock, &msg, flags);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-ssize_t lc_socket_recvmsg(lc_socket_t *sock, struct msghdr *msg, int flags)
+lc_timer_t *lc_timer_add(lc_ctx_t *ctx, unsigned int delay, unsigned int interval,
+		void (*f)(void *), void *arg)
 {
-	if (sock->ifx) return lc_socket_recvmsg_if(sock, msg, flags);
-	return recvmsg(sock->sock, msg, flags);
+	if (!f) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return lc_wheel_add(&ctx->wheel, lc_clock_ms(), delay, interval, f, arg);
 }
 
-ssize_t lc_socket_recv(lc_socket_t *sock, void *buf, size_t len, int flags)
+void lc_timer_del(lc_ctx_t *ctx, lc_timer_t *timer)
 {
-	if (sock->ifx) return lc_socket_recv_if(sock, buf, len, flags);
-	return recv(sock->sock, buf, len, flags);
+	lc_wheel_del(&ctx->wheel, timer);
 }
 
-static void process_msg(lc_socket_call_t *sc, lc_message_t *msg)
+#ifdef __linux__
+/* create epoll instance for ctx, with an eventfd to wake it */
+static int lc_ctx_epoll(lc_ctx_t *ctx)
 {
-	lc_channel_t *chan;
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
 
-	inet_ntop(AF_INET6, &msg->dst, msg->dstaddr, INET6_ADDRSTRLEN);
-	inet_ntop(AF_INET6, &msg->src, msg->srcaddr, INET6_ADDRSTRLEN);
-	msg->sockid = sc->sock->id;
-
-	/* update channel stats */
-	chan = lc_channel_by_address(sc->sock->ctx, &msg->dst);
-	if (chan) {
-		msg->chan = chan;
-		chan->seq = (msg->seq > chan->seq) ? msg->seq + 1 : chan->seq + 1;
-		chan->rnd = msg->rnd;
-		if (lc_msg_logger) lc_msg_logger(chan, msg, NULL);
+	if (ctx->epfd >= 0) return 0;
+	if ((ctx->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) return -1;
+	if ((ctx->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1
+	|| epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, ctx->evfd, &ev) == -1)
+	{
+		int err = errno;
+		if (ctx->evfd >= 0) close(ctx->evfd);
+		close(ctx->epfd);
+		ctx->evfd = -1;
+		ctx->epfd = -1;
+		errno = err;
+		return -1;
 	}
-
-	/* opcode handler */
-	if (msg->op < LC_OP_MAX && lc_op_handler[msg->op])
-		lc_op_handler[msg->op](sc, msg);
-
-	/* callback to message handler */
-	if (sc->callback_msg) sc->callback_msg(msg);
+	return 0;
 }
 
-void *lc_socket_listen_thread(void *arg)
+/* receive one batch of messages from a watched socket and dispatch them */
+static int lc_socket_ready(lc_socket_t *sock)
 {
-	ssize_t len;
-	lc_message_t msg = {0};
-	lc_socket_call_t *sc = arg;
+	lc_message_t msgs[LC_RECVMMSG_MAX];
+	lc_ctx_t *ctx = sock->ctx;
+	lc_socket_call_t sc = *sock->watch;
+	ssize_t n, i;
 
-	pthread_cleanup_push(free, arg);
-	pthread_cleanup_push(lc_msg_free, &msg);
-	while(1) {
-		len = lc_msg_recv(sc->sock, &msg);
-		if (len > 0) {
-			msg.bytes = len;
-			process_msg(sc, &msg);
-		}
-		if (len < 0) {
-			lc_msg_free(&msg);
-			if (sc->callback_err) sc->callback_err(len);
-		}
-		lc_msg_free(&msg);
+	n = lc_msg_recv_batch(sock, msgs, LC_RECVMMSG_MAX, MSG_DONTWAIT);
+	if (n <= 0) {
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && sc.callback_err)
+			sc.callback_err(n);
+		return 0;
 	}
-	/* not reached */
-	pthread_cleanup_pop(0);
-	pthread_cleanup_pop(0);
-
-	return NULL;
+	ctx->ready = sock;
+	for (i = 0; i < n && ctx->ready == sock; i++) {
+		process_msg(&sc, &msgs[i]);
+		lc_msg_free(&msgs[i]);
+	}
+	/* socket unwatched or closed by a callback - drop the rest */
+	for (; i < n; i++) lc_msg_free(&msgs[i]);
+	ctx->ready = NULL;
+	return n;
 }
 
-int lc_socket_listen(lc_socket_t *sock, void (*callback_msg)(lc_message_t*),
+int lc_socket_watch(lc_socket_t *sock, void (*callback_msg)(lc_message_t*),
 					void (*callback_err)(int))
 {
-	pthread_attr_t attr = {0};
+	struct epoll_event ev = { .events = EPOLLIN };
 	lc_socket_call_t *sc;
 
 	if (!sock) return LC_ERROR_SOCKET_REQUIRED;
-	if (sock->thread) return LC_ERROR_SOCKET_LISTENING;
-
-	sc = calloc(1, sizeof(lc_socket_call_t));
-	if (!sc) return LC_ERROR_MALLOC;
+	if (sock->thread || sock->watch) return LC_ERROR_SOCKET_LISTENING;
+	/* messages on a ring or AF_XDP socket never wake sock->sock */
+	if (sock->ring || sock->xdp) return LC_ERROR_INVALID_PARAMS;
+	if (lc_ctx_epoll(sock->ctx) == -1) return -1;
+	if (!(sc = calloc(1, sizeof(lc_socket_call_t)))) return LC_ERROR_MALLOC;
 	sc->sock = sock;
 	sc->callback_msg = callback_msg;
 	sc->callback_err = callback_err;
+	ev.data.ptr = sock;
+	if (epoll_ctl(sock->ctx->epfd, EPOLL_CTL_ADD, sock->sock, &ev) == -1) {
+		free(sc);
+		return -1;
+	}
+	sock->watch = sc;
+	return 0;
+}
 
-	pthread_attr_init(&attr);
-	pthread_create(&sock->thread, &attr, &lc_socket_listen_thread, sc);
-	pthread_attr_destroy(&attr);
+int lc_socket_unwatch(lc_socket_t *sock)
+{
+	lc_ctx_t *ctx;
 
+	if (!sock) return LC_ERROR_SOCKET_REQUIRED;
+	if (!sock->watch) return 0;
+	ctx = sock->ctx;
+	epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, sock->sock, NULL);
+	free(sock->watch);
+	sock->watch = NULL;
+	if (ctx->ready == sock) ctx->ready = NULL;
+	/* drop any events for this socket still waiting in lc_ctx_poll() */
+	for (int i = 0; i < ctx->nevents; i++) {
+		if (ctx->events[i] == sock) ctx->events[i] = NULL;
+	}
+	return 0;
+}
+
+int lc_ctx_poll(lc_ctx_t *ctx, int timeout)
+{
+	struct epoll_event ev[LC_EPOLL_EVENTS];
+	lc_socket_t *events[LC_EPOLL_EVENTS];
+	int64_t t;
+	uint64_t val;
+	int n, rc = 0;
+
+	if (lc_ctx_epoll(ctx) == -1) return -1;
+
+	/* don't sleep past the next timer */
+	t = lc_wheel_timeout(&ctx->wheel, lc_clock_ms());
+	if (t >= 0 && (timeout < 0 || t < timeout)) timeout = (int)t;
+
+	n = epoll_wait(ctx->epfd, ev, LC_EPOLL_EVENTS, timeout);
+	if (n == -1 && errno != EINTR) return -1;
+	for (int i = 0; i < n; i++) events[i] = ev[i].data.ptr;
+	ctx->events = events;
+	ctx->nevents = (n > 0) ? n : 0;
+	for (int i = 0; i < n; i++) {
+		if (!ev[i].data.ptr) {
+			/* woken by lc_ctx_stop(), reset eventfd */
+			while (read(ctx->evfd, &val, sizeof val) > 0);
+		}
+		else if (events[i]) rc += lc_socket_ready(events[i]);
+	}
+	ctx->events = NULL;
+	ctx->nevents = 0;
+	rc += lc_wheel_run(&ctx->wheel, lc_clock_ms());
+
+	return rc;
+}
+
+int lc_ctx_run(lc_ctx_t *ctx)
+{
+	while (!atomic_exchange(&ctx->stop, 0)) {
+		if (lc_ctx_poll(ctx, -1) == -1) return -1;
+	}
+	return 0;
+}
+
+void lc_ctx_stop(lc_ctx_t *ctx)
+{
+	uint64_t val = 1;
+
+	atomic_store(&ctx->stop, 1);
+	if (ctx->evfd >= 0) {
+		/* EAGAIN means the counter is full, so a wakeup is pending anyway */
+		while (write(ctx->evfd, &val, sizeof val) == -1 && errno == EINTR);
+	}
+}
+#else
+int lc_socket_watch(lc_socket_t *sock, void (*callback_msg)(lc_message_t*),
+					void (*callback_err)(int))
+{
+	(void)sock; (void)callback_msg; (void)callback_err;
+	errno = ENOTSUP;
+	return -1;
+}
+
+int lc_socket_unwatch(lc_socket_t *sock)
+{
+	(void)sock;
 	return 0;
 }
 
+int lc_ctx_poll(lc_ctx_t *ctx, int timeout)
+{
+	(void)ctx; (void)timeout;
+	errno = ENOTSUP;
+	return -1;
+}
+
+int lc_ctx_run(lc_ctx_t *ctx)
+{
+	(void)ctx;
+	errno = ENOTSUP;
+	return -1;
+}
+
+void lc_ctx_stop(lc_ctx_t *ctx)
+{
+	atomic_store(&ctx->stop, 1);
+}
+#endif
+
 static int lc_channel_membership_all(int sock, int opt, struct ipv6_mreq *req)
 {
 	struct ifaddrs *ifaddr, *ifa;
@@ -591,13 +3284,30 @@ int lc_channel_part(lc_channel_t *chan)
 
 int lc_channel_join(lc_channel_t *chan)
 {
-	return lc_channel_action(chan, IPV6_JOIN_GROUP);
+	int rc = lc_channel_action(chan, IPV6_JOIN_GROUP);
+	/* make sure the kernel lets the group through */
+	if (!rc) rc = lc_socket_filter(chan->sock);
+	return rc;
 }
 
 int lc_channel_unbind(lc_channel_t *chan)
 {
-	chan->sock->bound--;
+	lc_socket_t *sock = chan->sock;
+	if (!sock) return 0;
+	for (lc_channel_t **p = &sock->chan_list; *p; p = &(*p)->snext) {
+		if (*p == chan) {
+			*p = chan->snext;
+			break;
+		}
+	}
+	chan->snext = NULL;
+	sock->bound--;
 	chan->sock = NULL;
+	/* we may still be a member, but its datagrams are no longer ours */
+	lc_socket_filter(sock);
+#ifdef LC_XDP
+	if (sock->xdp) lc_xdp_group(sock->xdp, &chan->sa.sin6_addr, 0);
+#endif
 	return 0;
 }
 
@@ -631,13 +3341,227 @@ int lc_channel_bind(lc_socket_t *sock, lc_channel_t *chan)
 	/* Librecast sockets can have multiple channels bound to them, but we
 	 * only need to call lc_socket_bind_addr() the first time */
 
-	int rc = (sock->bound) ? 0 : lc_socket_bind_addr(sock);
+	int rc;
 
+	if (chan->sock == sock) return 0;
+	rc = (sock->bound) ? 0 : lc_socket_bind_addr(sock);
 	if (!rc) {
+		lc_channel_unbind(chan);
 		chan->sock = sock;
+		chan->snext = sock->chan_list;
+		sock->chan_list = chan;
 		sock->bound++;
+		rc = lc_socket_filter(sock);
+#ifdef LC_XDP
+		if (!rc && sock->xdp) rc = lc_xdp_group(sock->xdp, &chan->sa.sin6_addr, 1);
+#endif
+	}
+
+	return rc;
+}
+
+/* hash used to steer an address to one of a group of workers. The classic
+ * BPF built by lc_bpf_steer() computes the same value */
+static uint32_t lc_steer_hash(const struct in6_addr *addr)
+{
+	uint32_t h = 0, w;
+	for (int i = 0; i < 4; i++) {
+		memcpy(&w, &addr->s6_addr[i * 4], sizeof w);
+		h ^= ntohl(w);
+	}
+	return h;
+}
+
+static int lc_steer_worker(lc_socket_group_t *grp, const struct in6_addr *addr)
+{
+	return lc_steer_hash(addr) % grp->n;
+}
+
+#ifdef __linux__
+/* steer unicast traffic to the group's port across the workers */
+static int lc_socket_group_reuseport(lc_socket_group_t *grp)
+{
+	struct sock_filter f[LC_BPF_STEER_LEN + 1];
+	struct sock_fprog prog = { .filter = f };
+	uint32_t off = (grp->steer == LC_STEER_SOURCE) ? LC_IP6_SRC : LC_IP6_DST;
+	int i;
+
+	i = lc_bpf_steer(f, off, grp->n);
+	f[i++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_A, 0);
+	prog.len = i;
+	return setsockopt(grp->sock[0]->sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog);
+}
+
+/* multicast is delivered to every socket that joined the group, so when
+ * steering by source each worker drops what belongs to the others */
+static int lc_socket_group_filter(lc_socket_group_t *grp, int worker)
+{
+	lc_socket_t *sock = grp->sock[worker];
+
+	sock->steer = (grp->steer == LC_STEER_SOURCE) ? grp->n : 0;
+	sock->worker = worker;
+	return lc_socket_filter(sock);
+}
+
+static int lc_socket_group_pin(lc_socket_group_t *grp, int worker)
+{
+	cpu_set_t cpus;
+	lc_socket_t *sock = grp->sock[worker];
+
+	if (!sock->thread) return 0;
+	CPU_ZERO(&cpus);
+	if (grp->cpu[worker] < 0) {
+		for (int i = 0; i < CPU_SETSIZE; i++) CPU_SET(i, &cpus);
+	}
+	else CPU_SET(grp->cpu[worker], &cpus);
+	return (pthread_setaffinity_np(sock->thread, sizeof cpus, &cpus)) ? -1 : 0;
+}
+#else
+static int lc_socket_group_reuseport(lc_socket_group_t *grp)
+{
+	(void)grp;
+	return 0;
+}
+
+static int lc_socket_group_filter(lc_socket_group_t *grp, int worker)
+{
+	(void)worker;
+	if (grp->steer == LC_STEER_SOURCE) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return 0;
+}
+
+static int lc_socket_group_pin(lc_socket_group_t *grp, int worker)
+{
+	(void)worker;
+	if (grp->cpu[worker] >= 0) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+void lc_socket_group_free(lc_socket_group_t *grp)
+{
+	if (!grp) return;
+	for (int i = 0; i < grp->n; i++) lc_socket_close(grp->sock[i]);
+	free(grp->sock);
+	free(grp->cpu);
+	free(grp);
+}
+
+lc_socket_group_t *lc_socket_group_new(lc_ctx_t *ctx, int nworkers)
+{
+	lc_socket_group_t *grp;
+	int err;
+
+	if (nworkers < 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!(grp = calloc(1, sizeof(lc_socket_group_t)))) return NULL;
+	grp->ctx = ctx;
+	grp->sock = calloc(nworkers, sizeof(lc_socket_t *));
+	grp->cpu = malloc(nworkers * sizeof(int));
+	if (!grp->sock || !grp->cpu) goto err_0;
+	for (grp->n = 0; grp->n < nworkers; grp->n++) {
+		grp->cpu[grp->n] = -1;
+		if (!(grp->sock[grp->n] = lc_socket_new(ctx))) goto err_0;
+		if (lc_socket_bind_addr(grp->sock[grp->n])) goto err_0;
+	}
+	/* not fatal - only affects unicast to our port */
+	lc_socket_group_reuseport(grp);
+	return grp;
+err_0:
+	err = errno;
+	lc_socket_group_free(grp);
+	errno = err;
+	return NULL;
+}
+
+int lc_socket_group_steer(lc_socket_group_t *grp, int mode)
+{
+	if (mode != LC_STEER_GROUP && mode != LC_STEER_SOURCE) return LC_ERROR_INVALID_PARAMS;
+	if (mode == grp->steer) return 0;
+	grp->steer = mode;
+	for (int i = 0; i < grp->n; i++) {
+		if (lc_socket_group_filter(grp, i) == -1) return -1;
+	}
+	lc_socket_group_reuseport(grp);
+	return 0;
+}
+
+int lc_socket_group_cpu(lc_socket_group_t *grp, int worker, int cpu)
+{
+	if (worker < 0 || worker >= grp->n) return LC_ERROR_INVALID_PARAMS;
+#ifdef __linux__
+	if (cpu >= CPU_SETSIZE) return LC_ERROR_INVALID_PARAMS;
+#endif
+	grp->cpu[worker] = (cpu < 0) ? -1 : cpu;
+	return lc_socket_group_pin(grp, worker);
+}
+
+lc_socket_t *lc_socket_group_socket(lc_socket_group_t *grp, int worker)
+{
+	if (worker < 0 || worker >= grp->n) return NULL;
+	return grp->sock[worker];
+}
+
+static int lc_socket_group_membership(lc_socket_group_t *grp, lc_channel_t *chan, int opt)
+{
+	int w, rc;
+
+	if (grp->steer == LC_STEER_GROUP) {
+		/* only the worker the group hashes to joins it */
+		w = lc_steer_worker(grp, &chan->sa.sin6_addr);
+		if ((rc = lc_channel_bind(grp->sock[w], chan))) return rc;
+		return lc_channel_action(chan, opt);
+	}
+	/* every worker joins, and source filters pick who keeps what */
+	if ((rc = lc_channel_bind(grp->sock[0], chan))) return rc;
+	for (w = 0; w < grp->n; w++) {
+		chan->sock = grp->sock[w];
+		rc = lc_channel_action(chan, opt);
+		if (rc) break;
+	}
+	chan->sock = grp->sock[0];
+	return rc;
+}
+
+int lc_socket_group_join(lc_socket_group_t *grp, lc_channel_t *chan)
+{
+	return lc_socket_group_membership(grp, chan, IPV6_JOIN_GROUP);
+}
+
+int lc_socket_group_part(lc_socket_group_t *grp, lc_channel_t *chan)
+{
+	return lc_socket_group_membership(grp, chan, IPV6_LEAVE_GROUP);
+}
+
+int lc_socket_group_listen_cancel(lc_socket_group_t *grp)
+{
+	int rc, ret = 0;
+	for (int i = 0; i < grp->n; i++) {
+		if ((rc = lc_socket_listen_cancel(grp->sock[i]))) ret = rc;
 	}
+	return ret;
+}
+
+int lc_socket_group_listen(lc_socket_group_t *grp, void (*callback_msg)(lc_message_t*),
+					void (*callback_err)(int))
+{
+	int rc;
 
+	for (int i = 0; i < grp->n; i++) {
+		if ((rc = lc_socket_listen(grp->sock[i], callback_msg, callback_err))) goto err_0;
+		if ((rc = lc_socket_group_pin(grp, i))) goto err_0;
+	}
+	return 0;
+err_0:
+	lc_socket_group_listen_cancel(grp);
 	return rc;
 }
 
@@ -663,8 +3587,41 @@ static int lc_hashgroup(char *baseaddr, unsigned char *group, size_t len,
 	return 0;
 }
 
+static int lc_chantab_grow(lc_ctx_t *ctx)
+{
+	lc_chanslot_t *old = ctx->chantab;
+	size_t oldsz = ctx->chantabsz;
+	size_t sz = (oldsz) ? oldsz * 2 : LC_CHANTAB_MIN;
+
+	if (!(ctx->chantab = calloc(sz, sizeof(lc_chanslot_t)))) {
+		ctx->chantab = old;
+		return -1;
+	}
+	ctx->chantabsz = sz;
+	for (size_t i = 0; i < oldsz; i++) {
+		if (old[i].chan) *lc_chantab_slot(ctx, &old[i].addr) = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+/* add channel to ctx. On failure, chan is freed and NULL returned */
 static lc_channel_t * lc_channel_ins(lc_ctx_t *ctx, lc_channel_t *chan)
 {
+	lc_chanslot_t *slot;
+
+	/* keep load factor <= 1/2 */
+	if ((ctx->chantabn + 1) * 2 > ctx->chantabsz && lc_chantab_grow(ctx)) {
+		free(chan);
+		return NULL;
+	}
+	slot = lc_chantab_slot(ctx, &chan->sa.sin6_addr);
+	if (!slot->chan) {
+		slot->addr = chan->sa.sin6_addr;
+		ctx->chantabn++;
+	}
+	chan->hnext = slot->chan;
+	slot->chan = chan;
 	chan->next = ctx->chan_list;
 	ctx->chan_list = chan;
 	return chan;
@@ -675,17 +3632,28 @@ static inline void lc_channel_setid(lc_channel_t *chan)
 	chan->id = ++chan_id;
 }
 
+/* copy of chan, not yet added to ctx */
+static lc_channel_t * lc_channel_dup(lc_ctx_t *ctx, lc_channel_t *chan)
+{
+	lc_channel_t *copy = calloc(1, sizeof(lc_channel_t));
+	if (!copy) return NULL;
+	copy->ctx = ctx;
+	lc_channel_setid(copy);
+	memcpy(&copy->sa, &chan->sa, sizeof(struct sockaddr_in6));
+	return copy;
+}
+
 lc_channel_t * lc_channel_sidehash(lc_channel_t *base, unsigned char *key, size_t keylen)
 {
 	struct in6_addr *in;
 	unsigned char *ptr;
 	lc_ctx_t *ctx = base->ctx;
-	lc_channel_t *side = lc_channel_copy(ctx, base);
+	lc_channel_t *side = lc_channel_dup(ctx, base);
 	if (!side) return NULL;
 	in = &side->sa.sin6_addr;
 	ptr = (unsigned char *)&in->s6_addr[2];
 	hash_generic_key(ptr, 14, (unsigned char *)in, sizeof(struct in6_addr), key, keylen);
-	return side;
+	return lc_channel_ins(ctx, side);
 }
 
 lc_channel_t * lc_channel_sideband(lc_channel_t *base, uint64_t band)
@@ -693,21 +3661,18 @@ lc_channel_t * lc_channel_sideband(lc_channel_t *base, uint64_t band)
 	struct in6_addr *in;
 	uint64_t *ptr;
 	lc_ctx_t *ctx = base->ctx;
-	lc_channel_t *side = lc_channel_copy(ctx, base);
+	lc_channel_t *side = lc_channel_dup(ctx, base);
 	if (!side) return NULL;
 	in = &side->sa.sin6_addr;
 	ptr = (uint64_t *)&in->s6_addr[8];
 	*ptr = band;
-	return side;
+	return lc_channel_ins(ctx, side);
 }
 
 lc_channel_t * lc_channel_copy(lc_ctx_t *ctx, lc_channel_t *chan)
 {
-	lc_channel_t *copy = calloc(1, sizeof(lc_channel_t));
+	lc_channel_t *copy = lc_channel_dup(ctx, chan);
 	if (!copy) return NULL;
-	copy->ctx = ctx;
-	lc_channel_setid(copy);
-	memcpy(&copy->sa, &chan->sa, sizeof(struct sockaddr_in6));
 	return lc_channel_ins(ctx, copy);
 }
 
@@ -739,7 +3704,7 @@ lc_channel_t * lc_channel_new(lc_ctx_t *ctx, char *s)
 {
 	lc_channel_t *chan;
 	chan = lc_channel_nnew(ctx, (unsigned char *)s, strlen(s));
-	chan->uri = s;
+	if (chan) chan->uri = s;
 	return chan;
 }
 
@@ -755,8 +3720,30 @@ void lc_socket_close(lc_socket_t *sock)
 	if (!sock) return;
 
 	lc_socket_listen_cancel(sock);
-
+	lc_socket_unwatch(sock);
+	lc_dispatch_free(sock->dispatch);
+
+	/* channels outlive their socket, but are no longer bound */
+	for (lc_channel_t *chan = sock->chan_list, *next; chan; chan = next) {
+		next = chan->snext;
+		chan->snext = NULL;
+		chan->sock = NULL;
+	}
+	lc_frag_free(sock->reasm);
+	lc_fec_dec_free(sock->fecdec);
+	lc_rx_free(sock->rx);
+#ifdef LC_ZEROCOPY
+	/* before the socket, and its error queue, are gone */
+	lc_zc_free(sock);
+#endif
 	if (sock->sock) close(sock->sock);
+	free(sock->gro);
+#ifdef __linux__
+	lc_ring_free(sock->ring);
+#endif
+#ifdef LC_XDP
+	if (sock->xdp) lc_xdp_release(sock->xdp);
+#endif
 	lc_socket_t *prev = NULL;
 	for (lc_socket_t *p = sock->ctx->sock_list; p; p = p->next) {
 		if (p->id == sock->id) {
@@ -784,20 +3771,98 @@ void lc_ctx_free(lc_ctx_t *ctx)
 			p = ((lc_channel_t *)p)->next;
 			lc_channel_free(h);
 		}
+		free(ctx->chantab);
+		lc_wheel_free(&ctx->wheel);
+		lc_ctx_engine(ctx, LC_ENGINE_SYSCALL);
+		pthread_mutex_destroy(&ctx->uring_mtx);
+		if (ctx->epfd >= 0) close(ctx->epfd);
+		if (ctx->evfd >= 0) close(ctx->evfd);
 		if (ctx->sock >= 0) close(ctx->sock);
+		/* pools outlive ctx until the last message using them is freed */
+		for (int i = 0; i < LC_POOL_CLASSES; i++) lc_pool_release(ctx->pool[i]);
 		free(ctx);
 	}
 }
 
 int lc_socket_bind(lc_socket_t *sock, unsigned int ifx)
 {
+#ifdef LC_XDP
+	lc_xdp_t *xdp = NULL;
+
+	if (sock->xdp && ifx != sock->ifx) {
+		/* AF_XDP is per interface, so set up on the new one first */
+		if (sock->thread || sock->watch) return LC_ERROR_SOCKET_LISTENING;
+		if (!ifx) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (!(xdp = lc_xdp_new(ifx, LC_DEFAULT_PORT))) return -1;
+		if (lc_socket_xdp_groups(sock, xdp) == -1) {
+			int err = errno;
+			lc_xdp_release(xdp);
+			errno = err;
+			return -1;
+		}
+		xdp->hops = sock->xdp->hops;
+	}
+#endif
 	if (setsockopt(sock->sock, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifx, sizeof ifx) == -1) {
+#ifdef LC_XDP
+		if (xdp) lc_xdp_release(xdp);
+#endif
 		return -1;
 	}
+#ifdef __linux__
+	if (sock->ring && lc_ring_bind(sock->ring, ifx) == -1) return -1;
+	/* the kernel drops what arrives on other interfaces */
+	unsigned int oldifx = sock->ifx;
+	sock->ifx = ifx;
+	if (lc_socket_filter(sock) == -1) {
+		sock->ifx = oldifx;
+#ifdef LC_XDP
+		if (xdp) lc_xdp_release(xdp);
+#endif
+		return -1;
+	}
+#endif
+#ifdef LC_XDP
+	if (xdp) {
+		lc_xdp_release(sock->xdp);
+		sock->xdp = xdp;
+	}
+#endif
 	sock->ifx = ifx;
 	return 0;
 }
 
+int lc_ctx_engine(lc_ctx_t *ctx, int engine)
+{
+	if (engine != LC_ENGINE_SYSCALL && engine != LC_ENGINE_URING) return LC_ERROR_INVALID_PARAMS;
+#ifdef LC_URING
+	if (engine == LC_ENGINE_URING && !ctx->uring) {
+		/* listeners need provided buffer rings (5.19+), so check for
+		 * those too, while we're setting up the send ring */
+		if (lc_uring_probe() || !(ctx->uring = malloc(sizeof(lc_uring_t)))) {
+			engine = LC_ENGINE_SYSCALL;
+		}
+		else if (lc_uring_init(ctx->uring, LC_SENDMMSG_MAX) == -1) {
+			free(ctx->uring);
+			ctx->uring = NULL;
+			engine = LC_ENGINE_SYSCALL;
+		}
+	}
+	if (engine == LC_ENGINE_SYSCALL && ctx->uring) {
+		lc_uring_free(ctx->uring);
+		free(ctx->uring);
+		ctx->uring = NULL;
+	}
+#else
+	engine = LC_ENGINE_SYSCALL;
+#endif
+	ctx->engine = engine;
+	return engine;
+}
+
 lc_socket_t * lc_socket_new(lc_ctx_t *ctx)
 {
 	lc_socket_t *sock;
@@ -806,6 +3871,7 @@ lc_socket_t * lc_socket_new(lc_ctx_t *ctx)
 	sock = calloc(1, sizeof(lc_socket_t));
 	if (!sock) return NULL;
 	sock->ctx = ctx;
+	sock->fragmem = LC_FRAG_MEM;
 	sock->id = ++sock_id;
 	sock->next = ctx->sock_list;
 	ctx->sock_list = sock;
@@ -826,6 +3892,16 @@ lc_socket_t * lc_socket_new(lc_ctx_t *ctx)
 	if (setsockopt(s, IPPROTO_IPV6, IPV6_RECVPKTINFO, &i, sizeof i) == -1) {
 		goto err_1;
 	}
+#if defined(SO_TIMESTAMPNS)
+	/* kernel receive timestamps, for msg->rxtime */
+	if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &i, sizeof i) == -1) {
+		goto err_1;
+	}
+#elif defined(SO_TIMESTAMP)
+	if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMP, &i, sizeof i) == -1) {
+		goto err_1;
+	}
+#endif
 	i = DEFAULT_MULTICAST_LOOP;
 	if (setsockopt(s, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &i, sizeof i) == -1) {
 		goto err_1;
@@ -849,10 +3925,20 @@ lc_ctx_t * lc_ctx_new(void)
 	lc_ctx_t *ctx;
 
 	if (!(ctx = calloc(1, sizeof(lc_ctx_t)))) return NULL; /* errno set by calloc */
+	ctx->sock = -1;
+	ctx->epfd = -1;
+	ctx->evfd = -1;
+	pthread_mutex_init(&ctx->uring_mtx, NULL);
+	for (int i = 0; i < LC_POOL_CLASSES; i++) {
+		ctx->pool[i] = lc_pool_new(sizeof(lc_buf_t) + lc_pool_bufsz[i], lc_pool_keep[i]);
+		if (!ctx->pool[i]) {
+			lc_ctx_free(ctx);
+			return NULL;
+		}
+	}
 	ctx->id = ++ctx_id;
 	ctx->next = ctx_list;
 	ctx_list = ctx;
-	ctx->sock = -1;
 
 	return ctx;
 }
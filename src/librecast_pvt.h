@@ -5,23 +5,93 @@
 #define _LIBRECAST_PVT_H 1
 
 #include "../include/librecast/types.h"
+#include "timer.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 
+#define LC_GRO_BYTES 65535 /* max size of coalesced UDP GRO receive */
+#define LC_POOL_CLASSES 3 /* size classes of pooled message buffers */
+
+/* slot in ctx channel hash table. The address is kept in the slot so probing
+ * doesn't touch the channels themselves */
+typedef struct lc_chanslot_t {
+	struct in6_addr addr;
+	lc_channel_t *chan; /* NULL = empty slot */
+} lc_chanslot_t;
+
 typedef struct lc_ctx_t {
 	lc_ctx_t *next;
 	uint32_t id;
 	lc_socket_t *sock_list;
 	lc_channel_t *chan_list;
 	int sock; /* AF_LOCAL socket for ioctls */
+	struct lc_pool_s *pool[LC_POOL_CLASSES]; /* message buffers, smallest first */
+	lc_chanslot_t *chantab; /* channels by address, open addressing hash table */
+	size_t chantabsz; /* slots in chantab (power of 2) */
+	size_t chantabn; /* slots in use */
+	int epfd; /* epoll instance for lc_ctx_poll(), -1 = not created */
+	int evfd; /* eventfd to wake lc_ctx_poll() */
+	atomic_int stop; /* lc_ctx_stop() called */
+	lc_socket_t *ready; /* socket whose messages are being dispatched */
+	lc_socket_t **events; /* sockets with events pending in lc_ctx_poll() */
+	int nevents;
+	lc_wheel_t wheel; /* timers run from lc_ctx_poll() */
+	int engine; /* LC_ENGINE_SYSCALL or LC_ENGINE_URING */
+	struct lc_uring_s *uring; /* io_uring for batch sends, NULL = none */
+	pthread_mutex_t uring_mtx; /* serialises use of uring */
 } lc_ctx_t;
 
+/* coalesced datagrams from a UDP GRO receive, waiting to be handed out */
+typedef struct lc_gro_t {
+	struct in6_addr dst;
+	struct in6_addr src;
+	uint64_t rxtime; /* kernel receive timestamp */
+	size_t segsz; /* size of each datagram (last may be shorter) */
+	size_t off; /* offset of next datagram in buf */
+	size_t len; /* bytes remaining */
+	char buf[LC_GRO_BYTES];
+} lc_gro_t;
+
+/* AF_PACKET TPACKET_V3 receive ring */
+typedef struct lc_ring_t {
+	int fd; /* packet socket */
+	char *map; /* blocks shared with the kernel */
+	size_t blocksz; /* bytes per block */
+	unsigned int blocks; /* number of blocks */
+	unsigned int cur; /* next block to read */
+} lc_ring_t;
+
 typedef struct lc_socket_t {
 	lc_socket_t *next;
 	lc_ctx_t *ctx;
+	lc_channel_t *chan_list; /* channels bound to this socket */
 	pthread_t thread;
 	uint32_t id;
 	unsigned int ifx; /* interface index, 0 = all (default) */
 	int bound; /* how many channels are bound to this socket */
+	int filter; /* how the kernel filter tests groups, LC_FILTER_* */
+	size_t gso; /* UDP GSO segment payload size, 0 = disabled (default) */
+	lc_gro_t *gro; /* UDP GRO receive buffer, NULL = disabled (default) */
+	lc_ring_t *ring; /* TPACKET_V3 receive ring, NULL = disabled (default) */
+	struct lc_xdp_s *xdp; /* AF_XDP socket, NULL = disabled (default) */
+	unsigned int xdpudp; /* AF_XDP receives since the UDP socket was last tried */
+	struct lc_dispatch_s *dispatch; /* callback worker pool, NULL = run on listener (default) */
+	size_t zerocopy; /* MSG_ZEROCOPY payloads of at least this size, 0 = disabled (default) */
+	struct lc_zc_s *zc; /* zero-copy sends awaiting completion, NULL = none yet */
+	struct lc_rx_s *rx; /* receive slots, NULL = none yet */
+	size_t frag; /* max datagram size, bigger messages go as fragments, 0 = never (default) */
+	size_t fragmem; /* max bytes of messages held for reassembly */
+	struct lc_frag_s *reasm; /* messages being reassembled, NULL = none yet */
+	struct lc_fec_dec_s *fecdec; /* FEC blocks being decoded, NULL = none yet */
+	unsigned int busypoll; /* usec listener spins before blocking, 0 = disabled (default) */
+	int txtime; /* pace with SO_TXTIME departure times, 0 = sleep in userspace (default) */
+	clockid_t txclock; /* clock of SO_TXTIME departure times */
+	lc_socket_call_t *watch; /* callbacks when watched by ctx event loop */
+	int steer; /* group workers to steer between by source, 0 = not steered */
+	int worker; /* our worker number when steered */
+	uint64_t uring_enters; /* io_uring_enter() calls by io_uring listener */
+	uint64_t uring_msgs; /* messages received by io_uring listener */
 	int sock;
 } lc_socket_t;
 
@@ -29,13 +99,31 @@ typedef struct lc_channel_t {
 	lc_channel_t *next;
 	lc_ctx_t *ctx;
 	struct lc_socket_t *sock;
+	lc_channel_t *snext; /* next channel bound to the same socket */
+	lc_channel_t *hnext; /* older channel with the same address in ctx->chantab */
 	struct sockaddr_in6 sa;
 	char *uri;
 	uint32_t id;
 	lc_seq_t seq; /* sequence number (Lamport clock) */
 	lc_rnd_t rnd; /* random nonce */
+	int err; /* errno from last socket send to this channel, 0 = success */
+	uint64_t rate; /* send rate limit, bytes/s, 0 = unlimited (default) */
+	uint64_t tau; /* burst allowance, ns at rate */
+	uint64_t tat; /* CLOCK_MONOTONIC ns the bucket is next empty (GCRA) */
+	struct lc_fec_enc_s *fec; /* FEC encoding of sends, NULL = disabled (default) */
+	lc_channel_t *fecrepair; /* sideband FEC repairs are sent on, NULL = this channel */
+	lc_channel_t *fecsrc; /* channel whose FEC repairs we carry, NULL = none */
 } lc_channel_t;
 
+/* sockets sharing a port with SO_REUSEPORT, one listening thread each */
+typedef struct lc_socket_group_t {
+	lc_ctx_t *ctx;
+	lc_socket_t **sock; /* one socket per worker */
+	int *cpu; /* cpu each worker is pinned to, -1 = not pinned */
+	int n; /* number of workers */
+	int steer; /* LC_STEER_GROUP or LC_STEER_SOURCE */
+} lc_socket_group_t;
+
 typedef struct lc_message_head_t {
 	uint64_t timestamp; /* nanosecond timestamp */
 	lc_seq_t seq; /* sequence number */
@@ -53,6 +141,66 @@ extern lc_socket_t *sock_list;
 extern lc_channel_t *chan_list;
 
 #define BUFSIZE 1500
+#define LC_SENDMMSG_MAX 64 /* max messages per sendmmsg() in batch sends */
+#define LC_GSO_SEGS 64 /* max segments per GSO send (UDP_MAX_SEGMENTS) */
+#define LC_GSO_BYTES 65507 /* max bytes per GSO send */
+#define LC_GSO_IOV 256 /* max iovecs per GSO send */
+#define LC_RECVMMSG_MAX 64 /* max messages per recvmmsg() */
+#define LC_CMSGSZ 256 /* control buffer per message for batch receives */
+#define LC_RECV_BUFSZ (65527 - sizeof(lc_message_head_t)) /* max payload in UDP/IPv6 datagram */
+#define LC_IP6_SRC 8 /* offset of source address in IPv6 header */
+#define LC_IP6_DST 24 /* offset of destination address in IPv6 header */
+#define LC_RECV_HEADROOM 256 /* extra room in largest buffers for io_uring recvmsg metadata */
+#define LC_EPOLL_EVENTS 64 /* max events per epoll_wait() in lc_ctx_poll() */
+#define LC_CHANTAB_MIN 64 /* initial slots in channel hash table */
+#define LC_POOL_SMALL 2048 /* payload size of smallest pooled buffers */
+#define LC_POOL_MEDIUM 16384 /* payload size of medium pooled buffers */
+#define LC_RING_BLOCKSZ (1 << 20) /* TPACKET_V3 block size, holds the largest datagram */
+#define LC_RING_TOV 2 /* ms before the kernel hands over a partly filled block */
+#define LC_URING_BUFS 64 /* provided receive buffers per io_uring listener */
+#define LC_URING_CMSGSZ 128 /* control data space in each io_uring receive buffer */
+#define LC_ZC_PENDING 1024 /* zero-copy sends awaiting completion per socket */
+#define LC_ZC_WAIT 1000 /* ms to wait for zero-copy completions on close */
+#define LC_FRAG_MEM (16 * 1024 * 1024) /* default max bytes held for reassembly per socket */
+#define LC_FRAG_TIMEOUT 1000000000 /* ns a message is held for without a new fragment */
+#define LC_FEC_MEM (16 * 1024 * 1024) /* max bytes held for FEC decoding per socket */
+#define LC_FEC_TIMEOUT 1000000000 /* ns a FEC block is held for without a new datagram */
+#define LC_PACE_AHEAD 100000000 /* ns ahead of now a SO_TXTIME departure time may be */
+#define LC_XDP_UDP 64 /* AF_XDP receives between tries of the UDP socket */
+#define LC_RX_SPILL (LC_RECV_BUFSZ - LC_POOL_SMALL) /* most a datagram overflows a slot by */
 #define DEFAULT_ADDR "ff1e::"
 
+/* MSG_ZEROCOPY send the kernel may still be reading from. The header is
+ * kept here, as it's sent from this memory too */
+typedef struct lc_zcsend_s {
+	lc_message_head_t head;
+	lc_free_fn_t *free; /* handed data back to its owner, NULL = done */
+	void *data;
+	void *hint;
+} lc_zcsend_t;
+
+/* zero-copy sends on a socket, by the id the kernel gives each one: the
+ * count of MSG_ZEROCOPY sendmsg() calls on the socket */
+typedef struct lc_zc_s {
+	pthread_mutex_t mtx;
+	uint32_t next; /* id of next send */
+	uint32_t done; /* oldest id not yet completed */
+	uint64_t sends; /* zero-copy sends */
+	uint64_t copied; /* ...that the kernel copied after all */
+	lc_zcsend_t send[LC_ZC_PENDING];
+} lc_zc_t;
+
+/* receive slots a socket keeps between receives: a pooled buffer for each,
+ * sized to the datagrams we expect, which goes with the message received
+ * into it, and a region each of one spill mapping for anything bigger. The
+ * mapping is only backed by memory where a datagram has overflowed. One
+ * receive has them at a time */
+typedef struct lc_rx_s {
+	size_t bufsz; /* size of slot buffers */
+	void *buf[LC_RECVMMSG_MAX]; /* NULL = taken by a message */
+	char *spill; /* LC_RECVMMSG_MAX regions of LC_RX_SPILL bytes */
+	void *spillbuf; /* pooled buffer spill is in, if a one-off */
+	atomic_int busy;
+} lc_rx_t;
+
 #endif /* _LIBRECAST_PVT_H */
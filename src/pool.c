@@ -0,0 +1,135 @@
+/* SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only */
+/* Copyright (c) 2021 Brett Sheffield <bacs@librecast.net> */
+
+#include "pool.h"
+#include <stdlib.h>
+
+lc_pool_t *lc_pool_new(size_t bufsz, size_t max)
+{
+	lc_pool_t *pool;
+
+	if (bufsz < sizeof(void *)) bufsz = sizeof(void *);
+	pool = calloc(1, sizeof(lc_pool_t));
+	if (!pool) return NULL;
+	if (pthread_mutex_init(&pool->mtx, NULL)) {
+		free(pool);
+		return NULL;
+	}
+	pool->bufsz = bufsz;
+	pool->max = max;
+	return pool;
+}
+
+void *lc_pool_get(lc_pool_t *pool)
+{
+	void *buf;
+
+	pthread_mutex_lock(&pool->mtx);
+	buf = pool->free;
+	if (buf) {
+		pool->free = *(void **)buf;
+		pool->nfree--;
+	}
+	pool->out++;
+	pthread_mutex_unlock(&pool->mtx);
+	if (!buf && !(buf = malloc(pool->bufsz))) {
+		pthread_mutex_lock(&pool->mtx);
+		pool->out--;
+		pthread_mutex_unlock(&pool->mtx);
+	}
+	return buf;
+}
+
+static void lc_pool_destroy(lc_pool_t *pool)
+{
+	pthread_mutex_destroy(&pool->mtx);
+	free(pool);
+}
+
+void *lc_pool_put(void *buf, void *hint)
+{
+	lc_pool_t *pool = hint;
+	int destroy;
+
+	if (!buf) return NULL;
+	pthread_mutex_lock(&pool->mtx);
+	pool->out--;
+	if (!pool->closed && pool->nfree < pool->max) {
+		*(void **)buf = pool->free;
+		pool->free = buf;
+		pool->nfree++;
+		buf = NULL;
+	}
+	destroy = pool->closed && !pool->out;
+	pthread_mutex_unlock(&pool->mtx);
+	free(buf);
+	if (destroy) lc_pool_destroy(pool);
+
+	return NULL;
+}
+
+void lc_pool_release(lc_pool_t *pool)
+{
+	void *buf, *next;
+	int destroy;
+
+	if (!pool) return;
+	pthread_mutex_lock(&pool->mtx);
+	buf = pool->free;
+	pool->free = NULL;
+	pool->nfree = 0;
+	pool->closed = 1;
+	destroy = !pool->out;
+	pthread_mutex_unlock(&pool->mtx);
+	for (; buf; buf = next) {
+		next = *(void **)buf;
+		free(buf);
+	}
+	if (destroy) lc_pool_destroy(pool);
+}
+
+void *lc_buf_get(lc_pool_t *pool)
+{
+	lc_buf_t *buf;
+
+	if (!(buf = lc_pool_get(pool))) return NULL;
+	buf->pool = pool;
+	atomic_init(&buf->ref, 1);
+	return buf + 1;
+}
+
+void *lc_buf_new(size_t len)
+{
+	lc_buf_t *buf;
+
+	if (!(buf = malloc(sizeof(lc_buf_t) + len))) return NULL;
+	buf->pool = NULL;
+	atomic_init(&buf->ref, 1);
+	return buf + 1;
+}
+
+void lc_buf_ref(void *data)
+{
+	lc_buf_t *buf = (lc_buf_t *)data - 1;
+	atomic_fetch_add_explicit(&buf->ref, 1, memory_order_relaxed);
+}
+
+unsigned int lc_buf_refs(void *data)
+{
+	lc_buf_t *buf = (lc_buf_t *)data - 1;
+	return atomic_load_explicit(&buf->ref, memory_order_acquire);
+}
+
+void *lc_buf_unref(void *data, void *hint)
+{
+	lc_buf_t *buf;
+
+	if (hint) data = hint;
+	if (!data) return NULL;
+	buf = (lc_buf_t *)data - 1;
+	if (atomic_fetch_sub_explicit(&buf->ref, 1, memory_order_acq_rel) == 1) {
+		if (buf->pool) lc_pool_put(buf, buf->pool);
+		else free(buf);
+	}
+	return NULL;
+}
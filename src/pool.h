@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only */
+/* Copyright (c) 2021 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _POOL_H
+#define _POOL_H 1
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+/* pool of fixed size buffers, recycled instead of returned to the heap */
+typedef struct lc_pool_s {
+	pthread_mutex_t mtx;
+	void *free; /* stack of free buffers, linked through first word */
+	size_t bufsz; /* size of each buffer */
+	size_t nfree; /* buffers on free stack */
+	size_t max; /* max buffers to keep on free stack */
+	size_t out; /* buffers handed out and not yet returned */
+	int closed; /* owner has released the pool */
+} lc_pool_t;
+
+/* create pool of buffers of bufsz bytes, keeping up to max free buffers */
+lc_pool_t *lc_pool_new(size_t bufsz, size_t max);
+
+/* take buffer from pool, allocating if none free. NULL on error */
+void *lc_pool_get(lc_pool_t *pool);
+
+/* return buffer to pool. Matches lc_free_fn_t, so can be used as
+ * msg->free with pool as msg->hint */
+void *lc_pool_put(void *buf, void *pool);
+
+/* release pool. Free buffers are freed now, the pool itself once every
+ * outstanding buffer has been returned */
+void lc_pool_release(lc_pool_t *pool);
+
+/* refcounted buffer. The header sits in front of the data, which is what
+ * lc_buf_get() hands out, so the data pointer alone finds its pool */
+typedef struct lc_buf_s {
+	lc_pool_t *pool;
+	atomic_uint ref;
+} lc_buf_t;
+
+/* usable data bytes in each refcounted buffer from pool */
+#define LC_BUF_SIZE(pool) ((pool)->bufsz - sizeof(lc_buf_t))
+
+/* take refcounted buffer from pool, with one reference. NULL on error */
+void *lc_buf_get(lc_pool_t *pool);
+
+/* refcounted buffer of len bytes from the heap rather than a pool, for
+ * anything bigger than the pool buffers. Freed by the last lc_buf_unref().
+ * NULL on error */
+void *lc_buf_new(size_t len);
+
+/* take another reference to buffer */
+void lc_buf_ref(void *data);
+
+/* references currently held to buffer */
+unsigned int lc_buf_refs(void *data);
+
+/* drop a reference, returning buffer to its pool when the last one goes.
+ * Matches lc_free_fn_t, so can be used as msg->free. If data points inside
+ * the buffer rather than at its start, pass the start as hint */
+void *lc_buf_unref(void *data, void *hint);
+
+#endif /* _POOL_H */
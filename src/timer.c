@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only */
+/* Copyright (c) 2021 Brett Sheffield <bacs@librecast.net> */
+
+#include "timer.h"
+#include <stdlib.h>
+
+static void lc_wheel_link(lc_wheel_t *w, lc_timer_t *t)
+{
+	uint64_t expires = t->expires;
+	uint64_t idx;
+	lc_timer_t **slot;
+	int lvl;
+
+	/* nothing is due before the tick being run, and a timer added from a
+	 * callback waits for the next one, so it can't keep the wheel running
+	 * by adding itself again */
+	if (expires < w->now + !!w->running) expires = w->now + !!w->running;
+	idx = expires - w->now;
+	if (idx > LC_WHEEL_MAX) {
+		/* beyond the wheel - park at the far end, and requeue from
+		 * there when it comes round */
+		idx = LC_WHEEL_MAX;
+		expires = w->now + idx;
+	}
+	for (lvl = 0; lvl < LC_WHEEL_LEVELS - 1; lvl++) {
+		if (idx < UINT64_C(1) << (LC_WHEEL_BITS * (lvl + 1))) break;
+	}
+	slot = &w->slot[lvl][(expires >> (LC_WHEEL_BITS * lvl)) & LC_WHEEL_MASK];
+	t->next = *slot;
+	if (t->next) t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+static void lc_wheel_unlink(lc_timer_t *t)
+{
+	*t->pprev = t->next;
+	if (t->next) t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/* move timers in the current slot of level lvl down the wheel. Returns the
+ * slot index, which is 0 when this level has wrapped too */
+static int lc_wheel_cascade(lc_wheel_t *w, int lvl)
+{
+	int idx = (w->now >> (LC_WHEEL_BITS * lvl)) & LC_WHEEL_MASK;
+	lc_timer_t *t = w->slot[lvl][idx], *next;
+
+	w->slot[lvl][idx] = NULL;
+	for (; t; t = next) {
+		next = t->next;
+		lc_wheel_link(w, t);
+	}
+	return idx;
+}
+
+lc_timer_t *lc_wheel_add(lc_wheel_t *w, uint64_t now, uint64_t delay, uint64_t interval,
+		void (*f)(void *), void *arg)
+{
+	lc_timer_t *t;
+
+	if (!(t = malloc(sizeof(lc_timer_t)))) return NULL;
+	/* idle wheel hasn't been kept up to date */
+	if (!w->count && w->now < now) w->now = now;
+	t->expires = now + delay;
+	t->interval = interval;
+	t->f = f;
+	t->arg = arg;
+	lc_wheel_link(w, t);
+	w->count++;
+	return t;
+}
+
+void lc_wheel_del(lc_wheel_t *w, lc_timer_t *t)
+{
+	if (t == w->running) {
+		w->deleted = 1;
+		return;
+	}
+	lc_wheel_unlink(t);
+	w->count--;
+	free(t);
+}
+
+int lc_wheel_run(lc_wheel_t *w, uint64_t now)
+{
+	lc_timer_t *t;
+	int idx, n = 0;
+
+	if (!w->count) {
+		if (w->now <= now) w->now = now + 1;
+		return 0;
+	}
+	for (; w->now <= now; w->now++) {
+		idx = w->now & LC_WHEEL_MASK;
+		if (!idx) {
+			for (int lvl = 1; lvl < LC_WHEEL_LEVELS && !lc_wheel_cascade(w, lvl); lvl++);
+		}
+		while ((t = w->slot[0][idx])) {
+			lc_wheel_unlink(t);
+			if (t->expires > w->now) {
+				/* parked beyond the wheel, not due yet */
+				lc_wheel_link(w, t);
+				continue;
+			}
+			w->running = t;
+			w->deleted = 0;
+			t->f(t->arg);
+			w->running = NULL;
+			n++;
+			if (t->interval && !w->deleted) {
+				t->expires = w->now + t->interval;
+				lc_wheel_link(w, t);
+			}
+			else {
+				w->count--;
+				free(t);
+			}
+		}
+	}
+	return n;
+}
+
+int64_t lc_wheel_timeout(lc_wheel_t *w, uint64_t now)
+{
+	uint64_t tick = w->now;
+
+	if (!w->count) return -1;
+	/* next busy slot on level 0, or else the next cascade */
+	if (tick & LC_WHEEL_MASK) {
+		while (!w->slot[0][tick & LC_WHEEL_MASK] && (++tick & LC_WHEEL_MASK));
+	}
+	return (tick > now) ? (int64_t)(tick - now) : 0;
+}
+
+void lc_wheel_free(lc_wheel_t *w)
+{
+	lc_timer_t *t, *next;
+
+	for (int lvl = 0; lvl < LC_WHEEL_LEVELS; lvl++) {
+		for (int i = 0; i < LC_WHEEL_SLOTS; i++) {
+			for (t = w->slot[lvl][i]; t; t = next) {
+				next = t->next;
+				free(t);
+			}
+			w->slot[lvl][i] = NULL;
+		}
+	}
+	w->count = 0;
+}
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only */
+/* Copyright (c) 2021 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _TIMER_H
+#define _TIMER_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LC_WHEEL_BITS 6
+#define LC_WHEEL_SLOTS (1 << LC_WHEEL_BITS)
+#define LC_WHEEL_MASK (LC_WHEEL_SLOTS - 1)
+#define LC_WHEEL_LEVELS 4 /* 1 ms ticks => range of 2^24 ms (~4.6 hours) */
+#define LC_WHEEL_MAX ((UINT64_C(1) << (LC_WHEEL_BITS * LC_WHEEL_LEVELS)) - 1)
+
+typedef struct lc_timer_s {
+	struct lc_timer_s *next;
+	struct lc_timer_s **pprev;
+	uint64_t expires; /* tick (ms) when timer is due */
+	uint64_t interval; /* ms between runs, 0 = one-shot */
+	void (*f)(void *);
+	void *arg;
+} lc_timer_t;
+
+/* hierarchical timing wheel. Level 0 has one slot per tick, each level
+ * above has slots LC_WHEEL_SLOTS times as wide, which are cascaded down a
+ * level as the wheel below wraps */
+typedef struct lc_wheel_s {
+	lc_timer_t *slot[LC_WHEEL_LEVELS][LC_WHEEL_SLOTS];
+	uint64_t now; /* next tick to process */
+	size_t count; /* timers on wheel */
+	lc_timer_t *running; /* timer whose callback is running */
+	int deleted; /* running timer was deleted by its callback */
+} lc_wheel_t;
+
+/* add timer to call f(arg) at tick now + delay, then every interval ticks
+ * if interval is nonzero. NULL on error */
+lc_timer_t *lc_wheel_add(lc_wheel_t *w, uint64_t now, uint64_t delay, uint64_t interval,
+		void (*f)(void *), void *arg);
+
+/* remove and free timer. Safe to call from the timer's own callback */
+void lc_wheel_del(lc_wheel_t *w, lc_timer_t *t);
+
+/* run every timer due up to and including tick now. Returns number run */
+int lc_wheel_run(lc_wheel_t *w, uint64_t now);
+
+/* ticks from now until the wheel next needs to run, -1 if no timers */
+int64_t lc_wheel_timeout(lc_wheel_t *w, uint64_t now);
+
+/* free all timers */
+void lc_wheel_free(lc_wheel_t *w);
+
+#endif /* _TIMER_H */
@@ -0,0 +1,255 @@
+/* SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only */
+/* Copyright (c) 2021 Brett Sheffield <bacs@librecast.net> */
+
+#define _GNU_SOURCE
+#include "uring.h"
+
+#ifdef LC_URING
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define lc_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define lc_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int lc_uring_setup(unsigned entries, struct io_uring_params *p, unsigned flags)
+{
+	memset(p, 0, sizeof(struct io_uring_params));
+	p->flags = flags;
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+int lc_uring_init(lc_uring_t *r, unsigned entries)
+{
+	struct io_uring_params p;
+	int err;
+
+	memset(r, 0, sizeof(lc_uring_t));
+	r->fd = -1;
+#ifdef IORING_SETUP_COOP_TASKRUN
+	/* we always reap from the submitting thread, so the kernel needn't
+	 * interrupt it to run completions (5.19+, retry without) */
+	r->fd = lc_uring_setup(entries, &p, IORING_SETUP_COOP_TASKRUN);
+#endif
+	if (r->fd == -1) r->fd = lc_uring_setup(entries, &p, 0);
+	if (r->fd == -1) return -1;
+
+	r->sq_mapsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_mapsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_mapsz > r->sq_mapsz) r->sq_mapsz = r->cq_mapsz;
+		r->cq_mapsz = 0;
+	}
+	r->sq_map = mmap(NULL, r->sq_mapsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED) goto err_0;
+	if (r->cq_mapsz) {
+		r->cq_map = mmap(NULL, r->cq_mapsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_map == MAP_FAILED) goto err_0;
+	}
+	else r->cq_map = r->sq_map;
+	r->sqes_mapsz = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_mapsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) goto err_0;
+
+	r->sq_head = (unsigned *)((char *)r->sq_map + p.sq_off.head);
+	r->sq_tail = (unsigned *)((char *)r->sq_map + p.sq_off.tail);
+	r->sq_array = (unsigned *)((char *)r->sq_map + p.sq_off.array);
+	r->sq_mask = *(unsigned *)((char *)r->sq_map + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->sq_local = *r->sq_tail;
+	r->cq_head = (unsigned *)((char *)r->cq_map + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->cq_map + p.cq_off.tail);
+	r->cq_mask = *(unsigned *)((char *)r->cq_map + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_map + p.cq_off.cqes);
+
+	/* sqes are used in ring order, so the indirection array never changes */
+	for (unsigned i = 0; i < r->sq_entries; i++) r->sq_array[i] = i;
+
+	return 0;
+err_0:
+	err = errno;
+	if (r->sqes == MAP_FAILED) r->sqes = NULL;
+	if (r->cq_map == MAP_FAILED) r->cq_map = NULL;
+	if (r->sq_map == MAP_FAILED) r->sq_map = NULL;
+	lc_uring_free(r);
+	errno = err;
+	return -1;
+}
+
+int lc_uring_probe(void)
+{
+	lc_uring_t r;
+	int rc;
+
+	if (lc_uring_init(&r, 2) == -1) return -1;
+	rc = lc_uring_buf_ring(&r, 1, 0);
+	lc_uring_free(&r);
+	return rc;
+}
+
+void lc_uring_free(lc_uring_t *r)
+{
+	if (r->sqes) munmap(r->sqes, r->sqes_mapsz);
+	if (r->cq_map && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_mapsz);
+	if (r->sq_map) munmap(r->sq_map, r->sq_mapsz);
+	if (r->fd > 0) close(r->fd);
+	free(r->br); /* kernel lets go of it with the ring */
+	memset(r, 0, sizeof(lc_uring_t));
+	r->fd = -1;
+}
+
+struct io_uring_sqe *lc_uring_sqe(lc_uring_t *r)
+{
+	struct io_uring_sqe *sqe;
+
+	if (r->sq_local - lc_load_acquire(r->sq_head) >= r->sq_entries) return NULL;
+	sqe = &r->sqes[r->sq_local++ & r->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+int lc_uring_enter(lc_uring_t *r, unsigned wait)
+{
+	/* everything the kernel hasn't taken yet, including any left over by
+	 * a failed or short submit */
+	unsigned submit = r->sq_local - lc_load_acquire(r->sq_head);
+	int rc;
+
+	lc_store_release(r->sq_tail, r->sq_local);
+	if (!submit && !wait) return 0;
+	do {
+		r->enters++;
+		rc = (int)syscall(__NR_io_uring_enter, r->fd, submit, wait,
+				wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	}
+	while (rc == -1 && errno == EINTR);
+	return rc;
+}
+
+struct io_uring_cqe *lc_uring_cqe(lc_uring_t *r)
+{
+	unsigned head = *r->cq_head;
+
+	if (head == lc_load_acquire(r->cq_tail)) return NULL;
+	return &r->cqes[head & r->cq_mask];
+}
+
+void lc_uring_cqe_seen(lc_uring_t *r)
+{
+	lc_store_release(r->cq_head, *r->cq_head + 1);
+}
+
+int lc_uring_buf_ring(lc_uring_t *r, unsigned entries, uint16_t bgid)
+{
+	struct io_uring_buf_reg reg = {0};
+	int err;
+
+	r->br_sz = entries * sizeof(struct io_uring_buf);
+	if ((err = posix_memalign((void **)&r->br, sysconf(_SC_PAGESIZE), r->br_sz))) {
+		r->br = NULL;
+		errno = err;
+		return -1;
+	}
+	memset(r->br, 0, r->br_sz);
+	reg.ring_addr = (uintptr_t)r->br;
+	reg.ring_entries = entries;
+	reg.bgid = bgid;
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		err = errno;
+		free(r->br);
+		r->br = NULL;
+		errno = err;
+		return -1;
+	}
+	r->br_entries = entries;
+	r->br_tail = 0;
+	r->bgid = bgid;
+	return 0;
+}
+
+void lc_uring_buf_add(lc_uring_t *r, void *addr, unsigned len, uint16_t bid)
+{
+	struct io_uring_buf *buf = &r->br->bufs[r->br_tail++ & (r->br_entries - 1)];
+
+	buf->addr = (uintptr_t)addr;
+	buf->len = len;
+	buf->bid = bid;
+}
+
+void lc_uring_buf_commit(lc_uring_t *r)
+{
+	lc_store_release(&r->br->tail, r->br_tail);
+}
+
+int lc_uring_sendmmsg(lc_uring_t *r, int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	struct io_uring_sqe *sqe, *last = NULL;
+	struct io_uring_cqe *cqe;
+	unsigned int i, n, ok, reaped, sent = 0;
+	int rc, err = 0;
+
+	while (sent < vlen) {
+		/* linked, so they go out in order and a failure cancels the
+		 * rest, just as sendmmsg() stops at the first error */
+		for (n = 0; sent + n < vlen && (sqe = lc_uring_sqe(r)); n++) {
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = fd;
+			sqe->addr = (uintptr_t)&msgvec[sent + n].msg_hdr;
+			sqe->len = 1;
+			sqe->msg_flags = flags;
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = sent + n;
+			last = sqe;
+		}
+		if (!n) {
+			err = EBUSY;
+			break;
+		}
+		last->flags = 0;
+		if ((rc = lc_uring_enter(r, n)) < (int)n) {
+			/* the kernel doesn't wait after a short submit. Take
+			 * back the sqes it didn't take, so they aren't left for
+			 * the next caller to submit, and send them next time
+			 * round once what it did take is reaped */
+			if (rc == -1) {
+				err = errno;
+				rc = 0;
+			}
+			r->sq_local -= n - rc;
+			lc_store_release(r->sq_tail, r->sq_local);
+			if (!(n = rc)) break;
+		}
+		/* everything submitted is reaped before msgvec goes back to the
+		 * caller. It completes whatever io_uring_enter() says */
+		for (ok = n, reaped = 0; reaped < n; reaped++) {
+			while (!(cqe = lc_uring_cqe(r))) {
+				if (lc_uring_enter(r, n - reaped) == -1) sched_yield();
+			}
+			i = (unsigned int)cqe->user_data - sent;
+			if (cqe->res >= 0) msgvec[sent + i].msg_len = cqe->res;
+			else if (i < ok) {
+				/* first failure wins over the cancellations after it */
+				ok = i;
+				err = -cqe->res;
+			}
+			lc_uring_cqe_seen(r);
+		}
+		sent += ok;
+		if (ok < n) break;
+	}
+	if (!sent && err) {
+		errno = err;
+		return -1;
+	}
+	return sent;
+}
+
+#endif /* LC_URING */
@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only */
+/* Copyright (c) 2021 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _URING_H
+#define _URING_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__linux__) && defined(IORING_RECV_MULTISHOT)
+#define LC_URING 1
+
+struct mmsghdr;
+
+/* io_uring driven with raw syscalls. Submission and completion rings are
+ * shared with the kernel, so queueing work and reaping results is just
+ * memory access - only io_uring_enter() costs a syscall */
+typedef struct lc_uring_s {
+	int fd;
+	/* submission queue */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_local; /* our tail, published on submit */
+	struct io_uring_sqe *sqes;
+	/* completion queue */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	/* provided buffer ring, NULL = none */
+	struct io_uring_buf_ring *br;
+	unsigned br_entries;
+	uint16_t br_tail;
+	uint16_t bgid;
+	/* mappings */
+	void *sq_map;
+	void *cq_map;
+	size_t sq_mapsz;
+	size_t cq_mapsz;
+	size_t sqes_mapsz;
+	size_t br_sz;
+	/* stats */
+	uint64_t enters; /* io_uring_enter() calls */
+} lc_uring_t;
+
+/* set up ring with (at least) entries submission queue entries. 0 on
+ * success, -1 on error with errno set */
+int lc_uring_init(lc_uring_t *r, unsigned entries);
+
+/* check the kernel has io_uring with provided buffer rings. 0 if so, -1 with
+ * errno set if not */
+int lc_uring_probe(void);
+
+/* unmap ring and close it. Safe on a zeroed ring */
+void lc_uring_free(lc_uring_t *r);
+
+/* next free submission queue entry, cleared. NULL if the queue is full */
+struct io_uring_sqe *lc_uring_sqe(lc_uring_t *r);
+
+/* submit queued entries, including any an earlier call didn't get in, and
+ * wait for at least wait completions. Returns entries submitted, which may
+ * be fewer than queued, or -1 on error with errno set */
+int lc_uring_enter(lc_uring_t *r, unsigned wait);
+
+/* next completion, NULL if none. Call lc_uring_cqe_seen() when done with it */
+struct io_uring_cqe *lc_uring_cqe(lc_uring_t *r);
+
+/* release completion returned by lc_uring_cqe() */
+void lc_uring_cqe_seen(lc_uring_t *r);
+
+/* register a ring of entries (power of 2) provided buffers as group bgid.
+ * Buffers are added with lc_uring_buf_add() and handed to the kernel by
+ * lc_uring_buf_commit(). 0 on success, -1 on error with errno set */
+int lc_uring_buf_ring(lc_uring_t *r, unsigned entries, uint16_t bgid);
+
+/* queue buffer bid of len bytes at addr for the kernel */
+void lc_uring_buf_add(lc_uring_t *r, void *addr, unsigned len, uint16_t bid);
+
+/* make queued buffers visible to the kernel */
+void lc_uring_buf_commit(lc_uring_t *r);
+
+/* as sendmmsg(2), with one IORING_OP_SENDMSG per message, all submitted
+ * and reaped with a single io_uring_enter() */
+int lc_uring_sendmmsg(lc_uring_t *r, int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+
+#endif /* __linux__ && IORING_RECV_MULTISHOT */
+
+#endif /* _URING_H */
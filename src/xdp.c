@@ -0,0 +1,584 @@
+/* SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only */
+/* Copyright (c) 2021 Brett Sheffield <bacs@librecast.net> */
+
+#define _GNU_SOURCE
+#include "xdp.h"
+
+#ifdef LC_XDP
+#include <arpa/inet.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define lc_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define lc_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+#define LC_XDP_ETH_TYPE 12 /* offset of ethertype in frame */
+#define LC_XDP_IP6 14 /* offset of IPv6 header in frame */
+#define LC_XDP_UDP 54 /* offset of UDP header in frame */
+#define LC_XDP_RETRIES 1000 /* waits for a send frame before giving up */
+
+#define LC_BPF_INSN(c, d, s, o, i) \
+	((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+static int lc_bpf(int cmd, union bpf_attr *attr)
+{
+	return (int)syscall(__NR_bpf, cmd, attr, sizeof(union bpf_attr));
+}
+
+/* XDP program: IPv6 multicast UDP to port for a group in groups goes to the
+ * AF_XDP socket in map for the receiving queue, everything else on to the
+ * kernel stack */
+static int lc_xdp_prog(int mapfd, int groupfd, uint16_t port)
+{
+	enum { PASS = 30 }; /* index of the pass instructions */
+	const struct bpf_insn prog[] = {
+		/* 0: r6 = ctx, r2 = data, r3 = data_end */
+		LC_BPF_INSN(BPF_ALU64|BPF_MOV|BPF_X, 6, 1, 0, 0),
+		LC_BPF_INSN(BPF_LDX|BPF_W|BPF_MEM, 2, 6, offsetof(struct xdp_md, data), 0),
+		LC_BPF_INSN(BPF_LDX|BPF_W|BPF_MEM, 3, 6, offsetof(struct xdp_md, data_end), 0),
+		/* 3: headers all there? */
+		LC_BPF_INSN(BPF_ALU64|BPF_MOV|BPF_X, 4, 2, 0, 0),
+		LC_BPF_INSN(BPF_ALU64|BPF_ADD|BPF_K, 4, 0, 0, LC_XDP_HDRLEN),
+		LC_BPF_INSN(BPF_JMP|BPF_JGT|BPF_X, 4, 3, PASS - 6, 0),
+		/* 6: ethertype IPv6 */
+		LC_BPF_INSN(BPF_LDX|BPF_H|BPF_MEM, 4, 2, LC_XDP_ETH_TYPE, 0),
+		LC_BPF_INSN(BPF_JMP|BPF_JNE|BPF_K, 4, 0, PASS - 8, htons(ETH_P_IPV6)),
+		/* 8: next header UDP */
+		LC_BPF_INSN(BPF_LDX|BPF_B|BPF_MEM, 4, 2, LC_XDP_IP6 + offsetof(struct ip6_hdr, ip6_nxt), 0),
+		LC_BPF_INSN(BPF_JMP|BPF_JNE|BPF_K, 4, 0, PASS - 10, IPPROTO_UDP),
+		/* 10: multicast destination */
+		LC_BPF_INSN(BPF_LDX|BPF_B|BPF_MEM, 4, 2, LC_XDP_IP6 + offsetof(struct ip6_hdr, ip6_dst), 0),
+		LC_BPF_INSN(BPF_JMP|BPF_JNE|BPF_K, 4, 0, PASS - 12, 0xff),
+		/* 12: destination port */
+		LC_BPF_INSN(BPF_LDX|BPF_H|BPF_MEM, 4, 2, LC_XDP_UDP + offsetof(struct udphdr, uh_dport), 0),
+		LC_BPF_INSN(BPF_JMP|BPF_JNE|BPF_K, 4, 0, PASS - 14, htons(port)),
+		/* 14: destination onto the stack, as the key */
+		LC_BPF_INSN(BPF_LDX|BPF_DW|BPF_MEM, 4, 2, LC_XDP_IP6 + offsetof(struct ip6_hdr, ip6_dst), 0),
+		LC_BPF_INSN(BPF_STX|BPF_DW|BPF_MEM, 10, 4, -16, 0),
+		LC_BPF_INSN(BPF_LDX|BPF_DW|BPF_MEM, 4, 2, LC_XDP_IP6 + offsetof(struct ip6_hdr, ip6_dst) + 8, 0),
+		LC_BPF_INSN(BPF_STX|BPF_DW|BPF_MEM, 10, 4, -8, 0),
+		/* 18: one of our groups? bpf_map_lookup_elem(groups, key) */
+		LC_BPF_INSN(BPF_ALU64|BPF_MOV|BPF_X, 2, 10, 0, 0),
+		LC_BPF_INSN(BPF_ALU64|BPF_ADD|BPF_K, 2, 0, 0, -16),
+		LC_BPF_INSN(BPF_LD|BPF_DW|BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, groupfd),
+		LC_BPF_INSN(0, 0, 0, 0, 0),
+		LC_BPF_INSN(BPF_JMP|BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+		LC_BPF_INSN(BPF_JMP|BPF_JEQ|BPF_K, 0, 0, PASS - 24, 0),
+		/* 24: return bpf_redirect_map(map, rx_queue_index, XDP_PASS) */
+		LC_BPF_INSN(BPF_LDX|BPF_W|BPF_MEM, 2, 6, offsetof(struct xdp_md, rx_queue_index), 0),
+		LC_BPF_INSN(BPF_LD|BPF_DW|BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, mapfd),
+		LC_BPF_INSN(0, 0, 0, 0, 0),
+		LC_BPF_INSN(BPF_ALU64|BPF_MOV|BPF_K, 3, 0, 0, XDP_PASS),
+		LC_BPF_INSN(BPF_JMP|BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+		LC_BPF_INSN(BPF_JMP|BPF_EXIT, 0, 0, 0, 0),
+		/* 30: pass */
+		LC_BPF_INSN(BPF_ALU64|BPF_MOV|BPF_K, 0, 0, 0, XDP_PASS),
+		LC_BPF_INSN(BPF_JMP|BPF_EXIT, 0, 0, 0, 0),
+	};
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof attr);
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.expected_attach_type = BPF_XDP;
+	attr.insns = (uintptr_t)prog;
+	attr.insn_cnt = sizeof prog / sizeof prog[0];
+	attr.license = (uintptr_t)"GPL";
+	return lc_bpf(BPF_PROG_LOAD, &attr);
+}
+
+/* XSKMAP holding xdp's socket at key 0, and xdp->groupfd, with the program
+ * attached to ifx in generic mode. Returns the link fd, which detaches the
+ * program when closed */
+static int lc_xdp_attach(lc_xdp_t *xdp, unsigned int ifx, uint16_t port)
+{
+	union bpf_attr attr;
+	uint32_t key = 0;
+	int mapfd, progfd, linkfd = -1, err;
+
+	memset(&attr, 0, sizeof attr);
+	attr.map_type = BPF_MAP_TYPE_HASH;
+	attr.key_size = sizeof(struct in6_addr);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = LC_XDP_GROUPS;
+	attr.map_flags = BPF_F_NO_PREALLOC;
+	if ((xdp->groupfd = lc_bpf(BPF_MAP_CREATE, &attr)) == -1) return -1;
+	memset(&attr, 0, sizeof attr);
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(int);
+	attr.max_entries = 1;
+	if ((mapfd = lc_bpf(BPF_MAP_CREATE, &attr)) == -1) return -1;
+	memset(&attr, 0, sizeof attr);
+	attr.map_fd = mapfd;
+	attr.key = (uintptr_t)&key;
+	attr.value = (uintptr_t)&xdp->fd;
+	if (lc_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1) goto err_0;
+	if ((progfd = lc_xdp_prog(mapfd, xdp->groupfd, port)) == -1) goto err_0;
+	memset(&attr, 0, sizeof attr);
+	attr.link_create.prog_fd = progfd;
+	attr.link_create.target_ifindex = ifx;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+	linkfd = lc_bpf(BPF_LINK_CREATE, &attr);
+	err = errno;
+	/* the link holds the program, which holds the maps. We keep groupfd
+	 * to update it */
+	close(progfd);
+	close(mapfd);
+	errno = err;
+	return linkfd;
+err_0:
+	err = errno;
+	close(mapfd);
+	errno = err;
+	return -1;
+}
+
+int lc_xdp_group(lc_xdp_t *xdp, const struct in6_addr *grp, int add)
+{
+	union bpf_attr attr;
+	uint32_t refs = 0;
+	int rc = 0;
+
+	memset(&attr, 0, sizeof attr);
+	attr.map_fd = xdp->groupfd;
+	attr.key = (uintptr_t)grp;
+	attr.value = (uintptr_t)&refs;
+	pthread_mutex_lock(&xdp->mtx);
+	if (xdp->closed) {
+		pthread_mutex_unlock(&xdp->mtx);
+		errno = EBADF;
+		return -1;
+	}
+	/* counted, as more than one channel bound may have the group. refs
+	 * stays 0 if it isn't there */
+	lc_bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+	if (add) {
+		refs++;
+		rc = lc_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+	}
+	else if (refs > 1) {
+		refs--;
+		rc = lc_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+	}
+	else if (refs) {
+		attr.value = 0; /* delete takes only the key */
+		rc = lc_bpf(BPF_MAP_DELETE_ELEM, &attr);
+	}
+	pthread_mutex_unlock(&xdp->mtx);
+	return (rc == -1) ? -1 : 0;
+}
+
+static int lc_xdp_ring_map(int fd, lc_xdp_ring_t *ring, struct xdp_ring_offset *off,
+		size_t descsz, off_t pgoff)
+{
+	ring->mapsz = off->desc + LC_XDP_RING * descsz;
+	ring->map = mmap(NULL, ring->mapsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			fd, pgoff);
+	if (ring->map == MAP_FAILED) {
+		ring->map = NULL;
+		return -1;
+	}
+	ring->producer = (uint32_t *)((char *)ring->map + off->producer);
+	ring->consumer = (uint32_t *)((char *)ring->map + off->consumer);
+	ring->flags = (uint32_t *)((char *)ring->map + off->flags);
+	ring->desc = (char *)ring->map + off->desc;
+	ring->size = LC_XDP_RING;
+	ring->mask = LC_XDP_RING - 1;
+	return 0;
+}
+
+static int lc_xdp_rings(lc_xdp_t *xdp)
+{
+	struct xdp_umem_reg mr = {
+		.addr = (uintptr_t)xdp->umem,
+		.len = (uint64_t)LC_XDP_FRAMES * LC_XDP_FRAMESZ,
+		.chunk_size = LC_XDP_FRAMESZ,
+	};
+	struct xdp_mmap_offsets off;
+	socklen_t optlen = sizeof off;
+	int sz = LC_XDP_RING;
+
+	if (setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof mr) == -1) return -1;
+	if (setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_FILL_RING, &sz, sizeof sz) == -1) return -1;
+	if (setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &sz, sizeof sz) == -1) return -1;
+	if (setsockopt(xdp->fd, SOL_XDP, XDP_RX_RING, &sz, sizeof sz) == -1) return -1;
+	if (setsockopt(xdp->fd, SOL_XDP, XDP_TX_RING, &sz, sizeof sz) == -1) return -1;
+	if (getsockopt(xdp->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) == -1) return -1;
+	if (lc_xdp_ring_map(xdp->fd, &xdp->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING))
+		return -1;
+	if (lc_xdp_ring_map(xdp->fd, &xdp->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING))
+		return -1;
+	if (lc_xdp_ring_map(xdp->fd, &xdp->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING))
+		return -1;
+	if (lc_xdp_ring_map(xdp->fd, &xdp->comp, &off.cr, sizeof(uint64_t),
+				XDP_UMEM_PGOFF_COMPLETION_RING))
+		return -1;
+	return 0;
+}
+
+/* hardware address of ifx, and an address to send from - global if it has
+ * one, else link local, else unspecified */
+static int lc_xdp_ifaddrs(lc_xdp_t *xdp)
+{
+	struct ifaddrs *ifaddr, *ifa;
+	struct sockaddr_in6 *sa;
+	char ifname[IF_NAMESIZE];
+	int found = 0;
+
+	if (!if_indextoname(xdp->ifx, ifname)) return -1;
+	if (getifaddrs(&ifaddr) == -1) return -1;
+	for (ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
+		if (!ifa->ifa_addr || strcmp(ifa->ifa_name, ifname)) continue;
+		if (ifa->ifa_addr->sa_family == AF_PACKET) {
+			memcpy(xdp->mac, ((struct sockaddr_ll *)ifa->ifa_addr)->sll_addr, sizeof xdp->mac);
+		}
+		else if (ifa->ifa_addr->sa_family == AF_INET6 && found < 2) {
+			sa = (struct sockaddr_in6 *)ifa->ifa_addr;
+			if (IN6_IS_ADDR_LINKLOCAL(&sa->sin6_addr)) {
+				if (found) continue;
+				found = 1;
+			}
+			else found = 2;
+			xdp->src = sa->sin6_addr;
+		}
+	}
+	freeifaddrs(ifaddr);
+	return 0;
+}
+
+static void lc_xdp_destroy(lc_xdp_t *xdp)
+{
+	if (xdp->umem) munmap(xdp->umem, (size_t)LC_XDP_FRAMES * LC_XDP_FRAMESZ);
+	pthread_mutex_destroy(&xdp->mtx);
+	free(xdp);
+}
+
+void lc_xdp_release(lc_xdp_t *xdp)
+{
+	lc_xdp_ring_t *ring[] = { &xdp->rx, &xdp->tx, &xdp->fill, &xdp->comp };
+	int out;
+
+	pthread_mutex_lock(&xdp->mtx);
+	if (xdp->linkfd >= 0) close(xdp->linkfd);
+	if (xdp->groupfd >= 0) close(xdp->groupfd);
+	if (xdp->fd >= 0) close(xdp->fd);
+	xdp->linkfd = xdp->groupfd = xdp->fd = -1;
+	for (size_t i = 0; i < sizeof ring / sizeof ring[0]; i++) {
+		if (ring[i]->map) munmap(ring[i]->map, ring[i]->mapsz);
+		ring[i]->map = NULL;
+	}
+	/* the UMEM is ours, and stays until messages are done with it */
+	xdp->closed = 1;
+	out = xdp->out;
+	pthread_mutex_unlock(&xdp->mtx);
+	if (!out) lc_xdp_destroy(xdp);
+}
+
+lc_xdp_t *lc_xdp_new(unsigned int ifx, uint16_t port)
+{
+	struct sockaddr_xdp sxdp = {
+		.sxdp_family = AF_XDP,
+		.sxdp_ifindex = ifx,
+		.sxdp_queue_id = 0,
+		/* generic mode copies, but works with any driver */
+		.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP,
+	};
+	uint64_t *fill;
+	lc_xdp_t *xdp;
+	int err;
+
+	if (!(xdp = calloc(1, sizeof(lc_xdp_t)))) return NULL;
+	pthread_mutex_init(&xdp->mtx, NULL);
+	xdp->fd = xdp->linkfd = xdp->groupfd = -1;
+	xdp->ifx = ifx;
+	xdp->umem = mmap(NULL, (size_t)LC_XDP_FRAMES * LC_XDP_FRAMESZ, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (xdp->umem == MAP_FAILED) {
+		err = errno;
+		xdp->umem = NULL;
+		lc_xdp_destroy(xdp);
+		errno = err;
+		return NULL;
+	}
+	if (lc_xdp_ifaddrs(xdp) == -1) goto err_0;
+	if ((xdp->fd = socket(AF_XDP, SOCK_RAW, 0)) == -1) goto err_0;
+	if (lc_xdp_rings(xdp) == -1) goto err_0;
+
+	/* first half of the UMEM receives, second half sends */
+	fill = xdp->fill.desc;
+	for (uint32_t i = 0; i < LC_XDP_FRAMES / 2; i++) fill[i] = (uint64_t)i * LC_XDP_FRAMESZ;
+	lc_store_release(xdp->fill.producer, LC_XDP_FRAMES / 2);
+	for (size_t i = 0; i < LC_XDP_FRAMES / 2; i++) {
+		xdp->txfree[i] = (uint64_t)(LC_XDP_FRAMES / 2 + i) * LC_XDP_FRAMESZ;
+	}
+	xdp->ntxfree = LC_XDP_FRAMES / 2;
+
+	if (bind(xdp->fd, (struct sockaddr *)&sxdp, sizeof sxdp) == -1) goto err_0;
+	if ((xdp->linkfd = lc_xdp_attach(xdp, ifx, port)) == -1) goto err_0;
+	return xdp;
+err_0:
+	err = errno;
+	lc_xdp_release(xdp);
+	errno = err;
+	return NULL;
+}
+
+/* move completed sends back to the free list. Call with mtx held */
+static void lc_xdp_reap(lc_xdp_t *xdp)
+{
+	uint32_t cons = *xdp->comp.consumer;
+	uint32_t prod = lc_load_acquire(xdp->comp.producer);
+	uint64_t *addr = xdp->comp.desc;
+
+	for (; cons != prod; cons++) xdp->txfree[xdp->ntxfree++] = addr[cons & xdp->comp.mask];
+	lc_store_release(xdp->comp.consumer, cons);
+}
+
+/* hand frames released by messages back to the kernel. Call with mtx held */
+static void lc_xdp_refill(lc_xdp_t *xdp)
+{
+	uint32_t prod = *xdp->fill.producer;
+	uint32_t cons = lc_load_acquire(xdp->fill.consumer);
+	uint64_t *addr = xdp->fill.desc;
+
+	if (!xdp->nrxfree) return;
+	for (; xdp->nrxfree && prod - cons < xdp->fill.size; prod++) {
+		addr[prod & xdp->fill.mask] = xdp->rxfree[--xdp->nrxfree];
+	}
+	lc_store_release(xdp->fill.producer, prod);
+}
+
+static int lc_xdp_wakeup(lc_xdp_t *xdp)
+{
+	/* copy mode sends from sendmsg(), so this is always needed there */
+	if (!(lc_load_acquire(xdp->tx.flags) & XDP_RING_NEED_WAKEUP)) return 0;
+	if (sendto(xdp->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1) {
+		/* busy or out of buffers - the sends stay queued */
+		if (errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) return -1;
+	}
+	return 0;
+}
+
+int lc_xdp_kick(lc_xdp_t *xdp)
+{
+	int rc;
+
+	pthread_mutex_lock(&xdp->mtx);
+	if (xdp->closed) {
+		pthread_mutex_unlock(&xdp->mtx);
+		errno = EBADF;
+		return -1;
+	}
+	rc = lc_xdp_wakeup(xdp);
+	lc_xdp_reap(xdp);
+	pthread_mutex_unlock(&xdp->mtx);
+	return rc;
+}
+
+/* UDP checksum over the IPv6 pseudo header and len bytes of UDP header and
+ * payload. Ones' complement sums don't care about byte order, so this adds
+ * native words and the result is stored as is */
+static uint16_t lc_xdp_csum(const struct in6_addr *src, const struct in6_addr *dst,
+		const char *udp, size_t len)
+{
+	uint64_t sum = htons((uint16_t)len) + htons(IPPROTO_UDP);
+	uint16_t w;
+	size_t i;
+
+	for (i = 0; i < sizeof(struct in6_addr); i += 2) {
+		memcpy(&w, &src->s6_addr[i], 2);
+		sum += w;
+		memcpy(&w, &dst->s6_addr[i], 2);
+		sum += w;
+	}
+	for (i = 0; i + 1 < len; i += 2) {
+		memcpy(&w, udp + i, 2);
+		sum += w;
+	}
+	if (len & 1) {
+		w = 0;
+		memcpy(&w, udp + len - 1, 1);
+		sum += w;
+	}
+	while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+	w = ~sum;
+	return w ? w : 0xffff; /* zero means no checksum */
+}
+
+/* ethernet, IPv6 and UDP headers for len bytes of payload to dst */
+static void lc_xdp_headers(lc_xdp_t *xdp, char *frame, const struct sockaddr_in6 *dst, size_t len)
+{
+	struct ip6_hdr ip6 = {0};
+	struct udphdr udp = {0};
+	const uint16_t ethertype = htons(ETH_P_IPV6);
+
+	/* multicast MAC is 33:33 and the low 32 bits of the group */
+	frame[0] = frame[1] = 0x33;
+	memcpy(frame + 2, &dst->sin6_addr.s6_addr[12], 4);
+	memcpy(frame + 6, xdp->mac, sizeof xdp->mac);
+	memcpy(frame + LC_XDP_ETH_TYPE, &ethertype, sizeof ethertype);
+	ip6.ip6_flow = htonl(6 << 28);
+	ip6.ip6_plen = htons(sizeof udp + len);
+	ip6.ip6_nxt = IPPROTO_UDP;
+	ip6.ip6_hlim = xdp->hops;
+	ip6.ip6_src = xdp->src;
+	ip6.ip6_dst = dst->sin6_addr;
+	memcpy(frame + LC_XDP_IP6, &ip6, sizeof ip6);
+	udp.uh_sport = dst->sin6_port;
+	udp.uh_dport = dst->sin6_port;
+	udp.uh_ulen = htons(sizeof udp + len);
+	memcpy(frame + LC_XDP_UDP, &udp, sizeof udp);
+	udp.uh_sum = lc_xdp_csum(&ip6.ip6_src, &ip6.ip6_dst, frame + LC_XDP_UDP, sizeof udp + len);
+	memcpy(frame + LC_XDP_UDP + offsetof(struct udphdr, uh_sum), &udp.uh_sum, sizeof udp.uh_sum);
+}
+
+ssize_t lc_xdp_send(lc_xdp_t *xdp, const struct sockaddr_in6 *dst, const struct iovec *iov,
+		int iovcnt, int kick)
+{
+	struct xdp_desc *desc;
+	char *frame, *p;
+	uint32_t prod;
+	size_t len = 0;
+	int err = 0;
+
+	for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+	if (LC_XDP_HDRLEN + len > LC_XDP_FRAMESZ) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	pthread_mutex_lock(&xdp->mtx);
+	for (int i = 0; !xdp->closed; i++) {
+		lc_xdp_reap(xdp);
+		if (xdp->ntxfree) break;
+		/* every frame in flight. Push them out and wait for some */
+		if (i == LC_XDP_RETRIES || lc_xdp_wakeup(xdp) == -1) {
+			err = (i == LC_XDP_RETRIES) ? ENOBUFS : errno;
+			break;
+		}
+		pthread_mutex_unlock(&xdp->mtx);
+		sched_yield();
+		pthread_mutex_lock(&xdp->mtx);
+	}
+	if (xdp->closed) err = EBADF;
+	if (err) {
+		pthread_mutex_unlock(&xdp->mtx);
+		errno = err;
+		return -1;
+	}
+	/* as many tx descriptors as send frames, so there is room */
+	prod = *xdp->tx.producer;
+	desc = &((struct xdp_desc *)xdp->tx.desc)[prod & xdp->tx.mask];
+	desc->addr = xdp->txfree[--xdp->ntxfree];
+	desc->len = LC_XDP_HDRLEN + len;
+	desc->options = 0;
+	frame = xdp->umem + desc->addr;
+	p = frame + LC_XDP_HDRLEN;
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+	lc_xdp_headers(xdp, frame, dst, len);
+	lc_store_release(xdp->tx.producer, prod + 1);
+	if (kick && lc_xdp_wakeup(xdp) == -1) err = errno;
+	pthread_mutex_unlock(&xdp->mtx);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return len;
+}
+
+/* UDP datagram in frame of len bytes. -1 if it isn't IPv6 UDP */
+static int lc_xdp_parse(char *frame, size_t len, lc_xdp_pkt_t *pkt)
+{
+	struct ip6_hdr ip6;
+	struct udphdr udp;
+	uint16_t ethertype;
+	size_t ulen;
+
+	if (len < LC_XDP_HDRLEN) return -1;
+	memcpy(&ethertype, frame + LC_XDP_ETH_TYPE, sizeof ethertype);
+	memcpy(&ip6, frame + LC_XDP_IP6, sizeof ip6);
+	memcpy(&udp, frame + LC_XDP_UDP, sizeof udp);
+	if (ethertype != htons(ETH_P_IPV6) || ip6.ip6_nxt != IPPROTO_UDP) return -1;
+	ulen = ntohs(udp.uh_ulen);
+	if (ulen < sizeof udp || ulen > len - LC_XDP_UDP) return -1;
+	/* drop what the kernel would: IPv6 UDP must have a checksum, and summing
+	 * a good one in with the rest leaves nothing to complement */
+	if (!udp.uh_sum || lc_xdp_csum(&ip6.ip6_src, &ip6.ip6_dst, frame + LC_XDP_UDP, ulen) != 0xffff)
+		return -1;
+	ulen -= sizeof udp;
+	pkt->data = frame + LC_XDP_HDRLEN;
+	pkt->len = ulen;
+	pkt->src = ip6.ip6_src;
+	pkt->dst = ip6.ip6_dst;
+	pkt->dport = udp.uh_dport;
+	return 0;
+}
+
+/* put the receive frame holding data on the free list. Call with mtx held */
+static void lc_xdp_push(lc_xdp_t *xdp, char *data)
+{
+	uint64_t addr = (uint64_t)(data - xdp->umem) & ~(uint64_t)(LC_XDP_FRAMESZ - 1);
+	xdp->rxfree[xdp->nrxfree++] = addr;
+}
+
+int lc_xdp_recv(lc_xdp_t *xdp, lc_xdp_pkt_t *pkt, int block)
+{
+	struct pollfd pfd = { .fd = xdp->fd, .events = POLLIN };
+	struct xdp_desc *desc = xdp->rx.desc;
+	uint32_t cons, prod;
+	char *frame;
+	int rc;
+
+	for (;;) {
+		pthread_mutex_lock(&xdp->mtx);
+		lc_xdp_refill(xdp);
+		pthread_mutex_unlock(&xdp->mtx);
+		cons = *xdp->rx.consumer;
+		prod = lc_load_acquire(xdp->rx.producer);
+		while (cons != prod) {
+			frame = xdp->umem + desc[cons & xdp->rx.mask].addr;
+			rc = lc_xdp_parse(frame, desc[cons & xdp->rx.mask].len, pkt);
+			lc_store_release(xdp->rx.consumer, ++cons);
+			pthread_mutex_lock(&xdp->mtx);
+			if (rc) lc_xdp_push(xdp, frame);
+			else xdp->out++;
+			pthread_mutex_unlock(&xdp->mtx);
+			if (!rc) return 1;
+		}
+		if (!block) return 0;
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR) return -1;
+	}
+}
+
+void *lc_xdp_free(void *data, void *hint)
+{
+	lc_xdp_t *xdp = hint;
+	int destroy;
+
+	if (!xdp) return NULL;
+	pthread_mutex_lock(&xdp->mtx);
+	lc_xdp_push(xdp, data);
+	destroy = (!--xdp->out && xdp->closed);
+	pthread_mutex_unlock(&xdp->mtx);
+	if (destroy) lc_xdp_destroy(xdp);
+	return NULL;
+}
+
+#endif /* LC_XDP */
@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only */
+/* Copyright (c) 2021 Brett Sheffield <bacs@librecast.net> */
+
+#ifndef _XDP_H
+#define _XDP_H 1
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#endif
+
+#if defined(__linux__) && defined(XDP_USE_NEED_WAKEUP) && defined(XDP_FLAGS_SKB_MODE)
+#define LC_XDP 1
+
+#define LC_XDP_FRAMESZ 2048 /* UMEM chunk size, holds one MTU sized frame */
+#define LC_XDP_FRAMES 4096 /* UMEM chunks, half for receive, half for send */
+#define LC_XDP_RING 2048 /* entries in each ring */
+#define LC_XDP_HDRLEN 62 /* ethernet + IPv6 + UDP headers */
+#define LC_XDP_GROUPS 65536 /* max groups the XDP program redirects */
+
+/* single producer / single consumer ring shared with the kernel */
+typedef struct lc_xdp_ring_s {
+	uint32_t *producer;
+	uint32_t *consumer;
+	uint32_t *flags;
+	void *desc;
+	uint32_t mask;
+	uint32_t size;
+	void *map;
+	size_t mapsz;
+} lc_xdp_ring_t;
+
+/* AF_XDP socket with its UMEM, bound to queue 0 of an interface in generic
+ * (SKB, copy) mode, and the XDP program redirecting librecast UDP for our
+ * groups to it */
+typedef struct lc_xdp_s {
+	int fd; /* AF_XDP socket */
+	int linkfd; /* XDP program attached to the interface */
+	int groupfd; /* BPF hash map of groups to redirect, to how many bound */
+	unsigned int ifx;
+	char *umem;
+	lc_xdp_ring_t rx, tx, fill, comp;
+	pthread_mutex_t mtx; /* send side, and the fields below */
+	uint64_t txfree[LC_XDP_FRAMES / 2]; /* send frames not in use */
+	size_t ntxfree;
+	uint64_t rxfree[LC_XDP_FRAMES / 2]; /* receive frames released by messages */
+	size_t nrxfree;
+	size_t out; /* receive frames held by messages */
+	int closed; /* released, free once out drops to 0 */
+	unsigned char mac[6]; /* interface hardware address */
+	struct in6_addr src; /* source address for sends */
+	int hops; /* hop limit for sends */
+} lc_xdp_t;
+
+/* a received UDP datagram, still in its UMEM frame */
+typedef struct lc_xdp_pkt_s {
+	char *data; /* UDP payload */
+	size_t len; /* UDP payload bytes */
+	struct in6_addr src;
+	struct in6_addr dst;
+	uint16_t dport; /* network byte order */
+} lc_xdp_pkt_t;
+
+/* set up AF_XDP on queue 0 of interface ifx, taking IPv6 multicast UDP to
+ * port for groups added with lc_xdp_group(). Needs CAP_NET_ADMIN and CAP_BPF
+ * (or CAP_SYS_ADMIN). NULL on error with errno set */
+lc_xdp_t *lc_xdp_new(unsigned int ifx, uint16_t port);
+
+/* add (add set) or remove a reference to group grp, which is redirected to
+ * the AF_XDP socket while it has any. 0 on success, -1 on error */
+int lc_xdp_group(lc_xdp_t *xdp, const struct in6_addr *grp, int add);
+
+/* detach from the interface. Memory is freed once every received frame
+ * has been released */
+void lc_xdp_release(lc_xdp_t *xdp);
+
+/* queue UDP datagram with payload iov to dst. If kick is set, have the
+ * kernel send everything queued. Returns payload bytes, or -1 with errno set,
+ * EMSGSIZE if it doesn't fit in a frame */
+ssize_t lc_xdp_send(lc_xdp_t *xdp, const struct sockaddr_in6 *dst, const struct iovec *iov,
+		int iovcnt, int kick);
+
+/* have the kernel send queued datagrams. 0 on success, -1 on error */
+int lc_xdp_kick(lc_xdp_t *xdp);
+
+/* next received librecast UDP datagram. Returns 1 and fills pkt, 0 if block
+ * is not set and there is nothing waiting, -1 on error. Single consumer. Give
+ * the frame back with lc_xdp_free() */
+int lc_xdp_recv(lc_xdp_t *xdp, lc_xdp_pkt_t *pkt, int block);
+
+/* release the receive frame holding data. Matches lc_free_fn_t, so can be
+ * used as msg->free with xdp as msg->hint */
+void *lc_xdp_free(void *data, void *xdp);
+
+#endif /* LC_XDP */
+
+#endif /* _XDP_H */
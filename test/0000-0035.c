@@ -0,0 +1,115 @@
+#define _GNU_SOURCE
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+
+#define WAITS 1
+#define MSGS 100 /* more than LC_SENDMMSG_MAX, so we need more than one syscall */
+
+static char channame[][6] = { "red", "green", "blue" };
+enum { channels = 2 }; /* blue is used for raw sendmmsg only */
+static sem_t sem;
+static lc_seq_t seq[channels][MSGS];
+static int seqs[channels];
+static char data[] = "black lives matter";
+
+void *recv_thread(void *arg)
+{
+	lc_ctx_t *lctx = lc_ctx_new();
+	lc_socket_t *sock = lc_socket_new(lctx);
+	lc_channel_t *chan[channels];
+	lc_message_t msg;
+
+	for (int i = 0; i < channels; i++) {
+		chan[i] = lc_channel_new(lctx, channame[i]);
+		lc_channel_bind(sock, chan[i]);
+		lc_channel_join(chan[i]);
+	}
+	sem_post(&sem); /* ready */
+	for (int n = 0; n < MSGS; n++) {
+		lc_msg_init(&msg);
+		if (lc_msg_recv(sock, &msg) <= 0) break;
+		test_expectn(data, msg.data, msg.len);
+		for (int i = 0; i < channels; i++) {
+			if (!memcmp(&msg.dst, lc_channel_in6addr(chan[i]), sizeof(struct in6_addr)))
+				seq[i][seqs[i]++] = msg.seq;
+		}
+		lc_msg_free(&msg);
+	}
+	sem_post(&sem); /* done */
+	lc_ctx_free(lctx);
+	return arg;
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx;
+	lc_socket_t *sock;
+	lc_channel_t *chan[channels], *blue;
+	lc_channel_t *chans[MSGS];
+	lc_message_t msgs[MSGS];
+	struct mmsghdr mmsg[2] = {0};
+	struct iovec iov = { .iov_base = data, .iov_len = sizeof data };
+	pthread_t thread;
+	struct timespec ts;
+	ssize_t sent;
+
+	test_name("lc_msg_send_batch() / lc_channel_sendmmsg()");
+
+	lctx = lc_ctx_new();
+	sock = lc_socket_new(lctx);
+	lc_socket_loop(sock, 1);
+	for (int i = 0; i < channels; i++) {
+		chan[i] = lc_channel_new(lctx, channame[i]);
+		lc_channel_bind(sock, chan[i]);
+	}
+
+	/* raw datagrams - nobody is listening to blue */
+	blue = lc_channel_new(lctx, channame[2]);
+	lc_channel_bind(sock, blue);
+	for (int i = 0; i < 2; i++) {
+		mmsg[i].msg_hdr.msg_iov = &iov;
+		mmsg[i].msg_hdr.msg_iovlen = 1;
+	}
+	test_assert(lc_channel_sendmmsg(blue, mmsg, 2, 0) == 2, "lc_channel_sendmmsg()");
+	test_assert(mmsg[0].msg_len == sizeof data, "msg_len");
+
+	sem_init(&sem, 0, 0);
+	pthread_create(&thread, NULL, &recv_thread, NULL);
+	sem_wait(&sem);
+
+	/* interleave messages across channels */
+	for (int i = 0; i < MSGS; i++) {
+		chans[i] = chan[i % channels];
+		lc_msg_init_data(&msgs[i], data, strlen(data), NULL, NULL);
+	}
+	sent = lc_msg_send_batch(chans, msgs, MSGS);
+	test_assert(sent == MSGS, "lc_msg_send_batch() sent %zi/%i", sent, MSGS);
+	test_assert(msgs[MSGS - 1].bytes == sizeof(lc_message_head_t) + strlen(data),
+			"bytes set for each message sent");
+	for (int i = 0; i < channels; i++) {
+		test_assert(chan[i]->seq == MSGS / channels, "channel %i seq = %i", i, (int)chan[i]->seq);
+	}
+
+	test_assert(!clock_gettime(CLOCK_REALTIME, &ts), "clock_gettime()");
+	ts.tv_sec += WAITS;
+	test_assert(!sem_timedwait(&sem, &ts), "timeout");
+	sem_destroy(&sem);
+	pthread_cancel(thread);
+	pthread_join(thread, NULL);
+
+	/* each channel numbered 1..n, in order */
+	for (int i = 0; i < channels; i++) {
+		test_assert(seqs[i] == MSGS / channels, "channel %i received %i", i, seqs[i]);
+		for (int n = 0; n < seqs[i]; n++) {
+			test_assert(seq[i][n] == (lc_seq_t)n + 1, "channel %i seq %i", i, (int)seq[i][n]);
+		}
+	}
+
+	lc_ctx_free(lctx);
+
+	return fails;
+}
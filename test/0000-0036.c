@@ -0,0 +1,63 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#define CHANNELS 200 /* more than fit in one sendmmsg() batch */
+
+static char data[] = "black lives matter";
+
+int main(void)
+{
+	lc_ctx_t *lctx;
+	lc_socket_t *sock;
+	lc_channel_t *chan[CHANNELS], *bad;
+	struct sockaddr_in6 sa = { .sin6_family = AF_INET6, .sin6_port = 0 };
+	ssize_t byt;
+	char name[16];
+	int bound = 0;
+
+	test_name("lc_socket_send() - fan-out with per-channel errors");
+
+	lctx = lc_ctx_new();
+	sock = lc_socket_new(lctx);
+
+	/* channel with port 0 will fail to send */
+	inet_pton(AF_INET6, "ff1e::1", &sa.sin6_addr);
+	bad = lc_channel_init(lctx, &sa);
+	test_assert(lc_channel_bind(sock, bad) == 0, "lc_channel_bind() - bad");
+
+	for (int i = 0; i < CHANNELS; i++) {
+		snprintf(name, sizeof name, "chan%i", i);
+		chan[i] = lc_channel_new(lctx, name);
+		lc_channel_bind(sock, chan[i]);
+	}
+	test_assert(lc_channel_bind(sock, chan[0]) == 0, "rebind same socket");
+	for (lc_channel_t *p = sock->chan_list; p; p = p->snext) bound++;
+	test_assert(bound == CHANNELS + 1, "%i channels in socket list", bound);
+	test_assert(sock->bound == CHANNELS + 1, "%i channels bound", sock->bound);
+
+	/* the bad channel is last in the list - everything else is sent */
+	byt = lc_socket_send(sock, data, strlen(data), 0);
+	test_assert(byt == (ssize_t)strlen(data) * CHANNELS, "lc_socket_send() = %zi", byt);
+	test_assert(lc_channel_errno(bad) != 0, "error recorded for bad channel");
+	for (int i = 0; i < CHANNELS; i++) {
+		test_assert(lc_channel_errno(chan[i]) == 0, "no error for channel %i", i);
+	}
+
+	/* unbind drops channel from socket list */
+	lc_channel_unbind(chan[CHANNELS / 2]);
+	lc_channel_free(bad);
+	byt = lc_socket_send(sock, data, strlen(data), 0);
+	test_assert(byt == (ssize_t)strlen(data) * (CHANNELS - 1), "lc_socket_send() = %zi", byt);
+	test_assert(sock->bound == CHANNELS - 1, "%i channels bound", sock->bound);
+
+	/* closing socket unbinds channels */
+	lc_socket_close(sock);
+	test_assert(lc_channel_socket(chan[0]) == NULL, "channel unbound on socket close");
+
+	lc_ctx_free(lctx);
+
+	return fails;
+}
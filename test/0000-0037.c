@@ -0,0 +1,142 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WAITS 1
+#define SEGSZ 1000
+#define SEGS 11
+#define PAYLOAD (SEGSZ * (SEGS - 1) + SEGSZ / 2) /* last segment is short */
+#define BENCH_BYTES (64 * 1024 * 1024)
+
+static sem_t sem;
+static char channame[] = "0000-0037";
+static unsigned char payload[PAYLOAD];
+static int segs, badseg;
+
+void *recv_thread(void *arg)
+{
+	lc_ctx_t *lctx = lc_ctx_new();
+	lc_socket_t *sock = lc_socket_new(lctx);
+	lc_channel_t *chan = lc_channel_new(lctx, channame);
+	lc_message_t msg;
+	lc_seq_t seq = 0;
+	size_t off = 0;
+
+	lc_channel_bind(sock, chan);
+	lc_channel_join(chan);
+	sem_post(&sem); /* ready */
+	for (int i = 0; i < SEGS; i++) {
+		lc_msg_init(&msg);
+		if (lc_msg_recv(sock, &msg) <= 0) break;
+		if (seq && msg.seq != seq + 1) badseg++;
+		if (msg.len != ((i < SEGS - 1) ? SEGSZ : SEGSZ / 2)) badseg++;
+		if (memcmp(msg.data, payload + off, msg.len)) badseg++;
+		seq = msg.seq;
+		off += msg.len;
+		segs++;
+		lc_msg_free(&msg);
+	}
+	sem_post(&sem); /* done */
+	/* drain until cancelled */
+	for (char buf[65536];;) lc_socket_recv(sock, buf, sizeof buf, 0);
+	lc_ctx_free(lctx);
+	return arg;
+}
+
+static double elapsed(struct timespec *t0)
+{
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1000000000.0;
+}
+
+static void benchmark(lc_socket_t *sock, lc_channel_t *chan)
+{
+	static unsigned char buf[LC_GSO_BYTES];
+	struct timespec t0;
+	lc_message_t msg;
+	size_t chunk;
+	double s;
+
+	/* one datagram per syscall */
+	lc_socket_gso(sock, 0);
+	lc_msg_init_data(&msg, buf, SEGSZ, NULL, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (size_t i = 0; i < BENCH_BYTES; i += SEGSZ) lc_msg_send(chan, &msg);
+	s = elapsed(&t0);
+	test_log("per-datagram: %i MiB in %f s (%.0f MiB/s, %.0f datagrams/s)",
+			BENCH_BYTES >> 20, s, (BENCH_BYTES >> 20) / s, BENCH_BYTES / SEGSZ / s);
+
+	/* as many segments as fit in one GSO send */
+	lc_socket_gso(sock, SEGSZ);
+	chunk = LC_GSO_BYTES / (SEGSZ + sizeof(lc_message_head_t)) * SEGSZ;
+	lc_msg_init_data(&msg, buf, chunk, NULL, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (size_t i = 0; i < BENCH_BYTES; i += chunk) lc_msg_send(chan, &msg);
+	s = elapsed(&t0);
+	test_log("GSO:          %i MiB in %f s (%.0f MiB/s, %.0f datagrams/s)",
+			BENCH_BYTES >> 20, s, (BENCH_BYTES >> 20) / s, BENCH_BYTES / SEGSZ / s);
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx;
+	lc_socket_t *sock;
+	lc_channel_t *chan;
+	lc_message_t msg;
+	pthread_t thread;
+	struct timespec ts;
+	struct iovec iov[2];
+	ssize_t byt;
+
+	test_name("lc_socket_gso()");
+
+	for (int i = 0; i < PAYLOAD; i++) payload[i] = i % 251;
+
+	lctx = lc_ctx_new();
+	sock = lc_socket_new(lctx);
+	chan = lc_channel_new(lctx, channame);
+	lc_socket_loop(sock, 1);
+	lc_channel_bind(sock, chan);
+
+	if (lc_socket_gso(sock, SEGSZ) == -1) {
+		test_log("UDP GSO not supported: %s", strerror(errno));
+		lc_ctx_free(lctx);
+		return fails;
+	}
+	test_assert(lc_socket_gso(sock, 65536) == -1, "lc_socket_gso() - size too large");
+
+	sem_init(&sem, 0, 0);
+	pthread_create(&thread, NULL, &recv_thread, NULL);
+	sem_wait(&sem);
+
+	/* split payload across buffers at a point that isn't a segment boundary */
+	iov[0].iov_base = payload;
+	iov[0].iov_len = SEGSZ * 3 / 2;
+	iov[1].iov_base = payload + iov[0].iov_len;
+	iov[1].iov_len = PAYLOAD - iov[0].iov_len;
+	lc_msg_init(&msg);
+	byt = lc_msg_sendv(chan, &msg, iov, 2);
+	test_assert(byt == (ssize_t)(PAYLOAD + SEGS * sizeof(lc_message_head_t)),
+			"lc_msg_sendv() = %zi", byt);
+	test_assert(chan->seq == SEGS, "one sequence number per segment");
+
+	test_assert(!clock_gettime(CLOCK_REALTIME, &ts), "clock_gettime()");
+	ts.tv_sec += WAITS;
+	test_assert(!sem_timedwait(&sem, &ts), "timeout");
+	test_assert(segs == SEGS, "received %i/%i segments", segs, SEGS);
+	test_assert(badseg == 0, "%i bad segments", badseg);
+
+	benchmark(sock, chan);
+
+	pthread_cancel(thread);
+	pthread_join(thread, NULL);
+	sem_destroy(&sem);
+	lc_ctx_free(lctx);
+
+	return fails;
+}
@@ -0,0 +1,95 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WAITS 2
+#define SEGSZ 1000
+#define SEGS 40
+#define SENDS 250
+
+static sem_t sem;
+static char channame[] = "0000-0038";
+static unsigned char payload[SEGSZ * SEGS];
+static unsigned char seen[SEGS * SENDS + 1];
+static int msgs, badmsg, coalesced;
+static lc_socket_t *rsock;
+
+void msg_received(lc_message_t *msg)
+{
+	/* callback is called by both the opcode handler and listener */
+	if (msg->seq > SEGS * SENDS || seen[msg->seq]++) return;
+	if (msg->len != SEGSZ || memcmp(msg->data, payload + (msg->seq - 1) % SEGS * SEGSZ, SEGSZ))
+		badmsg++;
+	if (rsock->gro->len) coalesced++; /* more segments waiting in buffer */
+	if (++msgs % SEGS == 0) sem_post(&sem); /* round complete */
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx;
+	lc_socket_t *sock;
+	lc_channel_t *chan, *rchan;
+	lc_message_t msg, batch[4];
+	struct timespec ts, t0, t1;
+	double s;
+
+	test_name("lc_socket_gro()");
+
+	for (int i = 0; i < SEGS * SEGSZ; i++) payload[i] = i % 251;
+
+	lctx = lc_ctx_new();
+	sock = lc_socket_new(lctx);
+	chan = lc_channel_new(lctx, channame);
+	lc_socket_loop(sock, 1);
+	lc_channel_bind(sock, chan);
+	if (lc_socket_gso(sock, SEGSZ) == -1) {
+		test_log("UDP GSO not supported: %s", strerror(errno));
+		goto exit_0;
+	}
+
+	rsock = lc_socket_new(lctx);
+	rchan = lc_channel_new(lctx, channame);
+	if (lc_socket_gro(rsock, 1) == -1) {
+		test_log("UDP GRO not supported: %s", strerror(errno));
+		goto exit_0;
+	}
+	test_assert(rsock->gro != NULL, "GRO buffer allocated");
+	lc_channel_bind(rsock, rchan);
+	lc_channel_join(rchan);
+	sem_init(&sem, 0, 0);
+	test_assert(!lc_socket_listen(rsock, &msg_received, NULL), "lc_socket_listen()");
+
+	/* each send is handed to the kernel as one GSO packet, which may
+	 * arrive in the receiver as one GRO buffer */
+	lc_msg_init_data(&msg, payload, sizeof payload, NULL, NULL);
+	test_assert(!clock_gettime(CLOCK_REALTIME, &ts), "clock_gettime()");
+	ts.tv_sec += WAITS;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < SENDS; i++) {
+		test_assert(lc_msg_send(chan, &msg) > 0, "lc_msg_send()");
+		/* wait for each round so we don't overrun the socket buffer */
+		if (sem_timedwait(&sem, &ts)) break;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	test_assert(msgs == SEGS * SENDS, "received %i/%i", msgs, SEGS * SENDS);
+	s = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1000000000.0;
+	test_log("received %i msgs in %f s (%.0f msgs/s), %i from coalesced buffers",
+			msgs, s, msgs / s, coalesced);
+	test_assert(badmsg == 0, "%i bad messages", badmsg);
+
+	test_assert(!lc_socket_listen_cancel(rsock), "lc_socket_listen_cancel()");
+	test_assert(lc_msg_recv_batch(rsock, batch, 4, MSG_DONTWAIT) == -1 && errno == EAGAIN,
+			"lc_msg_recv_batch() - MSG_DONTWAIT");
+	test_assert(lc_socket_gro(rsock, 0) == 0, "lc_socket_gro() - disable");
+	test_assert(rsock->gro == NULL, "GRO buffer freed");
+	sem_destroy(&sem);
+exit_0:
+	lc_ctx_free(lctx);
+
+	return fails;
+}
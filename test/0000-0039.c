@@ -0,0 +1,86 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include "../src/pool.h"
+
+static char channame[] = "0000-0039";
+static char data[] = "black lives matter";
+static char big[LC_POOL_MEDIUM * 2];
+
+int main(void)
+{
+	lc_ctx_t *lctx;
+	lc_socket_t *sock;
+	lc_channel_t *chan;
+	lc_message_t msg, msg2;
+	void *buf;
+	ssize_t byt;
+
+	test_name("lc_msg_recv() - pooled receive buffers");
+
+	lctx = lc_ctx_new();
+	sock = lc_socket_new(lctx);
+	chan = lc_channel_new(lctx, channame);
+	lc_socket_loop(sock, 1);
+	lc_channel_bind(sock, chan);
+	lc_channel_join(chan);
+
+	lc_msg_init_data(&msg, data, sizeof data, NULL, NULL);
+	lc_msg_send(chan, &msg);
+	lc_msg_send(chan, &msg);
+	lc_msg_send(chan, &msg);
+
+	/* message data comes from the socket pool, and goes back to it */
+	lc_msg_init(&msg);
+	byt = lc_msg_recv(sock, &msg);
+	test_assert(byt == (ssize_t)(sizeof(lc_message_head_t) + sizeof data), "lc_msg_recv() = %zi", byt);
+	test_expect(data, msg.data);
+	test_assert(msg.free == &lc_buf_unref, "msg->free returns buffer to pool");
+	test_assert(lctx->pool[0]->out == 1, "1 buffer out");
+	test_assert(lctx->pool[2]->out == 0 && lctx->pool[2]->nfree == 0, "no spill buffer taken");
+	buf = msg.data;
+	lc_msg_free(&msg);
+	test_assert(lctx->pool[0]->out == 0, "buffer returned");
+	test_assert(lctx->pool[0]->nfree == 1, "buffer on free list");
+
+	/* buffer is reused without allocating */
+	falloc_setfail(1);
+	byt = lc_msg_recv(sock, &msg);
+	falloc_setfail(-1);
+	test_assert(byt > 0, "lc_msg_recv() without allocation");
+	test_assert(msg.data == buf, "buffer reused");
+
+	/* bigger messages spill, and are held in a buffer their own size up to
+	 * medium, so a message never pins a largest buffer it doesn't need */
+	lc_msg_init(&msg2);
+	lc_msg_recv(sock, &msg2);
+	lc_msg_free(&msg2);
+	for (size_t i = 0; i < sizeof big; i++) big[i] = i % 251;
+	lc_msg_init_data(&msg2, big, LC_POOL_MEDIUM, NULL, NULL);
+	lc_msg_send(chan, &msg2);
+	lc_msg_init_data(&msg2, big, sizeof big, NULL, NULL);
+	lc_msg_send(chan, &msg2);
+	lc_msg_init_data(&msg2, data, sizeof data, NULL, NULL);
+	lc_msg_send(chan, &msg2);
+	lc_msg_init(&msg2);
+	lc_msg_recv(sock, &msg2);
+	test_assert(msg2.len == LC_POOL_MEDIUM && !memcmp(msg2.data, big, msg2.len), "medium message");
+	test_assert(lctx->pool[1]->out == 1 && lctx->pool[2]->out == 0, "medium buffer holds it");
+	test_assert(lctx->pool[2]->nfree == 0, "spilled without a largest buffer");
+	lc_msg_free(&msg2);
+	lc_msg_recv(sock, &msg2);
+	test_assert(msg2.len == sizeof big && !memcmp(msg2.data, big, msg2.len), "large message");
+	test_assert(lctx->pool[2]->out == 1 && lctx->pool[1]->out == 0, "largest buffer holds it");
+	lc_msg_free(&msg2);
+
+	/* messages outlive the socket and ctx */
+	lc_msg_recv(sock, &msg2);
+	test_assert(lctx->pool[0]->out == 2, "2 buffers out");
+	lc_socket_close(sock);
+	lc_ctx_free(lctx);
+	test_expect(data, msg.data);
+	lc_msg_free(&msg);
+	lc_msg_free(&msg2);
+
+	return fails;
+}
@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include "../src/pool.h"
+#include <semaphore.h>
+#include <time.h>
+
+#define WAITS 1
+#define MSGS 100
+#define BIGSZ 10000
+#define BIGS 8
+#define FRAGSZ 1232
+
+static char channame[] = "0000-0040";
+static char data[] = "black lives matter";
+static unsigned char big[BIGSZ];
+static sem_t sem;
+static int msgs, bigs, batches, badmsg;
+
+/* pooled buffers sock's receive slots keep between receives */
+static size_t slots(lc_socket_t *sock)
+{
+	size_t n = 0;
+	if (sock->rx) for (int i = 0; i < LC_RECVMMSG_MAX; i++) n += !!sock->rx->buf[i];
+	return n;
+}
+
+void batch_received(lc_message_t *msg, size_t n)
+{
+	batches++;
+	for (size_t i = 0; i < n; i++) {
+		if (msg[i].len == BIGSZ) {
+			if (msg[i].op != LC_OP_DATA || memcmp(msg[i].data, big, BIGSZ)) badmsg++;
+			else if (++bigs == BIGS) sem_post(&sem);
+		}
+		else if (msg[i].len != sizeof data || memcmp(msg[i].data, data, sizeof data)) badmsg++;
+		else if (++msgs == MSGS) sem_post(&sem);
+	}
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx;
+	lc_socket_t *sock, *rsock;
+	lc_channel_t *chan, *rchan;
+	lc_channel_t *chans[MSGS];
+	lc_message_t msg[MSGS];
+	struct timespec ts;
+	ssize_t n;
+	int got = 0, rcvbuf = 4 * 1024 * 1024;
+
+	test_name("lc_msg_recv_batch() / lc_socket_listen_batch()");
+
+	lctx = lc_ctx_new();
+	sock = lc_socket_new(lctx);
+	chan = lc_channel_new(lctx, channame);
+	lc_socket_loop(sock, 1);
+	lc_channel_bind(sock, chan);
+	lc_channel_join(chan);
+
+	for (int i = 0; i < 10; i++) {
+		chans[i] = chan;
+		lc_msg_init_data(&msg[i], data, sizeof data, NULL, NULL);
+	}
+	test_assert(lc_msg_send_batch(chans, msg, 10) == 10, "lc_msg_send_batch()");
+
+	/* drain socket in as few calls as it takes */
+	while (got < 10) {
+		n = lc_msg_recv_batch(sock, &msg[got], MSGS - got, MSG_WAITFORONE);
+		test_assert(n > 0, "lc_msg_recv_batch() = %zi", n);
+		if (n <= 0) break;
+		got += n;
+	}
+	test_log("received %i messages", got);
+	test_assert(lctx->pool[0]->out == got + slots(sock), "small messages hold small buffers");
+	test_assert(lctx->pool[2]->out == 0 && lctx->pool[2]->nfree == 0, "no spill buffers taken");
+	for (int i = 0; i < got; i++) {
+		test_assert(msg[i].seq == (lc_seq_t)i + 1, "seq %i", (int)msg[i].seq);
+		test_assert(msg[i].bytes == sizeof(lc_message_head_t) + sizeof data, "bytes");
+		test_expect(data, msg[i].data);
+		lc_msg_free(&msg[i]);
+	}
+
+	/* slots keep what they didn't use, and refill from the pool */
+	for (int i = 0; i < 10; i++) lc_msg_init_data(&msg[i], data, sizeof data, NULL, NULL);
+	test_assert(lc_msg_send_batch(chans, msg, 10) == 10, "lc_msg_send_batch()");
+	falloc_setfail(1);
+	n = lc_msg_recv_batch(sock, msg, MSGS, MSG_WAITFORONE);
+	falloc_setfail(-1);
+	test_assert(n == 10, "lc_msg_recv_batch() without allocation = %zi", n);
+	for (int i = 0; i < n; i++) lc_msg_free(&msg[i]);
+
+	/* bigger ones spill, and move to a buffer their own size */
+	for (int i = 0; i < BIGSZ; i++) big[i] = i % 251;
+	lc_msg_init_data(&msg[0], big, BIGSZ, NULL, NULL);
+	lc_msg_send(chan, &msg[0]);
+	n = lc_msg_recv_batch(sock, msg, MSGS, MSG_WAITFORONE);
+	test_assert(n == 1, "lc_msg_recv_batch() - medium = %zi", n);
+	test_assert(msg[0].len == BIGSZ && !memcmp(msg[0].data, big, BIGSZ), "medium message");
+	test_assert(lctx->pool[1]->out == 1 && lctx->pool[2]->out == 0, "medium buffer holds it");
+	lc_msg_free(&msg[0]);
+	test_assert(lctx->pool[2]->nfree == 0, "spilled without a largest buffer");
+	for (int i = 0; i < LC_POOL_CLASSES; i++) {
+		test_assert(lctx->pool[i]->out == (i ? 0 : slots(sock)), "all buffers returned to pool %i", i);
+	}
+
+	/* batch listener */
+	rsock = lc_socket_new(lctx);
+	rchan = lc_channel_new(lctx, channame);
+	lc_channel_bind(rsock, rchan);
+	lc_channel_join(rchan);
+	setsockopt(lc_socket_raw(rsock), SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+	sem_init(&sem, 0, 0);
+	test_assert(lc_socket_listen_batch(rsock, NULL, NULL) == LC_ERROR_INVALID_PARAMS,
+			"lc_socket_listen_batch() - callback required");
+	test_assert(!lc_socket_listen_batch(rsock, &batch_received, NULL), "lc_socket_listen_batch()");
+	test_assert(lc_socket_listen(rsock, NULL, NULL) == LC_ERROR_SOCKET_LISTENING,
+			"socket already listening");
+
+	for (int i = 0; i < MSGS; i++) {
+		chans[i] = chan;
+		lc_msg_init_data(&msg[i], data, sizeof data, NULL, NULL);
+	}
+	test_assert(lc_msg_send_batch(chans, msg, MSGS) == MSGS, "lc_msg_send_batch()");
+
+	test_assert(!clock_gettime(CLOCK_REALTIME, &ts), "clock_gettime()");
+	ts.tv_sec += WAITS;
+	test_assert(!sem_timedwait(&sem, &ts), "timeout");
+	test_log("received %i messages in %i batches", msgs, batches);
+	test_assert(msgs == MSGS, "received %i/%i", msgs, MSGS);
+	test_assert(badmsg == 0, "%i bad messages", badmsg);
+
+	/* fragments and FEC datagrams are put back together before the
+	 * callback, which only sees whole messages */
+	test_assert(!lc_socket_fragment(sock, FRAGSZ), "lc_socket_fragment()");
+	test_assert(!lc_channel_fec(chan, 4, 2, NULL), "lc_channel_fec()");
+	for (int i = 0; i < BIGS; i++) {
+		chans[i] = chan;
+		lc_msg_init_data(&msg[i], big, BIGSZ, NULL, NULL);
+	}
+	test_assert(lc_msg_send_batch(chans, msg, BIGS) == BIGS, "lc_msg_send_batch() - fragmented");
+	test_assert(msg[0].bytes > sizeof(lc_message_head_t) + BIGSZ, "sent as fragments: %zu bytes",
+			msg[0].bytes);
+	test_assert(!clock_gettime(CLOCK_REALTIME, &ts), "clock_gettime()");
+	ts.tv_sec += WAITS;
+	test_assert(!sem_timedwait(&sem, &ts), "timeout - fragmented");
+	test_assert(bigs == BIGS, "received %i/%i fragmented", bigs, BIGS);
+	test_assert(badmsg == 0, "%i bad messages", badmsg);
+
+	test_assert(!lc_socket_listen_cancel(rsock), "lc_socket_listen_cancel()");
+	sem_destroy(&sem);
+	lc_ctx_free(lctx);
+
+	return fails;
+}
@@ -0,0 +1,87 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include "../src/pool.h"
+#include <pthread.h>
+
+#define CONSUMERS 8
+#define BIGSZ 10000
+
+static char channame[] = "0000-0041";
+static char data[] = "black lives matter";
+static unsigned char big[BIGSZ];
+static int badmsg;
+
+void *consumer(void *arg)
+{
+	lc_message_t *msg = (lc_message_t *)arg;
+	if (msg->len != sizeof data || memcmp(msg->data, data, sizeof data))
+		__atomic_add_fetch(&badmsg, 1, __ATOMIC_RELAXED);
+	lc_msg_unref(msg);
+	return NULL;
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx;
+	lc_socket_t *sock;
+	lc_channel_t *chan;
+	lc_message_t msg, copy[CONSUMERS];
+	pthread_t thread[CONSUMERS];
+	ssize_t byt;
+
+	test_name("lc_msg_ref() / lc_msg_unref()");
+
+	for (int i = 0; i < BIGSZ; i++) big[i] = i % 251;
+
+	lctx = lc_ctx_new();
+	sock = lc_socket_new(lctx);
+	chan = lc_channel_new(lctx, channame);
+	lc_socket_loop(sock, 1);
+	lc_channel_bind(sock, chan);
+	lc_channel_join(chan);
+
+	/* only refcounted data can be shared */
+	lc_msg_init_data(&msg, data, sizeof data, NULL, NULL);
+	test_assert(lc_msg_ref(&msg) == -1 && errno == EINVAL, "lc_msg_ref() - not refcounted");
+	lc_msg_send(chan, &msg);
+
+	/* fan out one received message to many threads without copying */
+	lc_msg_init(&msg);
+	byt = lc_msg_recv(sock, &msg);
+	test_assert(byt > 0, "lc_msg_recv() = %zi", byt);
+	for (int i = 0; i < CONSUMERS; i++) {
+		test_assert(!lc_msg_ref(&msg), "lc_msg_ref()");
+		copy[i] = msg;
+	}
+	for (int i = 0; i < CONSUMERS; i++) {
+		pthread_create(&thread[i], NULL, &consumer, &copy[i]);
+	}
+	for (int i = 0; i < CONSUMERS; i++) pthread_join(thread[i], NULL);
+	test_assert(badmsg == 0, "%i bad messages", badmsg);
+	test_assert(lctx->pool[0]->out == 1, "buffer held by last reference");
+	test_expect(data, msg.data);
+	lc_msg_unref(&msg);
+	test_assert(lctx->pool[0]->out == 0, "buffer returned with last reference");
+
+	/* bigger messages land in a bigger size class */
+	lc_msg_init_data(&msg, big, sizeof big, NULL, NULL);
+	lc_msg_send(chan, &msg);
+	lc_msg_init(&msg);
+	byt = lc_msg_recv(sock, &msg);
+	test_assert(byt == (ssize_t)(sizeof(lc_message_head_t) + BIGSZ), "lc_msg_recv() = %zi", byt);
+	test_assert(msg.len == BIGSZ && !memcmp(msg.data, big, BIGSZ), "big message data");
+	test_assert(lctx->pool[0]->out == 1, "small buffer kept for the next receive");
+	test_assert(lctx->pool[1]->out == 1, "medium buffer out");
+	test_assert(LC_BUF_SIZE(lctx->pool[1]) >= BIGSZ, "medium buffer holds message");
+
+	/* references outlive the ctx */
+	lc_msg_ref(&msg);
+	copy[0] = msg;
+	lc_ctx_free(lctx);
+	lc_msg_unref(&msg);
+	test_assert(copy[0].len == BIGSZ && !memcmp(copy[0].data, big, BIGSZ), "data outlives ctx");
+	lc_msg_unref(&copy[0]);
+
+	return fails;
+}
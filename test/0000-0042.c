@@ -0,0 +1,116 @@
+#include "test.h"
+#include <librecast/net.h>
+#include <arpa/inet.h>
+#include <semaphore.h>
+#include <time.h>
+
+#define WAITS 1
+#define BENCH_MSGS 1000000
+
+static char channame[] = "0000-0042";
+static char data[] = "black lives matter";
+static char chanaddr[INET6_ADDRSTRLEN];
+static sem_t sem;
+static int lazy, dstok;
+
+void msg_received(lc_message_t *msg)
+{
+	/* callback is called by both the opcode handler and listener */
+	if (msg->srcaddr[0] || msg->dstaddr[0]) return;
+	lazy++;
+	dstok = !strcmp(lc_msg_dstaddr(msg), chanaddr);
+	sem_post(&sem);
+}
+
+static double elapsed(struct timespec *t0)
+{
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1000000000.0;
+}
+
+/* what every received message used to pay, whether or not the address strings
+ * were ever read */
+static void benchmark(void)
+{
+	lc_message_t msg;
+	struct timespec t0;
+	double s;
+
+	lc_msg_init(&msg);
+	inet_pton(AF_INET6, "fe80::dead:beef:cafe:1", &msg.src);
+	inet_pton(AF_INET6, "ff1e:4b9f:8e31:1a2c:5d77:e012:3b48:aa01", &msg.dst);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < BENCH_MSGS; i++) {
+		msg.srcaddr[0] = 0;
+		msg.dstaddr[0] = 0;
+		lc_msg_srcaddr(&msg);
+		lc_msg_dstaddr(&msg);
+	}
+	s = elapsed(&t0);
+	test_log("formatting src + dst: %.1f ns/msg, saved per message when unused", s * 1e9 / BENCH_MSGS);
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx;
+	lc_socket_t *sock;
+	lc_channel_t *chan;
+	lc_message_t msg, msg2;
+	struct sockaddr_in6 *sa;
+	struct timespec ts;
+	unsigned char id[16], id2[16];
+	const char *p;
+
+	test_name("lc_msg_srcaddr() / lc_msg_dstaddr()");
+
+	/* formatted on demand, and cached */
+	lc_msg_init(&msg);
+	inet_pton(AF_INET6, "fe80::1", &msg.src);
+	inet_pton(AF_INET6, "ff1e::42", &msg.dst);
+	test_assert(msg.srcaddr[0] == 0 && msg.dstaddr[0] == 0, "not formatted on init");
+	p = lc_msg_srcaddr(&msg);
+	test_assert(!strcmp(p, "fe80::1"), "lc_msg_srcaddr() = %s", p);
+	test_assert(p == msg.srcaddr, "cached in msg");
+	p = lc_msg_dstaddr(&msg);
+	test_assert(!strcmp(p, "ff1e::42"), "lc_msg_dstaddr() = %s", p);
+
+	/* lc_msg_id() hashes the binary source address */
+	lc_msg_init_data(&msg, data, sizeof data, NULL, NULL);
+	lc_msg_init_data(&msg2, data, sizeof data, NULL, NULL);
+	inet_pton(AF_INET6, "fe80::1", &msg.src);
+	inet_pton(AF_INET6, "fe80::1", &msg2.src);
+	lc_msg_srcaddr(&msg);
+	lc_msg_id(&msg, id, sizeof id);
+	lc_msg_id(&msg2, id2, sizeof id2);
+	test_assert(!memcmp(id, id2, sizeof id), "same id whether or not address is formatted");
+	inet_pton(AF_INET6, "fe80::2", &msg2.src);
+	lc_msg_id(&msg2, id2, sizeof id2);
+	test_assert(memcmp(id, id2, sizeof id), "different source, different id");
+
+	/* listener doesn't format addresses */
+	lctx = lc_ctx_new();
+	sock = lc_socket_new(lctx);
+	chan = lc_channel_new(lctx, channame);
+	sa = lc_channel_sockaddr(chan);
+	inet_ntop(AF_INET6, &sa->sin6_addr, chanaddr, INET6_ADDRSTRLEN);
+	lc_socket_loop(sock, 1);
+	lc_channel_bind(sock, chan);
+	lc_channel_join(chan);
+	sem_init(&sem, 0, 0);
+	lc_socket_listen(sock, &msg_received, NULL);
+	lc_msg_init_data(&msg, data, sizeof data, NULL, NULL);
+	lc_msg_send(chan, &msg);
+	test_assert(!clock_gettime(CLOCK_REALTIME, &ts), "clock_gettime()");
+	ts.tv_sec += WAITS;
+	test_assert(!sem_timedwait(&sem, &ts), "timeout");
+	test_assert(lazy, "addresses not formatted by listener");
+	test_assert(dstok, "lc_msg_dstaddr() matches channel address");
+	lc_socket_listen_cancel(sock);
+	sem_destroy(&sem);
+	lc_ctx_free(lctx);
+
+	benchmark();
+
+	return fails;
+}
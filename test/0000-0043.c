@@ -0,0 +1,113 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include <arpa/inet.h>
+#include <time.h>
+
+#define CHANNELS 10000
+#define LOOKUPS 1000000
+#define BENCH_MAX 1000000
+#define LINEAR_MAX 10000
+#define LINEAR_LOOKUPS 10000
+
+static void chanaddr(struct sockaddr_in6 *sa, uint32_t n)
+{
+	memset(sa, 0, sizeof(struct sockaddr_in6));
+	sa->sin6_family = AF_INET6;
+	inet_pton(AF_INET6, "ff1e::", &sa->sin6_addr);
+	memcpy(&sa->sin6_addr.s6_addr[12], &n, sizeof n);
+}
+
+static double elapsed(struct timespec *t0)
+{
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1000000000.0;
+}
+
+static void benchmark(void)
+{
+	struct sockaddr_in6 sa;
+	struct timespec t0;
+	lc_ctx_t *lctx;
+	uint32_t r = 1;
+	int found;
+	double s;
+
+	for (int n = 10; n <= BENCH_MAX; n *= 10) {
+		lctx = lc_ctx_new();
+		for (int i = 0; i < n; i++) {
+			chanaddr(&sa, i);
+			lc_channel_init(lctx, &sa);
+		}
+		found = 0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (int i = 0; i < LOOKUPS; i++) {
+			r = r * 1103515245 + 12345;
+			memcpy(&sa.sin6_addr.s6_addr[12], &(uint32_t){ (r >> 8) % n }, sizeof r);
+			if (lc_channel_by_address(lctx, &sa.sin6_addr)) found++;
+		}
+		s = elapsed(&t0);
+		test_assert(found == LOOKUPS, "%i channels: found %i/%i", n, found, LOOKUPS);
+		test_log("%7i channels: %.1f ns/lookup", n, s * 1e9 / LOOKUPS);
+		if (n <= LINEAR_MAX) {
+			/* what the old linear scan of ctx->chan_list cost */
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			for (int i = 0; i < LINEAR_LOOKUPS; i++) {
+				r = r * 1103515245 + 12345;
+				memcpy(&sa.sin6_addr.s6_addr[12], &(uint32_t){ (r >> 8) % n }, sizeof r);
+				for (lc_channel_t *p = lctx->chan_list; p; p = p->next) {
+					if (!memcmp(&sa.sin6_addr, &p->sa.sin6_addr, sizeof(struct in6_addr)))
+						break;
+				}
+			}
+			s = elapsed(&t0);
+			test_log("%7i channels: %.1f ns/lookup (linear scan)", n, s * 1e9 / LINEAR_LOOKUPS);
+		}
+		lc_ctx_free(lctx);
+	}
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx;
+	lc_channel_t *a, *b, *side, *chan[CHANNELS];
+	struct sockaddr_in6 sa;
+	int err = 0;
+
+	test_name("lc_channel_by_address() - hash table");
+
+	lctx = lc_ctx_new();
+
+	/* newest channel wins for duplicate addresses */
+	a = lc_channel_new(lctx, "0000-0043");
+	b = lc_channel_new(lctx, "0000-0043");
+	test_assert(lc_channel_by_address(lctx, lc_channel_in6addr(a)) == b, "newest channel found");
+	lc_channel_free(b);
+	test_assert(lc_channel_by_address(lctx, lc_channel_in6addr(a)) == a, "older channel found");
+
+	/* side channels are indexed by their own address */
+	side = lc_channel_sideband(a, 42);
+	test_assert(lc_channel_by_address(lctx, lc_channel_in6addr(side)) == side, "sideband found");
+	test_assert(lc_channel_by_address(lctx, lc_channel_in6addr(a)) == a, "base found");
+	lc_channel_free(a);
+	test_assert(lc_channel_by_address(lctx, lc_channel_in6addr(side)) == side, "sideband found");
+
+	/* grow, then delete half and check nothing gets lost */
+	for (int i = 0; i < CHANNELS; i++) {
+		chanaddr(&sa, i);
+		chan[i] = lc_channel_init(lctx, &sa);
+	}
+	for (int i = 0; i < CHANNELS; i += 2) lc_channel_free(chan[i]);
+	for (int i = 0; i < CHANNELS; i++) {
+		chanaddr(&sa, i);
+		if (lc_channel_by_address(lctx, &sa.sin6_addr) != ((i % 2) ? chan[i] : NULL)) err++;
+	}
+	test_assert(err == 0, "%i lookups wrong after delete", err);
+	test_assert(lctx->chantabn == CHANNELS / 2 + 1, "%zu slots in use", lctx->chantabn);
+	lc_ctx_free(lctx);
+
+	benchmark();
+
+	return fails;
+}
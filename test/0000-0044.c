@@ -0,0 +1,160 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include <stdint.h>
+#include <time.h>
+
+#define SOCKS 16
+#define ROUNDS 5
+#define TIMERS 1000
+#define MAXDELAY 500 /* ms - long enough to cascade through the wheel */
+#define SLACK 50 /* ms late a timer may fire */
+
+static char data[] = "black lives matter";
+static lc_ctx_t *lctx;
+static lc_channel_t *rchan[SOCKS], *chan[SOCKS];
+static unsigned char seen[SOCKS][ROUNDS + 1];
+static int msgs, badmsg, rounds, fired, early, late, stopped;
+static lc_timer_t *ticker;
+static uint64_t t0;
+static uint64_t due[TIMERS];
+static lc_timer_t *again;
+static int agains;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void msg_received(lc_message_t *msg)
+{
+	int i;
+	/* callback is called by both the opcode handler and listener */
+	for (i = 0; i < SOCKS && msg->chan != rchan[i]; i++);
+	if (i == SOCKS || msg->seq > ROUNDS || seen[i][msg->seq]++) return;
+	if (msg->len != sizeof data || memcmp(msg->data, data, sizeof data)) badmsg++;
+	msgs++;
+}
+
+/* periodic - send a message to every channel, deleting itself after the
+ * last round */
+void tick(void *arg)
+{
+	lc_message_t msg;
+	(void)arg;
+	for (int i = 0; i < SOCKS; i++) {
+		lc_msg_init_data(&msg, data, sizeof data, NULL, NULL);
+		lc_msg_send(chan[i], &msg);
+	}
+	if (++rounds == ROUNDS) lc_timer_del(lctx, ticker);
+}
+
+void timeout(void *arg)
+{
+	uint64_t now = now_ms();
+	uint64_t expect = *(uint64_t *)arg;
+	if (now < expect) early++;
+	if (now > expect + SLACK) late++;
+	fired++;
+}
+
+/* one-shot that adds itself again with no delay */
+void rearm(void *arg)
+{
+	agains++;
+	again = lc_timer_add(lctx, 0, 0, &rearm, arg);
+}
+
+void stop(void *arg)
+{
+	(void)arg;
+	stopped++;
+	lc_ctx_stop(lctx);
+}
+
+int main(void)
+{
+	lc_ctx_t *sctx;
+	lc_socket_t *sock[SOCKS], *ssock;
+	lc_timer_t *cancelled;
+	char name[16];
+	uint32_t r = 42;
+	uint64_t elapsed;
+
+	test_name("lc_ctx_run() / lc_ctx_poll() - event loop and timers");
+
+	lctx = lc_ctx_new();
+	test_assert(lc_ctx_poll(lctx, 0) == 0, "lc_ctx_poll() - nothing to do");
+
+	/* a timer added from a callback runs on a later tick, never the one
+	 * being run, so this returns having run it at most once a tick */
+	t0 = now_ms();
+	again = lc_timer_add(lctx, 0, 0, &rearm, NULL);
+	lc_ctx_poll(lctx, 10);
+	elapsed = now_ms() - t0;
+	test_assert(agains >= 1 && agains <= (int)elapsed + 1,
+			"zero delay timer from callback ran %i times in %i ms", agains, (int)elapsed);
+	lc_timer_del(lctx, again);
+	agains = 0;
+
+	/* many sockets, one thread */
+	for (int i = 0; i < SOCKS; i++) {
+		snprintf(name, sizeof name, "0000-0044-%i", i);
+		sock[i] = lc_socket_new(lctx);
+		rchan[i] = lc_channel_new(lctx, name);
+		lc_channel_bind(sock[i], rchan[i]);
+		lc_channel_join(rchan[i]);
+		test_assert(!lc_socket_watch(sock[i], &msg_received, NULL), "lc_socket_watch()");
+	}
+	test_assert(lc_socket_watch(sock[0], &msg_received, NULL) == LC_ERROR_SOCKET_LISTENING,
+			"lc_socket_watch() - already watched");
+	test_assert(lc_socket_listen(sock[0], &msg_received, NULL) == LC_ERROR_SOCKET_LISTENING,
+			"lc_socket_listen() - already watched");
+
+	/* senders live in another ctx, so their channels don't shadow ours */
+	sctx = lc_ctx_new();
+	ssock = lc_socket_new(sctx);
+	lc_socket_loop(ssock, 1);
+	for (int i = 0; i < SOCKS; i++) {
+		snprintf(name, sizeof name, "0000-0044-%i", i);
+		chan[i] = lc_channel_new(sctx, name);
+		lc_channel_bind(ssock, chan[i]);
+	}
+
+	t0 = now_ms();
+	ticker = lc_timer_add(lctx, 10, 10, &tick, NULL);
+	test_assert(ticker != NULL, "lc_timer_add() - periodic");
+	for (int i = 0; i < TIMERS; i++) {
+		r = r * 1103515245 + 12345;
+		due[i] = (r >> 8) % MAXDELAY;
+		lc_timer_add(lctx, due[i], 0, &timeout, &due[i]);
+		due[i] += t0;
+	}
+	cancelled = lc_timer_add(lctx, 20, 0, &stop, NULL);
+	lc_timer_del(lctx, cancelled);
+	lc_timer_add(lctx, MAXDELAY + 100, 0, &stop, NULL);
+
+	test_assert(lc_ctx_run(lctx) == 0, "lc_ctx_run()");
+	elapsed = now_ms() - t0;
+
+	test_assert(stopped == 1, "stopped by timer");
+	test_assert(elapsed >= MAXDELAY + 100, "ran for %i ms", (int)elapsed);
+	test_assert(rounds == ROUNDS, "periodic timer ran %i/%i times", rounds, ROUNDS);
+	test_assert(msgs == SOCKS * ROUNDS, "received %i/%i", msgs, SOCKS * ROUNDS);
+	test_assert(badmsg == 0, "%i bad messages", badmsg);
+	test_assert(fired == TIMERS, "%i/%i timers fired", fired, TIMERS);
+	test_assert(early == 0, "%i timers fired early", early);
+	test_assert(late == 0, "%i timers fired late", late);
+	test_assert(lctx->wheel.count == 0, "no timers left");
+
+	for (int i = 0; i < SOCKS; i++) {
+		test_assert(!lc_socket_unwatch(sock[i]), "lc_socket_unwatch()");
+	}
+	test_assert(!lc_socket_listen(sock[0], &msg_received, NULL), "lc_socket_listen() - unwatched");
+	lc_ctx_free(sctx);
+	lc_ctx_free(lctx);
+
+	return fails;
+}
@@ -0,0 +1,138 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WAITS 2
+#define WORKERS 4
+#define CHANNELS 32
+#define MSGS 5
+
+static char data[] = "black lives matter";
+static lc_channel_t *rchan[CHANNELS];
+static lc_socket_group_t *grp;
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static sem_t sem;
+static unsigned char seen[CHANNELS][MSGS];
+static int worker[CHANNELS]; /* worker that received channel, -1 = none yet */
+static int used[WORKERS]; /* callbacks on each worker */
+static int msgs, badmsg, moved;
+
+void msg_received(lc_message_t *msg)
+{
+	int c, w;
+
+	for (c = 0; c < CHANNELS && msg->chan != rchan[c]; c++);
+	for (w = 0; w < WORKERS && lc_socket_get_id(lc_socket_group_socket(grp, w)) != msg->sockid; w++);
+	pthread_mutex_lock(&mtx);
+	used[w]++;
+	/* callback is called by both the opcode handler and listener */
+	if (c < CHANNELS && !seen[c][(msg->seq - 1) % MSGS]++) {
+		if (msg->len != sizeof data || memcmp(msg->data, data, sizeof data)) badmsg++;
+		if (worker[c] < 0) worker[c] = w;
+		if (worker[c] != w) moved++;
+		if (++msgs == CHANNELS * MSGS) sem_post(&sem);
+	}
+	pthread_mutex_unlock(&mtx);
+}
+
+static void reset(void)
+{
+	memset(seen, 0, sizeof seen);
+	memset(used, 0, sizeof used);
+	for (int c = 0; c < CHANNELS; c++) worker[c] = -1;
+	msgs = 0;
+}
+
+/* send MSGS messages to each channel, and wait for them */
+static void send_and_wait(lc_channel_t *chan[])
+{
+	lc_message_t msg;
+	struct timespec ts;
+
+	for (int i = 0; i < MSGS; i++) {
+		for (int c = 0; c < CHANNELS; c++) {
+			lc_msg_init_data(&msg, data, sizeof data, NULL, NULL);
+			lc_msg_send(chan[c], &msg);
+		}
+	}
+	test_assert(!clock_gettime(CLOCK_REALTIME, &ts), "clock_gettime()");
+	ts.tv_sec += WAITS;
+	test_assert(!sem_timedwait(&sem, &ts), "timeout");
+	test_assert(msgs == CHANNELS * MSGS, "received %i/%i", msgs, CHANNELS * MSGS);
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx, *sctx;
+	lc_socket_t *ssock;
+	lc_channel_t *chan[CHANNELS];
+	char name[16];
+	int workers = 0;
+
+	test_name("lc_socket_group_new() - SO_REUSEPORT worker group");
+
+	lctx = lc_ctx_new();
+	grp = lc_socket_group_new(lctx, WORKERS);
+	test_assert(grp != NULL, "lc_socket_group_new()");
+	test_assert(lc_socket_group_new(lctx, 0) == NULL, "lc_socket_group_new() - no workers");
+	test_assert(lc_socket_group_socket(grp, WORKERS) == NULL, "lc_socket_group_socket() - bad worker");
+	test_assert(lc_socket_group_cpu(grp, WORKERS, 0) == LC_ERROR_INVALID_PARAMS,
+			"lc_socket_group_cpu() - bad worker");
+	test_assert(lc_socket_group_cpu(grp, 0, 0) == 0, "lc_socket_group_cpu() - pin worker 0");
+	test_assert(lc_socket_group_steer(grp, 42) == LC_ERROR_INVALID_PARAMS,
+			"lc_socket_group_steer() - bad mode");
+
+	sctx = lc_ctx_new();
+	ssock = lc_socket_new(sctx);
+	lc_socket_loop(ssock, 1);
+	for (int c = 0; c < CHANNELS; c++) {
+		snprintf(name, sizeof name, "0000-0045-%i", c);
+		rchan[c] = lc_channel_new(lctx, name);
+		chan[c] = lc_channel_new(sctx, name);
+		lc_channel_bind(ssock, chan[c]);
+	}
+
+	/* steer by group: each channel sticks to one worker */
+	sem_init(&sem, 0, 0);
+	reset();
+	for (int c = 0; c < CHANNELS; c++) {
+		test_assert(!lc_socket_group_join(grp, rchan[c]), "lc_socket_group_join()");
+	}
+	test_assert(!lc_socket_group_listen(grp, &msg_received, NULL), "lc_socket_group_listen()");
+	test_assert(lc_socket_listen(lc_socket_group_socket(grp, 0), NULL, NULL) == LC_ERROR_SOCKET_LISTENING,
+			"workers listening");
+	send_and_wait(chan);
+	test_assert(moved == 0, "%i messages on the wrong worker", moved);
+	test_assert(badmsg == 0, "%i bad messages", badmsg);
+	for (int w = 0; w < WORKERS; w++) if (used[w]) workers++;
+	test_log("channels spread across %i/%i workers", workers, WORKERS);
+	test_assert(workers > 1, "more than one worker used");
+	test_assert(!lc_socket_group_listen_cancel(grp), "lc_socket_group_listen_cancel()");
+	for (int c = 0; c < CHANNELS; c++) lc_socket_group_part(grp, rchan[c]);
+
+	/* steer by source: every worker joins, but one source goes to one
+	 * worker, and nothing is received twice */
+	reset();
+	test_assert(!lc_socket_group_steer(grp, LC_STEER_SOURCE), "lc_socket_group_steer()");
+	for (int c = 0; c < CHANNELS; c++) {
+		test_assert(!lc_socket_group_join(grp, rchan[c]), "lc_socket_group_join()");
+	}
+	test_assert(!lc_socket_group_listen(grp, &msg_received, NULL), "lc_socket_group_listen()");
+	send_and_wait(chan);
+	usleep(100000); /* give any duplicates time to arrive */
+	workers = 0;
+	for (int w = 0; w < WORKERS; w++) if (used[w]) workers++;
+	test_assert(workers == 1, "one source, %i workers", workers);
+	test_assert(badmsg == 0, "%i bad messages", badmsg);
+
+	lc_socket_group_free(grp);
+	sem_destroy(&sem);
+	lc_ctx_free(sctx);
+	lc_ctx_free(lctx);
+
+	return fails;
+}
@@ -0,0 +1,122 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include "../src/pool.h"
+#include "../src/uring.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define WAITS 5
+#define MSGS 10000
+#define BATCH 64
+#define KEEP 100 /* messages the callback keeps a reference to */
+#define INFLIGHT 64 /* max messages sent and not yet received */
+
+static char data[] = "black lives matter";
+static lc_channel_t *rchan;
+static sem_t sem;
+static unsigned char seen[MSGS + 1];
+static lc_message_t kept[KEEP];
+static atomic_int msgs;
+static int badmsg, nkept;
+
+void msg_received(lc_message_t *msg)
+{
+	/* callback is called by both the opcode handler and listener */
+	if (msg->chan != rchan || msg->seq < 1 || msg->seq > MSGS || seen[msg->seq]++) return;
+	if (msg->len != sizeof data || memcmp(msg->data, data, sizeof data)) badmsg++;
+	/* hang on to some, so the listener has to replace their buffers */
+	if (nkept < KEEP && !(msg->seq % (MSGS / KEEP))) {
+		if (!lc_msg_ref(msg)) kept[nkept++] = *msg;
+	}
+	if (++msgs == MSGS) sem_post(&sem);
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx, *sctx;
+	lc_socket_t *sock, *ssock;
+	lc_channel_t *chan, *chans[BATCH];
+	lc_message_t msg[BATCH];
+	struct timespec ts;
+	ssize_t rc;
+	int sent, badkept = 0;
+
+	test_name("lc_ctx_engine() - io_uring");
+
+	lctx = lc_ctx_new();
+	test_assert(lc_ctx_engine(lctx, 42) == LC_ERROR_INVALID_PARAMS, "lc_ctx_engine() - bad engine");
+	test_assert(lc_ctx_engine(lctx, LC_ENGINE_SYSCALL) == LC_ENGINE_SYSCALL, "lc_ctx_engine() - syscall");
+	if (lc_ctx_engine(lctx, LC_ENGINE_URING) != LC_ENGINE_URING) {
+		/* falls back, and everything still works */
+		test_log("io_uring not available, using syscalls");
+	}
+	sctx = lc_ctx_new();
+	lc_ctx_engine(sctx, LC_ENGINE_URING);
+
+	sock = lc_socket_new(lctx);
+	rchan = lc_channel_new(lctx, "0000-0046");
+	lc_channel_bind(sock, rchan);
+	lc_channel_join(rchan);
+	sem_init(&sem, 0, 0);
+	test_assert(!lc_socket_listen(sock, &msg_received, NULL), "lc_socket_listen()");
+
+	ssock = lc_socket_new(sctx);
+	lc_socket_loop(ssock, 1);
+	chan = lc_channel_new(sctx, "0000-0046");
+	lc_channel_bind(ssock, chan);
+	for (int i = 0; i < BATCH; i++) chans[i] = chan;
+
+	/* batches go out as linked sendmsg operations, one io_uring_enter()
+	 * each. Wait for the listener to keep up, so the socket receive buffer
+	 * doesn't overflow */
+	for (sent = 0; sent < MSGS; sent += rc) {
+		int n = (MSGS - sent < BATCH) ? MSGS - sent : BATCH;
+		for (int i = 0; i < n; i++) lc_msg_init_data(&msg[i], data, sizeof data, NULL, NULL);
+		rc = lc_msg_send_batch(chans, msg, n);
+		test_assert(rc > 0, "lc_msg_send_batch() returned %zi", rc);
+		if (rc <= 0) break;
+		for (int i = 0; i < 10000 && sent + rc - msgs > INFLIGHT; i++) {
+			nanosleep(&(struct timespec){ .tv_nsec = 100000 }, NULL);
+		}
+	}
+#ifdef LC_URING
+	if (sctx->uring) {
+		test_log("send: %i messages, %llu io_uring_enter()", sent,
+				(unsigned long long)sctx->uring->enters);
+		test_assert(sctx->uring->enters <= (uint64_t)(MSGS / BATCH + 1),
+				"one io_uring_enter() per batch");
+	}
+#endif
+
+	test_assert(!clock_gettime(CLOCK_REALTIME, &ts), "clock_gettime()");
+	ts.tv_sec += WAITS;
+	test_assert(!sem_timedwait(&sem, &ts), "timeout");
+	test_assert(!lc_socket_listen_cancel(sock), "lc_socket_listen_cancel()");
+	test_assert(msgs == MSGS, "received %i/%i", msgs, MSGS);
+	test_assert(badmsg == 0, "%i bad messages", badmsg);
+
+	if (lctx->engine == LC_ENGINE_URING) {
+		test_log("recv: %llu messages, %llu io_uring_enter() (%.3f per message)",
+				(unsigned long long)sock->uring_msgs,
+				(unsigned long long)sock->uring_enters,
+				(double)sock->uring_enters / sock->uring_msgs);
+		test_assert(sock->uring_msgs >= MSGS, "received with io_uring");
+		test_assert(sock->uring_enters < sock->uring_msgs, "less than one syscall per message");
+	}
+
+	/* messages we kept a reference to are intact, and outlive the ring */
+	test_assert(nkept == KEEP, "kept %i/%i", nkept, KEEP);
+	for (int i = 0; i < nkept; i++) {
+		if (memcmp(kept[i].data, data, sizeof data)) badkept++;
+	}
+	test_assert(badkept == 0, "%i kept messages changed", badkept);
+	lc_ctx_free(sctx);
+	lc_ctx_free(lctx);
+	for (int i = 0; i < nkept; i++) lc_msg_unref(&kept[i]);
+	sem_destroy(&sem);
+
+	return fails;
+}
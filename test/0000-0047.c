@@ -0,0 +1,153 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include <librecast/if.h>
+#include <arpa/inet.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WAITS 2
+#define CHANNELS 16
+#define MSGS 100
+#define RINGSZ (4 << 20)
+
+static char data[] = "black lives matter";
+static lc_channel_t *rchan[CHANNELS], *other;
+static lc_socket_t *sock;
+static sem_t sem;
+static unsigned char seen[CHANNELS][MSGS + 1];
+static int msgs, badmsg, copied, refd, foreign;
+
+void msg_received(lc_message_t *msg)
+{
+	char *map = sock->ring->map;
+	int c;
+
+	if (msg->chan == other) foreign++;
+	/* callback is called by both the opcode handler and listener */
+	for (c = 0; c < CHANNELS && msg->chan != rchan[c]; c++);
+	if (c == CHANNELS || msg->seq < 1 || msg->seq > MSGS || seen[c][msg->seq]++) return;
+	if (msg->len != sizeof data || memcmp(msg->data, data, sizeof data)) badmsg++;
+	/* data is in the ring, not a copy */
+	if ((char *)msg->data < map || (char *)msg->data >= map + RINGSZ) copied++;
+	if (!lc_msg_ref(msg)) refd++;
+	if (++msgs == CHANNELS * MSGS) sem_post(&sem);
+}
+
+/* never called - a ring socket has no batch listener */
+void msg_batch(lc_message_t *msg, size_t n)
+{
+	(void)msg; (void)n;
+}
+
+/* ethernet frame carrying a librecast message to chan, as if from the wire */
+static size_t frame(char *buf, lc_channel_t *chan, lc_seq_t seq)
+{
+	struct in6_addr *grp = lc_channel_in6addr(chan);
+	lc_message_head_t head = { .seq = htobe64(seq), .len = htobe64(sizeof data), .op = LC_OP_DATA };
+	struct ip6_hdr ip6 = {0};
+	struct udphdr udp = {0};
+	const size_t ulen = sizeof udp + sizeof head + sizeof data;
+	char *p = buf;
+
+	memcpy(p, "\x33\x33", 2);
+	memcpy(p + 2, &grp->s6_addr[12], 4);
+	memcpy(p + 6, "\x02\x00\x00\x00\x00\x01", 6);
+	memcpy(p + 12, "\x86\xdd", 2);
+	p += 14;
+	ip6.ip6_flow = htonl(6 << 28);
+	ip6.ip6_plen = htons(ulen);
+	ip6.ip6_nxt = IPPROTO_UDP;
+	ip6.ip6_hlim = 1;
+	inet_pton(AF_INET6, "fe80::1", &ip6.ip6_src);
+	ip6.ip6_dst = *grp;
+	udp.uh_sport = htons(LC_DEFAULT_PORT);
+	udp.uh_dport = htons(LC_DEFAULT_PORT);
+	udp.uh_ulen = htons(ulen);
+	memcpy(p, &ip6, sizeof ip6);
+	p += sizeof ip6;
+	memcpy(p, &udp, sizeof udp);
+	p += sizeof udp;
+	memcpy(p, &head, sizeof head);
+	p += sizeof head;
+	memcpy(p, data, sizeof data);
+	return p + sizeof data - buf;
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx;
+	lc_socket_t *osock;
+	lc_message_t msg;
+	struct timespec ts;
+	char ifname[IFNAMSIZ];
+	char buf[BUFSIZ];
+	char name[32];
+	int tap;
+
+	test_cap_require(CAP_NET_ADMIN);
+	test_name("lc_socket_ring() - TPACKET_V3 receive ring");
+	test_require_linux();
+
+	/* AF_PACKET doesn't see multicast looped back by the sending host, so
+	 * write frames into a tap, which the kernel receives like any others */
+	lctx = lc_ctx_new();
+	tap = lc_tap_create(ifname);
+	test_assert(tap != -1, "lc_tap_create(): %s", strerror(errno));
+	test_assert(!lc_link_set(lctx, ifname, LC_IF_UP), "lc_link_set() - up");
+
+	sock = lc_socket_new(lctx);
+	test_assert(!lc_socket_ring(sock, RINGSZ), "lc_socket_ring(): %s", strerror(errno));
+	test_assert(lc_socket_watch(sock, &msg_received, NULL) == LC_ERROR_INVALID_PARAMS,
+			"lc_socket_watch() - ring");
+	/* nothing reaches the UDP socket, so these would block forever */
+	test_assert(lc_msg_recv(sock, &msg) == LC_ERROR_INVALID_PARAMS, "lc_msg_recv() - ring");
+	test_assert(lc_msg_recv_batch(sock, &msg, 1, 0) == LC_ERROR_INVALID_PARAMS,
+			"lc_msg_recv_batch() - ring");
+	test_assert(lc_socket_listen_batch(sock, &msg_batch, NULL) == LC_ERROR_INVALID_PARAMS,
+			"lc_socket_listen_batch() - ring");
+	test_assert(!lc_socket_bind(sock, if_nametoindex(ifname)), "lc_socket_bind()");
+	for (int c = 0; c < CHANNELS; c++) {
+		snprintf(name, sizeof name, "0000-0047-%i", c);
+		rchan[c] = lc_channel_new(lctx, name);
+		lc_channel_bind(sock, rchan[c]);
+		lc_channel_join(rchan[c]);
+	}
+	/* bound to another socket - the ring sees it, but must not deliver it */
+	osock = lc_socket_new(lctx);
+	other = lc_channel_new(lctx, "0000-0047-other");
+	lc_channel_bind(osock, other);
+
+	sem_init(&sem, 0, 0);
+	test_assert(!lc_socket_listen(sock, &msg_received, NULL), "lc_socket_listen()");
+	test_assert(lc_socket_ring(sock, 0) == LC_ERROR_SOCKET_LISTENING, "lc_socket_ring() - listening");
+
+	for (int i = 1; i <= MSGS; i++) {
+		for (int c = 0; c < CHANNELS; c++) {
+			test_assert(write(tap, buf, frame(buf, rchan[c], i)) > 0, "write(): %s", strerror(errno));
+		}
+		write(tap, buf, frame(buf, other, i));
+	}
+
+	test_assert(!clock_gettime(CLOCK_REALTIME, &ts), "clock_gettime()");
+	ts.tv_sec += WAITS;
+	test_assert(!sem_timedwait(&sem, &ts), "timeout");
+	test_assert(!lc_socket_listen_cancel(sock), "lc_socket_listen_cancel()");
+	test_assert(msgs == CHANNELS * MSGS, "received %i/%i", msgs, CHANNELS * MSGS);
+	test_assert(badmsg == 0, "%i bad messages", badmsg);
+	test_assert(copied == 0, "%i messages copied out of the ring", copied);
+	test_assert(refd == 0, "lc_msg_ref() refused for ring messages");
+	test_assert(foreign == 0, "%i messages for another socket", foreign);
+
+	test_assert(!lc_socket_ring(sock, 0), "lc_socket_ring() - off: %s", strerror(errno));
+	test_assert(sock->ring == NULL, "ring freed");
+
+	sem_destroy(&sem);
+	close(tap);
+	lc_ctx_free(lctx);
+
+	return fails;
+}
@@ -0,0 +1,280 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include "../src/xdp.h"
+#include <librecast/if.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WAITS 5
+#define CHANNELS 4
+#define MSGS 100
+#define BENCH 20000 /* messages each way for each path */
+#define INFLIGHT 64 /* max frames written and not yet received */
+
+static char data[] = "black lives matter";
+static lc_channel_t *rchan[CHANNELS], *other;
+static lc_socket_t *sock;
+static sem_t sem;
+static unsigned char seen[CHANNELS][MSGS + 1];
+static unsigned char bseen[BENCH + 1];
+static int msgs, badmsg, copied, refd, foreign;
+static atomic_int bmsgs;
+
+void msg_received(lc_message_t *msg)
+{
+	char *umem = sock->xdp->umem;
+	int c;
+
+	if (msg->chan == other) foreign++;
+	/* callback is called by both the opcode handler and listener */
+	for (c = 0; c < CHANNELS && msg->chan != rchan[c]; c++);
+	if (c == CHANNELS || msg->seq < 1 || msg->seq > MSGS || seen[c][msg->seq]++) return;
+	if (msg->len != sizeof data || memcmp(msg->data, data, sizeof data)) badmsg++;
+	/* data is in the UMEM, not a copy */
+	if ((char *)msg->data < umem || (char *)msg->data >= umem + LC_XDP_FRAMES * LC_XDP_FRAMESZ)
+		copied++;
+	if (!lc_msg_ref(msg)) refd++;
+	if (++msgs == CHANNELS * MSGS) sem_post(&sem);
+}
+
+void bench_received(lc_message_t *msg)
+{
+	if (msg->chan != rchan[0] || msg->seq < 1 || msg->seq > BENCH || bseen[msg->seq]++) return;
+	if (++bmsgs == BENCH) sem_post(&sem);
+}
+
+/* independent of the library's: sum bytes in network order */
+static uint16_t csum(const struct ip6_hdr *ip6, const unsigned char *udp, size_t len)
+{
+	uint32_t sum = len + IPPROTO_UDP;
+	const unsigned char *s = ip6->ip6_src.s6_addr, *d = ip6->ip6_dst.s6_addr;
+
+	for (int i = 0; i < 16; i += 2) sum += (s[i] << 8 | s[i + 1]) + (d[i] << 8 | d[i + 1]);
+	for (size_t i = 0; i < len; i += 2) sum += udp[i] << 8 | ((i + 1 < len) ? udp[i + 1] : 0);
+	while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/* ethernet frame carrying a librecast message to chan, as if from the wire */
+static size_t frame(char *buf, lc_channel_t *chan, lc_seq_t seq)
+{
+	struct in6_addr *grp = lc_channel_in6addr(chan);
+	lc_message_head_t head = { .seq = htobe64(seq), .len = htobe64(sizeof data), .op = LC_OP_DATA };
+	struct ip6_hdr ip6 = {0};
+	struct udphdr udp = {0};
+	const size_t ulen = sizeof udp + sizeof head + sizeof data;
+	char *p = buf;
+
+	memcpy(p, "\x33\x33", 2);
+	memcpy(p + 2, &grp->s6_addr[12], 4);
+	memcpy(p + 6, "\x02\x00\x00\x00\x00\x01", 6);
+	memcpy(p + 12, "\x86\xdd", 2);
+	p += 14;
+	ip6.ip6_flow = htonl(6 << 28);
+	ip6.ip6_plen = htons(ulen);
+	ip6.ip6_nxt = IPPROTO_UDP;
+	ip6.ip6_hlim = 1;
+	inet_pton(AF_INET6, "fe80::1", &ip6.ip6_src);
+	ip6.ip6_dst = *grp;
+	udp.uh_sport = htons(LC_DEFAULT_PORT);
+	udp.uh_dport = htons(LC_DEFAULT_PORT);
+	udp.uh_ulen = htons(ulen);
+	memcpy(p, &ip6, sizeof ip6);
+	memcpy(p + sizeof ip6 + sizeof udp, &head, sizeof head);
+	memcpy(p + sizeof ip6 + sizeof udp + sizeof head, data, sizeof data);
+	/* both paths check it, and IPv6 sends zero as all ones */
+	memcpy(p + sizeof ip6, &udp, sizeof udp);
+	udp.uh_sum = htons(~csum(&ip6, (unsigned char *)p + sizeof ip6, ulen));
+	if (!udp.uh_sum) udp.uh_sum = 0xffff;
+	memcpy(p + sizeof ip6, &udp, sizeof udp);
+	return 14 + sizeof ip6 + ulen;
+}
+
+/* next frame the tap was given to send to grp, 0 if none */
+static ssize_t tap_read(int tap, char *buf, size_t len, struct in6_addr *grp)
+{
+	struct pollfd pfd = { .fd = tap, .events = POLLIN };
+	struct ip6_hdr ip6;
+	ssize_t n;
+
+	while (poll(&pfd, 1, WAITS * 1000) == 1) {
+		if ((n = read(tap, buf, len)) < 54) continue;
+		memcpy(&ip6, buf + 14, sizeof ip6);
+		if (ip6.ip6_nxt == IPPROTO_UDP && !memcmp(&ip6.ip6_dst, grp, sizeof *grp)) return n;
+	}
+	return 0;
+}
+
+static void sem_wait_timeout(void)
+{
+	struct timespec ts;
+	test_assert(!clock_gettime(CLOCK_REALTIME, &ts), "clock_gettime()");
+	ts.tv_sec += WAITS;
+	test_assert(!sem_timedwait(&sem, &ts), "timeout");
+}
+
+static double elapsed(struct timespec *t0)
+{
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/* packets/sec received by sock, for BENCH frames written to the tap */
+static double bench_rx(int tap)
+{
+	struct timespec t0;
+	char buf[BUFSIZ];
+	double t;
+
+	memset(bseen, 0, sizeof bseen);
+	bmsgs = 0;
+	test_assert(!lc_socket_listen(sock, &bench_received, NULL), "lc_socket_listen()");
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 1; i <= BENCH; i++) {
+		write(tap, buf, frame(buf, rchan[0], i));
+		for (int j = 0; j < 10000 && i - bmsgs > INFLIGHT; j++) {
+			nanosleep(&(struct timespec){ .tv_nsec = 10000 }, NULL);
+		}
+	}
+	sem_wait_timeout();
+	t = elapsed(&t0);
+	lc_socket_listen_cancel(sock);
+	test_assert(bmsgs == BENCH, "bench received %i/%i", (int)bmsgs, BENCH);
+	return bmsgs / t;
+}
+
+/* packets/sec sent by sock */
+static double bench_tx(void)
+{
+	struct timespec t0;
+	lc_message_t msg;
+	int sent = 0;
+
+	/* the kernel won't send until the new interface has an address */
+	for (int i = 0; i < WAITS * 10; i++) {
+		lc_msg_init_data(&msg, data, sizeof data, NULL, NULL);
+		if (lc_msg_send(rchan[0], &msg) > 0 || errno != EADDRNOTAVAIL) break;
+		nanosleep(&(struct timespec){ .tv_nsec = 100000000 }, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < BENCH; i++) {
+		lc_msg_init_data(&msg, data, sizeof data, NULL, NULL);
+		if (lc_msg_send(rchan[0], &msg) > 0) sent++;
+	}
+	test_assert(sent == BENCH, "bench sent %i/%i", sent, BENCH);
+	return sent / elapsed(&t0);
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx;
+	lc_socket_t *osock;
+	lc_message_t msg, batch[4];
+	lc_message_head_t head;
+	struct ip6_hdr ip6;
+	struct udphdr udp;
+	struct in6_addr *grp;
+	char ifname[IFNAMSIZ];
+	char buf[BUFSIZ];
+	char name[32];
+	double xrx, xtx, krx, ktx;
+	ssize_t n;
+	int tap;
+
+	test_cap_require(CAP_NET_ADMIN);
+	test_name("lc_socket_xdp() - AF_XDP send/receive");
+	test_require_linux();
+
+	lctx = lc_ctx_new();
+	tap = lc_tap_create(ifname);
+	test_assert(tap != -1, "lc_tap_create(): %s", strerror(errno));
+	test_assert(!lc_link_set(lctx, ifname, LC_IF_UP), "lc_link_set() - up");
+
+	sock = lc_socket_new(lctx);
+	errno = 0;
+	test_assert(lc_socket_xdp(sock, 1) == -1 && errno == EINVAL, "lc_socket_xdp() - not bound");
+	test_assert(!lc_socket_bind(sock, if_nametoindex(ifname)), "lc_socket_bind()");
+	test_assert(!lc_socket_xdp(sock, 1), "lc_socket_xdp(): %s", strerror(errno));
+	if (!sock->xdp) goto exit_0;
+	test_assert(lc_socket_watch(sock, &msg_received, NULL) == LC_ERROR_INVALID_PARAMS,
+			"lc_socket_watch() - xdp");
+	for (int c = 0; c < CHANNELS; c++) {
+		snprintf(name, sizeof name, "0000-0048-%i", c);
+		rchan[c] = lc_channel_new(lctx, name);
+		lc_channel_bind(sock, rchan[c]);
+		lc_channel_join(rchan[c]);
+	}
+	/* bound to another socket - the XDP program passes it to the stack,
+	 * and it must not be delivered */
+	osock = lc_socket_new(lctx);
+	other = lc_channel_new(lctx, "0000-0048-other");
+	lc_channel_bind(osock, other);
+
+	/* receive: frames written to the tap are received by the interface */
+	sem_init(&sem, 0, 0);
+	test_assert(!lc_socket_listen(sock, &msg_received, NULL), "lc_socket_listen()");
+	test_assert(lc_socket_xdp(sock, 0) == LC_ERROR_SOCKET_LISTENING, "lc_socket_xdp() - listening");
+	for (int i = 1; i <= MSGS; i++) {
+		for (int c = 0; c < CHANNELS; c++) {
+			test_assert(write(tap, buf, frame(buf, rchan[c], i)) > 0, "write(): %s", strerror(errno));
+		}
+		write(tap, buf, frame(buf, other, i));
+	}
+	sem_wait_timeout();
+	test_assert(!lc_socket_listen_cancel(sock), "lc_socket_listen_cancel()");
+	test_assert(lc_msg_recv_batch(sock, batch, 4, MSG_DONTWAIT) == -1 && errno == EAGAIN,
+			"lc_msg_recv_batch() - MSG_DONTWAIT");
+	test_assert(msgs == CHANNELS * MSGS, "received %i/%i", msgs, CHANNELS * MSGS);
+	test_assert(badmsg == 0, "%i bad messages", badmsg);
+	test_assert(copied == 0, "%i messages copied out of the UMEM", copied);
+	test_assert(refd == 0, "lc_msg_ref() refused for AF_XDP messages");
+	test_assert(foreign == 0, "%i messages for another socket", foreign);
+
+	/* send: the frame comes out of the tap */
+	test_assert(!lc_socket_ttl(sock, 7), "lc_socket_ttl()");
+	lc_msg_init_data(&msg, data, sizeof data, NULL, NULL);
+	test_assert(lc_msg_send(rchan[1], &msg) == (ssize_t)(sizeof head + sizeof data), "lc_msg_send()");
+	grp = lc_channel_in6addr(rchan[1]);
+	n = tap_read(tap, buf, sizeof buf, grp);
+	test_assert(n == 62 + (ssize_t)(sizeof head + sizeof data), "frame length %zi", n);
+	if (n > 0) {
+		memcpy(&ip6, buf + 14, sizeof ip6);
+		memcpy(&udp, buf + 54, sizeof udp);
+		memcpy(&head, buf + 62, sizeof head);
+		test_assert(!memcmp(buf, "\x33\x33", 2) && !memcmp(buf + 2, &grp->s6_addr[12], 4),
+				"multicast MAC");
+		test_assert(!memcmp(buf + 6, sock->xdp->mac, 6), "source MAC");
+		test_assert(ip6.ip6_hlim == 7, "hop limit %i", ip6.ip6_hlim);
+		test_assert(ntohs(ip6.ip6_plen) == sizeof udp + sizeof head + sizeof data, "payload length");
+		test_assert(ntohs(udp.uh_dport) == LC_DEFAULT_PORT, "destination port");
+		test_assert(csum(&ip6, (unsigned char *)buf + 54, n - 54) == 0xffff, "UDP checksum");
+		test_assert(be64toh(head.len) == sizeof data, "header length");
+		test_assert(!memcmp(buf + 62 + sizeof head, data, sizeof data), "payload");
+	}
+
+	/* packets/sec against the kernel UDP socket on the same interface */
+	xrx = bench_rx(tap);
+	xtx = bench_tx();
+	test_assert(!lc_socket_xdp(sock, 0), "lc_socket_xdp() - off: %s", strerror(errno));
+	test_assert(sock->xdp == NULL, "AF_XDP released");
+	krx = bench_rx(tap);
+	ktx = bench_tx();
+	test_log("receive: AF_XDP %.0f pps, kernel %.0f pps (%.2fx)", xrx, krx, xrx / krx);
+	test_log("send:    AF_XDP %.0f pps, kernel %.0f pps (%.2fx)", xtx, ktx, xtx / ktx);
+
+	sem_destroy(&sem);
+exit_0:
+	close(tap);
+	lc_ctx_free(lctx);
+
+	return fails;
+}
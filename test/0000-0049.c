@@ -0,0 +1,138 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include <librecast/if.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/filter.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <unistd.h>
+
+#define MSGS 50
+#define OTHER 1000 /* sequence numbers from the other interface start here */
+
+static char data[] = "black lives matter";
+
+static uint16_t csum(const struct ip6_hdr *ip6, const unsigned char *udp, size_t len)
+{
+	uint32_t sum = len + IPPROTO_UDP;
+	const unsigned char *s = ip6->ip6_src.s6_addr, *d = ip6->ip6_dst.s6_addr;
+
+	for (int i = 0; i < 16; i += 2) sum += (s[i] << 8 | s[i + 1]) + (d[i] << 8 | d[i + 1]);
+	for (size_t i = 0; i < len; i += 2) sum += udp[i] << 8 | ((i + 1 < len) ? udp[i + 1] : 0);
+	while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/* ethernet frame carrying a librecast message to chan, as if from the wire */
+static size_t frame(char *buf, lc_channel_t *chan, lc_seq_t seq)
+{
+	struct in6_addr *grp = lc_channel_in6addr(chan);
+	lc_message_head_t head = { .seq = htobe64(seq), .len = htobe64(sizeof data), .op = LC_OP_DATA };
+	struct ip6_hdr ip6 = {0};
+	struct udphdr udp = {0};
+	const size_t ulen = sizeof udp + sizeof head + sizeof data;
+	char *p = buf;
+
+	memcpy(p, "\x33\x33", 2);
+	memcpy(p + 2, &grp->s6_addr[12], 4);
+	memcpy(p + 6, "\x02\x00\x00\x00\x00\x01", 6);
+	memcpy(p + 12, "\x86\xdd", 2);
+	p += 14;
+	ip6.ip6_flow = htonl(6 << 28);
+	ip6.ip6_plen = htons(ulen);
+	ip6.ip6_nxt = IPPROTO_UDP;
+	ip6.ip6_hlim = 1;
+	inet_pton(AF_INET6, "fe80::1", &ip6.ip6_src);
+	ip6.ip6_dst = *grp;
+	udp.uh_sport = htons(LC_DEFAULT_PORT);
+	udp.uh_dport = htons(LC_DEFAULT_PORT);
+	udp.uh_ulen = htons(ulen);
+	memcpy(p, &ip6, sizeof ip6);
+	memcpy(p + sizeof ip6 + sizeof udp, &head, sizeof head);
+	memcpy(p + sizeof ip6 + sizeof udp + sizeof head, data, sizeof data);
+	memcpy(p + sizeof ip6, &udp, sizeof udp);
+	udp.uh_sum = htons(~csum(&ip6, (unsigned char *)p + sizeof ip6, ulen));
+	memcpy(p + sizeof ip6, &udp, sizeof udp);
+	return 14 + sizeof ip6 + ulen;
+}
+
+/* write MSGS frames into each tap, then count what sock receives from each */
+static void inject(lc_socket_t *sock, lc_channel_t *chan, int tap[2], int got[2])
+{
+	struct pollfd pfd = { .fd = lc_socket_raw(sock), .events = POLLIN };
+	lc_message_head_t head;
+	char buf[BUFSIZ];
+	lc_seq_t seq;
+
+	for (int i = 1; i <= MSGS; i++) {
+		write(tap[0], buf, frame(buf, chan, i));
+		write(tap[1], buf, frame(buf, chan, OTHER + i));
+	}
+	got[0] = got[1] = 0;
+	while (poll(&pfd, 1, 200) == 1) {
+		if (lc_socket_recv(sock, buf, sizeof buf, MSG_DONTWAIT) < (ssize_t)sizeof head) continue;
+		memcpy(&head, buf, sizeof head);
+		seq = be64toh(head.seq);
+		got[seq > OTHER]++;
+	}
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx;
+	lc_socket_t *sock;
+	lc_channel_t *chan;
+	struct ipv6_mreq req;
+	struct sock_filter f[64];
+	socklen_t flen = 0, len;
+	char ifname[2][IFNAMSIZ];
+	unsigned int ifx[2];
+	int tap[2], got[2];
+
+	test_cap_require(CAP_NET_ADMIN);
+	test_name("lc_socket_bind() - kernel drops datagrams from other interfaces");
+	test_require_linux();
+
+	lctx = lc_ctx_new();
+	for (int i = 0; i < 2; i++) {
+		tap[i] = lc_tap_create(ifname[i]);
+		test_assert(tap[i] != -1, "lc_tap_create(): %s", strerror(errno));
+		test_assert(!lc_link_set(lctx, ifname[i], LC_IF_UP), "lc_link_set() - up");
+		ifx[i] = if_nametoindex(ifname[i]);
+	}
+	sock = lc_socket_new(lctx);
+	chan = lc_channel_new(lctx, "0000-0049");
+	test_assert(!lc_socket_bind(sock, ifx[0]), "lc_socket_bind()");
+	lc_channel_bind(sock, chan);
+	test_assert(!lc_channel_join(chan), "lc_channel_join()");
+	/* member on the other interface too, so only the filter keeps it out */
+	req.ipv6mr_multiaddr = *lc_channel_in6addr(chan);
+	req.ipv6mr_interface = ifx[1];
+	test_assert(!setsockopt(lc_socket_raw(sock), IPPROTO_IPV6, IPV6_JOIN_GROUP, &req, sizeof req),
+			"IPV6_JOIN_GROUP: %s", strerror(errno));
+
+	test_assert(!getsockopt(lc_socket_raw(sock), SOL_SOCKET, SO_GET_FILTER, f, &flen),
+			"SO_GET_FILTER: %s", strerror(errno));
+	test_assert(flen > 0, "filter attached");
+	len = flen;
+	inject(sock, chan, tap, got);
+	test_assert(got[0] == MSGS, "bound interface: received %i/%i", got[0], MSGS);
+	test_assert(got[1] == 0, "other interface: received %i/0", got[1]);
+
+	/* unbound, we hear both, and the interface test is gone */
+	test_assert(!lc_socket_bind(sock, 0), "lc_socket_bind() - all");
+	flen = 0;
+	test_assert(getsockopt(lc_socket_raw(sock), SOL_SOCKET, SO_GET_FILTER, f, &flen) || flen < len,
+			"interface filter detached");
+	inject(sock, chan, tap, got);
+	test_assert(got[0] == MSGS, "all interfaces (0): received %i/%i", got[0], MSGS);
+	test_assert(got[1] == MSGS, "all interfaces (1): received %i/%i", got[1], MSGS);
+
+	for (int i = 0; i < 2; i++) close(tap[i]);
+	lc_ctx_free(lctx);
+
+	return fails;
+}
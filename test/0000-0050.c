@@ -0,0 +1,195 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include <librecast/if.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <unistd.h>
+
+#define MSGS 20
+#define CHANS 4
+#define MANY 300 /* more than the 256 channels filtered exactly */
+#define BUCKETS 2048 /* LC_BPF_BUCKETS */
+
+static char data[] = "black lives matter";
+
+static uint16_t csum(const struct ip6_hdr *ip6, const unsigned char *udp, size_t len)
+{
+	uint32_t sum = len + IPPROTO_UDP;
+	const unsigned char *s = ip6->ip6_src.s6_addr, *d = ip6->ip6_dst.s6_addr;
+
+	for (int i = 0; i < 16; i += 2) sum += (s[i] << 8 | s[i + 1]) + (d[i] << 8 | d[i + 1]);
+	for (size_t i = 0; i < len; i += 2) sum += udp[i] << 8 | ((i + 1 < len) ? udp[i + 1] : 0);
+	while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/* ethernet frame carrying a librecast message to chan, as if from the wire */
+static size_t frame(char *buf, lc_channel_t *chan, lc_seq_t seq)
+{
+	struct in6_addr *grp = lc_channel_in6addr(chan);
+	lc_message_head_t head = { .seq = htobe64(seq), .len = htobe64(sizeof data), .op = LC_OP_DATA };
+	struct ip6_hdr ip6 = {0};
+	struct udphdr udp = {0};
+	const size_t ulen = sizeof udp + sizeof head + sizeof data;
+	char *p = buf;
+
+	memcpy(p, "\x33\x33", 2);
+	memcpy(p + 2, &grp->s6_addr[12], 4);
+	memcpy(p + 6, "\x02\x00\x00\x00\x00\x01", 6);
+	memcpy(p + 12, "\x86\xdd", 2);
+	p += 14;
+	ip6.ip6_flow = htonl(6 << 28);
+	ip6.ip6_plen = htons(ulen);
+	ip6.ip6_nxt = IPPROTO_UDP;
+	ip6.ip6_hlim = 1;
+	inet_pton(AF_INET6, "fe80::1", &ip6.ip6_src);
+	ip6.ip6_dst = *grp;
+	udp.uh_sport = htons(LC_DEFAULT_PORT);
+	udp.uh_dport = htons(LC_DEFAULT_PORT);
+	udp.uh_ulen = htons(ulen);
+	memcpy(p, &ip6, sizeof ip6);
+	memcpy(p + sizeof ip6 + sizeof udp, &head, sizeof head);
+	memcpy(p + sizeof ip6 + sizeof udp + sizeof head, data, sizeof data);
+	memcpy(p + sizeof ip6, &udp, sizeof udp);
+	udp.uh_sum = htons(~csum(&ip6, (unsigned char *)p + sizeof ip6, ulen));
+	memcpy(p + sizeof ip6, &udp, sizeof udp);
+	return 14 + sizeof ip6 + ulen;
+}
+
+/* write MSGS frames to each channel into the tap, then count what sock
+ * receives for each */
+static void inject(lc_socket_t *sock, lc_channel_t **chan, int tap, int *got)
+{
+	struct pollfd pfd = { .fd = lc_socket_raw(sock), .events = POLLIN };
+	lc_message_head_t head;
+	char buf[BUFSIZ];
+	lc_seq_t seq;
+
+	for (int i = 1; i <= MSGS; i++) {
+		for (int c = 0; c < CHANS; c++) {
+			write(tap, buf, frame(buf, chan[c], c * MSGS + i));
+		}
+	}
+	memset(got, 0, sizeof(int) * CHANS);
+	while (poll(&pfd, 1, 200) == 1) {
+		if (lc_socket_recv(sock, buf, sizeof buf, MSG_DONTWAIT) < (ssize_t)sizeof head) continue;
+		memcpy(&head, buf, sizeof head);
+		seq = be64toh(head.seq) - 1;
+		if (seq < CHANS * MSGS) got[seq / MSGS]++;
+	}
+}
+
+/* bucket the kernel filter hashes chan's group into */
+static uint32_t bucket(lc_channel_t *chan)
+{
+	uint32_t w;
+	memcpy(&w, &lc_channel_in6addr(chan)->s6_addr[12], sizeof w);
+	return ntohl(w) % BUCKETS;
+}
+
+static int filterlen(lc_socket_t *sock)
+{
+	socklen_t flen = 0;
+	if (getsockopt(lc_socket_raw(sock), SOL_SOCKET, SO_GET_FILTER, NULL, &flen)) return 0;
+	return flen;
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx;
+	lc_socket_t *sock;
+	lc_channel_t *chan[CHANS], *many[MANY];
+	struct ipv6_mreq req;
+	static char used[BUCKETS];
+	char ifname[IFNAMSIZ];
+	char name[32];
+	int tap, got[CHANS], len;
+
+	test_cap_require(CAP_NET_ADMIN);
+	test_name("lc_channel_bind() - kernel drops groups with no bound channel");
+	test_require_linux();
+
+	lctx = lc_ctx_new();
+	tap = lc_tap_create(ifname);
+	test_assert(tap != -1, "lc_tap_create(): %s", strerror(errno));
+	test_assert(!lc_link_set(lctx, ifname, LC_IF_UP), "lc_link_set() - up");
+	sock = lc_socket_new(lctx);
+	test_assert(!lc_socket_bind(sock, if_nametoindex(ifname)), "lc_socket_bind()");
+	for (int c = 0; c < CHANS; c++) {
+		snprintf(name, sizeof name, "0000-0050-%i", c);
+		chan[c] = lc_channel_new(lctx, name);
+	}
+
+	/* 0, 1: bound and joined */
+	for (int c = 0; c < 2; c++) {
+		test_assert(!lc_channel_bind(sock, chan[c]), "lc_channel_bind(%i)", c);
+		test_assert(!lc_channel_join(chan[c]), "lc_channel_join(%i)", c);
+	}
+	/* 2: joined, then unbound - still a member, but not ours */
+	test_assert(!lc_channel_bind(sock, chan[2]), "lc_channel_bind(2)");
+	test_assert(!lc_channel_join(chan[2]), "lc_channel_join(2)");
+	len = filterlen(sock);
+	test_assert(!lc_channel_unbind(chan[2]), "lc_channel_unbind(2)");
+	test_assert(filterlen(sock) < len, "filter shrinks on unbind");
+	/* 3: joined behind our back, never bound */
+	req.ipv6mr_multiaddr = *lc_channel_in6addr(chan[3]);
+	req.ipv6mr_interface = if_nametoindex(ifname);
+	test_assert(!setsockopt(lc_socket_raw(sock), IPPROTO_IPV6, IPV6_JOIN_GROUP, &req, sizeof req),
+			"IPV6_JOIN_GROUP: %s", strerror(errno));
+
+	inject(sock, chan, tap, got);
+	test_assert(got[0] == MSGS, "bound channel 0: received %i/%i", got[0], MSGS);
+	test_assert(got[1] == MSGS, "bound channel 1: received %i/%i", got[1], MSGS);
+	test_assert(got[2] == 0, "unbound channel: received %i/0", got[2]);
+	test_assert(got[3] == 0, "never bound channel: received %i/0", got[3]);
+
+	/* binding lets it through, unbinding the rest shuts them out */
+	test_assert(!lc_channel_bind(sock, chan[3]), "lc_channel_bind(3)");
+	test_assert(!lc_channel_unbind(chan[0]), "lc_channel_unbind(0)");
+	inject(sock, chan, tap, got);
+	test_assert(got[0] == 0, "unbound channel 0: received %i/0", got[0]);
+	test_assert(got[1] == MSGS, "bound channel 1: received %i/%i", got[1], MSGS);
+	test_assert(got[3] == MSGS, "bound channel 3: received %i/%i", got[3], MSGS);
+	test_assert(lc_socket_filter_mode(sock) == LC_FILTER_EXACT, "exact filter");
+
+	/* too many channels to test each: the filter tests the bucket of a
+	 * hash instead. Bound groups still get through, and groups in a bucket
+	 * no bound channel uses don't */
+	for (int c = 0; c < MANY; c++) {
+		snprintf(name, sizeof name, "0000-0050-many-%i", c);
+		many[c] = lc_channel_new(lctx, name);
+		test_assert(!lc_channel_bind(sock, many[c]), "lc_channel_bind(many %i): %s", c, strerror(errno));
+		used[bucket(many[c])] = 1;
+	}
+	used[bucket(chan[1])] = used[bucket(chan[3])] = 1;
+	test_assert(lc_socket_filter_mode(sock) == LC_FILTER_HASH, "hashed filter");
+	test_assert(!lc_channel_join(many[0]), "lc_channel_join(many 0)");
+	chan[0] = many[0];
+	for (int c = 0; ; c++) {
+		snprintf(name, sizeof name, "0000-0050-other-%i", c);
+		chan[2] = lc_channel_new(lctx, name);
+		if (!used[bucket(chan[2])]) break;
+		lc_channel_free(chan[2]);
+	}
+	req.ipv6mr_multiaddr = *lc_channel_in6addr(chan[2]);
+	test_assert(!setsockopt(lc_socket_raw(sock), IPPROTO_IPV6, IPV6_JOIN_GROUP, &req, sizeof req),
+			"IPV6_JOIN_GROUP: %s", strerror(errno));
+	inject(sock, chan, tap, got);
+	test_assert(got[0] == MSGS, "hashed bound channel: received %i/%i", got[0], MSGS);
+	test_assert(got[1] == MSGS, "bound channel 1: received %i/%i", got[1], MSGS);
+	test_assert(got[2] == 0, "unbound channel, empty bucket: received %i/0", got[2]);
+	test_assert(got[3] == MSGS, "bound channel 3: received %i/%i", got[3], MSGS);
+
+	/* back down to a few, and it's exact again */
+	for (int c = 1; c < MANY; c++) lc_channel_unbind(many[c]);
+	test_assert(lc_socket_filter_mode(sock) == LC_FILTER_EXACT, "exact filter again");
+
+	close(tap);
+	lc_ctx_free(lctx);
+
+	return fails;
+}
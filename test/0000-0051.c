@@ -0,0 +1,132 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define PINGS 2000
+#define ROUNDS 4 /* turns each mode takes, so neither gets the quieter machine */
+#define WARMUP 100 /* pings not counted, while the path warms up */
+#define BUSYPOLL 1000000 /* usec the echo listener spins before it blocks */
+
+static char data[] = "black lives matter";
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* one-way latency (half the round trip) of pings PINGs from psock/pchan,
+ * answered with PONG by the opcode handler of whoever is listening on the
+ * channel. Returns pongs received, with their latencies in ns */
+static int pingpong(lc_socket_t *psock, lc_channel_t *pchan, uint64_t *ns, int pings)
+{
+	lc_message_t msg;
+	uint64_t ts;
+	int op = LC_OP_PING, n = 0;
+	ssize_t rc;
+
+	for (int i = 0; i < WARMUP + pings; i++) {
+		lc_msg_init_data(&msg, data, sizeof data, NULL, NULL);
+		lc_msg_set(&msg, LC_ATTR_OPCODE, &op);
+		/* the PONG carries our timestamp back */
+		msg.timestamp = ts = now_ns();
+		if (lc_msg_send(pchan, &msg) <= 0) continue;
+		for (;;) {
+			if ((rc = lc_msg_recv(psock, &msg)) == -1) break; /* timed out */
+			/* our own PING looped back, or a late PONG */
+			if (msg.op != LC_OP_PONG || msg.timestamp != ts) {
+				lc_msg_free(&msg);
+				continue;
+			}
+			if (i >= WARMUP) ns[n++] = (now_ns() - ts) / 2;
+			lc_msg_free(&msg);
+			break;
+		}
+	}
+	return n;
+}
+
+/* a round of pings with the echo side listening, spinning for busypoll usec */
+static int pinground(lc_socket_t *esock, unsigned int busypoll,
+		lc_socket_t *psock, lc_channel_t *pchan, uint64_t *ns)
+{
+	int n;
+
+	test_assert(!lc_socket_busypoll(esock, busypoll), "lc_socket_busypoll(): %s", strerror(errno));
+	test_assert(esock->busypoll == busypoll, "busypoll set");
+	test_assert(!lc_socket_listen(esock, NULL, NULL), "lc_socket_listen()");
+	n = pingpong(psock, pchan, ns, PINGS / ROUNDS);
+	test_assert(!lc_socket_listen_cancel(esock), "lc_socket_listen_cancel()");
+	return n;
+}
+
+static void report(const char *mode, uint64_t *ns, int n)
+{
+	if (!n) return;
+	qsort(ns, n, sizeof *ns, &cmp);
+	test_log("%s: p50 %.1f us, p99 %.1f us, p99.9 %.1f us (%i pongs)", mode,
+		ns[n * 50 / 100] / 1e3, ns[n * 99 / 100] / 1e3, ns[n * 999 / 1000] / 1e3, n);
+}
+
+int main(void)
+{
+	lc_ctx_t *ectx, *pctx;
+	lc_socket_t *esock, *psock;
+	lc_channel_t *echan, *pchan;
+	struct timeval tv = { .tv_sec = 1 };
+	static uint64_t spin[PINGS], block[PINGS];
+	int nspin = 0, nblock = 0;
+
+	test_name("lc_socket_busypoll() - spinning listener, PING/PONG latency");
+	test_require_linux();
+
+	/* echo side: the PING opcode handler answers from the listener */
+	ectx = lc_ctx_new();
+	esock = lc_socket_new(ectx);
+	lc_socket_loop(esock, 1);
+	echan = lc_channel_new(ectx, "0000-0051");
+	lc_channel_bind(esock, echan);
+	lc_channel_join(echan);
+	test_assert(!lc_socket_busypoll(esock, BUSYPOLL), "lc_socket_busypoll(): %s", strerror(errno));
+	test_assert(!lc_socket_listen(esock, NULL, NULL), "lc_socket_listen()");
+	test_assert(lc_socket_busypoll(esock, 0) == LC_ERROR_SOCKET_LISTENING,
+			"lc_socket_busypoll() - listening");
+	test_assert(!lc_socket_listen_cancel(esock), "lc_socket_listen_cancel()");
+
+	/* ping side: plain blocking receive, the same for both modes */
+	pctx = lc_ctx_new();
+	psock = lc_socket_new(pctx);
+	lc_socket_loop(psock, 1);
+	setsockopt(lc_socket_raw(psock), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	pchan = lc_channel_new(pctx, "0000-0051");
+	lc_channel_bind(psock, pchan);
+	lc_channel_join(pchan);
+
+	/* the echo side takes turns spinning and blocking in recvmsg() */
+	for (int i = 0; i < ROUNDS; i++) {
+		nspin += pinground(esock, BUSYPOLL, psock, pchan, spin + nspin);
+		nblock += pinground(esock, 0, psock, pchan, block + nblock);
+	}
+	test_assert(esock->busypoll == 0, "busypoll cleared");
+	test_assert(nspin == PINGS, "spinning: %i/%i pongs", nspin, PINGS);
+	test_assert(nblock == PINGS, "blocking: %i/%i pongs", nblock, PINGS);
+
+	report("busy poll", spin, nspin);
+	report("blocking ", block, nblock);
+
+	lc_ctx_free(pctx);
+	lc_ctx_free(ectx);
+
+	return fails;
+}
@@ -0,0 +1,204 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define WAITS 5
+#define CHANNELS 8
+#define MSGS 500
+#define WORKERS 4
+#define QLEN 1024
+#define INFLIGHT 64 /* max messages sent and not yet received */
+#define SMALLQ 4
+#define FLOOD 20
+
+static char data[] = "black lives matter";
+static lc_channel_t *rchan[CHANNELS];
+static lc_socket_t *sock;
+static sem_t sem, gate;
+static lc_seq_t last[CHANNELS];
+static pthread_t tid[WORKERS + 1];
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int msgs, blocked, pongs, pongworker, pinglistener;
+static void (*ping_handler)(lc_socket_call_t *, lc_message_t *);
+static int badmsg, unordered, onlistener, ntid;
+
+void msg_received(lc_message_t *msg)
+{
+	int c;
+
+	if (pthread_equal(pthread_self(), sock->thread)) onlistener++;
+	pthread_mutex_lock(&mtx);
+	for (c = 0; c < ntid && !pthread_equal(tid[c], pthread_self()); c++);
+	if (c == ntid && ntid <= WORKERS) tid[ntid++] = pthread_self();
+	pthread_mutex_unlock(&mtx);
+
+	for (c = 0; c < CHANNELS && msg->chan != rchan[c]; c++);
+	if (c == CHANNELS) return;
+	/* each worker has its own channels, so no locking */
+	if (msg->seq <= last[c]) unordered++;
+	last[c] = msg->seq;
+	if (msg->len != sizeof data || memcmp(msg->data, data, sizeof data)) badmsg++;
+	if (++msgs == CHANNELS * MSGS) sem_post(&sem);
+}
+
+void msg_blocked(lc_message_t *msg)
+{
+	(void)msg;
+	blocked++;
+	sem_wait(&gate);
+}
+
+/* wraps the PING opcode handler, to see where it runs */
+static void ping_wrap(lc_socket_call_t *sc, lc_message_t *msg)
+{
+	if (pthread_equal(pthread_self(), sock->thread)) pinglistener++;
+	ping_handler(sc, msg);
+}
+
+/* the PING handler has turned it into a PONG before it gets here */
+void msg_pong(lc_message_t *msg)
+{
+	if (msg->op != LC_OP_PONG) return;
+	if (!pthread_equal(pthread_self(), sock->thread)) pongworker++;
+	pongs++;
+}
+
+static void sem_wait_timeout(void)
+{
+	struct timespec ts;
+	test_assert(!clock_gettime(CLOCK_REALTIME, &ts), "clock_gettime()");
+	ts.tv_sec += WAITS;
+	test_assert(!sem_timedwait(&sem, &ts), "timeout");
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx, *sctx, *pctx;
+	lc_socket_t *ssock, *psock;
+	lc_channel_t *schan[CHANNELS], *pchan;
+	lc_message_t msg;
+	struct timeval tv = { .tv_sec = WAITS };
+	char name[32];
+	size_t depth;
+	int op = LC_OP_PING, pong = 0;
+
+	test_name("lc_socket_dispatch() - callbacks on a worker pool");
+
+	lctx = lc_ctx_new();
+	sock = lc_socket_new(lctx);
+	sctx = lc_ctx_new();
+	ssock = lc_socket_new(sctx);
+	lc_socket_loop(ssock, 1);
+	for (int c = 0; c < CHANNELS; c++) {
+		snprintf(name, sizeof name, "0000-0052-%i", c);
+		rchan[c] = lc_channel_new(lctx, name);
+		lc_channel_bind(sock, rchan[c]);
+		lc_channel_join(rchan[c]);
+		schan[c] = lc_channel_new(sctx, name);
+		lc_channel_bind(ssock, schan[c]);
+	}
+	test_assert(lc_socket_dispatch(sock, -1, QLEN) == LC_ERROR_INVALID_PARAMS,
+			"lc_socket_dispatch() - bad workers");
+	test_assert(!lc_socket_dispatch(sock, WORKERS, QLEN), "lc_socket_dispatch()");
+	sem_init(&sem, 0, 0);
+	sem_init(&gate, 0, 0);
+	test_assert(!lc_socket_listen(sock, &msg_received, NULL), "lc_socket_listen()");
+	test_assert(lc_socket_dispatch(sock, 1, QLEN) == LC_ERROR_SOCKET_LISTENING,
+			"lc_socket_dispatch() - listening");
+
+	for (int i = 1; i <= MSGS; i++) {
+		for (int c = 0; c < CHANNELS; c++) {
+			lc_msg_init_data(&msg, data, sizeof data, NULL, NULL);
+			lc_msg_send(schan[c], &msg);
+		}
+		for (int j = 0; j < 10000 && i * CHANNELS - msgs > INFLIGHT; j++) {
+			nanosleep(&(struct timespec){ .tv_nsec = 10000 }, NULL);
+		}
+	}
+	sem_wait_timeout();
+	test_assert(msgs == CHANNELS * MSGS, "received %i/%i", (int)msgs, CHANNELS * MSGS);
+	test_assert(badmsg == 0, "%i bad messages", badmsg);
+	test_assert(unordered == 0, "%i messages out of order", unordered);
+	test_assert(onlistener == 0, "%i callbacks on the listening thread", onlistener);
+	test_assert(ntid > 1 && ntid <= WORKERS, "callbacks ran on %i workers", ntid);
+	test_assert(lc_socket_dispatch_drops(sock) == 0, "%zu dropped",
+			(size_t)lc_socket_dispatch_drops(sock));
+	test_assert(!lc_socket_listen_cancel(sock), "lc_socket_listen_cancel()");
+
+	/* PING is answered by the listener, not a worker, which only gets the
+	 * callback */
+	pctx = lc_ctx_new();
+	psock = lc_socket_new(pctx);
+	lc_socket_loop(psock, 1);
+	setsockopt(lc_socket_raw(psock), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	pchan = lc_channel_new(pctx, "0000-0052-0");
+	lc_channel_bind(psock, pchan);
+	lc_channel_join(pchan);
+	lc_socket_loop(sock, 1); /* for the PONG to get back to us */
+	ping_handler = lc_op_handler[LC_OP_PING];
+	lc_op_handler[LC_OP_PING] = &ping_wrap;
+	test_assert(!lc_socket_listen(sock, &msg_pong, NULL), "lc_socket_listen()");
+	lc_msg_init_data(&msg, data, sizeof data, NULL, NULL);
+	lc_msg_set(&msg, LC_ATTR_OPCODE, &op);
+	lc_msg_send(pchan, &msg);
+	while (!pong && lc_msg_recv(psock, &msg) > 0) {
+		pong = (msg.op == LC_OP_PONG); /* else our PING looped back */
+		lc_msg_free(&msg);
+	}
+	test_assert(pong, "PONG received");
+	/* the PING, answered, and then our own PONG looped back */
+	for (int i = 0; i < WAITS * 100 && pongs < 2; i++) {
+		nanosleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);
+	}
+	test_assert(pongs == 2, "callback run %i times", (int)pongs);
+	test_assert(pongworker == pongs, "callback on a worker");
+	test_assert(pinglistener == 1, "PING handler on the listener");
+	lc_op_handler[LC_OP_PING] = ping_handler;
+	test_assert(!lc_socket_listen_cancel(sock), "lc_socket_listen_cancel()");
+	lc_ctx_free(pctx);
+
+	/* one worker stuck in its callback: the queue fills, then the rest are
+	 * dropped without holding up the listener */
+	test_assert(!lc_socket_dispatch(sock, 1, SMALLQ), "lc_socket_dispatch() - small queue");
+	test_assert(!lc_socket_listen(sock, &msg_blocked, NULL), "lc_socket_listen()");
+	lc_msg_init_data(&msg, data, sizeof data, NULL, NULL);
+	lc_msg_send(schan[0], &msg);
+	for (int i = 0; i < WAITS * 100 && !blocked; i++) {
+		nanosleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);
+	}
+	test_assert(blocked == 1, "worker blocked");
+	for (int i = 0; i < FLOOD; i++) {
+		lc_msg_init_data(&msg, data, sizeof data, NULL, NULL);
+		lc_msg_send(schan[0], &msg);
+	}
+	for (int i = 0; i < WAITS * 100; i++) {
+		if (lc_socket_dispatch_drops(sock) >= FLOOD - SMALLQ) break;
+		nanosleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);
+	}
+	depth = lc_socket_dispatch_depth(sock);
+	test_assert(depth == SMALLQ, "queue depth %zu", depth);
+	test_assert(lc_socket_dispatch_drops(sock) == FLOOD - SMALLQ, "%zu dropped",
+			(size_t)lc_socket_dispatch_drops(sock));
+	for (int i = 0; i < SMALLQ + 1; i++) sem_post(&gate);
+	for (int i = 0; i < WAITS * 100; i++) {
+		if (!lc_socket_dispatch_depth(sock) && blocked == SMALLQ + 1) break;
+		nanosleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);
+	}
+	test_assert(lc_socket_dispatch_depth(sock) == 0, "queue drained");
+	/* once each, by the worker alone */
+	test_assert(blocked == SMALLQ + 1, "callbacks run: %i", (int)blocked);
+	test_assert(!lc_socket_listen_cancel(sock), "lc_socket_listen_cancel()");
+	test_assert(!lc_socket_dispatch(sock, 0, 0), "lc_socket_dispatch() - off");
+	test_assert(lc_socket_dispatch_depth(sock) == 0, "no dispatch stage");
+
+	sem_destroy(&gate);
+	sem_destroy(&sem);
+	lc_ctx_free(sctx);
+	lc_ctx_free(lctx);
+
+	return fails;
+}
@@ -0,0 +1,132 @@
+#include "test.h"
+#include <librecast/net.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define WAITS 5
+#define MSGS 100
+
+static char data[] = "black lives matter";
+static lc_channel_t *rchan;
+static sem_t sem;
+static unsigned char seen[3 * MSGS + 1];
+static int msgs, unstamped, early, late;
+static uint64_t latency, queued; /* sums, ns */
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* stamped after it was sent, and before we looked at it */
+static void check(lc_message_t *msg, uint64_t now)
+{
+	if (!msg->rxtime) {
+		unstamped++;
+		return;
+	}
+	if (msg->rxtime < msg->timestamp) early++;
+	if (msg->rxtime > now) late++;
+	latency += msg->rxtime - msg->timestamp;
+	queued += now - msg->rxtime;
+}
+
+void msg_received(lc_message_t *msg)
+{
+	uint64_t now = now_ns();
+
+	/* callback is called by both the opcode handler and listener */
+	if (msg->chan != rchan || msg->seq > 3 * MSGS || seen[msg->seq]++) return;
+	check(msg, now);
+	if (++msgs == MSGS) sem_post(&sem);
+}
+
+static void send_msgs(lc_channel_t *chan)
+{
+	lc_message_t msg;
+	for (int i = 0; i < MSGS; i++) {
+		lc_msg_init_data(&msg, data, sizeof data, NULL, NULL);
+		test_assert(lc_msg_send(chan, &msg) > 0, "lc_msg_send(): %s", strerror(errno));
+	}
+}
+
+static void report(const char *path)
+{
+	int n = MSGS - unstamped;
+	test_assert(unstamped == 0, "%s: %i messages without receive timestamp", path, unstamped);
+	test_assert(early == 0, "%s: %i stamped before they were sent", path, early);
+	test_assert(late == 0, "%s: %i stamped after they were received", path, late);
+	if (n) test_log("%s: one-way %.1f us, queued %.1f us (mean)", path,
+			latency / n / 1e3, queued / n / 1e3);
+	unstamped = early = late = 0;
+	latency = queued = 0;
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx, *sctx;
+	lc_socket_t *sock, *ssock;
+	lc_channel_t *chan;
+	lc_message_t msg, msgs_batch[MSGS];
+	struct timeval tv = { .tv_sec = WAITS };
+	struct timespec ts;
+	ssize_t n;
+	int got;
+
+	test_name("msg->rxtime - kernel receive timestamps");
+
+	lctx = lc_ctx_new();
+	sock = lc_socket_new(lctx);
+	rchan = lc_channel_new(lctx, "0000-0053");
+	lc_channel_bind(sock, rchan);
+	lc_channel_join(rchan);
+	setsockopt(lc_socket_raw(sock), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+
+	sctx = lc_ctx_new();
+	ssock = lc_socket_new(sctx);
+	lc_socket_loop(ssock, 1);
+	chan = lc_channel_new(sctx, "0000-0053");
+	lc_channel_bind(ssock, chan);
+
+	/* lc_msg_recv() */
+	send_msgs(chan);
+	for (got = 0; got < MSGS && lc_msg_recv(sock, &msg) > 0; got++) {
+		check(&msg, now_ns());
+		lc_msg_free(&msg);
+	}
+	test_assert(got == MSGS, "lc_msg_recv() received %i/%i", got, MSGS);
+	report("lc_msg_recv()");
+
+	/* lc_msg_recv_batch() */
+	send_msgs(chan);
+	for (got = 0; got < MSGS; got += n) {
+		if ((n = lc_msg_recv_batch(sock, msgs_batch, MSGS - got, MSG_WAITFORONE)) <= 0) break;
+		for (int i = 0; i < n; i++) {
+			check(&msgs_batch[i], now_ns());
+			lc_msg_free(&msgs_batch[i]);
+		}
+	}
+	test_assert(got == MSGS, "lc_msg_recv_batch() received %i/%i", got, MSGS);
+	report("lc_msg_recv_batch()");
+
+	/* listener */
+	sem_init(&sem, 0, 0);
+	test_assert(!lc_socket_listen(sock, &msg_received, NULL), "lc_socket_listen()");
+	send_msgs(chan);
+	test_assert(!clock_gettime(CLOCK_REALTIME, &ts), "clock_gettime()");
+	ts.tv_sec += WAITS;
+	test_assert(!sem_timedwait(&sem, &ts), "timeout");
+	lc_socket_listen_cancel(sock);
+	test_assert(msgs == MSGS, "lc_socket_listen() received %i/%i", msgs, MSGS);
+	report("lc_socket_listen()");
+	sem_destroy(&sem);
+
+	lc_ctx_free(sctx);
+	lc_ctx_free(lctx);
+
+	return fails;
+}
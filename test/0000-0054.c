@@ -0,0 +1,139 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/csprng.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BIG 100000
+#define CALLS 100000
+#define SENDS 20000
+
+static char data[] = "black lives matter";
+
+/* lc_getrandom() as it was: open, read, close */
+static int urandom(void *buf, size_t len)
+{
+	int fd, rc;
+	if ((fd = open("/dev/urandom", O_RDONLY)) == -1) return -1;
+	rc = read(fd, buf, len);
+	close(fd);
+	return rc;
+}
+
+static double elapsed(struct timespec *t0)
+{
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static void *thread_rnd(void *arg)
+{
+	lc_getrandom(arg, sizeof(uint64_t) * 4);
+	return NULL;
+}
+
+/* sends/sec on chan, with the old cost of the nonce added if old is set */
+static double bench_send(lc_channel_t *chan, int old)
+{
+	struct timespec t0;
+	lc_message_t msg;
+	lc_rnd_t rnd;
+	int sent = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < SENDS; i++) {
+		if (old) urandom(&rnd, sizeof rnd);
+		lc_msg_init_data(&msg, data, sizeof data, NULL, NULL);
+		if (lc_msg_send(chan, &msg) > 0) sent++;
+	}
+	test_assert(sent == SENDS, "sent %i/%i", sent, SENDS);
+	return sent / elapsed(&t0);
+}
+
+int main(void)
+{
+	/* RFC 8439 2.3.2 */
+	const uint32_t in[16] = {
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+		0x03020100, 0x07060504, 0x0b0a0908, 0x0f0e0d0c,
+		0x13121110, 0x17161514, 0x1b1a1918, 0x1f1e1d1c,
+		0x00000001, 0x09000000, 0x4a000000, 0x00000000
+	};
+	const uint32_t want[16] = {
+		0xe4e7f110, 0x15593bd1, 0x1fdd0f50, 0xc47120a3,
+		0xc7f4d1c7, 0x0368c033, 0x9aaa2204, 0x4e6cd4c3,
+		0x466482d2, 0x09aa9f07, 0x05d7c214, 0xa2028bd9,
+		0xd19c12b5, 0xb94e16de, 0xe883d0cb, 0x4e3c50a2
+	};
+	uint32_t out[16];
+	uint64_t a[4], b[4], t[2][4];
+	static unsigned char big[BIG];
+	lc_ctx_t *lctx;
+	lc_socket_t *sock;
+	lc_channel_t *chan;
+	struct timespec t0;
+	pthread_t thr[2];
+	double tnew, told, snew, sold;
+	size_t ones = 0;
+	int fd[2], status;
+	pid_t pid;
+
+	test_name("lc_getrandom() - per-thread ChaCha20 CSPRNG");
+
+	lc_chacha20_block(out, in);
+	test_assert(!memcmp(out, want, sizeof want), "ChaCha20 block function (RFC 8439 2.3.2)");
+
+	test_assert(lc_getrandom(a, sizeof a) == sizeof a, "lc_getrandom()");
+	test_assert(lc_getrandom(b, sizeof b) == sizeof b, "lc_getrandom() - again");
+	test_assert(memcmp(a, b, sizeof a), "successive calls differ");
+
+	/* more than one batch of blocks at a time, and roughly half the bits set */
+	test_assert(lc_getrandom(big, sizeof big) == BIG, "lc_getrandom() - %i bytes", BIG);
+	for (size_t i = 0; i < sizeof big; i++) ones += __builtin_popcount(big[i]);
+	test_assert(ones > BIG * 4 - BIG / 10 && ones < BIG * 4 + BIG / 10,
+			"bit balance: %zu/%i", ones, BIG * 8);
+
+	/* each thread has its own generator */
+	for (int i = 0; i < 2; i++) pthread_create(&thr[i], NULL, &thread_rnd, t[i]);
+	for (int i = 0; i < 2; i++) pthread_join(thr[i], NULL);
+	test_assert(memcmp(t[0], t[1], sizeof t[0]), "threads differ");
+
+	/* a child must not repeat what its parent is about to generate */
+	test_assert(!pipe(fd), "pipe()");
+	if (!(pid = fork())) {
+		lc_getrandom(a, sizeof a);
+		_exit(write(fd[1], a, sizeof a) != sizeof a);
+	}
+	lc_getrandom(a, sizeof a);
+	test_assert(read(fd[0], b, sizeof b) == sizeof b, "read from child");
+	waitpid(pid, &status, 0);
+	test_assert(memcmp(a, b, sizeof a), "parent and child differ after fork()");
+	close(fd[0]);
+	close(fd[1]);
+
+	/* cost of one nonce, old and new */
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < CALLS; i++) urandom(a, sizeof(lc_rnd_t));
+	told = elapsed(&t0) / CALLS * 1e9;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < CALLS; i++) lc_getrandom(a, sizeof(lc_rnd_t));
+	tnew = elapsed(&t0) / CALLS * 1e9;
+	test_log("nonce: /dev/urandom %.0f ns, ChaCha20 %.0f ns (%.0fx)", told, tnew, told / tnew);
+
+	/* lc_msg_send() throughput, before (with the old nonce cost put back)
+	 * and after */
+	lctx = lc_ctx_new();
+	sock = lc_socket_new(lctx);
+	chan = lc_channel_new(lctx, "0000-0054");
+	lc_channel_bind(sock, chan);
+	sold = bench_send(chan, 1);
+	snew = bench_send(chan, 0);
+	test_log("lc_msg_send(): before %.0f/s, after %.0f/s (%.2fx)", sold, snew, snew / sold);
+	lc_ctx_free(lctx);
+
+	return fails;
+}
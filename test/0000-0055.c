@@ -0,0 +1,200 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define WAITS 5
+#define MSGS 100
+#define BIGSZ 8192
+#define SMALLSZ 512
+#define THRESHOLD 4096
+#define SENDS 5000
+
+static atomic_int freed, pinged;
+static char small[SMALLSZ];
+static char ping[BIGSZ];
+
+static void *count_free(void *data, void *hint)
+{
+	(void)hint;
+	free(data);
+	freed++;
+	return NULL;
+}
+
+static void *keep(void *data, void *hint)
+{
+	(void)hint;
+	return data;
+}
+
+static void *payload(size_t len, int i)
+{
+	unsigned char *p = malloc(len);
+	for (size_t j = 0; j < len; j++) p[j] = (unsigned char)(i + j);
+	return p;
+}
+
+void ping_received(lc_message_t *msg)
+{
+	if (msg->len == BIGSZ) pinged = 1;
+}
+
+static int wait_pending(lc_socket_t *sock)
+{
+	int n;
+	for (int i = 0; i < WAITS * 100 && (n = lc_socket_zerocopy_pending(sock)); i++) {
+		nanosleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);
+	}
+	return n;
+}
+
+static double elapsed(struct timespec *t0)
+{
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/* MB/s sending len byte payloads with and without zero-copy */
+static double bench(lc_socket_t *sock, lc_channel_t *chan, size_t len, int zc)
+{
+	static unsigned char buf[65000];
+	lc_message_t msg;
+	struct timespec t0;
+	int sent = 0;
+
+	lc_socket_zerocopy(sock, zc ? len : 0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < SENDS; i++) {
+		/* a free function that doesn't free, so the buffer can be reused */
+		lc_msg_init_data(&msg, buf, len, zc ? &keep : NULL, NULL);
+		if (lc_msg_send(chan, &msg) > 0) sent++;
+	}
+	wait_pending(sock);
+	return (double)sent * len / elapsed(&t0) / 1e6;
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx, *sctx;
+	lc_socket_t *sock, *ssock;
+	lc_channel_t *rchan, *chan;
+	lc_message_t msg;
+	struct timeval tv = { .tv_sec = WAITS };
+	int bad = 0, got, pending, rcvbuf = 4 * 1024 * 1024;
+	uint64_t sends, copied;
+	const size_t sizes[] = { 1024, 4096, 16384, 60000 };
+
+	test_name("lc_socket_zerocopy() - MSG_ZEROCOPY sends");
+
+	lctx = lc_ctx_new();
+	sock = lc_socket_new(lctx);
+	rchan = lc_channel_new(lctx, "0000-0055");
+	lc_channel_bind(sock, rchan);
+	lc_channel_join(rchan);
+	setsockopt(lc_socket_raw(sock), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	setsockopt(lc_socket_raw(sock), SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+
+	sctx = lc_ctx_new();
+	ssock = lc_socket_new(sctx);
+	lc_socket_loop(ssock, 1);
+	chan = lc_channel_new(sctx, "0000-0055");
+	lc_channel_bind(ssock, chan);
+
+	test_assert(lc_socket_zerocopy_pending(ssock) == 0, "nothing pending before enabled");
+	test_assert(!lc_socket_zerocopy(ssock, THRESHOLD), "lc_socket_zerocopy(): %s", strerror(errno));
+
+	/* big messages are the library's until the kernel lets go, small ones
+	 * are copied and left to the caller */
+	for (int i = 0; i < MSGS; i++) {
+		lc_msg_init_data(&msg, payload(BIGSZ, i), BIGSZ, &count_free, NULL);
+		test_assert(lc_msg_send(chan, &msg) > 0, "lc_msg_send() - big: %s", strerror(errno));
+		if (msg.free) {
+			bad++;
+			lc_msg_free(&msg);
+		}
+		lc_msg_init_data(&msg, small, sizeof small, &count_free, small);
+		test_assert(lc_msg_send(chan, &msg) > 0, "lc_msg_send() - small: %s", strerror(errno));
+		if (msg.free != &count_free) bad++;
+	}
+	test_assert(bad == 0, "%i messages with the wrong owner", bad);
+
+	/* what was sent is what arrives, the kernel read it from our pages */
+	bad = 0;
+	for (got = 0; got < 2 * MSGS && lc_msg_recv(sock, &msg) > 0; got++) {
+		unsigned char *p = msg.data;
+		if (msg.len == BIGSZ) {
+			for (size_t j = 0; j < BIGSZ; j++) if (p[j] != (unsigned char)(got / 2 + j)) {
+				bad++;
+				break;
+			}
+		}
+		else if (msg.len != SMALLSZ) bad++;
+		lc_msg_free(&msg);
+	}
+	test_assert(got == 2 * MSGS, "received %i/%i", got, 2 * MSGS);
+	test_assert(bad == 0, "%i bad payloads", bad);
+
+	/* the PONG to a PING goes from the listener's own receive buffer, which
+	 * is never handed to zero-copy */
+	int op = LC_OP_PING;
+	test_assert(!lc_socket_zerocopy(sock, 1), "lc_socket_zerocopy() - listener");
+	test_assert(!lc_socket_listen(sock, &ping_received, NULL), "lc_socket_listen()");
+	lc_msg_init_data(&msg, ping, BIGSZ, NULL, NULL);
+	lc_msg_set(&msg, LC_ATTR_OPCODE, &op);
+	test_assert(lc_msg_send(chan, &msg) > 0, "lc_msg_send() - PING");
+	lc_msg_free(&msg);
+	for (int i = 0; i < WAITS * 100 && !pinged; i++) {
+		nanosleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);
+	}
+	test_assert(pinged, "PING received");
+	lc_socket_listen_cancel(sock);
+	test_assert(sock->zc->sends == 0, "PONG zero-copy sends: %i", (int)sock->zc->sends);
+	lc_socket_zerocopy(sock, 0);
+
+	pending = wait_pending(ssock);
+	test_assert(pending == 0, "%i sends pending", pending);
+	test_assert(freed == MSGS, "freed %i/%i", (int)freed, MSGS);
+	sends = ssock->zc->sends;
+	copied = ssock->zc->copied;
+	test_assert(sends == MSGS, "zero-copy sends %i/%i", (int)sends, MSGS);
+	/* loopback always copies in the end, a real device needn't */
+	test_log("kernel copied %i/%i", (int)copied, (int)sends);
+
+	/* close hands back whatever is still pending */
+	freed = 0;
+	for (int i = 0; i < MSGS; i++) {
+		lc_msg_init_data(&msg, payload(BIGSZ, i), BIGSZ, &count_free, NULL);
+		lc_msg_send(chan, &msg);
+		if (msg.free) lc_msg_free(&msg);
+	}
+	test_assert(!lc_socket_zerocopy(ssock, 0), "lc_socket_zerocopy() - off");
+	lc_msg_init_data(&msg, payload(BIGSZ, 0), BIGSZ, &count_free, NULL);
+	lc_msg_send(chan, &msg);
+	test_assert(msg.free == &count_free, "off: copied");
+	lc_msg_free(&msg);
+	freed--;
+	lc_socket_close(ssock);
+	test_assert(freed == MSGS, "close: freed %i/%i", (int)freed, MSGS);
+
+	/* copy vs zero-copy */
+	ssock = lc_socket_new(sctx);
+	lc_channel_bind(ssock, chan);
+	lc_channel_part(rchan);
+	for (int i = 0; i < 4; i++) {
+		size_t len = sizes[i];
+		double mc = bench(ssock, chan, len, 0);
+		double mz = bench(ssock, chan, len, 1);
+		test_log("%6zu bytes: copy %8.1f MB/s, zero-copy %8.1f MB/s (%.2fx)",
+				len, mc, mz, mz / mc);
+	}
+
+	lc_ctx_free(sctx);
+	lc_ctx_free(lctx);
+
+	return fails;
+}
@@ -0,0 +1,172 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <time.h>
+
+#define PAYLOAD 1000
+#define MSGSZ (PAYLOAD + sizeof(lc_message_head_t))
+#define RATE 1000000 /* bytes/s */
+#define BURST (10 * MSGSZ)
+#define MSGS 210
+#define CHANNELS 1000
+#define CHANRATE (100 * MSGSZ) /* 10ms between messages */
+#define ROUNDS 3
+
+static char data[PAYLOAD];
+
+static double elapsed(struct timespec *t0)
+{
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static double send_msgs(lc_channel_t *chan, int n)
+{
+	lc_message_t msg;
+	struct timespec t0;
+	int sent = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < n; i++) {
+		lc_msg_init_data(&msg, data, sizeof data, NULL, NULL);
+		if (lc_msg_send(chan, &msg) > 0) sent++;
+	}
+	test_assert(sent == n, "sent %i/%i", sent, n);
+	return elapsed(&t0);
+}
+
+/* lc_channel_sendmsg() of PAYLOAD bytes with its control data filled with
+ * IPV6_TCLASS, leaving no room for anything else */
+static ssize_t sendmsg_full(lc_channel_t *chan)
+{
+	union {
+		char buf[LC_CMSGSZ];
+		struct cmsghdr align;
+	} ctl;
+	struct iovec iov = { .iov_base = data, .iov_len = sizeof data };
+	struct msghdr msgh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.buf };
+	struct cmsghdr *cmsg;
+	int tclass = 0;
+
+	memset(&ctl, 0, sizeof ctl);
+	msgh.msg_controllen = sizeof ctl.buf / CMSG_SPACE(sizeof tclass) * CMSG_SPACE(sizeof tclass);
+	for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+		cmsg->cmsg_level = IPPROTO_IPV6;
+		cmsg->cmsg_type = IPV6_TCLASS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof tclass);
+		memcpy(CMSG_DATA(cmsg), &tclass, sizeof tclass);
+	}
+	return lc_channel_sendmsg(chan, &msgh, 0);
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx;
+	lc_socket_t *sock;
+	lc_channel_t *chan, *chans[CHANNELS];
+	lc_message_t msgs[CHANNELS];
+	struct timespec t0;
+	double t, want;
+	char name[32];
+	ssize_t sent;
+
+	test_name("lc_channel_rate() - per-channel send pacing");
+
+	lctx = lc_ctx_new();
+	sock = lc_socket_new(lctx);
+	chan = lc_channel_new(lctx, "0000-0056");
+	lc_channel_bind(sock, chan);
+
+	/* unlimited */
+	t = send_msgs(chan, MSGS);
+	test_log("unlimited: %i messages in %.1f ms", MSGS, t * 1e3);
+
+	/* a burst goes at once */
+	lc_channel_rate(chan, RATE, BURST);
+	t = send_msgs(chan, 10);
+	test_assert(t < 0.005, "burst sent in %.1f ms", t * 1e3);
+
+	/* then it's RATE. With the bucket empty, MSGS more take MSGS * MSGSZ / RATE */
+	want = (double)MSGS * MSGSZ / RATE;
+	t = send_msgs(chan, MSGS);
+	test_assert(t > want * 0.95 && t < want * 1.25, "paced: %.1f ms, expected %.1f ms",
+			t * 1e3, want * 1e3);
+
+	/* and lc_channel_send() is paced too */
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < 20; i++) lc_channel_send(chan, data, MSGSZ, 0);
+	t = elapsed(&t0);
+	want = 20.0 * MSGSZ / RATE;
+	test_assert(t > want * 0.95 && t < want * 1.25, "lc_channel_send(): %.1f ms, expected %.1f ms",
+			t * 1e3, want * 1e3);
+
+	/* bursts too big to count in ns are as good as forever */
+	lc_channel_rate(chan, 1000, (size_t)20000000000ULL);
+	test_assert(chan->tau == 20000000000000000ULL, "20 GB burst: tau %" PRIu64, chan->tau);
+	lc_channel_rate(chan, 1, SIZE_MAX);
+	test_assert(chan->tau == UINT64_MAX, "endless burst: tau %" PRIu64, chan->tau);
+	t = send_msgs(chan, 10);
+	test_assert(t < 0.005, "endless burst sent in %.1f ms", t * 1e3);
+
+	lc_channel_rate(chan, 0, 0);
+	t = send_msgs(chan, MSGS);
+	test_assert(t < (double)MSGS * MSGSZ / RATE / 2, "limit removed: %.1f ms", t * 1e3);
+
+	/* lots of channels on one socket, each with its own bucket: every
+	 * channel sends one message a round, and each round after the first
+	 * waits for the buckets to refill, not CHANNELS times as long */
+	for (int c = 0; c < CHANNELS; c++) {
+		snprintf(name, sizeof name, "0000-0056-%i", c);
+		chans[c] = lc_channel_new(lctx, name);
+		lc_channel_bind(sock, chans[c]);
+		lc_channel_rate(chans[c], CHANRATE, MSGSZ);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int r = 0; r < ROUNDS; r++) {
+		for (int c = 0; c < CHANNELS; c++) lc_msg_init_data(&msgs[c], data, sizeof data, NULL, NULL);
+		sent = lc_msg_send_batch(chans, msgs, CHANNELS);
+		test_assert(sent == CHANNELS, "round %i: lc_msg_send_batch() sent %zi/%i", r, sent, CHANNELS);
+	}
+	t = elapsed(&t0);
+	want = (ROUNDS - 1) * (double)MSGSZ / CHANRATE;
+	test_assert(t > want * 0.9 && t < want * 3, "%i channels x %i rounds: %.1f ms, expected %.1f ms",
+			CHANNELS, ROUNDS, t * 1e3, want * 1e3);
+
+	/* SO_TXTIME: the qdisc does the waiting, so sends within 100ms of their
+	 * departure time return at once */
+	if (!lc_socket_txtime(sock, CLOCK_MONOTONIC)) {
+		lc_channel_rate(chan, RATE, MSGSZ);
+		want = (double)(MSGS / 4) * MSGSZ / RATE;
+		t = send_msgs(chan, MSGS / 4);
+		test_assert(t < want / 2, "SO_TXTIME: %.1f ms to send %.1f ms of messages",
+				t * 1e3, want * 1e3);
+		/* no room left in the control data for a departure time: the
+		 * send sleeps instead of going out unpaced */
+		lc_channel_rate(chan, RATE, MSGSZ);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (int i = 0; i < 20; i++) {
+			test_assert(sendmsg_full(chan) > 0, "lc_channel_sendmsg() - full control data: %s",
+					strerror(errno));
+		}
+		t = elapsed(&t0);
+		want = 19.0 * PAYLOAD / RATE;
+		test_assert(t > want * 0.95, "full control data: %.1f ms, expected %.1f ms",
+				t * 1e3, want * 1e3);
+		test_assert(!lc_socket_txtime(sock, -1), "lc_socket_txtime() - off");
+		/* start again with a full bucket */
+		lc_channel_rate(chan, RATE, MSGSZ);
+		t = send_msgs(chan, 20);
+		want = 19.0 * MSGSZ / RATE;
+		test_assert(t > want * 0.95, "sleeping again: %.1f ms, expected %.1f ms",
+				t * 1e3, want * 1e3);
+	}
+	else test_log("SO_TXTIME: %s", strerror(errno));
+
+	lc_ctx_free(lctx);
+
+	return fails;
+}
@@ -0,0 +1,258 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include "../src/frag.h"
+#include <endian.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define WAITS 5
+#define FRAGSZ 1232
+#define FRAGDATA (FRAGSZ - sizeof(lc_message_head_t) - sizeof(lc_frag_head_t))
+#define BIG 50000
+#define HUGE 200000 /* more than the biggest pooled buffer */
+#define SIZES 6
+#define CAP 100000
+#define RESTART 5000 /* size of messages from restarted senders */
+#define RESTART_MSGS 4 /* messages from each */
+
+static const size_t sizes[SIZES] = { 1, 1000, FRAGSZ, 5000, BIG, HUGE };
+static unsigned char data[HUGE];
+static lc_channel_t *rchan;
+static sem_t sem;
+static lc_seq_t last;
+static int msgs, bad;
+
+static int check(lc_message_t *msg, size_t len)
+{
+	return msg->len == len && msg->op == LC_OP_DATA && !memcmp(msg->data, data, len);
+}
+
+void msg_received(lc_message_t *msg)
+{
+	/* callback is called by both the opcode handler and listener */
+	if (msg->chan != rchan || msg->seq == last) return;
+	last = msg->seq;
+	if (msgs >= SIZES || !check(msg, sizes[msgs])) bad++;
+	if (++msgs == SIZES) sem_post(&sem);
+}
+
+/* send one hand made fragment of a len byte message */
+static void send_frag(lc_channel_t *chan, lc_seq_t seq, size_t len, size_t off, int idx, int cnt,
+		size_t flen)
+{
+	lc_message_head_t head = {0};
+	lc_frag_head_t fh;
+	struct iovec iov[3];
+	struct msghdr msgh = { .msg_iov = iov, .msg_iovlen = 3 };
+
+	head.seq = htobe64(seq);
+	head.op = LC_OP_DATA | LC_OP_FRAG;
+	head.len = htobe64(sizeof fh + flen);
+	fh.len = htobe32(len);
+	fh.off = htobe32(off);
+	fh.idx = htobe16(idx);
+	fh.cnt = htobe16(cnt);
+	iov[0].iov_base = &head;
+	iov[0].iov_len = sizeof head;
+	iov[1].iov_base = &fh;
+	iov[1].iov_len = sizeof fh;
+	iov[2].iov_base = data + off;
+	iov[2].iov_len = flen;
+	test_assert(lc_channel_sendmsg(chan, &msgh, 0) > 0, "send fragment: %s", strerror(errno));
+}
+
+/* send a len byte message as cnt fragments, skipping fragment skip (-1 =
+ * none) and sending fragment dup twice */
+static void send_frags(lc_channel_t *chan, lc_seq_t seq, size_t len, int cnt, int skip, int dup)
+{
+	size_t fsz = (len + cnt - 1) / cnt, off;
+	for (int i = 0; i < cnt; i++) {
+		off = i * fsz;
+		if (i == skip) continue;
+		send_frag(chan, seq, len, off, i, cnt, (len - off < fsz) ? len - off : fsz);
+		if (i == dup) send_frag(chan, seq, len, off, i, cnt, (len - off < fsz) ? len - off : fsz);
+	}
+}
+
+static int recv_none(lc_socket_t *sock)
+{
+	lc_message_t msg;
+	struct timeval tv = { .tv_usec = 100000 };
+	ssize_t rc;
+
+	setsockopt(lc_socket_raw(sock), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	rc = lc_msg_recv(sock, &msg);
+	if (rc > 0) lc_msg_free(&msg);
+	tv.tv_sec = WAITS;
+	tv.tv_usec = 0;
+	setsockopt(lc_socket_raw(sock), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	return rc == -1 && errno == EAGAIN;
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx, *sctx;
+	lc_socket_t *sock, *ssock;
+	lc_channel_t *chan;
+	lc_message_t msg;
+	lc_frag_t *fr;
+	struct timeval tv = { .tv_sec = WAITS };
+	struct timespec ts;
+	struct iovec iov[3];
+	int rcvbuf = 4 * 1024 * 1024;
+	char buf[FRAGSZ];
+	ssize_t rc;
+
+	test_name("lc_socket_fragment() - fragmentation and reassembly");
+
+	for (size_t i = 0; i < sizeof data; i++) data[i] = (unsigned char)(i * 7 + i / 251);
+
+	lctx = lc_ctx_new();
+	sock = lc_socket_new(lctx);
+	rchan = lc_channel_new(lctx, "0000-0057");
+	lc_channel_bind(sock, rchan);
+	lc_channel_join(rchan);
+	setsockopt(lc_socket_raw(sock), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	setsockopt(lc_socket_raw(sock), SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+
+	sctx = lc_ctx_new();
+	ssock = lc_socket_new(sctx);
+	lc_socket_loop(ssock, 1);
+	chan = lc_channel_new(sctx, "0000-0057");
+	lc_channel_bind(ssock, chan);
+
+	test_assert(lc_socket_fragment(ssock, sizeof(lc_message_head_t)) == -1 && errno == EINVAL,
+			"lc_socket_fragment() - too small");
+	test_assert(!lc_socket_fragment(ssock, FRAGSZ), "lc_socket_fragment()");
+
+	/* one message, many datagrams, no bigger than FRAGSZ */
+	lc_msg_init_data(&msg, data, BIG, NULL, NULL);
+	rc = lc_msg_send(chan, &msg);
+	test_assert(rc > BIG, "lc_msg_send(): %zi", rc);
+	rc = lc_msg_recv(sock, &msg);
+	test_assert(rc > BIG, "lc_msg_recv(): %zi", rc);
+	test_assert(check(&msg, BIG), "reassembled");
+	test_assert(msg.bytes == (size_t)rc, "bytes %zu", msg.bytes);
+	lc_msg_free(&msg);
+
+	/* each fragment's header gives the length that fragment carries */
+	lc_msg_init_data(&msg, data, 5000, NULL, NULL);
+	test_assert(lc_msg_send(chan, &msg) > 5000, "lc_msg_send() - 5000 bytes");
+	for (int frags = 0; frags < (int)(5000 + FRAGDATA - 1) / (int)FRAGDATA; frags++) {
+		lc_message_head_t head;
+		rc = recv(lc_socket_raw(sock), buf, sizeof buf, 0);
+		test_assert(rc > (ssize_t)sizeof head, "fragment %i: %zi bytes", frags, rc);
+		if (rc <= (ssize_t)sizeof head) break;
+		memcpy(&head, buf, sizeof head);
+		test_assert(be64toh(head.len) == (uint64_t)rc - sizeof head,
+				"fragment %i header length %zu, carries %zi", frags,
+				(size_t)be64toh(head.len), rc - (ssize_t)sizeof head);
+	}
+
+	/* gathered from several buffers, split across fragments */
+	iov[0].iov_base = data;
+	iov[0].iov_len = 100;
+	iov[1].iov_base = data + 100;
+	iov[1].iov_len = 3 * FRAGSZ;
+	iov[2].iov_base = data + 100 + 3 * FRAGSZ;
+	iov[2].iov_len = BIG - 100 - 3 * FRAGSZ;
+	lc_msg_init(&msg);
+	test_assert(lc_msg_sendv(chan, &msg, iov, 3) > BIG, "lc_msg_sendv()");
+	test_assert(lc_msg_recv(sock, &msg) > BIG, "lc_msg_recv()");
+	test_assert(check(&msg, BIG), "lc_msg_sendv() reassembled");
+	lc_msg_free(&msg);
+
+	/* fragments out of order, with a duplicate, make one message */
+	send_frag(chan, 1000, 3000, 2000, 2, 3, 1000);
+	send_frag(chan, 1000, 3000, 0, 0, 3, 1000);
+	send_frag(chan, 1000, 3000, 0, 0, 3, 1000);
+	send_frag(chan, 1000, 3000, 1000, 1, 3, 1000);
+	test_assert(lc_msg_recv(sock, &msg) > 0, "out of order");
+	test_assert(check(&msg, 3000) && msg.seq == 1000, "out of order reassembled");
+	lc_msg_free(&msg);
+	test_assert(recv_none(sock), "duplicate not delivered");
+
+	/* a message missing a fragment never arrives, and is dropped once
+	 * it's had no fragments for a second */
+	send_frags(chan, 2000, 10000, 10, 4, -1);
+	test_assert(recv_none(sock), "incomplete not delivered");
+	fr = sock->reasm;
+	test_assert(fr->mem == 10000, "incomplete held: %zu", fr->mem);
+	nanosleep(&(struct timespec){ .tv_sec = 1 }, NULL);
+	send_frags(chan, 2001, 2000, 2, -1, 1);
+	test_assert(lc_msg_recv(sock, &msg) > 0 && check(&msg, 2000), "next message");
+	lc_msg_free(&msg);
+	test_assert(fr->expired == 1, "expired %zu", (size_t)fr->expired);
+	test_assert(fr->mem == 0, "nothing held: %zu", fr->mem);
+
+	/* memory cap: too big is dropped, the oldest partial makes way */
+	lc_socket_reassembly(sock, CAP);
+	send_frags(chan, 3000, CAP + 1, 100, -1, -1);
+	test_assert(recv_none(sock), "bigger than cap not delivered");
+	test_assert(fr->dropped == 100, "dropped %zu", (size_t)fr->dropped);
+	send_frags(chan, 3001, 40000, 40, 0, -1);
+	send_frags(chan, 3002, 40000, 40, 0, -1);
+	send_frags(chan, 3003, 40000, 40, -1, -1);
+	test_assert(lc_msg_recv(sock, &msg) > 0 && check(&msg, 40000), "within cap");
+	lc_msg_free(&msg);
+	test_assert(fr->evicted == 1, "evicted %zu", (size_t)fr->evicted);
+	test_assert(fr->mem <= CAP, "held %zu", fr->mem);
+	lc_socket_reassembly(sock, LC_FRAG_MEM);
+
+	/* a fragment that doesn't sit where its index says is dropped, and
+	 * the message is never delivered with a hole in it */
+	size_t dropped = fr->dropped;
+	send_frag(chan, 4000, 3000, 0, 0, 3, 1000);
+	send_frag(chan, 4000, 3000, 2000, 1, 3, 1000);
+	send_frag(chan, 4000, 3000, 2000, 2, 3, 1000);
+	test_assert(recv_none(sock), "fragment at wrong offset not delivered");
+	test_assert(fr->dropped == dropped + 1, "dropped %zu", (size_t)fr->dropped);
+
+	/* senders that start over, one after another, with their sequence
+	 * numbers from 1 again, are each reassembled afresh */
+	for (int s = 0; s < 2; s++) {
+		lc_ctx_t *rctx = lc_ctx_new();
+		lc_socket_t *rsock = lc_socket_new(rctx);
+		lc_channel_t *c = lc_channel_new(rctx, "0000-0057");
+		lc_socket_loop(rsock, 1);
+		lc_channel_bind(rsock, c);
+		lc_socket_fragment(rsock, FRAGSZ);
+		for (int i = 0; i < RESTART_MSGS; i++) {
+			lc_msg_init_data(&msg, data, RESTART, NULL, NULL);
+			test_assert(lc_msg_send(c, &msg) > RESTART, "lc_msg_send() - sender %i", s);
+		}
+		lc_ctx_free(rctx);
+	}
+	for (int i = 0; i < 2 * RESTART_MSGS; i++) {
+		test_assert(lc_msg_recv(sock, &msg) > 0, "restarted senders: %i/%i", i,
+				2 * RESTART_MSGS);
+		test_assert(check(&msg, RESTART), "restarted senders reassembled");
+		lc_msg_free(&msg);
+	}
+
+	/* listener: each message once, whole, whatever its size */
+	sem_init(&sem, 0, 0);
+	test_assert(!lc_socket_listen(sock, &msg_received, NULL), "lc_socket_listen()");
+	for (int i = 0; i < SIZES; i++) {
+		lc_msg_init_data(&msg, data, sizes[i], NULL, NULL);
+		test_assert(lc_msg_send(chan, &msg) > 0, "lc_msg_send() - %zu bytes", sizes[i]);
+	}
+	test_assert(!clock_gettime(CLOCK_REALTIME, &ts), "clock_gettime()");
+	ts.tv_sec += WAITS;
+	test_assert(!sem_timedwait(&sem, &ts), "timeout");
+	lc_socket_listen_cancel(sock);
+	test_assert(msgs == SIZES, "listener received %i/%i", msgs, SIZES);
+	test_assert(bad == 0, "%i bad messages", bad);
+	test_log("reassembled %zu, expired %zu, evicted %zu, dropped %zu",
+			(size_t)fr->complete, (size_t)fr->expired, (size_t)fr->evicted,
+			(size_t)fr->dropped);
+	sem_destroy(&sem);
+
+	lc_ctx_free(sctx);
+	lc_ctx_free(lctx);
+
+	return fails;
+}
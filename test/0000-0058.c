@@ -0,0 +1,396 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include "../src/fec.h"
+#include "../src/frag.h"
+#include "../src/pool.h"
+#include <endian.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define WAITS 5
+#define K 16
+#define M 4
+#define MSGS 1000
+#define MAXSZ 1200
+#define DGRAMS (MSGS + (MSGS / K + 1) * M)
+#define RATES 5
+#define E2E_RATE 100 /* per mille, end to end run */
+#define BIG 20000 /* fragmented message */
+#define FRAGSZ 1232
+#define FRAGS ((BIG + FRAGSZ - 1) / (FRAGSZ - sizeof(lc_message_head_t) - sizeof(lc_frag_head_t) \
+		- sizeof(lc_fec_head_t)))
+#define RESTART 77 /* size of messages from restarted senders */
+#define RESTART_MSGS 8 /* messages from each */
+#define BENCH_BYTES (64 * 1024 * 1024)
+
+static const int rates[RATES] = { 0, 10, 50, 100, 200 }; /* per mille */
+
+typedef struct dgram_s {
+	size_t len;
+	unsigned char buf[1500];
+} dgram_t;
+
+static dgram_t dg[DGRAMS];
+static int ndg;
+static unsigned char big[BIG];
+static unsigned char got[MSGS];
+static lc_channel_t *rchan;
+static sem_t sem;
+static int msgs, bad, bigs, expect, restarts;
+static uint32_t restarted; /* bitmap of messages from restarted senders */
+static size_t payload; /* bytes of messages sent */
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t rnd_state;
+static uint32_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return rnd_state >> 32;
+}
+
+/* message i: its number, then a pattern, of a size that varies */
+static size_t msg_make(unsigned char *buf, uint32_t i)
+{
+	size_t len = 100 + (i * 7919) % (MAXSZ - 100);
+	memcpy(buf, &i, sizeof i);
+	for (size_t j = sizeof i; j < len; j++) buf[j] = (unsigned char)(i + j * 31);
+	return len;
+}
+
+/* message number of payload, -1 if it isn't one we sent intact */
+static int msg_check(const unsigned char *data, size_t len)
+{
+	unsigned char want[MAXSZ];
+	uint32_t i;
+
+	if (len < sizeof i) return -1;
+	memcpy(&i, data, sizeof i);
+	if (i >= MSGS || msg_make(want, i) != len || memcmp(want, data, len)) return -1;
+	return i;
+}
+
+/* datagram d is a repair */
+static int is_repair(const dgram_t *d)
+{
+	lc_fec_head_t fh;
+	memcpy(&fh, d->buf + sizeof(lc_message_head_t), sizeof fh);
+	return fh.idx >= fh.k;
+}
+
+/* drop datagram? Sources and repairs alike */
+static int lose(int permille)
+{
+	return (int)(rnd() % 1000) < permille;
+}
+
+static void *sym_alloc(void *arg, size_t len)
+{
+	(void)arg;
+	return lc_buf_new(len);
+}
+
+void msg_received(lc_message_t *msg)
+{
+	int i;
+
+	/* callback is called by both the opcode handler and listener */
+	if (msg->chan != rchan) return;
+	if (msg->len == RESTART) {
+		uint8_t i = *(uint8_t *)msg->data;
+		if (i >= 32 || restarted & (1U << i)) return;
+		restarted |= 1U << i;
+		if (++restarts == 2 * RESTART_MSGS) sem_post(&sem);
+		return;
+	}
+	if (msg->len == BIG) {
+		if (!memcmp(msg->data, big, BIG) && !bigs++) sem_post(&sem);
+		return;
+	}
+	if ((i = msg_check(msg->data, msg->len)) == -1) {
+		bad++;
+		return;
+	}
+	if (got[i]++) return;
+	if (++msgs == expect) sem_post(&sem);
+}
+
+/* decode the captured stream with datagrams lost at permille, returning the
+ * messages recovered and the time it took */
+static int decode_run(int permille, int *raw, uint64_t *ns)
+{
+	const size_t hdrsz = sizeof(lc_message_head_t);
+	lc_message_head_t head;
+	lc_message_t msg;
+	lc_fec_dec_t *dec;
+	struct in6_addr grp = {0};
+	unsigned char seen[MSGS] = {0};
+	uint64_t t0;
+	int n = 0;
+
+	dec = lc_fec_dec_new(LC_FEC_MEM, LC_FEC_TIMEOUT, &sym_alloc, NULL);
+	test_assert(dec != NULL, "lc_fec_dec_new()");
+	rnd_state = 0x9e3779b97f4a7c15ULL + permille;
+	*raw = 0;
+	t0 = now_ns();
+	for (int d = 0; d < ndg; d++) {
+		if (lose(permille)) continue;
+		memcpy(&head, dg[d].buf, hdrsz);
+		lc_msg_init(&msg);
+		msg.seq = be64toh(head.seq);
+		msg.rnd = be64toh(head.rnd);
+		msg.timestamp = be64toh(head.timestamp);
+		msg.op = head.op;
+		msg.len = dg[d].len - hdrsz;
+		msg.data = dg[d].buf + hdrsz;
+		if (!is_repair(&dg[d])) (*raw)++;
+		lc_fec_dec_add(dec, &msg, &grp, t0);
+		for (; dec->iout < dec->nout; dec->iout++) {
+			uint8_t *sym = dec->out[dec->iout];
+			size_t len = ((size_t)sym[0] << 8 | sym[1]) - hdrsz;
+			int i = msg_check(sym + 2 + hdrsz, len);
+			if (i == -1) bad++;
+			else if (!seen[i]++) n++;
+			lc_buf_unref(sym, NULL);
+		}
+	}
+	*ns = now_ns() - t0;
+	lc_fec_dec_free(dec);
+	return n;
+}
+
+/* replay the captured stream to the relay channel and its sideband, losing
+ * datagrams at permille */
+static void relay(lc_channel_t *chan, lc_channel_t *side, int permille)
+{
+	rnd_state = 0x9e3779b97f4a7c15ULL + permille;
+	for (int d = 0; d < ndg; d++) {
+		if (lose(permille)) continue;
+		lc_channel_send(is_repair(&dg[d]) ? side : chan, dg[d].buf, dg[d].len, 0);
+		if (d % 64 == 0) nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+	}
+}
+
+/* take everything waiting on the capture socket */
+static void capture(lc_socket_t *sock)
+{
+	ssize_t rc;
+	while (ndg < DGRAMS
+	&& (rc = lc_socket_recv(sock, dg[ndg].buf, sizeof dg[ndg].buf, MSG_DONTWAIT)) > 0)
+		dg[ndg++].len = rc;
+}
+
+static void bench_kernel(void)
+{
+	static uint8_t a[4096], b[4096], c[4096];
+	uint64_t t0, ts, tv;
+	int ok = 1;
+
+	rnd_state = 1;
+	for (size_t i = 0; i < sizeof a; i++) a[i] = rnd();
+	for (int coef = 0; coef < 256; coef++) {
+		size_t len = 1 + rnd() % sizeof a;
+		memcpy(b, a + 7, sizeof b - 7);
+		memcpy(c, b, sizeof c);
+		lc_gf_muladd(b, a, coef, len);
+		lc_gf_muladd_scalar(c, a, coef, len);
+		if (memcmp(b, c, sizeof b)) ok = 0;
+	}
+	test_assert(ok, "%s kernel matches scalar", lc_gf_kernel());
+	test_assert(lc_gf_mul(0x53, 0xca) == lc_gf_mul(0xca, 0x53), "commutes");
+	test_assert(lc_gf_mul(2, 0x80) == 0x1d, "reduces by 0x11d");
+
+	t0 = now_ns();
+	for (size_t n = 0; n < BENCH_BYTES; n += sizeof a) lc_gf_muladd_scalar(b, a, 0x8e, sizeof a);
+	ts = now_ns() - t0;
+	t0 = now_ns();
+	for (size_t n = 0; n < BENCH_BYTES; n += sizeof a) lc_gf_muladd(b, a, 0x8e, sizeof a);
+	tv = now_ns() - t0;
+	test_log("GF(256) muladd: scalar %.0f MB/s, %s %.0f MB/s",
+			BENCH_BYTES * 1e3 / ts, lc_gf_kernel(), BENCH_BYTES * 1e3 / tv);
+}
+
+static void bench_encode(void)
+{
+	lc_fec_enc_t *enc = lc_fec_enc_new(K, M);
+	unsigned char buf[MAXSZ];
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof buf };
+	uint64_t t0;
+	size_t n = 0;
+
+	test_assert(enc != NULL, "lc_fec_enc_new()");
+	test_assert(lc_fec_enc_new(200, 56) == NULL && errno == EINVAL, "k + m > 255");
+	memset(buf, 0xa5, sizeof buf);
+	t0 = now_ns();
+	for (; n < BENCH_BYTES; n += sizeof buf) {
+		lc_fec_enc_add(enc, &iov, 1);
+		if (enc->n == K) lc_fec_enc_next(enc);
+	}
+	t0 = now_ns() - t0;
+	test_log("encode k=%i m=%i, %zu byte datagrams: %.0f MB/s", K, M, sizeof buf, n * 1e3 / t0);
+	lc_fec_enc_free(enc);
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx, *sctx, *cctx;
+	lc_socket_t *sock, *ssock, *csock;
+	lc_channel_t *chan, *side, *cchan, *cside, *xchan, *xside, *rside;
+	lc_message_t msg;
+	unsigned char buf[MAXSZ];
+	struct timeval tv = { .tv_sec = WAITS };
+	struct timespec ts;
+	int rcvbuf = 4 * 1024 * 1024;
+	int raw, n, sources = 0;
+	uint64_t ns;
+
+	test_name("lc_channel_fec() - forward error correction");
+
+	bench_kernel();
+	bench_encode();
+
+	/* sender: FEC on "0000-0058", repairs on its sideband */
+	sctx = lc_ctx_new();
+	ssock = lc_socket_new(sctx);
+	lc_socket_loop(ssock, 1);
+	chan = lc_channel_new(sctx, "0000-0058");
+	side = lc_channel_sideband(chan, 1);
+	lc_channel_bind(ssock, chan);
+	test_assert(lc_channel_fec(chan, 200, 56, NULL) == -1 && errno == EINVAL, "k + m > 255");
+	test_assert(lc_channel_fec(chan, K, M, chan) == -1 && errno == EINVAL, "repair on itself");
+	test_assert(!lc_channel_fec(chan, K, M, side), "lc_channel_fec()");
+	lc_msg_init(&msg);
+	test_assert(lc_msg_send(chan, &msg) > 0, "lc_msg_send() - source");
+	test_assert(lc_channel_fec_flush(chan) == -1 && errno == ENOTCONN, "sideband not bound");
+	test_assert(lc_channel_fec_flush(chan) == 0, "nothing to flush");
+	lc_channel_bind(ssock, side);
+	test_assert(!lc_channel_fec(chan, K, M, side), "lc_channel_fec() - restart");
+
+	/* capture what goes out, as datagrams */
+	cctx = lc_ctx_new();
+	csock = lc_socket_new(cctx);
+	cchan = lc_channel_new(cctx, "0000-0058");
+	cside = lc_channel_sideband(cchan, 1);
+	lc_channel_bind(csock, cchan);
+	lc_channel_bind(csock, cside);
+	lc_channel_join(cchan);
+	lc_channel_join(cside);
+	setsockopt(lc_socket_raw(csock), SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+
+	for (uint32_t i = 0; i < MSGS; i++) {
+		lc_msg_init_data(&msg, buf, msg_make(buf, i), NULL, NULL);
+		payload += msg.len;
+		test_assert(lc_msg_send(chan, &msg) > 0, "lc_msg_send(): %s", strerror(errno));
+		capture(csock);
+	}
+	test_assert(lc_channel_fec_flush(chan) > 0, "lc_channel_fec_flush()");
+	test_assert(chan->fec->n == 0, "flushed");
+	capture(csock);
+	for (int d = 0; d < ndg; d++) sources += !is_repair(&dg[d]);
+	test_assert(sources == MSGS, "sources sent %i/%i", sources, MSGS);
+	test_assert(ndg == DGRAMS, "datagrams sent %i/%i", ndg, DGRAMS);
+
+	/* decode across loss rates, against what gets through without FEC */
+	for (int r = 0; r < RATES; r++) {
+		n = decode_run(rates[r], &raw, &ns);
+		test_log("loss %4.1f%%: without FEC %4i/%i, with k=%i m=%i %4i/%i, decode %.0f MB/s",
+				rates[r] / 10.0, raw, MSGS, K, M, n, MSGS,
+				payload * 1e3 / ns);
+		test_assert(n >= raw, "FEC never loses more");
+		if (rates[r] <= 10) test_assert(n == MSGS, "all recovered at %i per mille", rates[r]);
+	}
+	test_assert(bad == 0, "%i bad messages decoded", bad);
+
+	/* end to end: the capture replayed through a lossy relay to a
+	 * listener taking repairs from a sideband */
+	lctx = lc_ctx_new();
+	sock = lc_socket_new(lctx);
+	rchan = lc_channel_new(lctx, "0000-0058-relay");
+	rside = lc_channel_sideband(rchan, 1);
+	lc_channel_bind(sock, rchan);
+	lc_channel_bind(sock, rside);
+	lc_channel_join(rchan);
+	lc_channel_join(rside);
+	test_assert(!lc_channel_fec(rchan, K, M, rside), "lc_channel_fec() - receiver");
+	setsockopt(lc_socket_raw(sock), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	setsockopt(lc_socket_raw(sock), SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+
+	xchan = lc_channel_new(cctx, "0000-0058-relay");
+	xside = lc_channel_sideband(xchan, 1);
+	lc_socket_t *xsock = lc_socket_new(cctx);
+	lc_socket_loop(xsock, 1);
+	lc_channel_bind(xsock, xchan);
+	lc_channel_bind(xsock, xside);
+
+	expect = decode_run(E2E_RATE, &raw, &ns);
+	sem_init(&sem, 0, 0);
+	test_assert(!lc_socket_listen(sock, &msg_received, NULL), "lc_socket_listen()");
+	relay(xchan, xside, E2E_RATE);
+	test_assert(!clock_gettime(CLOCK_REALTIME, &ts), "clock_gettime()");
+	ts.tv_sec += WAITS;
+	test_assert(!sem_timedwait(&sem, &ts), "timeout");
+	test_assert(msgs == expect, "listener received %i/%i (%i without FEC)", msgs, expect, raw);
+	test_assert(sock->fecdec && sock->fecdec->recovered > 0, "recovered %zu",
+			(size_t)(sock->fecdec ? sock->fecdec->recovered : 0));
+
+	/* fragments are datagrams like any other: lose some, and the message
+	 * still arrives whole */
+	for (size_t i = 0; i < sizeof big; i++) big[i] = (unsigned char)(i * 13);
+	test_assert(!lc_socket_fragment(ssock, FRAGSZ), "lc_socket_fragment()");
+	ndg = 0;
+	lc_msg_init_data(&msg, big, BIG, NULL, NULL);
+	test_assert(lc_msg_send(chan, &msg) > BIG, "lc_msg_send() - fragmented");
+	lc_channel_fec_flush(chan);
+	capture(csock);
+	test_assert(ndg == (int)FRAGS + 2 * M, "fragments and repairs %i", ndg);
+	for (int d = 0; d < ndg; d++) {
+		if (d == 0 || d == 5 || d == 16 || d == 17) continue;
+		lc_channel_send(is_repair(&dg[d]) ? xside : xchan, dg[d].buf, dg[d].len, 0);
+	}
+	test_assert(!clock_gettime(CLOCK_REALTIME, &ts), "clock_gettime()");
+	ts.tv_sec += WAITS;
+	test_assert(!sem_timedwait(&sem, &ts), "fragmented message recovered");
+
+	/* senders that start over, one after another, with their block
+	 * numbers from 0 again, are each decoded afresh */
+	for (int s = 0; s < 2; s++) {
+		lc_ctx_t *rctx = lc_ctx_new();
+		lc_socket_t *rsock = lc_socket_new(rctx);
+		lc_channel_t *c = lc_channel_new(rctx, "0000-0058-relay");
+		lc_socket_loop(rsock, 1);
+		lc_channel_bind(rsock, c);
+		test_assert(!lc_channel_fec(c, 4, 2, NULL), "lc_channel_fec() - sender %i", s);
+		for (int i = 0; i < RESTART_MSGS; i++) {
+			memset(buf, s * RESTART_MSGS + i, RESTART);
+			lc_msg_init_data(&msg, buf, RESTART, NULL, NULL);
+			test_assert(lc_msg_send(c, &msg) > 0, "lc_msg_send() - sender %i", s);
+		}
+		lc_ctx_free(rctx);
+	}
+	test_assert(!clock_gettime(CLOCK_REALTIME, &ts), "clock_gettime()");
+	ts.tv_sec += WAITS;
+	test_assert(!sem_timedwait(&sem, &ts), "restarted senders");
+	test_assert(restarts == 2 * RESTART_MSGS, "restarted senders: %i/%i", restarts,
+			2 * RESTART_MSGS);
+	lc_socket_listen_cancel(sock);
+	test_assert(bad == 0, "%i bad messages", bad);
+	test_log("listener recovered %zu, lost %zu, dropped %zu", (size_t)sock->fecdec->recovered,
+			(size_t)sock->fecdec->lost, (size_t)sock->fecdec->dropped);
+	sem_destroy(&sem);
+
+	lc_ctx_free(lctx);
+	lc_ctx_free(cctx);
+	lc_ctx_free(sctx);
+
+	return fails;
+}
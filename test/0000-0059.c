@@ -0,0 +1,192 @@
+#include "test.h"
+#include <librecast/net.h>
+#include "../src/librecast_pvt.h"
+#include "../src/xdp.h"
+#include <librecast/if.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/if_tun.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WAITS 5
+#define QUEUES 2
+#define MSGS 10
+
+static char data[] = "black lives matter";
+
+/* independent of the library's: sum bytes in network order */
+static uint16_t csum(const struct ip6_hdr *ip6, const unsigned char *udp, size_t len)
+{
+	uint32_t sum = len + IPPROTO_UDP;
+	const unsigned char *s = ip6->ip6_src.s6_addr, *d = ip6->ip6_dst.s6_addr;
+
+	for (int i = 0; i < 16; i += 2) sum += (s[i] << 8 | s[i + 1]) + (d[i] << 8 | d[i + 1]);
+	for (size_t i = 0; i < len; i += 2) sum += udp[i] << 8 | ((i + 1 < len) ? udp[i + 1] : 0);
+	while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/* ethernet frame carrying a librecast message to chan, as if from the wire */
+static size_t frame(char *buf, lc_channel_t *chan, lc_seq_t seq)
+{
+	struct in6_addr *grp = lc_channel_in6addr(chan);
+	lc_message_head_t head = { .seq = htobe64(seq), .len = htobe64(sizeof data), .op = LC_OP_DATA };
+	struct ip6_hdr ip6 = {0};
+	struct udphdr udp = {0};
+	const size_t ulen = sizeof udp + sizeof head + sizeof data;
+	char *p = buf;
+
+	memcpy(p, "\x33\x33", 2);
+	memcpy(p + 2, &grp->s6_addr[12], 4);
+	memcpy(p + 6, "\x02\x00\x00\x00\x00\x01", 6);
+	memcpy(p + 12, "\x86\xdd", 2);
+	p += 14;
+	ip6.ip6_flow = htonl(6 << 28);
+	ip6.ip6_plen = htons(ulen);
+	ip6.ip6_nxt = IPPROTO_UDP;
+	ip6.ip6_hlim = 1;
+	inet_pton(AF_INET6, "fe80::1", &ip6.ip6_src);
+	ip6.ip6_dst = *grp;
+	udp.uh_sport = htons(LC_DEFAULT_PORT);
+	udp.uh_dport = htons(LC_DEFAULT_PORT);
+	udp.uh_ulen = htons(ulen);
+	memcpy(p, &ip6, sizeof ip6);
+	memcpy(p + sizeof ip6 + sizeof udp, &head, sizeof head);
+	memcpy(p + sizeof ip6 + sizeof udp + sizeof head, data, sizeof data);
+	memcpy(p + sizeof ip6, &udp, sizeof udp);
+	udp.uh_sum = htons(~csum(&ip6, (unsigned char *)p + sizeof ip6, ulen));
+	if (!udp.uh_sum) udp.uh_sum = 0xffff;
+	memcpy(p + sizeof ip6, &udp, sizeof udp);
+	return 14 + sizeof ip6 + ulen;
+}
+
+/* wait for a message on sock. 1 if there was one */
+static int recv_wait(lc_socket_t *sock)
+{
+	lc_message_t msg;
+
+	for (int i = 0; i < WAITS * 1000; i++) {
+		lc_msg_init(&msg);
+		if (lc_msg_recv_batch(sock, &msg, 1, MSG_DONTWAIT) == 1) {
+			lc_msg_free(&msg);
+			return 1;
+		}
+		nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+	}
+	return 0;
+}
+
+/* tap with a queue per fd. What is written to fd[i] arrives on rx queue i */
+static int mqtap(char *ifname, int *fd)
+{
+	struct ifreq ifr = {0};
+
+	ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_MULTI_QUEUE;
+	for (int i = 0; i < QUEUES; i++) {
+		if ((fd[i] = open("/dev/net/tun", O_RDWR)) == -1) return -1;
+		if (ioctl(fd[i], TUNSETIFF, &ifr) == -1) return -1;
+	}
+	strncpy(ifname, ifr.ifr_name, IFNAMSIZ);
+	return 0;
+}
+
+int main(void)
+{
+	lc_ctx_t *lctx;
+	lc_socket_t *sock, *osock;
+	lc_channel_t *chan, *other;
+	lc_message_t msg;
+	lc_xdp_pkt_t pkt;
+	char ifname[IFNAMSIZ];
+	char buf[BUFSIZ];
+	int tap[QUEUES] = { -1, -1 };
+	int seen[QUEUES][MSGS + 1] = {0};
+	int got = 0, xdp = 0, rc = 0;
+	ssize_t n;
+
+	test_cap_require(CAP_NET_ADMIN);
+	test_name("lc_socket_xdp() - receive queues and groups");
+	test_require_linux();
+
+	lctx = lc_ctx_new();
+	test_assert(!mqtap(ifname, tap), "multiqueue tap: %s", strerror(errno));
+	test_assert(!lc_link_set(lctx, ifname, LC_IF_UP), "lc_link_set() - up");
+
+	sock = lc_socket_new(lctx);
+	test_assert(!lc_socket_bind(sock, if_nametoindex(ifname)), "lc_socket_bind()");
+	test_assert(!lc_socket_xdp(sock, 1), "lc_socket_xdp(): %s", strerror(errno));
+	if (!sock->xdp) goto exit_0;
+	chan = lc_channel_new(lctx, "0000-0059");
+	lc_channel_bind(sock, chan);
+	lc_channel_join(chan);
+
+	/* the AF_XDP socket has queue 0. Queue 1 goes through the stack, and
+	 * must be received just the same */
+	for (int i = 1; i <= MSGS; i++) {
+		for (int q = 0; q < QUEUES; q++) {
+			n = frame(buf, chan, q * MSGS + i);
+			test_assert(write(tap[q], buf, n) == n, "write() queue %i: %s", q, strerror(errno));
+		}
+	}
+	for (int i = 0; got < QUEUES * MSGS && i < WAITS * 1000; ) {
+		lc_msg_init(&msg);
+		if (lc_msg_recv_batch(sock, &msg, 1, MSG_DONTWAIT) != 1) {
+			nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+			i++;
+			continue;
+		}
+		if (msg.seq >= 1 && msg.seq <= QUEUES * MSGS && msg.len == sizeof data
+		&& !memcmp(msg.data, data, sizeof data)) {
+			seen[(msg.seq - 1) / MSGS][(msg.seq - 1) % MSGS + 1]++;
+			got++;
+		}
+		/* through the UMEM, or a copy from the stack */
+		xdp += (msg.free == &lc_xdp_free);
+		lc_msg_free(&msg);
+	}
+	test_assert(got == QUEUES * MSGS, "received %i/%i", got, QUEUES * MSGS);
+	for (int q = 0; q < QUEUES; q++) {
+		for (int i = 1; i <= MSGS; i++) test_assert(seen[q][i] == 1, "queue %i message %i", q, i);
+	}
+	test_assert(xdp == MSGS, "%i/%i from queue 0 through AF_XDP", xdp, MSGS);
+	test_assert(lc_msg_recv_batch(sock, &msg, 1, MSG_DONTWAIT) == -1 && errno == EAGAIN,
+			"nothing left");
+
+	/* only groups bound to sock are redirected. Others go on to the stack,
+	 * and other sockets */
+	osock = lc_socket_new(lctx);
+	other = lc_channel_new(lctx, "0000-0059-other");
+	lc_socket_bind(osock, if_nametoindex(ifname));
+	lc_channel_bind(osock, other);
+	lc_channel_join(other);
+	write(tap[0], buf, frame(buf, other, 1));
+	test_assert(recv_wait(osock), "unbound group passed to the stack");
+
+	/* counted, so a group stays while another reference has it */
+	test_assert(!lc_xdp_group(sock->xdp, lc_channel_in6addr(chan), 1), "lc_xdp_group()");
+	lc_channel_unbind(chan);
+	write(tap[0], buf, frame(buf, chan, 1));
+	for (int i = 0; i < WAITS * 1000 && !(rc = lc_xdp_recv(sock->xdp, &pkt, 0)); i++) {
+		nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+	}
+	test_assert(rc == 1, "group redirected while referenced");
+	if (rc == 1) lc_xdp_free(pkt.data, sock->xdp);
+
+	/* the last reference gone, it goes to the stack. The frame after it on
+	 * the same queue arriving says it has been through the program */
+	test_assert(!lc_xdp_group(sock->xdp, lc_channel_in6addr(chan), 0), "lc_xdp_group() - remove");
+	write(tap[0], buf, frame(buf, chan, 2));
+	write(tap[0], buf, frame(buf, other, 2));
+	test_assert(recv_wait(osock), "unbound group passed to the stack");
+	test_assert(lc_xdp_recv(sock->xdp, &pkt, 0) == 0, "unbound group not redirected");
+exit_0:
+	for (int q = 0; q < QUEUES; q++) if (tap[q] != -1) close(tap[q]);
+	lc_ctx_free(lctx);
+
+	return fails;
+}